@@ -0,0 +1,332 @@
+#include "../definitions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <SWI-Prolog.h>
+
+/*
+  Benchmark of the C functions of the library. It calls the functions of matricesLogic.c
+  directly, so it measures the cost of the operations without the foreign interface, and
+  it measures separately the conversion of a list of lists into a matrix (parse) and of
+  a matrix into a list of lists (unify), using an embedded SWI-Prolog engine.
+
+  Usage: benchmark [--min N] [--max N] [--max-terms N] [--time SECONDS] [--format csv|json] [--ops op1,op2,...]
+    - The sizes go from --min to --max (4 and 8192 by default), doubling each time
+    - The conversions are only measured up to --max-terms (2048 by default), because the
+      lists of lists of larger matrices need several gigabytes in the Prolog stacks
+    - Every measure is repeated until it takes --time seconds (0.2 by default)
+    - The dot product uses vectors of n elements, the other operations matrices of n x n
+  The results are written in the standard output, one line per operation and size.
+*/
+
+typedef enum {
+    OP_ADDITION, OP_SUBSTRACTION, OP_MULTIPLICATION, OP_TRANSPOSE, OP_SCALE, OP_DIVISION,
+    OP_SUM, OP_MAXIMUM, OP_DOT_PRODUCT, OP_DIAGONAL, OP_COUNT
+} Operation;
+
+static const char* operation_names[OP_COUNT] = {
+    "suma", "resta", "multiplicacion", "transpuesta", "factor", "division",
+    "suma_elementos", "maximo", "producto_escalar", "diagonal"
+};
+
+typedef struct {
+    int min_size;
+    int max_size;
+    int max_term_size;
+    double minimum_time;
+    int json;
+    int selected[OP_COUNT];
+} Options;
+
+typedef struct {
+    const char* operation;
+    int size;
+    long repetitions;
+    double parse_seconds; // negative when it has not been measured
+    double compute_seconds;
+    double unify_seconds;
+    double gflops;
+    double gbytes_per_second;
+    double pool_allocations;
+    double allocated_bytes;
+} Result;
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static Matrix* random_matrix(int rows, int columns) {
+    Matrix* matrix = new_matrix(rows, columns);
+    if (matrix) {
+        for (size_t i = 0; i < (size_t) rows * columns; i++) {
+            matrix->data[i] = rand() / (double) RAND_MAX - 0.5;
+        }
+    }
+    return matrix;
+}
+
+/*
+    Run an operation once. The result matrix is created and freed as the predicates do
+*/
+static int run_operation(Operation operation, Matrix* a, Matrix* b, Matrix* vector1, Matrix* vector2) {
+    double factor = 1.5, value = 0;
+    Matrix* result = NULL;
+    int correct = SUCCESS;
+
+    switch (operation) {
+    case OP_ADDITION:
+        result = new_matrix(a->rows, a->columns);
+        correct = matrices_addition(a, b, result);
+        break;
+    case OP_SUBSTRACTION:
+        result = new_matrix(a->rows, a->columns);
+        correct = matrices_substraction(a, b, result);
+        break;
+    case OP_MULTIPLICATION:
+        result = new_matrix(a->rows, b->columns);
+        correct = matrices_multiplication(a, b, result);
+        break;
+    case OP_TRANSPOSE:
+        result = new_matrix(a->columns, a->rows);
+        correct = matrix_transpose(a, result);
+        break;
+    case OP_SCALE:
+        result = new_matrix(a->rows, a->columns);
+        correct = multiply_matrix_by_factor(a, &factor, result);
+        break;
+    case OP_DIVISION:
+        result = new_matrix(a->rows, a->columns);
+        correct = divide_matrix_by_factor(a, &factor, result);
+        break;
+    case OP_SUM:
+        correct = sum_elements_from_matrix(a, &value);
+        break;
+    case OP_MAXIMUM:
+        correct = obtain_maximum_value_from_matrix(a, &value);
+        break;
+    case OP_DOT_PRODUCT:
+        correct = calculate_dot_product(vector1, vector2, &value);
+        break;
+    case OP_DIAGONAL:
+        invalidate_matrix_structure(a); // otherwise only the first call scans the matrix
+        is_matrix_diagonal(a);
+        break;
+    default:
+        break;
+    }
+    free_matrix(result);
+    return correct;
+}
+
+/*
+    Number of matrices converted from lists (operands) and into lists (result) by the predicate of an operation
+*/
+static void operation_conversions(Operation operation, int* operands, int* results) {
+    *operands = operation <= OP_SUBSTRACTION || operation == OP_MULTIPLICATION || operation == OP_DOT_PRODUCT ? 2 : 1;
+    *results = operation <= OP_DIVISION ? 1 : 0;
+}
+
+/*
+    Floating point operations and bytes read and written by an operation on n x n matrices
+    (or on vectors of n elements for the dot product)
+*/
+static void operation_cost(Operation operation, int n, double* flops, double* bytes) {
+    double elements = (double) n * n;
+    switch (operation) {
+    case OP_ADDITION: case OP_SUBSTRACTION:
+        *flops = elements; *bytes = 3 * elements * sizeof(double); break;
+    case OP_MULTIPLICATION:
+        *flops = 2 * elements * n; *bytes = 3 * elements * sizeof(double); break;
+    case OP_TRANSPOSE:
+        *flops = 0; *bytes = 2 * elements * sizeof(double); break;
+    case OP_SCALE: case OP_DIVISION:
+        *flops = elements; *bytes = 2 * elements * sizeof(double); break;
+    case OP_SUM: case OP_MAXIMUM:
+        *flops = elements; *bytes = elements * sizeof(double); break;
+    case OP_DOT_PRODUCT:
+        *flops = 2.0 * n; *bytes = 2.0 * n * sizeof(double); break;
+    default:
+        *flops = 0; *bytes = elements * sizeof(double); break;
+    }
+}
+
+/*
+    Time the conversion of a matrix into a list of lists (unify) and back (parse)
+*/
+static void measure_conversions(Matrix* a, double minimum_time, double* parse_seconds, double* unify_seconds) {
+    long repetitions = 0;
+    double start = now();
+    do {
+        fid_t frame = PL_open_foreign_frame();
+        term_t list = PL_new_term_ref();
+        unify_matrix_with_term(a, list, MATRIX_FORMAT_ROWS);
+        PL_discard_foreign_frame(frame);
+        repetitions++;
+    } while (now() - start < minimum_time);
+    *unify_seconds = (now() - start) / repetitions;
+
+    fid_t frame = PL_open_foreign_frame();
+    term_t list = PL_new_term_ref();
+    unify_matrix_with_term(a, list, MATRIX_FORMAT_ROWS);
+    repetitions = 0;
+    start = now();
+    do {
+        free_matrix(parse_list_of_lists_into_matrix(list));
+        repetitions++;
+    } while (now() - start < minimum_time);
+    *parse_seconds = (now() - start) / repetitions;
+    PL_discard_foreign_frame(frame);
+}
+
+/*
+    Print a result as a line of CSV or as a JSON object. The conversions which have not been
+    measured are left empty (null in JSON)
+*/
+static void print_result(const Result* result, int json, int first) {
+    int converted = result->parse_seconds >= 0;
+    char parse[32] = "", unify[32] = "", total[32] = "";
+    if (converted) {
+        snprintf(parse, sizeof(parse), "%.9g", result->parse_seconds);
+        snprintf(unify, sizeof(unify), "%.9g", result->unify_seconds);
+        snprintf(total, sizeof(total), "%.9g", result->parse_seconds + result->compute_seconds + result->unify_seconds);
+    }
+    if (json) {
+        printf("%s  {\"harness\": \"c\", \"operation\": \"%s\", \"size\": %d, \"repetitions\": %ld, "
+               "\"parse_seconds\": %s, \"compute_seconds\": %.9g, \"unify_seconds\": %s, \"total_seconds\": %s, "
+               "\"gflops\": %.6g, \"gbytes_per_second\": %.6g, \"pool_allocations\": %.6g, "
+               "\"allocated_bytes\": %.6g, \"threads\": %d, \"simd\": \"%s\"}",
+               first ? "" : ",\n", result->operation, result->size, result->repetitions,
+               converted ? parse : "null", result->compute_seconds, converted ? unify : "null",
+               converted ? total : "null", result->gflops, result->gbytes_per_second,
+               result->pool_allocations, result->allocated_bytes, get_thread_count(), kernels->name);
+        return;
+    }
+    printf("c,%s,%d,%ld,%s,%.9g,%s,%s,%.6g,%.6g,%.6g,%.6g,%d,%s\n", result->operation, result->size,
+           result->repetitions, parse, result->compute_seconds, unify, total, result->gflops,
+           result->gbytes_per_second, result->pool_allocations, result->allocated_bytes,
+           get_thread_count(), kernels->name);
+}
+
+static int parse_options(int argc, char** argv, Options* options) {
+    options->min_size = 4;
+    options->max_size = 8192;
+    options->max_term_size = 2048;
+    options->minimum_time = 0.2;
+    options->json = 0;
+    for (int op = 0; op < OP_COUNT; op++) options->selected[op] = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            fprintf(stderr, "Falta el valor de %s\n", argv[i]);
+            return FAILURE;
+        }
+        if (strcmp(argv[i], "--min") == 0) options->min_size = atoi(value);
+        else if (strcmp(argv[i], "--max") == 0) options->max_size = atoi(value);
+        else if (strcmp(argv[i], "--max-terms") == 0) options->max_term_size = atoi(value);
+        else if (strcmp(argv[i], "--time") == 0) options->minimum_time = atof(value);
+        else if (strcmp(argv[i], "--format") == 0) options->json = strcmp(value, "json") == 0;
+        else if (strcmp(argv[i], "--ops") == 0) {
+            for (int op = 0; op < OP_COUNT; op++) {
+                options->selected[op] = strstr(value, operation_names[op]) != NULL;
+            }
+        } else {
+            fprintf(stderr, "Opción desconocida: %s\n", argv[i]);
+            return FAILURE;
+        }
+        i++;
+    }
+    return options->min_size > 0 && options->max_size >= options->min_size ? SUCCESS : FAILURE;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (parse_options(argc, argv, &options) == FAILURE) {
+        fprintf(stderr, "Uso: %s [--min N] [--max N] [--max-terms N] [--time SEGUNDOS] [--format csv|json] [--ops op1,op2]\n", argv[0]);
+        return 1;
+    }
+    // The embedded engine is only used to build and read the lists of lists
+    char* engine_arguments[] = { argv[0], "-q", "--no-signals", NULL };
+    if (!PL_initialise(3, engine_arguments)) {
+        fprintf(stderr, "No es posible iniciar SWI-Prolog\n");
+        return 1;
+    }
+    select_kernels();
+    srand(1);
+
+    if (options.json) {
+        printf("[\n");
+    } else {
+        printf("harness,operation,size,repetitions,parse_seconds,compute_seconds,unify_seconds,total_seconds,"
+               "gflops,gbytes_per_second,pool_allocations,allocated_bytes,threads,simd\n");
+    }
+    int first = 1;
+    for (int n = options.min_size; n <= options.max_size; n *= 2) {
+        Matrix* a = random_matrix(n, n);
+        Matrix* b = random_matrix(n, n);
+        Matrix* vector1 = random_matrix(1, n);
+        Matrix* vector2 = random_matrix(1, n);
+        if (!a || !b || !vector1 || !vector2) {
+            fprintf(stderr, "No hay memoria suficiente para matrices de %d x %d\n", n, n);
+            break;
+        }
+        double parse_seconds = -1, unify_seconds = -1, vector_parse_seconds = -1, vector_unify_seconds = -1;
+        if (n <= options.max_term_size) {
+            measure_conversions(a, options.minimum_time, &parse_seconds, &unify_seconds);
+            if (options.selected[OP_DOT_PRODUCT]) {
+                measure_conversions(vector1, options.minimum_time, &vector_parse_seconds, &vector_unify_seconds);
+            }
+        }
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (!options.selected[op]) {
+                continue;
+            }
+            MemoryStatistics before, after;
+            if (n <= 1024) {
+                run_operation(op, a, b, vector1, vector2); // warm up
+            }
+            get_memory_statistics(&before);
+            long repetitions = 0;
+            double start = now(), elapsed = 0;
+            do {
+                if (run_operation(op, a, b, vector1, vector2) == FAILURE) {
+                    break;
+                }
+                repetitions++;
+            } while ((elapsed = now() - start) < options.minimum_time);
+            get_memory_statistics(&after);
+            if (!repetitions) {
+                fprintf(stderr, "La operación %s ha fallado\n", operation_names[op]);
+                continue;
+            }
+
+            double flops, bytes;
+            int operands, results;
+            operation_cost(op, n, &flops, &bytes);
+            operation_conversions(op, &operands, &results);
+            Result result = {
+                operation_names[op], n, repetitions,
+                (op == OP_DOT_PRODUCT ? vector_parse_seconds : parse_seconds) * operands,
+                elapsed / repetitions, unify_seconds * results,
+                flops * repetitions / elapsed / 1e9, bytes * repetitions / elapsed / 1e9,
+                (double)(after.allocations - before.allocations) / repetitions,
+                (double)(after.allocated_bytes - before.allocated_bytes) / repetitions
+            };
+            print_result(&result, options.json, first);
+            first = 0;
+            fflush(stdout);
+        }
+        free_matrix(a);
+        free_matrix(b);
+        free_matrix(vector1);
+        free_matrix(vector2);
+    }
+    if (options.json) {
+        printf("\n]\n");
+    }
+    PL_halt(0);
+    return 0;
+}
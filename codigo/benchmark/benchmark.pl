@@ -0,0 +1,180 @@
+/*
+  Benchmark of the foreign predicates of the library, called from SWI-Prolog.
+
+  Usage: swipl benchmark.pl [--min N] [--max N] [--max-terms N] [--time SECONDS] [--format csv|json]
+
+  For every operation and size it measures:
+    - parse: lista_a_matriz/2, the conversion of the list of lists of every operand
+    - compute: the _h predicate (or the predicate called with handles), without conversions
+    - unify: matriz_a_lista/2, the conversion of the result
+    - total: the predicate called with lists of lists, as a program which does not use handles
+  Every row of the input matrices is a different random list, so the parse does not read the
+  same warm term again and again. The conversions (parse, unify and total) are only measured up
+  to --max-terms; larger matrices, which would fill the Prolog stacks, are created for the
+  compute measure with rows which share the same list. The dot product uses vectors of Size
+  elements. The output has the same columns as the C benchmark.
+*/
+
+:- initialization(main, main).
+
+:- prolog_load_context(directory, Directory),
+   atom_concat(Directory, '/../matrices', Library),
+   load_foreign_library(Library).
+
+% operation(Name, ListPredicate, HandlePredicate, Operands, FlopsPerElement, BytesPerElement)
+operation(suma, sumar_matrices, sumar_matrices_h, matrices, 1, 24).
+operation(resta, restar_matrices, restar_matrices_h, matrices, 1, 24).
+operation(multiplicacion, multiplicar_matrices, multiplicar_matrices_h, matrices, product, 24).
+operation(transpuesta, transponer_matriz, transponer_matriz_h, matrix, 0, 16).
+operation(factor, multiplicar_matriz_por_factor, multiplicar_matriz_por_factor_h, factor, 1, 16).
+operation(division, dividir_matriz_por_factor, dividir_matriz_por_factor_h, factor, 1, 16).
+operation(suma_elementos, sumar_elementos_de_matriz, sumar_elementos_de_matriz, value, 1, 8).
+operation(maximo, obtener_valor_maximo, obtener_valor_maximo, value, 1, 8).
+operation(producto_escalar, producto_escalar, producto_escalar, vectors, vector(2), vector(16)).
+operation(diagonal, es_diagonal, es_diagonal, check, 0, 8).
+
+main :-
+    current_prolog_flag(argv, Arguments),
+    options(Arguments, options(4, 8192, 2048, 0.2, csv), Options),
+    Options = options(Min, Max, _, _, Format),
+    header(Format),
+    forall(size(Min, Max, Size),
+           forall(operation(Name, List, Handle, Operands, Flops, Bytes),
+                  benchmark(Options, Size, operation(Name, List, Handle, Operands, Flops, Bytes)))),
+    footer(Format).
+
+options([], Options, Options).
+options(['--min', Value|Rest], options(_, Max, Terms, Time, Format), Options) :- !,
+    atom_number(Value, Min), options(Rest, options(Min, Max, Terms, Time, Format), Options).
+options(['--max', Value|Rest], options(Min, _, Terms, Time, Format), Options) :- !,
+    atom_number(Value, Max), options(Rest, options(Min, Max, Terms, Time, Format), Options).
+options(['--max-terms', Value|Rest], options(Min, Max, _, Time, Format), Options) :- !,
+    atom_number(Value, Terms), options(Rest, options(Min, Max, Terms, Time, Format), Options).
+options(['--time', Value|Rest], options(Min, Max, Terms, _, Format), Options) :- !,
+    atom_number(Value, Time), options(Rest, options(Min, Max, Terms, Time, Format), Options).
+options(['--format', Format|Rest], options(Min, Max, Terms, Time, _), Options) :- !,
+    options(Rest, options(Min, Max, Terms, Time, Format), Options).
+options([Option|_], _, _) :-
+    format(user_error, "Opción desconocida: ~w~n", [Option]),
+    halt(1).
+
+size(Min, Max, Min) :- Min =< Max.
+size(Min, Max, Size) :- Min < Max, Next is Min * 2, size(Next, Max, Size).
+
+/*
+  A matrix of Rows x Columns of random values: every row is a different list (distinct), or all
+  the rows are the same list (shared)
+*/
+random_matrix(distinct, Rows, Columns, Matrix) :-
+    length(Matrix, Rows),
+    maplist(random_row(Columns), Matrix).
+random_matrix(shared, Rows, Columns, Matrix) :-
+    random_row(Columns, Row),
+    length(Matrix, Rows),
+    maplist(=(Row), Matrix).
+
+random_row(Columns, Row) :-
+    length(Row, Columns),
+    maplist([X]>>(X is random_float - 0.5), Row).
+
+benchmark(options(_, _, MaxTerms, Time, Format), Size, operation(Name, List, Handle, Operands, Flops, Bytes)) :-
+    (   Size =< MaxTerms
+    ->  inputs(Operands, distinct, Size, Lists),
+        measure(maplist([L, H]>>lista_a_matriz(L, H), Lists, _), Time, Parse, _)
+    ;   inputs(Operands, shared, Size, Lists),
+        Parse = ''
+    ),
+    maplist([L, H]>>lista_a_matriz(L, H), Lists, Handles),
+    memory(Allocations0, Bytes0),
+    compute_goal(Operands, Handle, Handles, Result, Compute),
+    measure(Compute, Time, ComputeSeconds, Repetitions),
+    memory(Allocations1, Bytes1),
+    (   Size =< MaxTerms
+    ->  once(Compute),
+        (   Operands \== value, Operands \== vectors, Operands \== check
+        ->  measure(matriz_a_lista(Result, _), Time, Unify, _)
+        ;   Unify = 0
+        ),
+        compute_goal(Operands, List, Lists, _, Total),
+        measure(Total, Time, TotalSeconds, _)
+    ;   Unify = '', TotalSeconds = ''
+    ),
+    garbage_collect_atoms,
+    cost(Flops, Bytes, Size, FlopCount, ByteCount),
+    GFlops is FlopCount / ComputeSeconds / 1.0e9,
+    GBytes is ByteCount / ComputeSeconds / 1.0e9,
+    PoolAllocations is (Allocations1 - Allocations0) / Repetitions,
+    AllocatedBytes is (Bytes1 - Bytes0) / Repetitions,
+    numero_hilos(Threads),
+    instrucciones_simd(Simd),
+    report(Format, [Name, Size, Repetitions, Parse, ComputeSeconds, Unify, TotalSeconds,
+                    GFlops, GBytes, PoolAllocations, AllocatedBytes, Threads, Simd]).
+
+inputs(matrices, Rows, Size, [A, B]) :- random_matrix(Rows, Size, Size, A), random_matrix(Rows, Size, Size, B).
+inputs(matrix, Rows, Size, [A]) :- random_matrix(Rows, Size, Size, A).
+inputs(factor, Rows, Size, [A]) :- random_matrix(Rows, Size, Size, A).
+inputs(value, Rows, Size, [A]) :- random_matrix(Rows, Size, Size, A).
+inputs(check, Rows, Size, [A]) :- random_matrix(Rows, Size, Size, A).
+inputs(vectors, Rows, Size, [A, B]) :- random_matrix(Rows, 1, Size, A), random_matrix(Rows, 1, Size, B).
+
+compute_goal(matrices, Predicate, [A, B], Result, call(Predicate, A, B, Result)).
+compute_goal(matrix, Predicate, [A], Result, call(Predicate, A, Result)).
+compute_goal(factor, Predicate, [A], Result, call(Predicate, A, 1.5, Result)).
+compute_goal(value, Predicate, [A], Result, call(Predicate, A, Result)).
+compute_goal(vectors, Predicate, [A, B], Result, call(Predicate, A, B, Result)).
+compute_goal(check, Predicate, [A], true, ignore(call(Predicate, A))).
+
+cost(product, Bytes, Size, Flops, ByteCount) :- !,
+    Flops is 2 * Size ** 3, ByteCount is Bytes * Size ** 2.
+cost(vector(Flops), vector(Bytes), Size, FlopCount, ByteCount) :- !,
+    FlopCount is Flops * Size, ByteCount is Bytes * Size.
+cost(Flops, Bytes, Size, FlopCount, ByteCount) :-
+    FlopCount is Flops * Size ** 2, ByteCount is Bytes * Size ** 2.
+
+/*
+  Average time of a goal, repeated until it takes Time seconds. Only the goal is timed,
+  the atom garbage collection which frees the handles it creates is not
+*/
+measure(Goal, Time, Seconds, Repetitions) :-
+    measure(Goal, Time, 0, 0, Seconds, Repetitions).
+
+measure(Goal, Time, Elapsed, Count, Seconds, Repetitions) :-
+    get_time(Start),
+    \+ \+ once(Goal),
+    get_time(End),
+    Elapsed1 is Elapsed + End - Start,
+    Count1 is Count + 1,
+    (   Count1 mod 16 =:= 0 -> garbage_collect_atoms ; true ),
+    (   Elapsed1 >= Time
+    ->  Seconds is Elapsed1 / Count1, Repetitions = Count1
+    ;   measure(Goal, Time, Elapsed1, Count1, Seconds, Repetitions)
+    ).
+
+memory(Allocations, Bytes) :-
+    estadisticas_memoria(Statistics),
+    memberchk(asignaciones-Allocations, Statistics),
+    memberchk(bytes_asignados-Bytes, Statistics).
+
+header(csv) :-
+    format("harness,operation,size,repetitions,parse_seconds,compute_seconds,unify_seconds,total_seconds,\c
+            gflops,gbytes_per_second,pool_allocations,allocated_bytes,threads,simd~n").
+header(json) :-
+    nb_setval(first_result, true),
+    format("[~n").
+
+footer(csv).
+footer(json) :- format("~n]~n").
+
+report(csv, Values) :-
+    atomic_list_concat([prolog|Values], ',', Line),
+    format("~w~n", [Line]),
+    flush_output.
+report(json, [Name, Size, Repetitions, Parse, Compute, Unify, Total, GFlops, GBytes, Allocations, Bytes, Threads, Simd]) :-
+    (   nb_getval(first_result, true) -> nb_setval(first_result, false) ; format(",~n") ),
+    maplist([V, J]>>(V == '' -> J = null ; J = V), [Parse, Unify, Total], [ParseJson, UnifyJson, TotalJson]),
+    format("  {\"harness\": \"prolog\", \"operation\": \"~w\", \"size\": ~w, \"repetitions\": ~w, \c
+            \"parse_seconds\": ~w, \"compute_seconds\": ~w, \"unify_seconds\": ~w, \"total_seconds\": ~w, \c
+            \"gflops\": ~w, \"gbytes_per_second\": ~w, \"pool_allocations\": ~w, \c
+            \"allocated_bytes\": ~w, \"threads\": ~w, \"simd\": \"~w\"}",
+           [Name, Size, Repetitions, ParseJson, Compute, UnifyJson, TotalJson, GFlops, GBytes, Allocations, Bytes, Threads, Simd]),
+    flush_output.
@@ -0,0 +1,15 @@
+#!/bin/bash
+# Build the C benchmark and run both benchmarks. The results are written in results/
+# with the date and the commit, so the results of two builds can be compared.
+# Usage: ./run_benchmark.sh [csv|json] [options of the benchmarks]
+cd "$(dirname "$0")"
+format=${1:-csv}
+shift
+(cd .. && ./generate_library.sh) || exit 1
+swipl-ld -o benchmark -O2 benchmark.c ../matricesLogic.c ../matricesGemm.c ../matricesKernels.c ../matricesThreads.c ../matricesMemory.c ../matricesHandles.c ../matricesFiles.c ../matricesSparse.c ../matricesStructure.c ../matricesStrassen.c ../matricesLinear.c ../matricesReductions.c ../matricesVectors.c ../matricesTranspose.c ../matricesViews.c ../matricesTypes.c ../matricesCache.c ../matricesAsync.c ../matricesChain.c ../matricesStats.c ../matricesEval.c -I/include -lpthread || exit 1
+mkdir -p results
+name=results/$(date +%Y%m%d-%H%M%S)-$(git rev-parse --short HEAD 2>/dev/null || echo local)
+./benchmark --format "$format" "$@" > "$name-c.$format"
+swipl benchmark.pl --format "$format" "$@" > "$name-prolog.$format"
+echo "$name-c.$format"
+echo "$name-prolog.$format"
@@ -1,17 +1,114 @@
 #ifndef definitions_H
 #define definitions_H
 
+#include <stdint.h>
+#include <stdatomic.h>
 #include <SWI-Prolog.h>
 
 /*
-Matrix struct to represent a matrix in C and carry out the operations
+Matrix struct to represent a matrix in C and carry out the operations.
+The element (row, column) is data[row * row_stride + column * column_stride], so a view
+(MATRIX_STORAGE_VIEW) can share the data buffer of its parent: a block, a row, a column,
+the diagonal or the transpose of the parent are only a different start and strides.
+The strides also give the layout of a matrix which owns its data (MATRIX_LAYOUT_*, matrix_layout)
 */
-typedef struct {
+typedef struct Matrix {
     int rows ; // represents the number of rows of the matrix
     int columns; // represents the number of columns the matrix
     double* data; // represents the data that a matrix contains. It is stored as an undimensional array (single pointer)
+    int element_type; // type of the values of data (MATRIX_TYPE_*), which are doubles unless it says otherwise
+    size_t capacity; // bytes of the data buffer, which comes from the memory pool (or of the mapping of a file)
+    int storage; // where the data buffer comes from (MATRIX_STORAGE_*)
+    atomic_int structure; // MATRIX_* structure flags, only valid with MATRIX_STRUCTURE_KNOWN. Published after the bandwidths
+    int lower_bandwidth; // number of diagonals below the main one which can have non zero values
+    int upper_bandwidth; // number of diagonals above the main one which can have non zero values
+    size_t row_stride; // distance between two consecutive values of a column (1 for the matrices which own their data)
+    size_t column_stride; // distance between two consecutive values of a row (rows for the matrices which own their data)
+    struct Matrix* parent; // only for views: matrix which owns the data buffer
+    atomic_int references; // number of views (or entries of the result cache) which share the matrix, besides the owner
+    uint64_t version; // unique number of the contents of the matrix, changed when they are modified in place
+    uint64_t values_hash[2]; // hash of the values taken while they were parsed (see ValuesHash)
+    uint64_t hashed_version; // version for which values_hash is valid, 0 when the values were not hashed
  } Matrix;
 
+/*
+Structure flags of a matrix. They are computed from the values when they are needed
+(MATRIX_STRUCTURE_EXACT) or derived from the operands of the operation which created
+the matrix, in which case the flags which are set are true but the missing ones can also be true.
+Diagonal, triangular, symmetric and identity are only set for square matrices
+*/
+# define MATRIX_STRUCTURE_KNOWN 0x01
+# define MATRIX_STRUCTURE_EXACT 0x02
+# define MATRIX_DIAGONAL 0x04
+# define MATRIX_UPPER_TRIANGULAR 0x08
+# define MATRIX_LOWER_TRIANGULAR 0x10
+# define MATRIX_SYMMETRIC 0x20
+# define MATRIX_IDENTITY 0x40
+# define MATRIX_BANDED 0x80
+
+/*
+The banded product is used when it does at least BANDED_PRODUCT_RATIO times less operations than
+the full product. Triangles of at most TRIANGULAR_BLOCK rows are multiplied with the simple loop
+*/
+# define BANDED_PRODUCT_RATIO 8
+# define TRIANGULAR_BLOCK 64
+
+/*
+Side of the tiles of the transposes: a tile of the matrix and the lines of the result
+it is written into fit in the first level cache
+*/
+# define TRANSPOSE_BLOCK 32
+
+/*
+Origin of the data buffer of a matrix: the memory pool, a read-only mapping of a matrix
+file (shared with the other processes which map the same file) or a private copy-on-write
+mapping of a matrix file. The data of a view belongs to its parent, which is kept alive
+until the last view which shares it is freed
+*/
+# define MATRIX_STORAGE_POOL 0
+# define MATRIX_STORAGE_MAPPED 1
+# define MATRIX_STORAGE_MAPPED_PRIVATE 2
+# define MATRIX_STORAGE_VIEW 3
+
+/*
+Order of the values in the data buffer: by columns one after the other (row_stride 1, the order
+of the matrices created by the operations unless they choose otherwise) or by rows one after the
+other (column_stride 1, the order of the lists of Prolog, so the lists are read and written
+sequentially). The views whose values are not contiguous are MATRIX_LAYOUT_STRIDED.
+The values of the first two are the ones of the layout of the matrix files
+*/
+# define MATRIX_LAYOUT_COLUMN_MAJOR 0
+# define MATRIX_LAYOUT_ROW_MAJOR 1
+# define MATRIX_LAYOUT_STRIDED 2
+
+/*
+Types of the values of a matrix. The matrices are MATRIX_TYPE_F64 unless they are created with
+another type, and the operations which do not have a typed path receive a copy in MATRIX_TYPE_F64.
+The values are the ones of the dtype of the matrix files
+*/
+# define MATRIX_TYPE_F64 0
+# define MATRIX_TYPE_F32 1
+# define MATRIX_TYPE_I32 2
+# define MATRIX_TYPE_I64 3
+# define MATRIX_TYPES 4
+
+/*
+Blocks of the products of typed matrices: a block of TYPED_GEMM_MC x TYPED_GEMM_KC values of A
+stays in the second level cache while it is multiplied by the columns of B. In f32 the tiles of
+TYPED_GEMM_MR x TYPED_GEMM_NR values of C are computed in registers (two registers of eight floats
+per column)
+*/
+# define TYPED_GEMM_MC 256
+# define TYPED_GEMM_KC 256
+# define TYPED_GEMM_MR 16
+# define TYPED_GEMM_NR 4
+
+/*
+The strided values of a view are gathered into blocks of VIEW_BLOCK values before they
+are given to the SIMD kernels
+*/
+# define VIEW_BLOCK 256
+
 
 # define SUCCESS 1
 # define FAILURE 0
@@ -20,7 +117,323 @@ typedef struct {
 Macro to access or assing an specific element in a bidemensional matrix
 which has been stored as a unidimensional matrix.
 */
-# define ACCESS(matrix, row, column) matrix -> data[column * matrix -> rows + row]
+# define ACCESS(matrix, row, column) \
+    (matrix)->data[(size_t)(column) * (matrix)->column_stride + (size_t)(row) * (matrix)->row_stride]
+
+/*
+Tile sizes of the blocked matrix product. GEMM_MR x GEMM_NR is the tile computed in registers
+by the micro kernel, GEMM_KC x GEMM_NR panels of B are kept in L1, GEMM_MC x GEMM_KC blocks
+of A in L2 and GEMM_KC x GEMM_NC blocks of B in L3.
+Products with less than GEMM_THRESHOLD multiply-add operations use the simple triple loop.
+*/
+# define GEMM_MR 8
+# define GEMM_NR 4
+# define GEMM_MC 96
+# define GEMM_KC 256
+# define GEMM_NC 2048
+# define GEMM_THRESHOLD (64.0 * 64.0 * 64.0)
+
+/*
+Algorithm of the products of large dense matrices (algoritmo_multiplicacion/1), chosen by each
+Prolog thread. With the Strassen-Winograd algorithm the products whose three dimensions are at
+least the cutoff (umbral_strassen/1, STRASSEN_CUTOFF by default) are split recursively
+*/
+# define MULTIPLICATION_CLASSIC 0
+# define MULTIPLICATION_STRASSEN 1
+# define STRASSEN_CUTOFF 1024
+
+/*
+Instruction sets of the element-wise and reduction kernels
+*/
+# define SIMD_SCALAR 0
+# define SIMD_SSE2 1
+# define SIMD_AVX2 2
+# define SIMD_AVX512 3
+
+/*
+Table with the element-wise and reduction kernels for one instruction set.
+All of them work over flat arrays of n doubles.
+*/
+typedef void (*binary_kernel_t)(const double* a, const double* b, double* result, size_t n);
+typedef void (*factor_kernel_t)(const double* a, double factor, double* result, size_t n);
+// Transpose a block of rows x columns stored by columns into a block of columns x rows
+typedef void (*transpose_kernel_t)(const double* source, size_t source_stride, double* destination,
+                                   size_t destination_stride, int rows, int columns);
+// result = alpha * x + y, where result can be y
+typedef void (*axpy_kernel_t)(double alpha, const double* x, const double* y, double* result, size_t n);
+// y = y + A x, for a block of rows x columns of A stored by columns with leading dimension lda
+typedef void (*gemv_kernel_t)(const double* a, size_t lda, const double* x, double* y, size_t rows, size_t columns);
+
+typedef struct {
+    int level; // instruction set, one of the SIMD_* values
+    const char* name; // name of the instruction set
+    binary_kernel_t add;
+    binary_kernel_t substract;
+    factor_kernel_t multiply;
+    factor_kernel_t divide;
+    double (*sum)(const double* a, size_t n);
+    double (*maximum)(const double* a, size_t n); // -INFINITY for empty arrays, NaN values are skipped
+    double (*dot)(const double* a, const double* b, size_t n);
+    axpy_kernel_t axpy;
+    gemv_kernel_t gemv;
+    transpose_kernel_t transpose;
+} MatrixKernels;
+
+// Kernels in use, chosen by select_kernels when the library is installed
+extern const MatrixKernels* kernels;
+
+/*
+Thread pool. A task receives a range [begin, end) of the indexes of the job.
+Jobs with less than PARALLEL_GRAIN elements (or products with less than
+PARALLEL_GEMM_THRESHOLD multiply-adds) run on the calling thread.
+*/
+typedef void (*parallel_task_t)(void* context, size_t begin, size_t end);
+
+# define PARALLEL_GRAIN ((size_t) 1 << 15)
+# define PARALLEL_GEMM_THRESHOLD (128.0 * 128.0 * 128.0)
+# define MAX_REDUCTION_CHUNKS 256
+
+/*
+Formats of the terms built for a matrix: list of lists (one per row), flat list with the
+values row by row, or matrix(Rows, Columns, Values) with the values row by row
+*/
+# define MATRIX_FORMAT_ROWS 0
+# define MATRIX_FORMAT_FLAT 1
+# define MATRIX_FORMAT_COMPOUND 2
+
+/*
+Sparse matrix in compressed rows (CSR) or compressed columns (CSC). The values of row (or column) i
+are values[pointers[i]] .. values[pointers[i + 1] - 1] and indices keeps their columns (or rows)
+*/
+# define SPARSE_CSR 0
+# define SPARSE_CSC 1
+
+typedef struct {
+    int rows;
+    int columns;
+    int format; // SPARSE_CSR or SPARSE_CSC
+    size_t* pointers; // rows + 1 (CSR) or columns + 1 (CSC) positions
+    int* indices;
+    double* values;
+} SparseMatrix;
+
+/*
+Factorization of a square matrix, kept in a handle so it can be used for many solves.
+  - FACTORIZATION_LU: P A = L U. The factors matrix has L below the diagonal (its diagonal
+    of ones is not stored) and U on and above it. pivots[i] is the row swapped with row i
+    at step i and sign is the sign of the permutation.
+  - FACTORIZATION_CHOLESKY: A = L L^T. The factors matrix has L on and below the diagonal
+    and L^T above it, so both triangular solves read columns.
+The factorizations work on panels of FACTORIZATION_BLOCK columns, and the updates of the
+rest of the matrix are done by the blocked product
+*/
+# define FACTORIZATION_LU 0
+# define FACTORIZATION_CHOLESKY 1
+# define FACTORIZATION_BLOCK 64
+
+typedef struct {
+    int kind; // FACTORIZATION_*
+    Matrix* factors;
+    int* pivots; // only for LU
+    int sign; // only for LU
+    int singular; // only for LU: some pivot is zero, so there is no solution or inverse
+} Factorization;
+
+/*
+Reductions of a whole matrix, of each row or of each column, which compute all the requested
+operations (REDUCTION_* flags) in one pass over the values.
+  - The values are read in blocks of REDUCTION_BLOCK, whose sums are computed with the SIMD
+    kernels, and the sums of the blocks are added pairwise (SUMMATION_PAIRWISE) or with
+    compensated summation (SUMMATION_KAHAN, Neumaier's variant).
+  - The reductions of the rows are computed for bands of REDUCTION_BAND rows, reading each
+    column of the band once.
+*/
+# define REDUCTION_SUM 1
+# define REDUCTION_MEAN 2
+# define REDUCTION_MINIMUM 4
+# define REDUCTION_MAXIMUM 8
+# define REDUCTION_ARGMIN 16
+# define REDUCTION_ARGMAX 32
+# define REDUCTION_NORM1 64
+# define REDUCTION_NORM2 128
+# define REDUCTION_MAX_OPERATIONS 16
+# define REDUCTION_ALL 0
+# define REDUCTION_ROWS 1
+# define REDUCTION_COLUMNS 2
+# define REDUCTION_BLOCK 256
+# define REDUCTION_BAND 128
+# define SUMMATION_PAIRWISE 0
+# define SUMMATION_KAHAN 1
+
+/*
+Matrix-vector products are computed in blocks of GEMV_BLOCK rows, whose part of the result
+stays in the first level cache while the columns of the matrix are added to it
+*/
+# define GEMV_BLOCK 512
+
+typedef struct {
+    double sums[3]; // sum, sum of the absolute values and sum of the squares
+    double errors[3]; // compensation of the sums, only for SUMMATION_KAHAN
+    double minimum;
+    double maximum;
+    size_t argmin; // index of the first minimum, in the matrix, row or column
+    size_t argmax; // index of the first maximum
+} Reduction;
+
+/*
+Operations of two matrices which have a sparse and a typed path
+*/
+# define SPARSE_ADDITION 0
+# define SPARSE_SUBSTRACTION 1
+# define SPARSE_MULTIPLICATION 2
+
+/*
+Binary matrix files: a header of MATRIX_FILE_HEADER_BYTES bytes followed by the values
+stored with the type (MATRIX_DTYPE_*) and in the layout of the header. The header keeps the data aligned to 64
+bytes, so the file can be mapped into memory and used without a copy
+*/
+# define MATRIX_FILE_MAGIC "PLMATRIX"
+# define MATRIX_FILE_VERSION 1
+# define MATRIX_FILE_BYTE_ORDER 0x01020304u
+# define MATRIX_FILE_HEADER_BYTES 64
+# define MATRIX_DTYPE_FLOAT64 0
+# define MATRIX_DTYPE_FLOAT32 1
+# define MATRIX_DTYPE_INT32 2
+# define MATRIX_DTYPE_INT64 3
+
+typedef struct {
+    char magic[8]; // MATRIX_FILE_MAGIC, without the final null character
+    uint32_t version;
+    uint32_t byte_order; // MATRIX_FILE_BYTE_ORDER written with the byte order of the machine
+    uint32_t dtype; // type of the values (MATRIX_DTYPE_*)
+    uint32_t layout; // order of the values (MATRIX_LAYOUT_*)
+    int64_t rows;
+    int64_t columns;
+    uint8_t reserved[24];
+} MatrixFileHeader;
+
+/*
+Size of the chunks read from a CSV file (and the initial size of the buffer of values)
+*/
+# define CSV_BUFFER_BYTES (1 << 16)
+
+/*
+Result cache (cache_resultados/1): results of the operations indexed by the operation and a hash
+of its operands, kept up to a budget of bytes and evicted from the least recently used. The
+operands which are handles are identified by their matrix and its version, the other ones by
+their dimensions, type and values
+*/
+# define RESULT_CACHE_BUCKETS 1024
+# define RESULT_CACHE_ADDITION 0
+# define RESULT_CACHE_SUBSTRACTION 1
+# define RESULT_CACHE_MULTIPLICATION 2
+# define RESULT_CACHE_TRANSPOSE 3
+
+typedef struct OperandShape {
+    int rows;
+    int columns;
+    int element_type;
+    int layout;
+} OperandShape;
+
+typedef struct ResultKey {
+    int enabled; // the cache was enabled when the key was computed
+    int operation;
+    uint64_t hash[2];
+    OperandShape operands[2]; // all zeros for the second operand of the operations of one operand
+} ResultKey;
+
+/*
+Hash of the values of a matrix in the order of its rows, whatever its layout, so the parsers can
+take it while they read the values and the cache does not go over them again. Each value is a
+word of 64 bits, and the words go in turn to four independent lanes
+*/
+typedef struct ValuesHash {
+    uint64_t lanes[4];
+    size_t words;
+} ValuesHash;
+
+/*
+Futures of the operations which run in the background (multiplicar_matrices_async/3, ...).
+A future goes from FUTURE_PENDING to FUTURE_RUNNING and ends in FUTURE_DONE, FUTURE_FAILED
+or FUTURE_CANCELLED. The message of the first error of its computation, at most
+FUTURE_ERROR_BYTES, is kept in the future instead of being printed. The Prolog threads print
+their errors and keep the first one of each call (matriz_ultimo_error/1)
+*/
+# define FUTURE_ADDITION 0
+# define FUTURE_SUBSTRACTION 1
+# define FUTURE_MULTIPLICATION 2
+# define FUTURE_TRANSPOSE 3
+# define FUTURE_PENDING 0
+# define FUTURE_RUNNING 1
+# define FUTURE_DONE 2
+# define FUTURE_FAILED 3
+# define FUTURE_CANCELLED 4
+# define FUTURE_ERROR_BYTES 256
+
+/*
+Memory pool for the data buffers of the matrices. Buffers are aligned to POOL_ALIGNMENT bytes,
+buffers bigger than POOL_MAX_BUFFER_BYTES are never kept for reuse and the free lists
+keep at most POOL_MAX_CACHED_BYTES.
+*/
+# define POOL_ALIGNMENT 64
+# define POOL_MIN_BYTES ((size_t) 64)
+# define POOL_MAX_BUFFER_BYTES ((size_t) 1 << 30)
+# define POOL_MAX_CACHED_BYTES ((size_t) 512 << 20)
+# define POOL_CLASSES 128
+
+typedef struct {
+    size_t allocations; // buffers requested
+    size_t allocated_bytes; // bytes of all the buffers handed out, reused or not
+    size_t reused; // buffers served from the free lists
+    size_t releases; // buffers given back
+    size_t system_allocations; // buffers obtained from the system
+    size_t system_bytes; // bytes obtained from the system
+    size_t bytes_in_use; // bytes of the buffers which are in use
+    size_t peak_bytes; // maximum of bytes_in_use
+    size_t cached_bytes; // bytes kept in the free lists
+} MemoryStatistics;
+
+/*
+Matrices created during a foreign call, which are freed together when the call finishes
+*/
+# define ARENA_CAPACITY 16
+
+typedef struct {
+    Matrix* matrices[ARENA_CAPACITY];
+    int count;
+} MatrixArena;
+
+/*
+Number of elements processed at a time by the fused evaluation of matriz_eval/2
+*/
+# define EVAL_BLOCK 256
+
+/*
+Statistics of the foreign predicates (matrices_stats/1). The counters of a call are collected
+in a CallStatistics on the stack of the predicate and added to the ones of the predicate when
+the call finishes. The reasons of the failures are the STATISTICS_FAILURE_* values
+*/
+# define STATISTICS_MAX_PREDICATES 64
+# define STATISTICS_FAILURE_ARGUMENTS 0
+# define STATISTICS_FAILURE_MEMORY 1
+# define STATISTICS_FAILURE_OPERATION 2
+# define STATISTICS_FAILURE_UNIFICATION 3
+# define STATISTICS_FAILURE_REASONS 4
+
+typedef struct CallStatistics {
+    int predicate; // index returned by register_predicate_statistics
+    int failure_reason; // first STATISTICS_FAILURE_* reason recorded, -1 if there is none
+    uint64_t start_ns; // monotonic clock when the call started
+    uint64_t parse_ns; // time spent obtaining matrices from the arguments
+    uint64_t unify_ns; // time spent unifying the result
+    uint64_t input_elements; // elements of the operands
+    uint64_t output_elements; // elements of the result
+    uint64_t bytes; // bytes taken from the memory pool
+    struct CallStatistics* previous; // call which was running in the thread when this one started
+} CallStatistics;
+
+extern int statistics_enabled;
 
  /* 
     Function declarations for the matricesLogic class to avoid the warning
@@ -28,6 +441,12 @@ which has been stored as a unidimensional matrix.
 
 // Creation and managment of the matrices
 Matrix* new_matrix(int rows, int columns);
+Matrix* new_matrix_with_layout(int rows, int columns, int layout);
+void set_matrix_shape(Matrix* matrix, int rows, int columns);
+void set_matrix_layout(Matrix* matrix, int rows, int columns, int layout);
+int elementwise_layout(Matrix* matrix1, Matrix* matrix2);
+int product_layout(Matrix* matrix1, Matrix* matrix2);
+int transpose_layout(Matrix* matrix);
 int free_matrix(Matrix* matrix);
 
 // Management of matrices
@@ -42,12 +461,257 @@ int multiply_matrix_by_factor(Matrix* matrix, double* factor, Matrix* result);
 int divide_matrix_by_factor(Matrix* matrix, double *factor, Matrix* result);
 int sum_elements_from_matrix(Matrix* matrix, double* result); 
 int is_upper_triangular_matrix(Matrix* matrix);
+int is_lower_triangular_matrix(Matrix* matrix);
+int is_matrix_symmetric(Matrix* matrix);
+int is_identity_matrix(Matrix* matrix);
 int do_matrices_have_same_dimensions(Matrix* matrix1, Matrix* matrix2); 
 
+// Selection of the SIMD kernels
+const MatrixKernels* get_kernels(int simd_level);
+void select_kernels(void);
+int set_kernels(int simd_level);
+
+// Memory pool and arenas
+void* pool_allocate(size_t bytes, size_t* capacity);
+void pool_release(void* buffer, size_t capacity);
+Matrix* pool_allocate_struct(void);
+void pool_release_struct(Matrix* matrix);
+void renew_matrix_version(Matrix* matrix);
+void pool_trim(void);
+void get_memory_statistics(MemoryStatistics* statistics);
+void arena_init(MatrixArena* arena);
+Matrix* arena_adopt(MatrixArena* arena, Matrix* matrix);
+Matrix* arena_new_matrix(MatrixArena* arena, int rows, int columns);
+Matrix* arena_new_matrix_with_layout(MatrixArena* arena, int rows, int columns, int layout);
+Matrix* arena_detach(MatrixArena* arena, Matrix* matrix);
+void arena_release(MatrixArena* arena);
+foreign_t arena_fail(MatrixArena* arena);
+foreign_t pl_memory_statistics(term_t statistics);
+foreign_t pl_trim_memory(void);
+
+// Statistics of the foreign predicates
+int register_predicate_statistics(const char* name, int arity);
+void statistics_begin(CallStatistics* call, int predicate);
+foreign_t statistics_end(CallStatistics* call, foreign_t result);
+uint64_t statistics_clock(void);
+void statistics_record_operand(uint64_t start, Matrix* matrix);
+void statistics_record_result(uint64_t start, Matrix* matrix, int unified);
+void statistics_record_allocation(size_t bytes);
+void statistics_record_failure(int reason);
+foreign_t pl_matrices_stats(term_t statistics);
+foreign_t pl_matrices_stats_enable(term_t enabled);
+foreign_t pl_matrices_stats_reset(void);
+foreign_t pl_matrices_stats_trace(term_t file);
+foreign_t pl_matrices_stats_close_trace(void);
+
+// Thread pool and parallel execution of the kernels
+void parallel_for(size_t n, size_t grain, parallel_task_t task, void* context);
+int get_thread_count(void);
+int current_worker(void);
+int set_thread_count(int thread_count);
+void shutdown_thread_pool(void);
+void parallel_binary_kernel(binary_kernel_t kernel, const double* a, const double* b, double* result, size_t n);
+void parallel_factor_kernel(factor_kernel_t kernel, const double* a, double factor, double* result, size_t n);
+double parallel_dot(const double* a, const double* b, size_t n);
+
+// Blocked matrix product for large matrices (column-major, with leading dimensions)
+int gemm_blocked(int m, int n, int k, double alpha, const double* a, int lda,
+                 const double* b, int ldb, double beta, double* c, int ldc);
+int gemm_parallel(int m, int n, int k, double alpha, const double* a, int lda,
+                  const double* b, int ldb, double beta, double* c, int ldc);
+int gemm_strided(int m, int n, int k, double alpha, const double* a, size_t a_row_stride, size_t a_column_stride,
+                 const double* b, size_t b_row_stride, size_t b_column_stride, double beta, double* c, int ldc);
+
 // Auxiliary methods for conversion
 Matrix* parse_list_of_lists_into_matrix(term_t tList);
 int parse_matrix_into_list_of_lists(Matrix* matrix, term_t resutltListOfLists);
 int assign_matrix_row_values_to_list(Matrix* matrix, term_t tList, int current_row); 
+int unify_matrix_with_term(Matrix* matrix, term_t result, int format);
+Matrix* parse_matrix_compound(term_t tMatrix);
 int get_correct_dimensions(term_t tList, int* rows, int* columns);
 
+// Matrix handles (SWI-Prolog blobs which own a matrix)
+// Functor matrix/3 of the compound terms, created by init_matrix_terms when the library is installed
+extern functor_t matrix_functor;
+void init_matrix_terms(void);
+int unify_matrix_handle(term_t handle, Matrix* matrix);
+Matrix* get_matrix_from_handle(term_t handle);
+int is_matrix_handle(term_t term);
+int is_matrix_compound(term_t term);
+Matrix* get_matrix_from_term(term_t term, MatrixArena* arena);
+Matrix* get_strided_matrix_from_term(term_t term, MatrixArena* arena);
+int unify_matrix_result(term_t result, Matrix* matrix, int as_handle, MatrixArena* arena);
+foreign_t pl_list_to_matrix_handle(term_t list, term_t handle);
+foreign_t pl_matrix_handle_to_list(term_t handle, term_t list);
+foreign_t pl_matrix_handle_to_term(term_t handle, term_t format, term_t term);
+foreign_t pl_matrix_handle_dimensions(term_t handle, term_t rows, term_t columns);
+
+// Binary matrix files
+int save_matrix_file(Matrix* matrix, const char* path);
+Matrix* map_matrix_file(const char* path, int storage);
+void unmap_matrix_file(Matrix* matrix);
+foreign_t pl_save_matrix(term_t matrix, term_t file);
+foreign_t pl_load_matrix(term_t file, term_t handle);
+foreign_t pl_load_matrix_with_mode(term_t file, term_t handle, term_t mode);
+Matrix* load_csv_file(const char* path);
+foreign_t pl_load_csv(term_t file, term_t result);
+foreign_t pl_load_csv_handle(term_t file, term_t handle);
+
+// Linear systems
+Factorization* lu_factorization(Matrix* matrix);
+Factorization* cholesky_factorization(Matrix* matrix);
+void free_factorization(Factorization* factorization);
+int solve_with_factorization(Factorization* factorization, Matrix* right_hand_sides, Matrix* result);
+double factorization_determinant(Factorization* factorization);
+foreign_t pl_lu_factorization(term_t matrix, term_t factorization);
+foreign_t pl_cholesky_factorization(term_t matrix, term_t factorization);
+foreign_t pl_solve_system(term_t matrix, term_t right_hand_sides, term_t result);
+foreign_t pl_solve_system_handle(term_t matrix, term_t right_hand_sides, term_t result);
+foreign_t pl_determinant(term_t matrix, term_t determinant);
+foreign_t pl_inverse(term_t matrix, term_t result);
+foreign_t pl_inverse_handle(term_t matrix, term_t result);
+
+// Reductions
+int reduce_matrix(Matrix* matrix, int axis, int operations, Reduction* results);
+double reduction_sum(const Reduction* reduction, int which);
+foreign_t pl_reduce_matrix(term_t matrix, term_t axis, term_t operations, term_t result);
+int get_summation_algorithm(void);
+void set_summation_algorithm(int algorithm);
+foreign_t pl_summation_algorithm(term_t algorithm);
+
+// Vectors
+Matrix* get_vector_from_term(term_t term, MatrixArena* arena);
+int unify_vector_result(term_t result, Matrix* vector, int as_handle, MatrixArena* arena);
+int matrix_vector_product(double alpha, Matrix* matrix, Matrix* x, double beta, Matrix* y, Matrix* result);
+int vectors_axpy(double alpha, Matrix* x, Matrix* y, Matrix* result);
+foreign_t pl_gemv(term_t alpha, term_t matrix, term_t x, term_t beta, term_t y, term_t result);
+foreign_t pl_gemv_handle(term_t alpha, term_t matrix, term_t x, term_t beta, term_t y, term_t result);
+foreign_t pl_matrix_vector_product(term_t matrix, term_t x, term_t result);
+foreign_t pl_matrix_vector_product_handle(term_t matrix, term_t x, term_t result);
+foreign_t pl_axpy(term_t alpha, term_t x, term_t y, term_t result);
+foreign_t pl_axpy_handle(term_t alpha, term_t x, term_t y, term_t result);
+foreign_t pl_batched_dot_products(term_t vector, term_t vectors, term_t result);
+
+// Strassen-Winograd product
+int strassen_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix* result);
+void get_multiplication_settings(int* algorithm, int* cutoff);
+void set_multiplication_settings(int algorithm, int cutoff);
+foreign_t pl_multiplication_algorithm(term_t algorithm);
+foreign_t pl_strassen_cutoff(term_t cutoff);
+
+// Transposes
+void transpose_values(const double* source, int rows, int columns, double* destination);
+void copy_strided_values(const double* source, size_t row_stride, size_t column_stride, int rows, int columns,
+                         double* destination);
+int matrix_transpose_in_place(Matrix* matrix);
+int change_matrix_layout(Matrix* matrix, int layout);
+foreign_t pl_matrix_transpose_in_place(term_t handle);
+foreign_t pl_matrix_layout(term_t matrix, term_t layout);
+foreign_t pl_change_matrix_layout(term_t handle, term_t layout);
+
+// Views which share the data of a matrix
+int is_matrix_contiguous(const Matrix* matrix);
+int matrix_layout(const Matrix* matrix);
+Matrix* describe_transpose(Matrix* matrix, Matrix* description);
+void copy_matrix_values(Matrix* source, Matrix* destination);
+Matrix* new_matrix_view(Matrix* matrix, int first_row, int first_column, int rows, int columns,
+                        size_t row_stride, size_t column_stride);
+Matrix* transposed_view(Matrix* matrix);
+Matrix* copy_matrix_view(Matrix* view);
+foreign_t pl_submatrix(term_t matrix, term_t first_row, term_t first_column, term_t rows, term_t columns, term_t view);
+foreign_t pl_matrix_row(term_t matrix, term_t row, term_t view);
+foreign_t pl_matrix_column(term_t matrix, term_t column, term_t view);
+foreign_t pl_matrix_diagonal(term_t matrix, term_t view);
+foreign_t pl_transposed_view(term_t matrix, term_t view);
+
+// Structure of the matrices
+int get_matrix_structure(Matrix* matrix);
+int has_matrix_structure(Matrix* matrix, int flags);
+void invalidate_matrix_structure(Matrix* matrix);
+void set_structure_of_sum(Matrix* matrix1, Matrix* matrix2, Matrix* result);
+void set_structure_of_scaling(Matrix* matrix, double factor, Matrix* result);
+void set_structure_of_transpose(Matrix* matrix, Matrix* result);
+void set_structure_of_product(Matrix* matrix1, Matrix* matrix2, Matrix* result);
+int structured_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix* result);
+
+// Sparse matrices
+SparseMatrix* new_sparse_matrix(int rows, int columns, int format, size_t nonzeros);
+void free_sparse_matrix(SparseMatrix* sparse);
+size_t sparse_nonzeros(const SparseMatrix* sparse);
+SparseMatrix* dense_to_sparse(Matrix* matrix, int format);
+Matrix* sparse_to_dense(SparseMatrix* sparse);
+SparseMatrix* sparse_convert(SparseMatrix* sparse, int format);
+SparseMatrix* sparse_transpose(SparseMatrix* sparse);
+SparseMatrix* sparse_addition(SparseMatrix* sparse1, SparseMatrix* sparse2, double sign);
+int sparse_dense_addition(SparseMatrix* sparse, double sign1, Matrix* matrix, double sign2, Matrix* result);
+SparseMatrix* sparse_scale(SparseMatrix* sparse, double factor, int divide);
+int sparse_dense_multiplication(SparseMatrix* sparse, Matrix* matrix, Matrix* result);
+int dense_sparse_multiplication(Matrix* matrix, SparseMatrix* sparse, Matrix* result);
+SparseMatrix* sparse_sparse_multiplication(SparseMatrix* sparse1, SparseMatrix* sparse2);
+int unify_sparse_handle(term_t handle, SparseMatrix* sparse);
+SparseMatrix* get_sparse_from_handle(term_t handle);
+int is_sparse_handle(term_t term);
+foreign_t sparse_binary_common(term_t matrix1, term_t matrix2, term_t result, int operation, int as_handle);
+foreign_t sparse_transpose_common(term_t matrix, term_t result, int as_handle);
+foreign_t sparse_scale_common(term_t matrix, term_t factor, term_t result, int divide, int as_handle);
+foreign_t pl_matrix_to_sparse(term_t matrix, term_t sparse);
+foreign_t pl_matrix_to_sparse_with_format(term_t matrix, term_t format, term_t sparse);
+foreign_t pl_sparse_to_matrix(term_t sparse, term_t result);
+foreign_t pl_sparse_to_matrix_handle(term_t sparse, term_t handle);
+foreign_t pl_sparse_nonzeros(term_t sparse, term_t nonzeros);
+
+// Element types of the matrices
+size_t matrix_element_size(int type);
+const char* matrix_type_name(int type);
+Matrix* new_typed_matrix(int rows, int columns, int type);
+int promote_types(int type1, int type2);
+Matrix* convert_matrix(Matrix* matrix, int type);
+int unify_typed_value(term_t value, Matrix* matrix, int row, int column);
+int typed_addition(Matrix* matrix1, Matrix* matrix2, int substract, Matrix** result);
+int typed_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix** result);
+int is_typed_handle(term_t term);
+Matrix* get_typed_matrix_from_term(term_t term, int type, MatrixArena* arena);
+foreign_t typed_binary_common(term_t matrix1, term_t matrix2, term_t result, int operation, int as_handle);
+foreign_t pl_list_to_typed_matrix(term_t list, term_t type, term_t handle);
+foreign_t pl_matrix_type(term_t matrix, term_t type);
+foreign_t pl_convert_matrix(term_t matrix, term_t type, term_t handle);
+
+// Result cache
+Matrix* cached_result(ResultKey* key, int operation, term_t term1, Matrix* matrix1, term_t term2, Matrix* matrix2);
+void cache_result(const ResultKey* key, Matrix* result);
+int unify_cached_result(term_t result, Matrix* cached, int as_handle);
+int result_cache_enabled(void);
+void begin_values_hash(ValuesHash* hash);
+void hash_values(ValuesHash* hash, const void* values, size_t count, size_t stride, int element_type);
+void finish_values_hash(ValuesHash* hash, Matrix* matrix);
+foreign_t pl_result_cache(term_t budget);
+foreign_t pl_result_cache_statistics(term_t statistics);
+foreign_t pl_clear_result_cache(void);
+
+// Errors and operations in the background
+void report_error(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void begin_call_errors(void);
+foreign_t pl_matrix_last_error(term_t message);
+void shutdown_futures(void);
+foreign_t pl_matrices_addition_async(term_t matrix1, term_t matrix2, term_t future);
+foreign_t pl_matrices_substraction_async(term_t matrix1, term_t matrix2, term_t future);
+foreign_t pl_matrices_multiplication_async(term_t matrix1, term_t matrix2, term_t future);
+foreign_t pl_matrices_transpose_async(term_t matrix, term_t future);
+foreign_t pl_matrix_wait(term_t future, term_t result);
+foreign_t pl_matrix_ready(term_t future);
+foreign_t pl_matrix_cancel(term_t future);
+foreign_t pl_matrix_error(term_t future, term_t message);
+
+// Products of many matrices
+int matrix_chain_multiplication(Matrix** factors, int count, Matrix* result);
+int matrix_power(Matrix* matrix, int exponent, Matrix* result);
+foreign_t pl_matrix_chain_multiplication(term_t list, term_t result);
+foreign_t pl_matrix_chain_multiplication_handle(term_t list, term_t result);
+foreign_t pl_matrix_power(term_t matrix, term_t exponent, term_t result);
+foreign_t pl_matrix_power_handle(term_t matrix, term_t exponent, term_t result);
+
+// Fused evaluation of expressions over matrices
+foreign_t pl_matrix_eval(term_t expression, term_t result);
+foreign_t pl_matrix_eval_handle(term_t expression, term_t result);
+
 # endif 
\ No newline at end of file
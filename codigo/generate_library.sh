@@ -1,3 +1,3 @@
 #!/bin/bash
-swipl-ld -o matrices.so -shared matricesLogic.c matricesProlog.c -I/include 
+swipl-ld -o matrices.so -shared matricesLogic.c matricesGemm.c matricesKernels.c matricesThreads.c matricesMemory.c matricesHandles.c matricesFiles.c matricesSparse.c matricesStructure.c matricesStrassen.c matricesLinear.c matricesReductions.c matricesVectors.c matricesTranspose.c matricesViews.c matricesTypes.c matricesCache.c matricesAsync.c matricesChain.c matricesStats.c matricesEval.c matricesProlog.c -I/include -lpthread 
 
@@ -0,0 +1,512 @@
+#include "definitions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the operations which run in the background. The operands are read on the
+  calling thread, because they are Prolog terms, and the operation is queued for a background
+  thread, so the predicate returns a future handle at once and Prolog can go on with its work.
+    - matriz_wait/2 blocks until the future has finished and returns its result as a handle,
+      matriz_ready/1 checks whether it has finished and matriz_cancel/1 cancels it. A future
+      which is still in the queue is never run, and the result of a running one is discarded.
+    - The background thread runs one operation at a time. The operation splits its work with the
+      thread pool, which runs on the calling thread the jobs of any other Prolog thread that asks
+      for it meanwhile, so the foreground work is never blocked by the background one.
+    - The errors are reported with report_error: they are kept in the future by the background
+      thread, and the Prolog threads print them and keep the first one of each call, which
+      matriz_ultimo_error/1 returns as an atom. matriz_wait/2 reports the message of a failed
+      future on the thread which waits, and matriz_error/2 returns it as an atom.
+    - The algorithms chosen by the thread which starts an operation (algoritmo_multiplicacion/1,
+      umbral_strassen/1 and algoritmo_suma/1) are copied into the future and used to run it.
+    - The operands are kept alive with a reference, as the views do, so their handles can be
+      collected while the operation runs.
+*/
+
+typedef struct Future {
+    int operation; // FUTURE_ADDITION, FUTURE_SUBSTRACTION, FUTURE_MULTIPLICATION or FUTURE_TRANSPOSE
+    Matrix* operands[2]; // the second one is NULL for the transpose
+    Matrix* result;
+    int state; // FUTURE_* state
+    int cancelled; // the result is not wanted any more
+    int references; // holders of the future: its handle and the queue until it finishes
+    int multiplication_algorithm; // settings of the thread which started the operation
+    int strassen_cutoff;
+    int summation_algorithm;
+    char error[FUTURE_ERROR_BYTES];
+    struct Future* next; // next future of the queue
+} Future;
+
+typedef struct {
+    pthread_mutex_t lock; // protects the queue and the fields of all the futures
+    pthread_cond_t work_ready; // signaled when a future is queued
+    pthread_cond_t finished; // broadcast when a future finishes
+    Future* first;
+    Future* last;
+    pthread_t worker;
+    int started;
+    int shutting_down;
+} FutureQueue;
+
+static FutureQueue queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_ready = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER
+};
+
+// Error message of the future which the thread is running, NULL for the Prolog threads
+static __thread char* error_sink = NULL;
+
+// First error message of the current call of a Prolog thread, empty if there has been none
+static __thread char call_error[FUTURE_ERROR_BYTES];
+
+/*
+    Report an error of an operation: it is printed and kept as the error of the current call,
+    or kept in the future which the thread is running. Only the first error of a call or a future
+    is kept, the rest are consequences of it
+*/
+void report_error(const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    if (!error_sink) {
+        va_list copy;
+        va_copy(copy, arguments);
+        vprintf(format, copy);
+        va_end(copy);
+        if (!call_error[0]) {
+            vsnprintf(call_error, FUTURE_ERROR_BYTES, format, arguments);
+        }
+    } else if (!error_sink[0]) {
+        vsnprintf(error_sink, FUTURE_ERROR_BYTES, format, arguments);
+    }
+    va_end(arguments);
+}
+
+/*
+    Forget the error of the previous call. Called at the beginning of every predicate
+*/
+void begin_call_errors(void) {
+    call_error[0] = '\0';
+}
+
+/*
+    Drop a holder of a future, freeing it with the last one. Called with the lock taken
+*/
+static void release_future(Future* future) {
+    if (--future->references > 0) {
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        free_matrix(future->operands[i]);
+    }
+    free_matrix(future->result);
+    free(future);
+}
+
+/*
+    Compute the result of a future. Returns SUCCESS or FAILURE
+*/
+static int run_future(Future* future) {
+    Matrix* a = future->operands[0];
+    Matrix* b = future->operands[1];
+    // The matrices of doubles, which can be stored by rows or be views, use the operations of matricesLogic.c
+    if (future->operation != FUTURE_TRANSPOSE && a->element_type == MATRIX_TYPE_F64 && b->element_type == MATRIX_TYPE_F64) {
+        int multiplication = future->operation == FUTURE_MULTIPLICATION;
+        future->result = new_matrix_with_layout(a->rows, multiplication ? b->columns : a->columns,
+                                                multiplication ? product_layout(a, b) : elementwise_layout(a, b));
+        if (!future->result) {
+            return FAILURE;
+        }
+        return multiplication ? matrices_multiplication(a, b, future->result) :
+               future->operation == FUTURE_SUBSTRACTION ? matrices_substraction(a, b, future->result) :
+               matrices_addition(a, b, future->result);
+    }
+    switch (future->operation) {
+        case FUTURE_ADDITION:
+            return typed_addition(a, b, 0, &future->result);
+        case FUTURE_SUBSTRACTION:
+            return typed_addition(a, b, 1, &future->result);
+        case FUTURE_MULTIPLICATION:
+            return typed_multiplication(a, b, &future->result);
+        default:
+            future->result = new_matrix_with_layout(a->columns, a->rows, transpose_layout(a));
+            return future->result ? matrix_transpose(a, future->result) : FAILURE;
+    }
+}
+
+/*
+    Loop of the background thread: take the futures of the queue in order and compute them
+*/
+static void* future_worker_loop(void* argument) {
+    pthread_mutex_lock(&queue.lock);
+    for (;;) {
+        while (!queue.shutting_down && !queue.first) {
+            pthread_cond_wait(&queue.work_ready, &queue.lock);
+        }
+        if (queue.shutting_down) {
+            break;
+        }
+        Future* future = queue.first;
+        queue.first = future->next;
+        if (!queue.first) {
+            queue.last = NULL;
+        }
+        future->state = FUTURE_RUNNING;
+        pthread_mutex_unlock(&queue.lock);
+
+        error_sink = future->error;
+        set_multiplication_settings(future->multiplication_algorithm, future->strassen_cutoff);
+        set_summation_algorithm(future->summation_algorithm);
+        int correct = run_future(future);
+        error_sink = NULL;
+
+        pthread_mutex_lock(&queue.lock);
+        if (future->cancelled) {
+            future->state = FUTURE_CANCELLED;
+        } else if (correct == SUCCESS && future->result) {
+            future->state = FUTURE_DONE;
+        } else {
+            future->state = FUTURE_FAILED;
+            if (!future->error[0]) {
+                snprintf(future->error, FUTURE_ERROR_BYTES, "No es posible calcular el resultado de la operación\n");
+            }
+        }
+        if (future->state != FUTURE_DONE && future->result) {
+            free_matrix(future->result);
+            future->result = NULL;
+        }
+        // The operands are not needed any more, so their handles can be modified again
+        for (int i = 0; i < 2; i++) {
+            free_matrix(future->operands[i]);
+            future->operands[i] = NULL;
+        }
+        release_future(future);
+        pthread_cond_broadcast(&queue.finished);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return NULL;
+}
+
+/*
+    Add a future to the queue, starting the background thread the first time.
+    Returns SUCCESS or FAILURE
+*/
+static int queue_future(Future* future) {
+    pthread_mutex_lock(&queue.lock);
+    if (!queue.started) {
+        queue.shutting_down = 0;
+        queue.started = pthread_create(&queue.worker, NULL, future_worker_loop, NULL) == 0;
+    }
+    if (!queue.started) {
+        pthread_mutex_unlock(&queue.lock);
+        return FAILURE;
+    }
+    future->references++;
+    if (queue.last) {
+        queue.last->next = future;
+    } else {
+        queue.first = future;
+    }
+    queue.last = future;
+    pthread_cond_signal(&queue.work_ready);
+    pthread_mutex_unlock(&queue.lock);
+    return SUCCESS;
+}
+
+/*
+    Remove a future from the queue if it has not been taken yet. Called with the lock taken.
+    Returns SUCCESS if it was removed
+*/
+static int unqueue_future(Future* future) {
+    Future* previous = NULL;
+    for (Future* current = queue.first; current; previous = current, current = current->next) {
+        if (current == future) {
+            if (previous) {
+                previous->next = current->next;
+            } else {
+                queue.first = current->next;
+            }
+            if (queue.last == current) {
+                queue.last = previous;
+            }
+            future->state = FUTURE_CANCELLED;
+            for (int i = 0; i < 2; i++) {
+                free_matrix(future->operands[i]);
+                future->operands[i] = NULL;
+            }
+            release_future(future);
+            return SUCCESS;
+        }
+    }
+    return FAILURE;
+}
+
+/*
+    Stop the background thread. The futures of the queue are cancelled. It is called when the
+    library is unloaded
+*/
+void shutdown_futures(void) {
+    pthread_mutex_lock(&queue.lock);
+    while (queue.first) {
+        unqueue_future(queue.first);
+    }
+    if (!queue.started) {
+        pthread_mutex_unlock(&queue.lock);
+        return;
+    }
+    queue.shutting_down = 1;
+    pthread_cond_broadcast(&queue.work_ready);
+    pthread_cond_broadcast(&queue.finished);
+    pthread_mutex_unlock(&queue.lock);
+    pthread_join(queue.worker, NULL);
+    queue.started = 0;
+}
+
+/*********************************************/
+/*
+    Future handles and foreign predicates
+*/
+/**********************************************/
+
+static const char* state_names[] = { "pendiente", "en_curso", "terminado", "fallido", "cancelado" };
+
+/*
+   Release a future handle. A future which is still in the queue is not run any more, and a
+   running one is freed by the background thread when it finishes
+*/
+static int release_future_handle(atom_t handle) {
+    Future** future = (Future**) PL_blob_data(handle, NULL, NULL);
+    if (future && *future) {
+        pthread_mutex_lock(&queue.lock);
+        (*future)->cancelled = 1;
+        unqueue_future(*future);
+        release_future(*future);
+        pthread_mutex_unlock(&queue.lock);
+        *future = NULL;
+    }
+    return TRUE;
+}
+
+/*
+   Print a handle as <futuro>(Address,State)
+*/
+static int write_future_handle(IOSTREAM* stream, atom_t handle, int flags) {
+    Future** future = (Future**) PL_blob_data(handle, NULL, NULL);
+    if (!future || !*future) {
+        Sfprintf(stream, "<futuro>(liberado)");
+        return TRUE;
+    }
+    pthread_mutex_lock(&queue.lock);
+    int state = (*future)->state;
+    pthread_mutex_unlock(&queue.lock);
+    Sfprintf(stream, "<futuro>(%p,%s)", (void*) *future, state_names[state]);
+    return TRUE;
+}
+
+static PL_blob_t future_blob = {
+    PL_BLOB_MAGIC,
+    PL_BLOB_UNIQUE,
+    "futuro",
+    release_future_handle,
+    NULL,
+    write_future_handle,
+    NULL
+};
+
+/*
+    Obtain the future of a handle. Returns NULL if the term is not a future handle
+*/
+static Future* get_future_from_handle(term_t handle) {
+    void* blob_data;
+    PL_blob_t* type;
+
+    if (!PL_get_blob(handle, &blob_data, NULL, &type) || type != &future_blob) {
+        report_error("No se trata de un futuro\n");
+        return NULL;
+    }
+    return *(Future**) blob_data;
+}
+
+/*
+    Keep an operand alive while the future needs it. The matrices of handles get a new holder,
+    and the ones read for this call are taken from the arena
+*/
+static Matrix* hold_operand(term_t term, Matrix* matrix, MatrixArena* arena) {
+    if (is_matrix_handle(term) && matrix == get_matrix_from_handle(term)) {
+        atomic_fetch_add(&matrix->references, 1);
+        return matrix;
+    }
+    return arena_detach(arena, matrix);
+}
+
+/*
+    Read the operands of an operation and queue it, unifying future with its handle. When one of
+    the operands is a typed handle the lists are read with its type, as in typed_binary_common
+*/
+static foreign_t start_future(int operation, term_t matrix1, term_t matrix2, term_t future) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m1;
+    Matrix* m2 = NULL;
+    if (operation == FUTURE_TRANSPOSE) {
+        m1 = get_strided_matrix_from_term(matrix1, &arena);
+    } else if (!is_typed_handle(matrix1) && !is_typed_handle(matrix2)) {
+        m1 = get_strided_matrix_from_term(matrix1, &arena);
+        m2 = get_strided_matrix_from_term(matrix2, &arena);
+        if (!m2) {
+            return arena_fail(&arena);
+        }
+    } else {
+        int type1 = is_typed_handle(matrix1) ? get_matrix_from_handle(matrix1)->element_type : MATRIX_TYPE_F64;
+        int type2 = is_typed_handle(matrix2) ? get_matrix_from_handle(matrix2)->element_type : MATRIX_TYPE_F64;
+        m1 = get_typed_matrix_from_term(matrix1, type2, &arena);
+        m2 = get_typed_matrix_from_term(matrix2, type1, &arena);
+        if (!m2) {
+            return arena_fail(&arena);
+        }
+    }
+    Future* f = m1 ? calloc(1, sizeof(Future)) : NULL;
+    if (!f) {
+        return arena_fail(&arena);
+    }
+    f->operation = operation;
+    f->state = FUTURE_PENDING;
+    get_multiplication_settings(&f->multiplication_algorithm, &f->strassen_cutoff);
+    f->summation_algorithm = get_summation_algorithm();
+    f->references = 1; // the handle
+    f->operands[0] = hold_operand(matrix1, m1, &arena);
+    f->operands[1] = m2 ? hold_operand(matrix2, m2, &arena) : NULL;
+    arena_release(&arena);
+    if (queue_future(f) == FAILURE) {
+        report_error("No es posible crear el hilo de las operaciones en segundo plano\n");
+        pthread_mutex_lock(&queue.lock);
+        release_future(f);
+        pthread_mutex_unlock(&queue.lock);
+        PL_fail;
+    }
+    return PL_unify_blob(future, &f, sizeof(Future*), &future_blob);
+}
+
+/*
+  Foreign predicates sumar_matrices_async/3, restar_matrices_async/3, multiplicar_matrices_async/3
+  and transponer_matriz_async/2, whose last argument is the future of the result
+*/
+foreign_t pl_matrices_addition_async(term_t matrix1, term_t matrix2, term_t future) {
+    return start_future(FUTURE_ADDITION, matrix1, matrix2, future);
+}
+
+foreign_t pl_matrices_substraction_async(term_t matrix1, term_t matrix2, term_t future) {
+    return start_future(FUTURE_SUBSTRACTION, matrix1, matrix2, future);
+}
+
+foreign_t pl_matrices_multiplication_async(term_t matrix1, term_t matrix2, term_t future) {
+    return start_future(FUTURE_MULTIPLICATION, matrix1, matrix2, future);
+}
+
+foreign_t pl_matrices_transpose_async(term_t matrix, term_t future) {
+    return start_future(FUTURE_TRANSPOSE, matrix, 0, future);
+}
+
+/*
+  Foreign predicate matriz_wait(Futuro, Resultado): wait until the future has finished and
+  unify Resultado with a handle of its result, which is shared by all the waits. Fails, reporting
+  the error, if the operation has failed or has been cancelled
+*/
+foreign_t pl_matrix_wait(term_t future, term_t result) {
+    Future* f = get_future_from_handle(future);
+    if (!f) {
+        PL_fail;
+    }
+    pthread_mutex_lock(&queue.lock);
+    while (!f->cancelled && (f->state == FUTURE_PENDING || f->state == FUTURE_RUNNING) && queue.started) {
+        pthread_cond_wait(&queue.finished, &queue.lock);
+    }
+    Matrix* matrix = f->state == FUTURE_DONE ? f->result : NULL;
+    if (matrix) {
+        // The handle is another holder of the result. When an earlier wait has already created
+        // it, unify_matrix_handle unifies with that one and gives this reference back
+        atomic_fetch_add(&matrix->references, 1);
+    } else if (f->state == FUTURE_FAILED) {
+        report_error("%s", f->error);
+    } else {
+        report_error("La operación se ha cancelado\n");
+    }
+    pthread_mutex_unlock(&queue.lock);
+    if (!matrix) {
+        PL_fail;
+    }
+    return unify_matrix_result(result, matrix, 1, NULL);
+}
+
+/*
+  Foreign predicate matriz_ready(Futuro): succeeds if the future has finished, whether its
+  operation has succeeded or failed, or if it has been cancelled
+*/
+foreign_t pl_matrix_ready(term_t future) {
+    Future* f = get_future_from_handle(future);
+    if (!f) {
+        PL_fail;
+    }
+    pthread_mutex_lock(&queue.lock);
+    int ready = f->cancelled || (f->state != FUTURE_PENDING && f->state != FUTURE_RUNNING);
+    pthread_mutex_unlock(&queue.lock);
+    return ready;
+}
+
+/*
+  Foreign predicate matriz_cancel(Futuro): cancel a future which has not finished, so the waits
+  fail at once. Fails if it had already finished or been cancelled
+*/
+foreign_t pl_matrix_cancel(term_t future) {
+    Future* f = get_future_from_handle(future);
+    if (!f) {
+        PL_fail;
+    }
+    pthread_mutex_lock(&queue.lock);
+    int pending = !f->cancelled && (f->state == FUTURE_PENDING || f->state == FUTURE_RUNNING);
+    if (pending) {
+        f->cancelled = 1;
+        unqueue_future(f);
+        pthread_cond_broadcast(&queue.finished);
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return pending;
+}
+
+/*
+  Foreign predicate matriz_error(Futuro, Mensaje): message of the error of a failed future, as
+  an atom without the final new line
+*/
+foreign_t pl_matrix_error(term_t future, term_t message) {
+    Future* f = get_future_from_handle(future);
+    if (!f) {
+        PL_fail;
+    }
+    char error[FUTURE_ERROR_BYTES];
+    pthread_mutex_lock(&queue.lock);
+    int failed = f->state == FUTURE_FAILED;
+    memcpy(error, f->error, sizeof(error));
+    pthread_mutex_unlock(&queue.lock);
+    if (!failed) {
+        PL_fail;
+    }
+    error[strcspn(error, "\n")] = '\0';
+    return PL_unify_atom_chars(message, error);
+}
+
+/*
+  Foreign predicate matriz_ultimo_error(Mensaje): message of the first error of the last predicate
+  called by this thread, as an atom without the final new line. Fails if that call had no error
+*/
+foreign_t pl_matrix_last_error(term_t message) {
+    if (!call_error[0]) {
+        PL_fail;
+    }
+    char error[FUTURE_ERROR_BYTES];
+    memcpy(error, call_error, sizeof(error));
+    error[strcspn(error, "\n")] = '\0';
+    return PL_unify_atom_chars(message, error);
+}
@@ -0,0 +1,351 @@
+#include "definitions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the result cache, which is disabled until cache_resultados/1 gives it a
+  budget of bytes. The rules which backtrack into the same operation with the same operands
+  obtain the matrix computed the first time instead of computing it again:
+    - The key of a call is the operation, the shapes of its operands and a hash of 128 bits of
+      their contents. A handle is identified by its matrix and the version of its contents, so
+      its key costs the same whatever its size. The other operands are identified by their
+      values, which the parsers hash while they read them, so they are not read twice. A hit
+      needs the same hash, operation and shapes.
+    - The cache keeps a reference to the matrix of every result, as the views do, so a hit
+      returned as a handle shares the matrix without copying it. The entries are kept in a
+      list from the most to the least recently used, and the last ones are evicted when the
+      budget is exceeded.
+*/
+
+typedef struct CacheEntry {
+    ResultKey key;
+    Matrix* result;
+    size_t bytes;
+    struct CacheEntry* next; // next entry of the bucket
+    struct CacheEntry* newer; // entry used just after this one
+    struct CacheEntry* older; // entry used just before this one
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry* buckets[RESULT_CACHE_BUCKETS];
+    CacheEntry* newest;
+    CacheEntry* oldest;
+    atomic_size_t budget; // 0 when the cache is disabled, read without the lock by cached_result
+    size_t bytes;
+    size_t entries;
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} ResultCache;
+
+static ResultCache result_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+# define HASH_MULTIPLIER1 0x9E3779B97F4A7C15ull
+# define HASH_MULTIPLIER2 0xC2B2AE3D27D4EB4Full
+
+static uint64_t rotate(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/*
+    Add a word to the two lanes of a hash
+*/
+static void mix_word(uint64_t hash[2], uint64_t word) {
+    hash[0] = rotate((hash[0] ^ word) * HASH_MULTIPLIER1, 31);
+    hash[1] = rotate((hash[1] ^ word) * HASH_MULTIPLIER2, 27);
+}
+
+/*
+    Start the hash of the values of a matrix
+*/
+void begin_values_hash(ValuesHash* hash) {
+    hash->lanes[0] = HASH_MULTIPLIER1;
+    hash->lanes[1] = HASH_MULTIPLIER2;
+    hash->lanes[2] = HASH_MULTIPLIER1 ^ HASH_MULTIPLIER2;
+    hash->lanes[3] = rotate(HASH_MULTIPLIER1, 32);
+    hash->words = 0;
+}
+
+/*
+    Add count values of a type, which are stride values away from each other, to a hash. The
+    values of 32 bits are widened to a word, so the hash does not depend on how they are grouped
+*/
+void hash_values(ValuesHash* hash, const void* values, size_t count, size_t stride, int element_type) {
+    size_t size = matrix_element_size(element_type);
+    const unsigned char* value = (const unsigned char*) values;
+    for (size_t i = 0; i < count; i++, value += stride * size) {
+        uint64_t word = 0;
+        if (size == sizeof(uint64_t)) {
+            memcpy(&word, value, sizeof(uint64_t));
+        } else {
+            uint32_t half;
+            memcpy(&half, value, sizeof(uint32_t));
+            word = half;
+        }
+        uint64_t* lane = &hash->lanes[hash->words++ & 3];
+        *lane = rotate((*lane ^ word) * HASH_MULTIPLIER1, 29);
+    }
+}
+
+/*
+    Keep the hash of the values of a matrix, which is valid until its contents change
+*/
+void finish_values_hash(ValuesHash* hash, Matrix* matrix) {
+    matrix->values_hash[0] = (uint64_t) hash->words;
+    matrix->values_hash[1] = ~(uint64_t) hash->words;
+    for (int lane = 0; lane < 4; lane++) {
+        mix_word(matrix->values_hash, hash->lanes[lane]);
+    }
+    matrix->hashed_version = matrix->version;
+}
+
+/*
+    Add an operand to the key of a call. The values of a parsed operand were hashed by its
+    parser; the other ones (a dense copy of a sparse matrix, ...) are hashed here by rows
+*/
+static void mix_operand(ResultKey* key, int index, term_t term, Matrix* matrix) {
+    OperandShape* shape = &key->operands[index];
+    shape->rows = matrix->rows;
+    shape->columns = matrix->columns;
+    shape->element_type = matrix->element_type;
+    // The result of an operation keeps the layout of its operands
+    shape->layout = matrix_layout(matrix);
+    Matrix* handle_matrix = is_matrix_handle(term) ? get_matrix_from_handle(term) : NULL;
+    if (handle_matrix) {
+        mix_word(key->hash, 1);
+        mix_word(key->hash, (uint64_t)(uintptr_t) handle_matrix);
+        mix_word(key->hash, handle_matrix->version);
+        return;
+    }
+    if (matrix->hashed_version != matrix->version) {
+        ValuesHash hash;
+        size_t size = matrix_element_size(matrix->element_type);
+        begin_values_hash(&hash);
+        for (int row = 0; row < matrix->rows; row++) {
+            hash_values(&hash, (const unsigned char*) matrix->data + row * matrix->row_stride * size,
+                        (size_t) matrix->columns, matrix->column_stride, matrix->element_type);
+        }
+        finish_values_hash(&hash, matrix);
+    }
+    mix_word(key->hash, 2);
+    mix_word(key->hash, matrix->values_hash[0]);
+    mix_word(key->hash, matrix->values_hash[1]);
+}
+
+/*
+    Check whether the cache is enabled, so the parsers hash the values they read
+*/
+int result_cache_enabled(void) {
+    return result_cache.budget > 0;
+}
+
+/*
+    Look for the entry of a key. Besides the hash, the operation and the shapes of the operands
+    have to be the same, so two calls whose hashes collide do not share a result with the wrong
+    dimensions or type
+*/
+static CacheEntry** find_entry(const ResultKey* key) {
+    CacheEntry** entry = &result_cache.buckets[key->hash[0] % RESULT_CACHE_BUCKETS];
+    while (*entry && ((*entry)->key.hash[0] != key->hash[0] || (*entry)->key.hash[1] != key->hash[1] ||
+                      (*entry)->key.operation != key->operation ||
+                      memcmp((*entry)->key.operands, key->operands, sizeof(key->operands)) != 0)) {
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+static void unlink_entry(CacheEntry* entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        result_cache.newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        result_cache.oldest = entry->newer;
+    }
+}
+
+static void link_newest(CacheEntry* entry) {
+    entry->older = result_cache.newest;
+    entry->newer = NULL;
+    if (result_cache.newest) {
+        result_cache.newest->newer = entry;
+    } else {
+        result_cache.oldest = entry;
+    }
+    result_cache.newest = entry;
+}
+
+/*
+    Remove the least recently used entries until the cache takes at most budget bytes.
+    Called with the lock taken
+*/
+static void evict_until(size_t budget) {
+    while (result_cache.oldest && result_cache.bytes > budget) {
+        CacheEntry* entry = result_cache.oldest;
+        unlink_entry(entry);
+        *find_entry(&entry->key) = entry->next;
+        result_cache.bytes -= entry->bytes;
+        result_cache.entries--;
+        result_cache.evictions++;
+        free_matrix(entry->result);
+        free(entry);
+    }
+}
+
+/*
+    Compute the key of an operation with one or two operands (term2 is 0 for one) and look
+    for its result. On a hit the caller receives a reference to the cached matrix, which is
+    given to unify_cached_result. Returns NULL on a miss or when the cache is disabled
+*/
+Matrix* cached_result(ResultKey* key, int operation, term_t term1, Matrix* matrix1, term_t term2, Matrix* matrix2) {
+    memset(key, 0, sizeof(ResultKey));
+    key->enabled = result_cache_enabled();
+    if (!key->enabled) {
+        return NULL;
+    }
+    key->operation = operation;
+    key->hash[0] = HASH_MULTIPLIER1 ^ (uint64_t) operation;
+    key->hash[1] = HASH_MULTIPLIER2 ^ (uint64_t) operation;
+    mix_operand(key, 0, term1, matrix1);
+    if (term2) {
+        mix_operand(key, 1, term2, matrix2);
+    }
+    Matrix* result = NULL;
+    pthread_mutex_lock(&result_cache.lock);
+    CacheEntry* entry = *find_entry(key);
+    if (entry) {
+        unlink_entry(entry);
+        link_newest(entry);
+        result = entry->result;
+        atomic_fetch_add(&result->references, 1);
+        result_cache.hits++;
+    } else {
+        result_cache.misses++;
+    }
+    pthread_mutex_unlock(&result_cache.lock);
+    return result;
+}
+
+/*
+    Keep the result of the call of a key computed by cached_result. The cache takes its own
+    reference to the matrix, so the caller still owns it
+*/
+void cache_result(const ResultKey* key, Matrix* result) {
+    if (!key->enabled || !result) {
+        return;
+    }
+    size_t bytes = sizeof(CacheEntry) + sizeof(Matrix) +
+                   (size_t) result->rows * result->columns * matrix_element_size(result->element_type);
+    pthread_mutex_lock(&result_cache.lock);
+    if (bytes <= result_cache.budget && !*find_entry(key)) {
+        CacheEntry* entry = malloc(sizeof(CacheEntry));
+        if (entry) {
+            evict_until(result_cache.budget - bytes);
+            entry->key = *key;
+            entry->result = result;
+            entry->bytes = bytes;
+            CacheEntry** bucket = &result_cache.buckets[key->hash[0] % RESULT_CACHE_BUCKETS];
+            entry->next = *bucket;
+            *bucket = entry;
+            link_newest(entry);
+            atomic_fetch_add(&result->references, 1);
+            result_cache.bytes += bytes;
+            result_cache.entries++;
+        }
+    }
+    pthread_mutex_unlock(&result_cache.lock);
+}
+
+/*
+    Unify the result of a call with the matrix returned by cached_result. The reference goes to
+    the handle, as the matrices of unify_matrix_result, or it is given back when the term has
+    been written
+*/
+int unify_cached_result(term_t result, Matrix* cached, int as_handle) {
+    int unified = unify_matrix_result(result, cached, as_handle, NULL);
+    if (!as_handle) {
+        free_matrix(cached);
+    }
+    return unified;
+}
+
+/*********************************************/
+/*
+    Foreign predicates
+*/
+/**********************************************/
+
+/*
+  Foreign predicate cache_resultados(Bytes): with a variable, unify it with the budget of the
+  cache; with an integer, set the budget, evicting the entries which do not fit. 0 empties and
+  disables the cache
+*/
+foreign_t pl_result_cache(term_t budget) {
+    int64_t value;
+    begin_call_errors();
+    if (PL_is_variable(budget)) {
+        return PL_unify_int64(budget, (int64_t) result_cache.budget);
+    }
+    if (!PL_get_int64(budget, &value) || value < 0) {
+        report_error("El presupuesto de la caché de resultados debe ser un número de bytes mayor o igual que 0\n");
+        PL_fail;
+    }
+    pthread_mutex_lock(&result_cache.lock);
+    result_cache.budget = (size_t) value;
+    evict_until(result_cache.budget);
+    pthread_mutex_unlock(&result_cache.lock);
+    PL_succeed;
+}
+
+/*
+  Foreign predicate estadisticas_cache(Estadisticas): list of Clave-Valor with the counters of
+  the result cache
+*/
+foreign_t pl_result_cache_statistics(term_t statistics) {
+    pthread_mutex_lock(&result_cache.lock);
+    size_t numbers[] = {
+        result_cache.hits, result_cache.misses, result_cache.evictions, result_cache.entries,
+        result_cache.bytes, result_cache.budget
+    };
+    pthread_mutex_unlock(&result_cache.lock);
+
+    const char* keys[] = { "aciertos", "fallos", "expulsiones", "entradas", "bytes", "presupuesto" };
+    functor_t pair = PL_new_functor(PL_new_atom("-"), 2);
+    term_t list = PL_copy_term_ref(statistics);
+    term_t head = PL_new_term_ref();
+    term_t key = PL_new_term_ref();
+    term_t value = PL_new_term_ref();
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (!PL_put_atom(key, PL_new_atom(keys[i])) ||
+            !PL_put_int64(value, (int64_t) numbers[i]) ||
+            !PL_unify_list(list, head, list) ||
+            !PL_unify_functor(head, pair) ||
+            !PL_unify_arg(1, head, key) ||
+            !PL_unify_arg(2, head, value)) {
+            PL_fail;
+        }
+    }
+    return PL_unify_nil(list);
+}
+
+/*
+  Foreign predicate vaciar_cache: remove all the entries of the result cache and set its
+  counters to zero. The budget does not change
+*/
+foreign_t pl_clear_result_cache(void) {
+    pthread_mutex_lock(&result_cache.lock);
+    evict_until(0);
+    result_cache.hits = 0;
+    result_cache.misses = 0;
+    result_cache.evictions = 0;
+    pthread_mutex_unlock(&result_cache.lock);
+    PL_succeed;
+}
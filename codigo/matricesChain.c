@@ -0,0 +1,348 @@
+#include "definitions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdio.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the products of many matrices: the product of a chain of matrices and the
+  power of a square matrix.
+    - The order of the products of a chain is chosen by the dynamic program of the matrix chain
+      over the shapes of the factors, which minimizes the number of multiplications, so a chain
+      of very different shapes does not create large intermediate matrices.
+    - The intermediate matrices are written in a single scratch buffer used as a stack: the
+      intermediate of a product is placed on top of the one which is being computed and dropped
+      once it has been multiplied. Only the final product is a new matrix.
+    - The power is computed by repeated squaring, whose squares and partial products take turns
+      in a scratch buffer of three matrices.
+*/
+
+typedef struct {
+    Matrix** factors; // matrices of the chain
+    int count; // number of factors
+    int* dimensions; // the factor i has dimensions[i] rows and dimensions[i + 1] columns
+    int* split; // split[first * count + last]: last factor of the left part of the product first..last
+    double* scratch; // values of the intermediate matrices
+    size_t top; // values of the scratch buffer in use
+} MatrixChain;
+
+/*
+    Choose the order of the products of the chain with the dynamic program of the matrix chain:
+    the cheapest product of the factors first..last splits them where the cost of both parts plus
+    the cost of multiplying them is the lowest. Returns SUCCESS or FAILURE
+*/
+static int order_matrix_chain(MatrixChain* chain) {
+    int count = chain->count;
+    const int* dimensions = chain->dimensions;
+    double* cost = calloc((size_t) count * count, sizeof(double));
+    if (!cost) {
+        return FAILURE;
+    }
+    for (int length = 2; length <= count; length++) {
+        for (int first = 0; first + length <= count; first++) {
+            int last = first + length - 1;
+            double best = -1.0;
+            for (int split = first; split < last; split++) {
+                double product = cost[first * count + split] + cost[(split + 1) * count + last] +
+                                 (double) dimensions[first] * dimensions[split + 1] * dimensions[last + 1];
+                if (best < 0.0 || product < best) {
+                    best = product;
+                    chain->split[first * count + last] = split;
+                }
+            }
+            cost[first * count + last] = best;
+        }
+    }
+    free(cost);
+    return SUCCESS;
+}
+
+/*
+    Number of values of the scratch buffer used by the product of the factors first..last, on top
+    of its result: the intermediate of the left part and whatever is needed to compute it, and
+    then the intermediates of both parts and whatever is needed to compute the right one
+*/
+static size_t chain_scratch_size(const MatrixChain* chain, int first, int last) {
+    if (first == last) {
+        return 0;
+    }
+    int split = chain->split[first * chain->count + last];
+    size_t left = split > first ? (size_t) chain->dimensions[first] * chain->dimensions[split + 1] : 0;
+    size_t right = last > split + 1 ? (size_t) chain->dimensions[split + 1] * chain->dimensions[last + 1] : 0;
+    size_t left_size = left + chain_scratch_size(chain, first, split);
+    size_t right_size = left + right + chain_scratch_size(chain, split + 1, last);
+    return left_size > right_size ? left_size : right_size;
+}
+
+static int multiply_matrix_chain(MatrixChain* chain, int first, int last, Matrix* result);
+
+/*
+    Obtain the product of the factors first..last as an operand: the factor itself, or an
+    intermediate matrix on top of the scratch buffer. Returns NULL on failure
+*/
+static Matrix* chain_operand(MatrixChain* chain, int first, int last, Matrix* intermediate) {
+    if (first == last) {
+        return chain->factors[first];
+    }
+    memset(intermediate, 0, sizeof(Matrix));
+    set_matrix_shape(intermediate, chain->dimensions[first], chain->dimensions[last + 1]);
+    intermediate->data = chain->scratch + chain->top;
+    chain->top += (size_t) intermediate->rows * intermediate->columns;
+    return multiply_matrix_chain(chain, first, last, intermediate) == SUCCESS ? intermediate : NULL;
+}
+
+/*
+    Write the product of the factors first..last into result, in the order chosen by
+    order_matrix_chain. The intermediates are dropped from the scratch buffer once they are multiplied
+*/
+static int multiply_matrix_chain(MatrixChain* chain, int first, int last, Matrix* result) {
+    int split = chain->split[first * chain->count + last];
+    size_t top = chain->top;
+    Matrix left, right;
+    Matrix* left_operand = chain_operand(chain, first, split, &left);
+    Matrix* right_operand = left_operand ? chain_operand(chain, split + 1, last, &right) : NULL;
+    int status = right_operand ? matrices_multiplication(left_operand, right_operand, result) : FAILURE;
+    chain->top = top;
+    return status;
+}
+
+/*
+    Write the product of count matrices into result, which has the rows of the first one and the
+    columns of the last one. Returns SUCCESS or FAILURE
+*/
+int matrix_chain_multiplication(Matrix** factors, int count, Matrix* result) {
+    if (!factors || count <= 0 || !result) {
+        return FAILURE;
+    }
+    for (int i = 1; i < count; i++) {
+        if (factors[i - 1]->columns != factors[i]->rows) {
+            report_error("Para multiplicar la cadena, el número de columnas de la matriz %d: %d debe ser "
+                         "igual al número de filas de la matriz %d: %d\n", i, factors[i - 1]->columns,
+                         i + 1, factors[i]->rows);
+            return FAILURE;
+        }
+    }
+    if (result->rows != factors[0]->rows || result->columns != factors[count - 1]->columns) {
+        return FAILURE;
+    }
+    if (count == 1) {
+        copy_matrix_values(factors[0], result);
+        invalidate_matrix_structure(result);
+        return SUCCESS;
+    }
+    MatrixChain chain = { factors, count, malloc(sizeof(int) * (count + 1)),
+                          malloc(sizeof(int) * (size_t) count * count), NULL, 0 };
+    int status = FAILURE;
+    size_t capacity = 0;
+    if (chain.dimensions && chain.split) {
+        for (int i = 0; i < count; i++) {
+            chain.dimensions[i] = factors[i]->rows;
+        }
+        chain.dimensions[count] = factors[count - 1]->columns;
+        status = order_matrix_chain(&chain);
+    }
+    size_t scratch_size = status == SUCCESS ? chain_scratch_size(&chain, 0, count - 1) : 0;
+    if (status == SUCCESS && scratch_size > 0) {
+        chain.scratch = pool_allocate(scratch_size * sizeof(double), &capacity);
+        status = chain.scratch ? SUCCESS : FAILURE;
+    }
+    if (status == SUCCESS) {
+        status = multiply_matrix_chain(&chain, 0, count - 1, result);
+    }
+    pool_release(chain.scratch, capacity);
+    free(chain.dimensions);
+    free(chain.split);
+    return status;
+}
+
+/*
+    Write the power of a square matrix into result by repeated squaring: the squares of the matrix
+    are multiplied into the partial product for each bit of the exponent which is set, and the last
+    product is written directly into result. Returns SUCCESS or FAILURE
+*/
+int matrix_power(Matrix* matrix, int exponent, Matrix* result) {
+    if (!matrix || !result || exponent < 0) {
+        return FAILURE;
+    }
+    if (matrix->rows != matrix->columns) {
+        report_error("Para elevar una matriz a una potencia debe ser cuadrada, y tiene %d filas y %d columnas\n",
+                     matrix->rows, matrix->columns);
+        return FAILURE;
+    }
+    int size = matrix->rows;
+    size_t values = (size_t) size * size;
+    if (exponent == 0) {
+        // The identity is the same in both layouts
+        memset(result->data, 0, values * sizeof(double));
+        for (int i = 0; i < size; i++) {
+            result->data[(size_t) i * size + i] = 1.0;
+        }
+        invalidate_matrix_structure(result);
+        return SUCCESS;
+    }
+    // Two buffers hold the partial product and the current square, the third one receives the next product
+    size_t capacity = 0;
+    double* scratch = exponent > 1 ? pool_allocate(3 * values * sizeof(double), &capacity) : NULL;
+    if (exponent > 1 && !scratch) {
+        return FAILURE;
+    }
+    Matrix buffers[3];
+    for (int i = 0; i < 3; i++) {
+        memset(&buffers[i], 0, sizeof(Matrix));
+        set_matrix_shape(&buffers[i], size, size);
+        buffers[i].data = scratch ? scratch + i * values : NULL;
+    }
+    Matrix* square = matrix;
+    Matrix* partial = NULL;
+    int status = SUCCESS;
+    while (status == SUCCESS) {
+        if (exponent & 1) {
+            if (!partial) {
+                partial = square;
+            } else {
+                Matrix* product = result;
+                for (int i = 0; exponent > 1 && i < 3; i++) {
+                    if (&buffers[i] != partial && &buffers[i] != square) {
+                        product = &buffers[i];
+                        break;
+                    }
+                }
+                status = matrices_multiplication(partial, square, product);
+                partial = product;
+            }
+        }
+        exponent >>= 1;
+        if (!exponent) {
+            break;
+        }
+        Matrix* next = NULL;
+        for (int i = 0; i < 3 && !next; i++) {
+            if (&buffers[i] != partial && &buffers[i] != square) {
+                next = &buffers[i];
+            }
+        }
+        status = status == SUCCESS ? matrices_multiplication(square, square, next) : FAILURE;
+        square = next;
+    }
+    if (status == SUCCESS && partial != result) {
+        copy_matrix_values(partial, result);
+        invalidate_matrix_structure(result);
+    }
+    pool_release(scratch, capacity);
+    return status;
+}
+
+/*********************************************/
+/*
+    Foreign predicates
+*/
+/**********************************************/
+
+/*
+    Read the matrices of a list into an array. The matrices of the handles are not copied, the ones
+    which are parsed or converted belong to the array and are marked in owned. Returns the number
+    of matrices, or -1 on failure
+*/
+static int get_matrices_from_list(term_t list, Matrix*** matrices, char** owned) {
+    size_t length = 0;
+    if (PL_skip_list(list, 0, &length) != PL_LIST || length == 0 || length > INT_MAX) {
+        report_error("La cadena debe ser una lista no vacía de matrices\n");
+        return -1;
+    }
+    *matrices = calloc(length, sizeof(Matrix*));
+    *owned = calloc(length, sizeof(char));
+    if (!*matrices || !*owned) {
+        free(*matrices);
+        free(*owned);
+        return -1;
+    }
+    term_t tail = PL_copy_term_ref(list);
+    term_t head = PL_new_term_ref();
+    for (size_t i = 0; PL_get_list(tail, head, tail); i++) {
+        Matrix* handle = is_matrix_handle(head) ? get_matrix_from_handle(head) : NULL;
+        (*matrices)[i] = get_strided_matrix_from_term(head, NULL);
+        if (!(*matrices)[i]) {
+            for (size_t j = 0; j < i; j++) {
+                if ((*owned)[j]) {
+                    free_matrix((*matrices)[j]);
+                }
+            }
+            free(*matrices);
+            free(*owned);
+            return -1;
+        }
+        (*owned)[i] = (*matrices)[i] != handle;
+    }
+    return (int) length;
+}
+
+/*
+  Product of a list of matrices, in the order of the fewest multiplications
+*/
+static foreign_t matrix_chain_common(term_t list, term_t result, int as_handle) {
+    Matrix** factors;
+    char* owned;
+    int count = get_matrices_from_list(list, &factors, &owned);
+    if (count < 0) {
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* product = arena_new_matrix_with_layout(&arena, factors[0]->rows, factors[count - 1]->columns,
+                                                   product_layout(factors[0], factors[count - 1]));
+    int status = product ? matrix_chain_multiplication(factors, count, product) : FAILURE;
+    for (int i = 0; i < count; i++) {
+        if (owned[i]) {
+            free_matrix(factors[i]);
+        }
+    }
+    free(factors);
+    free(owned);
+    if (status == FAILURE) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_matrix_result(result, product, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+foreign_t pl_matrix_chain_multiplication(term_t list, term_t result) {
+    return matrix_chain_common(list, result, 0);
+}
+
+foreign_t pl_matrix_chain_multiplication_handle(term_t list, term_t result) {
+    return matrix_chain_common(list, result, 1);
+}
+
+/*
+  Power of a square matrix to a non negative integer exponent
+*/
+static foreign_t matrix_power_common(term_t matrix, term_t exponent, term_t result, int as_handle) {
+    int exponent_value;
+    if (!PL_get_integer(exponent, &exponent_value) || exponent_value < 0) {
+        report_error("El exponente debe ser un número entero no negativo\n");
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    Matrix* power = arena_new_matrix_with_layout(&arena, m->rows, m->columns, product_layout(m, m));
+    if (!power || matrix_power(m, exponent_value, power) == FAILURE) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_matrix_result(result, power, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+foreign_t pl_matrix_power(term_t matrix, term_t exponent, term_t result) {
+    return matrix_power_common(matrix, exponent, result, 0);
+}
+
+foreign_t pl_matrix_power_handle(term_t matrix, term_t exponent, term_t result) {
+    return matrix_power_common(matrix, exponent, result, 1);
+}
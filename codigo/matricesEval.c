@@ -0,0 +1,529 @@
+#include "definitions.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of matriz_eval/2, which evaluates an expression over matrices such as
+  A*2 + B - C in a single call. The expression is compiled once into a tree:
+    - The products of two matrices and the transposes are computed with the usual
+      kernels and their results become leaves of the tree.
+    - The element-wise part (+, -, unary -, product and division by a scalar) is turned
+      into a small postfix program that is run block by block over all the elements, so
+      no intermediate matrix is created and every element is read and written once. The
+      program goes over the elements in the layout of its matrices, by rows when all of them
+      are stored by rows (the lists of lists) and otherwise by columns; only the matrices
+      stored the other way, or the views, are copied before it runs.
+  The operands can be lists of lists, matrix handles or numbers.
+*/
+
+# define EXPR_MATRIX 0 // leaf with a matrix
+# define EXPR_SCALAR 1 // leaf with a number
+# define EXPR_ADD 2
+# define EXPR_SUBSTRACT 3
+# define EXPR_NEGATE 4
+# define EXPR_SCALE 5 // matrix multiplied by a scalar
+# define EXPR_DIVIDE 6 // matrix divided by a scalar
+# define EXPR_PRODUCT 7 // product of two matrices
+# define EXPR_TRANSPOSE 8
+
+typedef struct ExprNode {
+    int kind; // one of the EXPR_* values
+    int rows; // rows of the value of the node (0 for scalars)
+    int columns; // columns of the value of the node (0 for scalars)
+    double scalar; // value of a scalar leaf or factor of EXPR_SCALE and EXPR_DIVIDE
+    Matrix* matrix; // matrix of a leaf
+    int owns_matrix; // whether the matrix has to be freed with the tree
+    struct ExprNode* left;
+    struct ExprNode* right;
+} ExprNode;
+
+/*
+    Instructions of the element-wise program. Every instruction works over a block of
+    EVAL_BLOCK elements of the operands at the top of the stack
+*/
+typedef struct {
+    int kind; // EXPR_MATRIX pushes a matrix, the other kinds pop their operands and push the result
+    double scalar;
+    const double* data; // data of the matrix pushed by EXPR_MATRIX
+} EvalInstruction;
+
+typedef struct {
+    EvalInstruction* instructions;
+    int length;
+    int max_depth; // maximum size of the stack
+    size_t elements; // number of elements of the result
+    double* result;
+    atomic_int failed; // Some block could not allocate its stack buffers
+} EvalProgram;
+
+static Matrix* evaluate_expression(ExprNode* node);
+
+/*
+    Free a tree and the matrices it owns
+*/
+static void free_expression(ExprNode* node) {
+    if (!node) {
+        return;
+    }
+    free_expression(node->left);
+    free_expression(node->right);
+    if (node->owns_matrix) {
+        free_matrix(node->matrix);
+    }
+    free(node);
+}
+
+static ExprNode* new_node(int kind, ExprNode* left, ExprNode* right) {
+    ExprNode* node = calloc(1, sizeof(ExprNode));
+    if (!node) {
+        return NULL;
+    }
+    node->kind = kind;
+    node->left = left;
+    node->right = right;
+    if (left) {
+        node->rows = left->rows;
+        node->columns = left->columns;
+    }
+    return node;
+}
+
+static int is_scalar(ExprNode* node) {
+    return node->kind == EXPR_SCALAR;
+}
+
+/*
+    Build a node for a binary operator once its operands are compiled. Operations between
+    two scalars are folded into a scalar. Returns NULL, freeing both operands, if they are not
+    compatible or the node can not be created
+*/
+static ExprNode* binary_node(const char* operator, ExprNode* left, ExprNode* right) {
+    if (is_scalar(left) && is_scalar(right)) {
+        double value;
+        switch (operator[0]) {
+            case '+': value = left->scalar + right->scalar; break;
+            case '-': value = left->scalar - right->scalar; break;
+            case '*': value = left->scalar * right->scalar; break;
+            default:
+                if (right->scalar == 0) {
+                    report_error("No es posible dividir los valores entre 0\n");
+                    free_expression(left);
+                    free_expression(right);
+                    return NULL;
+                }
+                value = left->scalar / right->scalar;
+                break;
+        }
+        free_expression(right);
+        left->scalar = value;
+        return left;
+    }
+    ExprNode* node = NULL;
+    switch (operator[0]) {
+        case '+':
+        case '-':
+            if (is_scalar(left) || is_scalar(right)) {
+                report_error("Solo se pueden sumar o restar matrices entre sí\n");
+                break;
+            }
+            if (left->rows != right->rows || left->columns != right->columns) {
+                report_error("Para realizar la %s, asegúrate que ambas matrices tienen el mismo número de filas que de columnas\n",
+                       operator[0] == '+' ? "suma" : "resta");
+                break;
+            }
+            node = new_node(operator[0] == '+' ? EXPR_ADD : EXPR_SUBSTRACT, left, right);
+            break;
+        case '*':
+            if (is_scalar(left) || is_scalar(right)) {
+                ExprNode* factor = is_scalar(left) ? left : right;
+                ExprNode* matrix = is_scalar(left) ? right : left;
+                node = new_node(EXPR_SCALE, matrix, NULL);
+                if (node) {
+                    node->scalar = factor->scalar;
+                    free_expression(factor);
+                    return node;
+                }
+                break;
+            }
+            if (left->columns != right->rows) {
+                report_error("Para realizar la multiplicación, asegúrate de que el número de columnas de "
+                       "la primera matriz: %d sea igual al número de filas de la segunda: %d\n",
+                       left->columns, right->rows);
+                break;
+            }
+            node = new_node(EXPR_PRODUCT, left, right);
+            if (node) {
+                node->columns = right->columns;
+            }
+            break;
+        default:
+            if (!is_scalar(right)) {
+                report_error("Solo se puede dividir una matriz entre un número\n");
+                break;
+            }
+            if (right->scalar == 0) {
+                report_error("No es posible dividir los valores entre 0\n");
+                break;
+            }
+            node = new_node(EXPR_DIVIDE, left, NULL);
+            if (node) {
+                node->scalar = right->scalar;
+                free_expression(right);
+                return node;
+            }
+            break;
+    }
+    if (!node) {
+        free_expression(left);
+        free_expression(right);
+    }
+    return node;
+}
+
+/*
+    Compile a Prolog expression into a tree. Returns NULL on failure
+*/
+static ExprNode* compile_expression(term_t expression) {
+    double value;
+
+    if (PL_is_number(expression) && PL_get_float(expression, &value)) {
+        ExprNode* node = new_node(EXPR_SCALAR, NULL, NULL);
+        if (node) {
+            node->scalar = value;
+        }
+        return node;
+    }
+    if (is_matrix_handle(expression) || is_sparse_handle(expression) || PL_is_list(expression) ||
+        is_matrix_compound(expression)) {
+        Matrix* matrix = get_strided_matrix_from_term(expression, NULL);
+        if (!matrix) {
+            return NULL;
+        }
+        // The matrix of a handle belongs to the handle, unless it is the dense copy of a sparse handle
+        int owns_matrix = matrix != get_matrix_from_handle(expression);
+        ExprNode* node = new_node(EXPR_MATRIX, NULL, NULL);
+        if (!node) {
+            if (owns_matrix) {
+                free_matrix(matrix);
+            }
+            return NULL;
+        }
+        node->matrix = matrix;
+        node->owns_matrix = owns_matrix;
+        node->rows = matrix->rows;
+        node->columns = matrix->columns;
+        return node;
+    }
+
+    atom_t name;
+    size_t arity;
+    if (!PL_get_name_arity(expression, &name, &arity)) {
+        report_error("La expresión contiene un término que no es una matriz, un número ni una operación\n");
+        return NULL;
+    }
+    const char* operator = PL_atom_chars(name);
+    term_t argument = PL_new_term_ref();
+
+    if (arity == 1 && (strcmp(operator, "-") == 0 || strcmp(operator, "transpuesta") == 0)) {
+        if (!PL_get_arg(1, expression, argument)) {
+            return NULL;
+        }
+        ExprNode* operand = compile_expression(argument);
+        if (!operand) {
+            return NULL;
+        }
+        if (is_scalar(operand)) {
+            if (operator[0] == '-') {
+                operand->scalar = -operand->scalar;
+            }
+            return operand;
+        }
+        ExprNode* node = new_node(operator[0] == '-' ? EXPR_NEGATE : EXPR_TRANSPOSE, operand, NULL);
+        if (!node) {
+            free_expression(operand);
+            return NULL;
+        }
+        if (node->kind == EXPR_TRANSPOSE) {
+            node->rows = operand->columns;
+            node->columns = operand->rows;
+        }
+        return node;
+    }
+    if (arity == 2 && strlen(operator) == 1 && strchr("+-*/", operator[0])) {
+        if (!PL_get_arg(1, expression, argument)) {
+            return NULL;
+        }
+        ExprNode* left = compile_expression(argument);
+        if (!left) {
+            return NULL;
+        }
+        if (!PL_get_arg(2, expression, argument)) {
+            free_expression(left);
+            return NULL;
+        }
+        ExprNode* right = compile_expression(argument);
+        if (!right) {
+            free_expression(left);
+            return NULL;
+        }
+        return binary_node(operator, left, right);
+    }
+    report_error("Operación no soportada en la expresión: %s/%d\n", operator, (int) arity);
+    return NULL;
+}
+
+/*
+    Evaluate the nodes which are not element-wise (products and transposes), replacing
+    them by matrix leaves. Returns SUCCESS or FAILURE
+*/
+static int evaluate_products(ExprNode* node) {
+    if (!node || node->kind == EXPR_MATRIX || node->kind == EXPR_SCALAR) {
+        return SUCCESS;
+    }
+    if (evaluate_products(node->left) == FAILURE || evaluate_products(node->right) == FAILURE) {
+        return FAILURE;
+    }
+    if (node->kind != EXPR_PRODUCT && node->kind != EXPR_TRANSPOSE) {
+        return SUCCESS;
+    }
+    // The operands are element-wise expressions, which are computed first
+    for (ExprNode** operand = &node->left; operand <= &node->right; operand++) {
+        if (*operand && (*operand)->kind != EXPR_MATRIX) {
+            Matrix* value = evaluate_expression(*operand);
+            if (!value) {
+                return FAILURE;
+            }
+            free_expression((*operand)->left);
+            free_expression((*operand)->right);
+            (*operand)->left = (*operand)->right = NULL;
+            (*operand)->kind = EXPR_MATRIX;
+            (*operand)->matrix = value;
+            (*operand)->owns_matrix = 1;
+        }
+    }
+    Matrix* result = new_matrix(node->rows, node->columns);
+    if (!result) {
+        return FAILURE;
+    }
+    int status = node->kind == EXPR_PRODUCT
+        ? matrices_multiplication(node->left->matrix, node->right->matrix, result)
+        : matrix_transpose(node->left->matrix, result);
+    if (status == FAILURE) {
+        free_matrix(result);
+        return FAILURE;
+    }
+    free_expression(node->left);
+    free_expression(node->right);
+    node->left = node->right = NULL;
+    node->kind = EXPR_MATRIX;
+    node->matrix = result;
+    node->owns_matrix = 1;
+    return SUCCESS;
+}
+
+/*
+    Check whether the values of a matrix are stored one after the other in a layout. The ones of
+    a matrix of one row or one column are stored both ways when they are contiguous
+*/
+static int stored_in_layout(Matrix* matrix, int layout) {
+    if (matrix->rows == 1 || matrix->columns == 1) {
+        return is_matrix_contiguous(matrix);
+    }
+    return matrix_layout(matrix) == layout;
+}
+
+/*
+    Layout in which the program of an element-wise tree goes over the elements: by rows when all
+    its matrices are stored by rows, otherwise by columns
+*/
+static int program_layout(ExprNode* node) {
+    if (!node) {
+        return MATRIX_LAYOUT_ROW_MAJOR;
+    }
+    if (node->kind == EXPR_MATRIX) {
+        return stored_in_layout(node->matrix, MATRIX_LAYOUT_ROW_MAJOR) ? MATRIX_LAYOUT_ROW_MAJOR
+                                                                       : MATRIX_LAYOUT_COLUMN_MAJOR;
+    }
+    return program_layout(node->left) == MATRIX_LAYOUT_ROW_MAJOR && program_layout(node->right) == MATRIX_LAYOUT_ROW_MAJOR
+           ? MATRIX_LAYOUT_ROW_MAJOR : MATRIX_LAYOUT_COLUMN_MAJOR;
+}
+
+/*
+    Replace the matrices of the leaves which are not stored in the layout of the program by a
+    copy in that layout. Returns SUCCESS or FAILURE
+*/
+static int copy_leaves_into_layout(ExprNode* node, int layout) {
+    if (!node) {
+        return SUCCESS;
+    }
+    if (node->kind != EXPR_MATRIX) {
+        return copy_leaves_into_layout(node->left, layout) == SUCCESS &&
+               copy_leaves_into_layout(node->right, layout) == SUCCESS ? SUCCESS : FAILURE;
+    }
+    if (stored_in_layout(node->matrix, layout)) {
+        return SUCCESS;
+    }
+    Matrix* copy = new_matrix_with_layout(node->rows, node->columns, layout);
+    if (!copy) {
+        return FAILURE;
+    }
+    copy_matrix_values(node->matrix, copy);
+    if (node->owns_matrix) {
+        free_matrix(node->matrix);
+    }
+    node->matrix = copy;
+    node->owns_matrix = 1;
+    return SUCCESS;
+}
+
+/*
+    Translate an element-wise tree into postfix instructions. Returns the depth of the
+    stack needed to evaluate the node
+*/
+static int emit_instructions(ExprNode* node, EvalProgram* program) {
+    int depth = 0;
+    if (node->left) {
+        depth = emit_instructions(node->left, program);
+    }
+    if (node->right) {
+        int right_depth = emit_instructions(node->right, program) + 1;
+        if (right_depth > depth) {
+            depth = right_depth;
+        }
+    }
+    EvalInstruction* instruction = &program->instructions[program->length++];
+    instruction->kind = node->kind;
+    instruction->scalar = node->scalar;
+    instruction->data = node->kind == EXPR_MATRIX ? node->matrix->data : NULL;
+    return depth > 0 ? depth : 1;
+}
+
+static int count_nodes(ExprNode* node) {
+    return node ? 1 + count_nodes(node->left) + count_nodes(node->right) : 0;
+}
+
+/*
+    Run the program over the elements [begin, end) block by block. Every entry of the stack
+    points either to the data of a matrix or to its own block buffer
+*/
+static void run_program_task(void* context, size_t begin, size_t end) {
+    EvalProgram* program = context;
+    const double* stack[program->max_depth];
+    double* buffers = malloc(sizeof(double) * EVAL_BLOCK * program->max_depth);
+    if (!buffers) {
+        atomic_store(&program->failed, 1);
+        return;
+    }
+
+    for (size_t block = begin; block < end; block += EVAL_BLOCK) {
+        size_t length = end - block < EVAL_BLOCK ? end - block : EVAL_BLOCK;
+        int top = 0;
+
+        for (int i = 0; i < program->length; i++) {
+            EvalInstruction* instruction = &program->instructions[i];
+            if (instruction->kind == EXPR_MATRIX) {
+                stack[top++] = instruction->data + block;
+                continue;
+            }
+            double* output = buffers + (size_t) EVAL_BLOCK * (top - 1);
+            if (instruction->kind == EXPR_ADD || instruction->kind == EXPR_SUBSTRACT) {
+                const double* left = stack[top - 2];
+                const double* right = stack[top - 1];
+                output = buffers + (size_t) EVAL_BLOCK * (top - 2);
+                if (instruction->kind == EXPR_ADD) {
+                    kernels->add(left, right, output, length);
+                } else {
+                    kernels->substract(left, right, output, length);
+                }
+                top--;
+            } else if (instruction->kind == EXPR_NEGATE) {
+                kernels->multiply(stack[top - 1], -1.0, output, length);
+            } else if (instruction->kind == EXPR_SCALE) {
+                kernels->multiply(stack[top - 1], instruction->scalar, output, length);
+            } else {
+                kernels->divide(stack[top - 1], instruction->scalar, output, length);
+            }
+            stack[top - 1] = output;
+        }
+        memcpy(program->result + block, stack[0], sizeof(double) * length);
+    }
+    free(buffers);
+}
+
+/*
+    Evaluate a compiled tree whose value is a matrix. Returns the new matrix or NULL on failure
+*/
+static Matrix* evaluate_expression(ExprNode* node) {
+    if (evaluate_products(node) == FAILURE) {
+        return NULL;
+    }
+    int layout = program_layout(node);
+    if (copy_leaves_into_layout(node, layout) == FAILURE) {
+        return NULL;
+    }
+    Matrix* result = new_matrix_with_layout(node->rows, node->columns, layout);
+    if (!result) {
+        return NULL;
+    }
+    EvalProgram program;
+    program.instructions = malloc(sizeof(EvalInstruction) * count_nodes(node));
+    if (!program.instructions) {
+        free_matrix(result);
+        return NULL;
+    }
+    program.length = 0;
+    program.max_depth = emit_instructions(node, &program);
+    program.elements = (size_t) node->rows * node->columns;
+    program.result = result->data;
+    atomic_init(&program.failed, 0);
+
+    parallel_for(program.elements, PARALLEL_GRAIN, run_program_task, &program);
+    free(program.instructions);
+    if (atomic_load(&program.failed)) {
+        report_error("No hay memoria suficiente para evaluar la expresión\n");
+        free_matrix(result);
+        return NULL;
+    }
+    return result;
+}
+
+/*
+    Evaluate an expression and unify the result as a number, a list of lists or a handle
+*/
+static foreign_t matrix_eval_common(term_t expression, term_t result, int as_handle) {
+    ExprNode* tree = compile_expression(expression);
+    if (!tree) {
+        PL_fail;
+    }
+    if (is_scalar(tree)) {
+        double value = tree->scalar;
+        free_expression(tree);
+        return PL_unify_float(result, value);
+    }
+    Matrix* value = evaluate_expression(tree);
+    free_expression(tree);
+    if (!value) {
+        PL_fail;
+    }
+    int unified = unify_matrix_result(result, value, as_handle, NULL);
+    if (!as_handle) {
+        free_matrix(value);
+    }
+    return unified;
+}
+
+/*
+  Foreign predicate to evaluate an expression over matrices and obtain a list of lists
+*/
+foreign_t pl_matrix_eval(term_t expression, term_t result) {
+    return matrix_eval_common(expression, result, 0);
+}
+
+/*
+  Foreign predicate to evaluate an expression over matrices and obtain a handle
+*/
+foreign_t pl_matrix_eval_handle(term_t expression, term_t result) {
+    return matrix_eval_common(expression, result, 1);
+}
@@ -0,0 +1,480 @@
+#include "definitions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the binary matrix files. A file is a MatrixFileHeader followed by
+  the values of the matrix, so loading a file only maps it into memory: the pages are
+  read by the operating system when they are used and they are shared through the page
+  cache with the other processes which load the same file.
+*/
+
+_Static_assert(sizeof(MatrixFileHeader) == MATRIX_FILE_HEADER_BYTES, "The header of the matrix files must have 64 bytes");
+
+/*
+    Write a matrix stored by columns or by rows into a binary file, with its layout.
+    Returns SUCCESS or FAILURE
+*/
+int save_matrix_file(Matrix* matrix, const char* path) {
+    if (!matrix || !path) {
+        return FAILURE;
+    }
+    MatrixFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+    header.version = MATRIX_FILE_VERSION;
+    header.byte_order = MATRIX_FILE_BYTE_ORDER;
+    header.dtype = (uint32_t) matrix->element_type; // the MATRIX_DTYPE_* have the values of the MATRIX_TYPE_*
+    header.layout = (uint32_t) matrix_layout(matrix);
+    header.rows = matrix->rows;
+    header.columns = matrix->columns;
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        report_error("No es posible crear el fichero %s: %s\n", path, strerror(errno));
+        return FAILURE;
+    }
+    size_t values = (size_t) matrix->rows * matrix->columns;
+    int written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(matrix->data, matrix_element_size(matrix->element_type), values, file) == values;
+    if (fclose(file) != 0 || !written) {
+        report_error("No es posible escribir el fichero %s: %s\n", path, strerror(errno));
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/*
+    Check the header of a matrix file of the given size. Returns SUCCESS or FAILURE
+*/
+static int check_matrix_file_header(const MatrixFileHeader* header, size_t file_bytes, const char* path) {
+    if (memcmp(header->magic, MATRIX_FILE_MAGIC, sizeof(header->magic)) != 0) {
+        report_error("El fichero %s no es un fichero de matrices\n", path);
+        return FAILURE;
+    }
+    if (header->version != MATRIX_FILE_VERSION || header->byte_order != MATRIX_FILE_BYTE_ORDER) {
+        report_error("El fichero %s tiene una versión o un orden de bytes no soportado\n", path);
+        return FAILURE;
+    }
+    // The typed matrices are only stored by columns
+    if (header->dtype > MATRIX_DTYPE_INT64 || header->layout > MATRIX_LAYOUT_ROW_MAJOR ||
+        (header->layout == MATRIX_LAYOUT_ROW_MAJOR && header->dtype != MATRIX_DTYPE_FLOAT64)) {
+        report_error("El fichero %s tiene un tipo de elementos o una disposición no soportada\n", path);
+        return FAILURE;
+    }
+    if (header->rows <= 0 || header->columns <= 0 || header->rows > INT_MAX || header->columns > INT_MAX ||
+        (uint64_t) header->rows * (uint64_t) header->columns > (file_bytes - sizeof(*header)) / matrix_element_size((int) header->dtype)) {
+        report_error("Las dimensiones del fichero %s no son correctas\n", path);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/*
+    Map a matrix file into memory. With MATRIX_STORAGE_MAPPED the pages are read-only and
+    shared with the file, with MATRIX_STORAGE_MAPPED_PRIVATE they can be written and the
+    changes are not saved in the file. Returns a valid matrix pointer on success and NULL on failure
+*/
+Matrix* map_matrix_file(const char* path, int storage) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) {
+        report_error("No es posible abrir el fichero %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat status;
+    if (fstat(descriptor, &status) != 0 || (size_t) status.st_size < sizeof(MatrixFileHeader)) {
+        report_error("El fichero %s no es un fichero de matrices\n", path);
+        close(descriptor);
+        return NULL;
+    }
+    size_t file_bytes = (size_t) status.st_size;
+    int protection = storage == MATRIX_STORAGE_MAPPED_PRIVATE ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = storage == MATRIX_STORAGE_MAPPED_PRIVATE ? MAP_PRIVATE : MAP_SHARED;
+    void* mapping = mmap(NULL, file_bytes, protection, flags, descriptor, 0);
+    close(descriptor); // the mapping keeps its own reference to the file
+    if (mapping == MAP_FAILED) {
+        report_error("No es posible proyectar el fichero %s en memoria: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    const MatrixFileHeader* header = (const MatrixFileHeader*) mapping;
+    Matrix* matrix = NULL;
+    if (check_matrix_file_header(header, file_bytes, path) == SUCCESS) {
+        matrix = pool_allocate_struct();
+    }
+    if (!matrix) {
+        munmap(mapping, file_bytes);
+        return NULL;
+    }
+    set_matrix_layout(matrix, (int) header->rows, (int) header->columns, (int) header->layout);
+    matrix->data = (double*)((char*) mapping + MATRIX_FILE_HEADER_BYTES);
+    matrix->capacity = file_bytes;
+    matrix->storage = storage;
+    matrix->element_type = (int) header->dtype;
+    return matrix;
+}
+
+/*
+    Unmap the file of a matrix created by map_matrix_file
+*/
+void unmap_matrix_file(Matrix* matrix) {
+    if (matrix && matrix->data) {
+        munmap((char*) matrix->data - MATRIX_FILE_HEADER_BYTES, matrix->capacity);
+        matrix->data = NULL;
+    }
+}
+
+/*
+  Foreign predicate to save a matrix (handle or list of lists) into a binary file. The values of
+  a typed matrix are saved with their type, and the ones of a matrix stored by rows in that order
+*/
+foreign_t pl_save_matrix(term_t matrix, term_t file) {
+    MatrixArena arena;
+    arena_init(&arena);
+    char* path;
+
+    if (!PL_get_file_name(file, &path, PL_FILE_OSPATH)) {
+        report_error("El nombre del fichero no es correcto\n");
+        PL_fail;
+    }
+    Matrix* m = is_typed_handle(matrix) ? get_typed_matrix_from_term(matrix, MATRIX_TYPE_F64, &arena)
+                                        : get_strided_matrix_from_term(matrix, &arena);
+    if (m && matrix_layout(m) == MATRIX_LAYOUT_STRIDED) {
+        m = arena_adopt(&arena, copy_matrix_view(m));
+    }
+    if (!m || save_matrix_file(m, path) == FAILURE) {
+        return arena_fail(&arena);
+    }
+    arena_release(&arena);
+    PL_succeed;
+}
+
+/*
+  Load a binary file as a handle with the given storage
+*/
+static foreign_t load_matrix_common(term_t file, term_t handle, int storage) {
+    char* path;
+
+    if (!PL_get_file_name(file, &path, PL_FILE_OSPATH)) {
+        report_error("El nombre del fichero no es correcto\n");
+        PL_fail;
+    }
+    Matrix* m = map_matrix_file(path, storage);
+    if (!m) {
+        PL_fail;
+    }
+    return unify_matrix_result(handle, m, 1, NULL);
+}
+
+/*
+  Foreign predicate to load a binary file as a read-only handle
+*/
+foreign_t pl_load_matrix(term_t file, term_t handle) {
+    return load_matrix_common(file, handle, MATRIX_STORAGE_MAPPED);
+}
+
+/*
+  Foreign predicate to load a binary file as a handle with a mode: lectura (read-only and
+  shared with the file) or copia (private copy-on-write pages)
+*/
+foreign_t pl_load_matrix_with_mode(term_t file, term_t handle, term_t mode) {
+    char* name;
+
+    if (!PL_get_atom_chars(mode, &name)) {
+        PL_fail;
+    }
+    if (strcmp(name, "lectura") == 0) {
+        return load_matrix_common(file, handle, MATRIX_STORAGE_MAPPED);
+    }
+    if (strcmp(name, "copia") == 0) {
+        return load_matrix_common(file, handle, MATRIX_STORAGE_MAPPED_PRIVATE);
+    }
+    report_error("El modo de carga debe ser lectura o copia\n");
+    PL_fail;
+}
+
+/*********************************************/
+/*
+    Streaming loader of CSV and TSV files
+*/
+/**********************************************/
+
+/*
+    Reader of the lines of a file through a buffer of fixed size. The buffer only grows
+    when a single line does not fit in it
+*/
+typedef struct {
+    FILE* file;
+    char* buffer;
+    size_t size; // bytes of the buffer
+    size_t start; // first byte of the next line
+    size_t end; // first byte which has not been read from the file
+    int end_of_file;
+} LineReader;
+
+/*
+    Obtain the next line of the file, without the end of line characters. Returns NULL at the end of the file
+*/
+static char* read_line(LineReader* reader) {
+    for (;;) {
+        char* line = reader->buffer + reader->start;
+        char* newline = memchr(line, '\n', reader->end - reader->start);
+        if (newline || (reader->end_of_file && reader->start < reader->end)) {
+            char* line_end = newline ? newline : reader->buffer + reader->end;
+            reader->start = newline ? (size_t)(newline - reader->buffer) + 1 : reader->end;
+            *line_end = '\0'; // there is always room for it: the buffer is never completely full at the end of the file
+            if (line_end > line && line_end[-1] == '\r') {
+                line_end[-1] = '\0';
+            }
+            return line;
+        }
+        if (reader->end_of_file) {
+            return NULL;
+        }
+        // Move the incomplete line to the beginning of the buffer and read the next chunk
+        memmove(reader->buffer, line, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        if (reader->end + 1 >= reader->size) {
+            char* buffer = realloc(reader->buffer, reader->size * 2);
+            if (!buffer) {
+                return NULL;
+            }
+            reader->buffer = buffer;
+            reader->size *= 2;
+        }
+        size_t read_bytes = fread(reader->buffer + reader->end, 1, reader->size - reader->end - 1, reader->file);
+        reader->end += read_bytes;
+        if (read_bytes == 0) {
+            reader->end_of_file = 1;
+        }
+    }
+}
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+    Parse the number between begin and end, ignoring the surrounding spaces. When the number has
+    at most 15 significant digits and a small exponent it is computed exactly with a single
+    multiplication or division, otherwise strtod is used. Returns SUCCESS or FAILURE
+*/
+static int parse_number(char* begin, char* end, double* value) {
+    while (begin < end && (*begin == ' ' || *begin == '\t')) begin++;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    if (begin == end) {
+        return FAILURE;
+    }
+    const char* p = begin;
+    int negative = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+    uint64_t mantissa = 0;
+    int digits = 0, significant_digits = 0, exponent = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+        if (mantissa || *p != '0') {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            significant_digits++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+            if (mantissa || *p != '0') {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                significant_digits++;
+            }
+            exponent--;
+        }
+    }
+    if (digits && p < end && (*p == 'e' || *p == 'E')) {
+        int exponent_negative = 0, exponent_value = 0, exponent_digits = 0;
+        p++;
+        if (p < end && (*p == '-' || *p == '+')) exponent_negative = *p++ == '-';
+        for (; p < end && *p >= '0' && *p <= '9' && exponent_value < 100000; p++, exponent_digits++) {
+            exponent_value = exponent_value * 10 + (*p - '0');
+        }
+        exponent += exponent_negative ? -exponent_value : exponent_value;
+        digits = exponent_digits ? digits : 0;
+    }
+    if (digits && p == end && significant_digits <= 15 && exponent >= -22 && exponent <= 22) {
+        double result = (double) mantissa;
+        result = exponent < 0 ? result / powers_of_ten[-exponent] : result * powers_of_ten[exponent];
+        *value = negative ? -result : result;
+        return SUCCESS;
+    }
+    // Slow path for long numbers, large exponents, inf and nan
+    char saved = *end;
+    char* parsed_end;
+    *end = '\0';
+    *value = strtod(begin, &parsed_end);
+    *end = saved;
+    return parsed_end == end ? SUCCESS : FAILURE;
+}
+
+/*
+    Append a value after the count values of the matrix, growing its buffer if it is full.
+    The buffer comes from the memory pool and doubles its size. Returns SUCCESS or FAILURE
+*/
+static int append_value(Matrix* matrix, size_t* count, double value) {
+    if ((*count + 1) * sizeof(double) > matrix->capacity) {
+        size_t capacity;
+        size_t bytes = matrix->capacity ? matrix->capacity * 2 : CSV_BUFFER_BYTES;
+        double* buffer = pool_allocate(bytes, &capacity);
+        if (!buffer) {
+            report_error("No hay memoria suficiente para cargar el fichero\n");
+            return FAILURE;
+        }
+        if (matrix->data) {
+            memcpy(buffer, matrix->data, *count * sizeof(double));
+            pool_release(matrix->data, matrix->capacity);
+        }
+        matrix->data = buffer;
+        matrix->capacity = capacity;
+    }
+    matrix->data[(*count)++] = value;
+    return SUCCESS;
+}
+
+/*
+    Choose the separator of the fields: tabs for .tsv files, otherwise the first of
+    comma, tab or semicolon which appears in the first line
+*/
+static char choose_separator(const char* path, const char* line) {
+    size_t length = strlen(path);
+    if (length > 4 && strcmp(path + length - 4, ".tsv") == 0) {
+        return '\t';
+    }
+    const char* separator = line + strcspn(line, ",\t;");
+    return *separator ? *separator : ',';
+}
+
+/*
+    Load a CSV or TSV file of numbers into a matrix stored by rows. The file is read in chunks of
+    CSV_BUFFER_BYTES and the values are stored row by row in the buffer of the matrix while they
+    are parsed, so they are never copied once the file has been read; the matrix keeps the
+    buffer with its capacity. A first line without numbers is taken as a header and skipped. Returns a valid matrix pointer on success and NULL on failure
+*/
+Matrix* load_csv_file(const char* path) {
+    LineReader reader = { fopen(path, "rb"), malloc(CSV_BUFFER_BYTES), CSV_BUFFER_BYTES, 0, 0, 0 };
+    Matrix* matrix = pool_allocate_struct();
+    size_t count = 0;
+    int columns = 0, rows = 0, line_number = 0, error = 0;
+    char separator = 0;
+    char* line;
+
+    if (!reader.file || !reader.buffer) {
+        report_error("No es posible abrir el fichero %s: %s\n", path, strerror(errno));
+        error = 1;
+        goto cleanup;
+    }
+    if (!matrix) {
+        report_error("No hay memoria suficiente para cargar el fichero\n");
+        error = 1;
+        goto cleanup;
+    }
+    while (!error && (line = read_line(&reader))) {
+        line_number++;
+        if (line[strspn(line, " \t")] == '\0') {
+            continue; // blank line
+        }
+        if (!separator) {
+            separator = choose_separator(path, line);
+        }
+        int column = 0, numbers = 0, wrong_column = 0;
+        size_t row_start = count;
+        char* field = line;
+        for (;;) {
+            char* field_end = field + strcspn(field, (char[]){ separator, '\0' });
+            double value;
+            column++;
+            if (parse_number(field, field_end, &value) == SUCCESS) {
+                numbers++;
+                error = append_value(matrix, &count, value) == FAILURE;
+            } else if (rows || numbers) {
+                report_error("Valor no numérico en la fila %d, columna %d del fichero %s\n", line_number, column, path);
+                error = 1;
+            } else if (!wrong_column) {
+                wrong_column = column;
+            }
+            if (error || *field_end == '\0') {
+                break;
+            }
+            field = field_end + 1;
+        }
+        if (error) {
+            break;
+        }
+        if (!numbers && !rows) {
+            count = row_start; // header
+            continue;
+        }
+        if (numbers != column) {
+            report_error("Valor no numérico en la fila %d, columna %d del fichero %s\n", line_number, wrong_column, path);
+            error = 1;
+        } else if (rows && column != columns) {
+            report_error("La fila %d del fichero %s tiene %d columnas y se esperaban %d\n", line_number, path, column, columns);
+            error = 1;
+        }
+        columns = column;
+        rows++;
+    }
+    if (!error && (!reader.end_of_file || ferror(reader.file))) {
+        report_error("No es posible leer el fichero %s\n", path);
+        error = 1;
+    }
+    if (!error && !rows) {
+        report_error("El fichero %s no contiene ninguna fila\n", path);
+        error = 1;
+    }
+    if (!error) {
+        set_matrix_layout(matrix, rows, columns, MATRIX_LAYOUT_ROW_MAJOR);
+    }
+
+cleanup:
+    if (reader.file) {
+        fclose(reader.file);
+    }
+    free(reader.buffer);
+    if (error) {
+        free_matrix(matrix);
+        matrix = NULL;
+    }
+    return matrix;
+}
+
+/*
+  Load a CSV or TSV file either as a list of lists or as a handle
+*/
+static foreign_t load_csv_common(term_t file, term_t result, int as_handle) {
+    MatrixArena arena;
+    arena_init(&arena);
+    char* path;
+
+    if (!PL_get_file_name(file, &path, PL_FILE_OSPATH)) {
+        report_error("El nombre del fichero no es correcto\n");
+        PL_fail;
+    }
+    Matrix* m = arena_adopt(&arena, load_csv_file(path));
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_matrix_result(result, m, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+foreign_t pl_load_csv(term_t file, term_t result) {
+    return load_csv_common(file, result, 0);
+}
+
+foreign_t pl_load_csv_handle(term_t file, term_t handle) {
+    return load_csv_common(file, handle, 1);
+}
@@ -0,0 +1,413 @@
+#include "definitions.h"
+#include <string.h>
+#include <stdlib.h>
+
+/*
+  Class in charge of the blocked matrix product (GEMM) for large matrices.
+  It follows the usual structure of the optimized BLAS libraries:
+    - The columns of B are split in blocks of GEMM_NC columns (kept in the L3 cache)
+    - The inner dimension is split in blocks of GEMM_KC (a panel of B stays in the L2 cache)
+    - The rows of A are split in blocks of GEMM_MC (a panel of A stays in the L2/L1 cache)
+  Every block is packed into a contiguous buffer so that the micro kernel, which computes
+  a tile of GEMM_MR x GEMM_NR elements held in registers, reads memory sequentially.
+  All the matrices are column-major, as the ones accessed by the ACCESS macro. A and B can
+  also have any row and column strides (views), since they are read only by the packing.
+*/
+
+// Vectors of 2 and 4 doubles, mapped by the compiler to SSE2 and AVX registers
+typedef double v2d __attribute__((vector_size(16)));
+typedef double v4d __attribute__((vector_size(32)));
+
+/*
+    Pack a block of mc x kc elements of A into panels of GEMM_MR rows. Inside a panel the
+    elements are stored column by column, so the micro kernel reads GEMM_MR consecutive
+    values per step. The rows that do not complete a panel are filled with zeros
+*/
+static void pack_block_of_a(int mc, int kc, const double* a, size_t row_stride, size_t column_stride, double* packed) {
+    for (int panel = 0; panel < mc; panel += GEMM_MR) {
+        int panel_rows = mc - panel < GEMM_MR ? mc - panel : GEMM_MR;
+        for (int p = 0; p < kc; p++) {
+            const double* column = a + (size_t)p * column_stride + (size_t)panel * row_stride;
+            int i = 0;
+            if (row_stride == 1) {
+                for (; i < panel_rows; i++) {
+                    packed[i] = column[i];
+                }
+            } else {
+                for (; i < panel_rows; i++) {
+                    packed[i] = column[(size_t)i * row_stride];
+                }
+            }
+            for (; i < GEMM_MR; i++) {
+                packed[i] = 0.0;
+            }
+            packed += GEMM_MR;
+        }
+    }
+}
+
+/*
+    Pack a block of kc x nc elements of B into panels of GEMM_NR columns. Inside a panel the
+    elements are stored row by row, so the micro kernel reads GEMM_NR consecutive values per
+    step. The columns that do not complete a panel are filled with zeros
+*/
+static void pack_block_of_b(int kc, int nc, const double* b, size_t row_stride, size_t column_stride, double* packed) {
+    for (int panel = 0; panel < nc; panel += GEMM_NR) {
+        int panel_columns = nc - panel < GEMM_NR ? nc - panel : GEMM_NR;
+        for (int p = 0; p < kc; p++) {
+            int j = 0;
+            for (; j < panel_columns; j++) {
+                packed[j] = b[(size_t)(panel + j) * column_stride + (size_t)p * row_stride];
+            }
+            for (; j < GEMM_NR; j++) {
+                packed[j] = 0.0;
+            }
+            packed += GEMM_NR;
+        }
+    }
+}
+
+/*
+    Write the tile computed by a micro kernel into C. When the tile is on the border
+    of C (rows < GEMM_MR or columns < GEMM_NR) only the valid elements are written
+*/
+static void update_tile(const double* tile, double alpha, double* c, int ldc, int rows, int columns) {
+    for (int j = 0; j < columns; j++) {
+        double* column = c + (size_t)j * ldc;
+        for (int i = 0; i < rows; i++) {
+            column[i] += alpha * tile[j * GEMM_MR + i];
+        }
+    }
+}
+
+/*
+    Micro kernel: C(8x4) += alpha * A_panel(8 x kc) * B_panel(kc x 4).
+    Baseline version for any x86-64 (SSE2): the tile is accumulated in sixteen
+    vectors of two doubles
+*/
+static void gemm_micro_kernel_sse2(int kc, double alpha, const double* a, const double* b,
+                                   double* c, int ldc, int rows, int columns) {
+    v2d accumulators[GEMM_NR][4] = {{{0}}};
+
+    for (int p = 0; p < kc; p++) {
+        v2d a0 = *(const v2d*)(a);
+        v2d a1 = *(const v2d*)(a + 2);
+        v2d a2 = *(const v2d*)(a + 4);
+        v2d a3 = *(const v2d*)(a + 6);
+        for (int j = 0; j < GEMM_NR; j++) {
+            double bj = b[j];
+            accumulators[j][0] += a0 * bj;
+            accumulators[j][1] += a1 * bj;
+            accumulators[j][2] += a2 * bj;
+            accumulators[j][3] += a3 * bj;
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    update_tile((const double*) accumulators, alpha, c, ldc, rows, columns);
+}
+
+/*
+    Micro kernel: C(8x4) += alpha * A_panel(8 x kc) * B_panel(kc x 4).
+    AVX2 version: the tile is accumulated in eight vectors of four doubles and the
+    compiler contracts the multiply-add into FMA instructions
+*/
+__attribute__((target("avx2,fma")))
+static void gemm_micro_kernel_avx2(int kc, double alpha, const double* a, const double* b,
+                                   double* c, int ldc, int rows, int columns) {
+    v4d c00 = {0}, c10 = {0}, c01 = {0}, c11 = {0};
+    v4d c02 = {0}, c12 = {0}, c03 = {0}, c13 = {0};
+
+    for (int p = 0; p < kc; p++) {
+        v4d a0 = *(const v4d*)(a);
+        v4d a1 = *(const v4d*)(a + 4);
+        c00 += a0 * b[0]; c10 += a1 * b[0];
+        c01 += a0 * b[1]; c11 += a1 * b[1];
+        c02 += a0 * b[2]; c12 += a1 * b[2];
+        c03 += a0 * b[3]; c13 += a1 * b[3];
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    double tile[GEMM_MR * GEMM_NR] __attribute__((aligned(64)));
+    *(v4d*)(tile + 0) = c00;  *(v4d*)(tile + 4) = c10;
+    *(v4d*)(tile + 8) = c01;  *(v4d*)(tile + 12) = c11;
+    *(v4d*)(tile + 16) = c02; *(v4d*)(tile + 20) = c12;
+    *(v4d*)(tile + 24) = c03; *(v4d*)(tile + 28) = c13;
+    update_tile(tile, alpha, c, ldc, rows, columns);
+}
+
+typedef void (*micro_kernel_t)(int kc, double alpha, const double* a, const double* b,
+                               double* c, int ldc, int rows, int columns);
+
+/*
+    Choose the micro kernel for the instruction set selected by select_kernels
+*/
+static micro_kernel_t select_micro_kernel(void) {
+    if (kernels->level >= SIMD_AVX2) {
+        return gemm_micro_kernel_avx2;
+    }
+    return gemm_micro_kernel_sse2;
+}
+
+/*
+    Multiply a packed block of A (mc x kc) by a packed block of B (kc x nc), updating C
+*/
+static void gemm_macro_kernel(micro_kernel_t micro_kernel, int mc, int nc, int kc, double alpha,
+                              const double* packed_a, const double* packed_b, double* c, int ldc) {
+    for (int j = 0; j < nc; j += GEMM_NR) {
+        int columns = nc - j < GEMM_NR ? nc - j : GEMM_NR;
+        for (int i = 0; i < mc; i += GEMM_MR) {
+            int rows = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+            micro_kernel(kc, alpha, packed_a + (size_t)i * kc, packed_b + (size_t)j * kc,
+                         c + (size_t)j * ldc + i, ldc, rows, columns);
+        }
+    }
+}
+
+typedef struct {
+    double* packed_a; // block of GEMM_MC x GEMM_KC elements of A
+    double* packed_b; // block of GEMM_KC x GEMM_NC elements of B
+} PackingBuffers;
+
+/*
+    Allocate the packing buffers which are missing (the one of B only if it is needed).
+    Returns SUCCESS or FAILURE
+*/
+static int allocate_packing_buffers(PackingBuffers* buffers, int with_b) {
+    if (!buffers->packed_a) {
+        buffers->packed_a = aligned_alloc(64, sizeof(double) * GEMM_MC * GEMM_KC);
+    }
+    if (with_b && !buffers->packed_b) {
+        buffers->packed_b = aligned_alloc(64, sizeof(double) * GEMM_KC * GEMM_NC);
+    }
+    return buffers->packed_a && (!with_b || buffers->packed_b) ? SUCCESS : FAILURE;
+}
+
+static void free_packing_buffers(PackingBuffers* buffers) {
+    free(buffers->packed_a);
+    free(buffers->packed_b);
+    buffers->packed_a = NULL;
+    buffers->packed_b = NULL;
+}
+
+/*
+    Multiply C by beta, so that the micro kernel always accumulates
+*/
+static void scale_block_of_c(int m, int n, double beta, double* c, int ldc) {
+    if (beta == 1.0) {
+        return;
+    }
+    for (int j = 0; j < n; j++) {
+        double* column = c + (size_t)j * ldc;
+        for (int i = 0; i < m; i++) {
+            column[i] = beta == 0.0 ? 0.0 : beta * column[i];
+        }
+    }
+}
+
+/*
+    Multiply the m rows of a block of kc columns of A by a packed block of B (kc x nc),
+    updating C. The rows are packed GEMM_MC at a time into packed_a
+*/
+static void multiply_by_packed_b(micro_kernel_t micro_kernel, int m, int nc, int kc, double alpha,
+                                 const double* a, size_t a_row_stride, size_t a_column_stride,
+                                 const double* packed_b, double* packed_a, double* c, int ldc) {
+    for (int ic = 0; ic < m; ic += GEMM_MC) {
+        int mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+        pack_block_of_a(mc, kc, a + (size_t)ic * a_row_stride, a_row_stride, a_column_stride, packed_a);
+        gemm_macro_kernel(micro_kernel, mc, nc, kc, alpha, packed_a, packed_b, c + ic, ldc);
+    }
+}
+
+/*
+    Compute C += alpha * A * B with the given packing buffers, block by block
+*/
+static void gemm_packed(micro_kernel_t micro_kernel, int m, int n, int k, double alpha, const double* a,
+                        size_t a_row_stride, size_t a_column_stride, const double* b, size_t b_row_stride,
+                        size_t b_column_stride, double* c, int ldc, PackingBuffers* buffers) {
+    for (int jc = 0; jc < n; jc += GEMM_NC) {
+        int nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+        for (int pc = 0; pc < k; pc += GEMM_KC) {
+            int kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            pack_block_of_b(kc, nc, b + (size_t)jc * b_column_stride + (size_t)pc * b_row_stride,
+                            b_row_stride, b_column_stride, buffers->packed_b);
+            multiply_by_packed_b(micro_kernel, m, nc, kc, alpha, a + (size_t)pc * a_column_stride,
+                                 a_row_stride, a_column_stride, buffers->packed_b, buffers->packed_a,
+                                 c + (size_t)jc * ldc, ldc);
+        }
+    }
+}
+
+/*
+    Compute C = alpha * A * B + beta * C, where A is m x k, B is k x n and C is m x n.
+    The element (i, p) of A is a[i * a_row_stride + p * a_column_stride], and the same for B,
+    while C is column-major with leading dimension ldc.
+    Returns SUCCESS, or FAILURE if the packing buffers can not be allocated
+*/
+static int gemm_blocked_strided(int m, int n, int k, double alpha, const double* a, size_t a_row_stride,
+                                size_t a_column_stride, const double* b, size_t b_row_stride, size_t b_column_stride,
+                                double beta, double* c, int ldc) {
+    if (m <= 0 || n <= 0) {
+        return SUCCESS;
+    }
+    scale_block_of_c(m, n, beta, c, ldc);
+    if (k <= 0 || alpha == 0.0) {
+        return SUCCESS;
+    }
+
+    PackingBuffers buffers = { NULL, NULL };
+    if (allocate_packing_buffers(&buffers, 1) == FAILURE) {
+        free_packing_buffers(&buffers);
+        return FAILURE;
+    }
+    gemm_packed(select_micro_kernel(), m, n, k, alpha, a, a_row_stride, a_column_stride,
+                b, b_row_stride, b_column_stride, c, ldc, &buffers);
+    free_packing_buffers(&buffers);
+    return SUCCESS;
+}
+
+/*
+    Compute C = alpha * A * B + beta * C, where A is m x k, B is k x n and C is m x n.
+    The three matrices are column-major with leading dimensions lda, ldb and ldc, so the
+    function also works on blocks of bigger matrices.
+    Returns SUCCESS, or FAILURE if the packing buffers can not be allocated
+*/
+int gemm_blocked(int m, int n, int k, double alpha, const double* a, int lda,
+                 const double* b, int ldb, double beta, double* c, int ldc) {
+    return gemm_blocked_strided(m, n, k, alpha, a, 1, (size_t) lda, b, 1, (size_t) ldb, beta, c, ldc);
+}
+
+typedef struct {
+    micro_kernel_t micro_kernel;
+    int m, n, k;
+    double alpha, beta;
+    const double* a;
+    const double* b;
+    double* c;
+    size_t a_row_stride, a_column_stride;
+    size_t b_row_stride, b_column_stride;
+    int ldc;
+    PackingBuffers* buffers; // buffers of every thread of the pool, indexed by current_worker()
+    int number_buffers;
+    // Block of B shared by the tasks when the rows are split
+    const double* packed_b;
+    int jc, nc, pc, kc;
+    atomic_int failed; // Some thread could not allocate its packing buffers
+} GemmJob;
+
+/*
+    Packing buffers of the thread which runs a task. Every thread allocates them the first time
+    it takes a task of the job and keeps them until the job finishes. If the pool has grown
+    since the job was created, the task uses buffers of its own, which it gives in own.
+    Returns NULL, marking the job as failed, if they can not be allocated
+*/
+static PackingBuffers* worker_buffers(GemmJob* job, PackingBuffers* own, int with_b) {
+    int worker = current_worker();
+    PackingBuffers* buffers = worker < job->number_buffers ? &job->buffers[worker] : own;
+    if (allocate_packing_buffers(buffers, with_b) == FAILURE) {
+        atomic_store(&job->failed, 1);
+        return NULL;
+    }
+    return buffers;
+}
+
+/*
+    Compute the columns [begin, end) of C
+*/
+static void gemm_columns_task(void* context, size_t begin, size_t end) {
+    GemmJob* job = context;
+    PackingBuffers own = { NULL, NULL };
+    PackingBuffers* buffers = worker_buffers(job, &own, 1);
+    if (buffers) {
+        double* c = job->c + begin * job->ldc;
+        scale_block_of_c(job->m, (int)(end - begin), job->beta, c, job->ldc);
+        gemm_packed(job->micro_kernel, job->m, (int)(end - begin), job->k, job->alpha, job->a,
+                    job->a_row_stride, job->a_column_stride, job->b + begin * job->b_column_stride,
+                    job->b_row_stride, job->b_column_stride, c, job->ldc, buffers);
+    }
+    free_packing_buffers(&own);
+}
+
+/*
+    Compute the rows [begin, end) of the current block of C with the packed block of B
+*/
+static void gemm_rows_task(void* context, size_t begin, size_t end) {
+    GemmJob* job = context;
+    PackingBuffers own = { NULL, NULL };
+    PackingBuffers* buffers = worker_buffers(job, &own, 0);
+    if (buffers) {
+        double* c = job->c + (size_t) job->jc * job->ldc + begin;
+        if (job->pc == 0) {
+            scale_block_of_c((int)(end - begin), job->nc, job->beta, c, job->ldc);
+        }
+        multiply_by_packed_b(job->micro_kernel, (int)(end - begin), job->nc, job->kc, job->alpha,
+                             job->a + begin * job->a_row_stride + (size_t) job->pc * job->a_column_stride,
+                             job->a_row_stride, job->a_column_stride, job->packed_b, buffers->packed_a, c, job->ldc);
+    }
+    free_packing_buffers(&own);
+}
+
+/*
+    Split the rows of C among the threads. Every block of B is packed once by the calling thread
+    and shared by all the tasks, which only pack their rows of A
+*/
+static void gemm_split_rows(GemmJob* job, double* packed_b) {
+    job->packed_b = packed_b;
+    for (job->jc = 0; job->jc < job->n && !atomic_load(&job->failed); job->jc += GEMM_NC) {
+        job->nc = job->n - job->jc < GEMM_NC ? job->n - job->jc : GEMM_NC;
+        for (job->pc = 0; job->pc < job->k && !atomic_load(&job->failed); job->pc += GEMM_KC) {
+            job->kc = job->k - job->pc < GEMM_KC ? job->k - job->pc : GEMM_KC;
+            pack_block_of_b(job->kc, job->nc, job->b + (size_t) job->jc * job->b_column_stride +
+                            (size_t) job->pc * job->b_row_stride, job->b_row_stride, job->b_column_stride, packed_b);
+            parallel_for(job->m, GEMM_MR * 4, gemm_rows_task, job);
+        }
+    }
+}
+
+/*
+    Same as gemm_parallel, but the elements of A and B are read with any row and column
+    strides, so the operands can be views of other matrices (blocks, transposes, ...)
+    which are packed directly from the data of their parents
+*/
+int gemm_strided(int m, int n, int k, double alpha, const double* a, size_t a_row_stride, size_t a_column_stride,
+                 const double* b, size_t b_row_stride, size_t b_column_stride, double beta, double* c, int ldc) {
+    int threads = get_thread_count();
+    if ((double) m * n * k < PARALLEL_GEMM_THRESHOLD || threads <= 1 || alpha == 0.0) {
+        return gemm_blocked_strided(m, n, k, alpha, a, a_row_stride, a_column_stride, b, b_row_stride,
+                                    b_column_stride, beta, c, ldc);
+    }
+    PackingBuffers* buffers = calloc(threads, sizeof(PackingBuffers));
+    if (!buffers) {
+        return FAILURE;
+    }
+    GemmJob job = { select_micro_kernel(), m, n, k, alpha, beta, a, b, c, a_row_stride, a_column_stride,
+                    b_row_stride, b_column_stride, ldc, buffers, threads, NULL, 0, 0, 0, 0, 0 };
+    if (n >= m || n >= threads * GEMM_NR * 4) {
+        parallel_for(n, GEMM_NR * 4, gemm_columns_task, &job);
+    } else {
+        double* packed_b = aligned_alloc(64, sizeof(double) * GEMM_KC * GEMM_NC);
+        if (packed_b) {
+            gemm_split_rows(&job, packed_b);
+        } else {
+            atomic_store(&job.failed, 1);
+        }
+        free(packed_b);
+    }
+    for (int i = 0; i < threads; i++) {
+        free_packing_buffers(&buffers[i]);
+    }
+    free(buffers);
+    return atomic_load(&job.failed) ? FAILURE : SUCCESS;
+}
+
+/*
+    Same as gemm_blocked, but large products are split among the threads of the pool.
+    Every thread computes a set of columns of C (or of rows when C has few columns),
+    so the threads never write the same elements.
+    Returns SUCCESS, or FAILURE if the packing buffers can not be allocated
+*/
+int gemm_parallel(int m, int n, int k, double alpha, const double* a, int lda,
+                  const double* b, int ldb, double beta, double* c, int ldc) {
+    return gemm_strided(m, n, k, alpha, a, 1, (size_t) lda, b, 1, (size_t) ldb, beta, c, ldc);
+}
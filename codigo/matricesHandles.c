@@ -0,0 +1,283 @@
+#include "definitions.h"
+#include <stdio.h>
+#include <string.h>
+#include <SWI-Stream.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the matrix handles. A handle is an SWI-Prolog blob which keeps
+  a pointer to a Matrix struct, so the matrix stays in C memory between predicate calls
+  and it is only converted into a list of lists when it is explicitly asked for.
+*/
+
+/*
+   Called by the atom garbage collector when the handle is no longer referenced.
+   It frees the matrix that the handle owns.
+*/
+static int release_matrix_handle(atom_t handle) {
+    Matrix** matrix = (Matrix**) PL_blob_data(handle, NULL, NULL);
+    if (matrix && *matrix) {
+        free_matrix(*matrix);
+        *matrix = NULL;
+    }
+    return TRUE;
+}
+
+/*
+   Print a handle as <matriz>(Address,RowsxColumns), <matriz>(Address,RowsxColumns,vista) for a view
+   or <matriz>(Address,RowsxColumns,Type) for a typed matrix
+*/
+static int write_matrix_handle(IOSTREAM* stream, atom_t handle, int flags) {
+    Matrix** matrix = (Matrix**) PL_blob_data(handle, NULL, NULL);
+    if (!matrix || !*matrix) {
+        Sfprintf(stream, "<matriz>(liberada)");
+        return TRUE;
+    }
+    Sfprintf(stream, "<matriz>(%p,%dx%d%s%s)", (void*) *matrix, (*matrix)->rows, (*matrix)->columns,
+             (*matrix)->storage == MATRIX_STORAGE_VIEW ? ",vista" : (*matrix)->element_type != MATRIX_TYPE_F64 ? "," : "",
+             (*matrix)->element_type != MATRIX_TYPE_F64 ? matrix_type_name((*matrix)->element_type) : "");
+    return TRUE;
+}
+
+/*
+  Formats of matriz_a_lista/3. The predicates which do not return a handle always return a
+  list of lists, the other formats are asked for in each call by converting a handle
+*/
+static const char* format_names[] = { "filas", "plana", "compuesto" };
+
+functor_t matrix_functor;
+
+/*
+    Create the functor of the matrix(Rows, Columns, Values) compounds, so it is not looked up
+    in every call
+*/
+void init_matrix_terms(void) {
+    matrix_functor = PL_new_functor(PL_new_atom("matrix"), 3);
+}
+
+// Whether the last handle looked up by this thread has been created, set by acquire_matrix_handle
+static __thread int handle_created = 0;
+
+/*
+   Called by SWI-Prolog when a handle is created. The handles are unique for their matrix, so
+   looking up the handle of a matrix which already has one returns it without calling this
+*/
+static void acquire_matrix_handle(atom_t handle) {
+    handle_created = 1;
+}
+
+static PL_blob_t matrix_blob = {
+    PL_BLOB_MAGIC,
+    PL_BLOB_UNIQUE,
+    "matriz",
+    release_matrix_handle,
+    NULL,
+    write_matrix_handle,
+    acquire_matrix_handle
+};
+
+/*
+    Unify a term with a new handle for the matrix. The handle takes the ownership
+    of the matrix, so it is freed by the garbage collector. A result which is shared (by the
+    result cache or by a future) can already have a handle: the term is unified with that one,
+    and the reference that the caller has taken for the new handle is given back.
+    Returns SUCCESS or FAILURE
+*/
+int unify_matrix_handle(term_t handle, Matrix* matrix) {
+    if (!matrix) {
+        return FAILURE;
+    }
+    term_t blob = PL_new_term_ref();
+    handle_created = 0;
+    if (!PL_put_blob(blob, &matrix, sizeof(Matrix*), &matrix_blob)) {
+        return FAILURE;
+    }
+    if (!handle_created) {
+        free_matrix(matrix);
+    }
+    return PL_unify(handle, blob);
+}
+
+/*
+    Obtain the matrix of a handle. Returns the matrix pointer on success and NULL
+    if the term is not a matrix handle
+*/
+Matrix* get_matrix_from_handle(term_t handle) {
+    void* blob_data;
+    PL_blob_t* type;
+
+    if (!PL_get_blob(handle, &blob_data, NULL, &type) || type != &matrix_blob) {
+        return NULL;
+    }
+    return *(Matrix**) blob_data;
+}
+
+/*
+    Check whether a term is a matrix handle
+*/
+int is_matrix_handle(term_t term) {
+    PL_blob_t* type;
+    return PL_is_blob(term, &type) && type == &matrix_blob;
+}
+
+/*
+    Check whether a term is a matrix(Rows, Columns, Values) compound
+*/
+int is_matrix_compound(term_t term) {
+    return PL_is_functor(term, matrix_functor);
+}
+
+/*
+    Obtain a matrix from a term which can be a matrix handle, a sparse matrix handle (which
+    is converted into a dense matrix), a matrix(Rows, Columns, Values) compound or a list of lists.
+    The matrices parsed from a list belong to the arena (or to the caller if arena is NULL),
+    while the ones of a handle still belong to the handle. The parsed matrices are stored by rows
+    and the matrix of a handle can be a view whose values are strided, so it is only for the
+    operations which read the values through the strides. The values of a typed matrix (f32, i32 or i64) are copied into a matrix of doubles,
+    which belongs to the arena (or to the caller) as the parsed ones.
+    Returns a valid matrix pointer on success and NULL on failure
+*/
+Matrix* get_strided_matrix_from_term(term_t term, MatrixArena* arena) {
+    if (is_matrix_handle(term)) {
+        Matrix* matrix = get_matrix_from_handle(term);
+        if (statistics_enabled) {
+            statistics_record_operand(0, matrix);
+        }
+        if (matrix && matrix->element_type != MATRIX_TYPE_F64) {
+            Matrix* copy = convert_matrix(matrix, MATRIX_TYPE_F64);
+            return arena ? arena_adopt(arena, copy) : copy;
+        }
+        return matrix;
+    }
+    uint64_t start = statistics_enabled ? statistics_clock() : 0;
+    Matrix* matrix = is_sparse_handle(term) ? sparse_to_dense(get_sparse_from_handle(term)) :
+                     is_matrix_compound(term) ? parse_matrix_compound(term) : parse_list_of_lists_into_matrix(term);
+    if (statistics_enabled) {
+        statistics_record_operand(start, matrix);
+    }
+    return arena ? arena_adopt(arena, matrix) : matrix;
+}
+
+/*
+    Same as get_strided_matrix_from_term, but the values of the matrix are always stored by
+    columns one after the other: the views which are not contiguous and the matrices stored by rows
+    are copied into a new matrix, which belongs to the arena (or to the caller if arena is NULL).
+    Returns a valid matrix pointer on success and NULL on failure
+*/
+Matrix* get_matrix_from_term(term_t term, MatrixArena* arena) {
+    Matrix* matrix = get_strided_matrix_from_term(term, arena);
+    if (!matrix || is_matrix_contiguous(matrix)) {
+        return matrix;
+    }
+    Matrix* copy = copy_matrix_view(matrix);
+    if (!arena && !(is_matrix_handle(term) && matrix == get_matrix_from_handle(term))) {
+        // The matrix read for this call belongs to the caller, who only receives the copy
+        free_matrix(matrix);
+    }
+    return arena ? arena_adopt(arena, copy) : copy;
+}
+
+/*
+    Unify the result of an operation either with a new handle or with a term in the
+    current output format. In the first case the matrix is detached from the arena,
+    because the handle owns it
+*/
+int unify_matrix_result(term_t result, Matrix* matrix, int as_handle, MatrixArena* arena) {
+    uint64_t start = statistics_enabled ? statistics_clock() : 0;
+    int unified;
+    if (as_handle) {
+        if (arena) {
+            arena_detach(arena, matrix);
+        }
+        unified = unify_matrix_handle(result, matrix);
+    } else {
+        unified = unify_matrix_with_term(matrix, result, MATRIX_FORMAT_ROWS);
+    }
+    if (statistics_enabled) {
+        statistics_record_result(start, matrix, unified);
+    }
+    return unified;
+}
+
+/*
+    Obtain the output format named by an atom. Returns -1 if the atom is not a format
+*/
+static int get_output_format(term_t format) {
+    char* name;
+    if (!PL_get_atom_chars(format, &name)) {
+        return -1;
+    }
+    for (int i = 0; i < (int)(sizeof(format_names) / sizeof(format_names[0])); i++) {
+        if (strcmp(name, format_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+  Foreign predicate to create a handle from a list of lists
+*/
+foreign_t pl_list_to_matrix_handle(term_t list, term_t handle) {
+    uint64_t start = statistics_enabled ? statistics_clock() : 0;
+    Matrix* m = parse_list_of_lists_into_matrix(list);
+    if (statistics_enabled) {
+        statistics_record_operand(start, m);
+    }
+    if (!m) {
+        PL_fail;
+    }
+    return unify_matrix_result(handle, m, 1, NULL);
+}
+
+/*
+  Foreign predicate to convert a handle into a list of lists
+*/
+foreign_t pl_matrix_handle_to_list(term_t handle, term_t list) {
+    Matrix* m = get_matrix_from_handle(handle);
+    if (!m) {
+        PL_fail;
+    }
+    uint64_t start = statistics_enabled ? statistics_clock() : 0;
+    int unified = unify_matrix_with_term(m, list, MATRIX_FORMAT_ROWS);
+    if (statistics_enabled) {
+        statistics_record_result(start, m, unified);
+    }
+    return unified;
+}
+
+/*
+  Foreign predicate to convert a handle into a term of a given format (filas, plana or compuesto)
+*/
+foreign_t pl_matrix_handle_to_term(term_t handle, term_t format, term_t term) {
+    Matrix* m = get_matrix_from_handle(handle);
+    int format_value = get_output_format(format);
+    if (!m) {
+        PL_fail;
+    }
+    if (format_value < 0) {
+        report_error("El formato de salida debe ser filas, plana o compuesto\n");
+        PL_fail;
+    }
+    uint64_t start = statistics_enabled ? statistics_clock() : 0;
+    int unified = unify_matrix_with_term(m, term, format_value);
+    if (statistics_enabled) {
+        statistics_record_result(start, m, unified);
+    }
+    return unified;
+}
+
+/*
+  Foreign predicate to obtain the number of rows and columns of a handle (dense or sparse)
+*/
+foreign_t pl_matrix_handle_dimensions(term_t handle, term_t rows, term_t columns) {
+    SparseMatrix* s = get_sparse_from_handle(handle);
+    if (s) {
+        return PL_unify_integer(rows, s->rows) && PL_unify_integer(columns, s->columns);
+    }
+    Matrix* m = get_matrix_from_handle(handle);
+    if (!m) {
+        PL_fail;
+    }
+    return PL_unify_integer(rows, m->rows) && PL_unify_integer(columns, m->columns);
+}
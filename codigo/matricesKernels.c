@@ -0,0 +1,799 @@
+#include "definitions.h"
+#include <math.h>
+#include <stddef.h>
+#include <immintrin.h>
+
+/*
+  Class in charge of the element-wise and reduction kernels. The data of a matrix is a
+  single contiguous buffer, so these operations work over a flat array of n doubles
+  regardless of the number of rows and columns.
+  There is a version of every kernel for each instruction set (scalar, SSE2, AVX2 and
+  AVX-512) and select_kernels chooses the best one supported by the processor when
+  the library is loaded.
+*/
+
+/*********************************************/
+/*
+    Scalar kernels. They are the fallback and give the reference results
+*/
+/**********************************************/
+
+static void add_scalar(const double* a, const double* b, double* result, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        result[i] = a[i] + b[i];
+    }
+}
+
+static void substract_scalar(const double* a, const double* b, double* result, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        result[i] = a[i] - b[i];
+    }
+}
+
+static void multiply_scalar(const double* a, double factor, double* result, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        result[i] = a[i] * factor;
+    }
+}
+
+static void divide_scalar(const double* a, double factor, double* result, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        result[i] = a[i] / factor;
+    }
+}
+
+static double sum_scalar(const double* a, size_t n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+static double maximum_scalar(const double* a, size_t n) {
+    double maximum = -INFINITY;
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] > maximum) {
+            maximum = a[i];
+        }
+    }
+    return maximum;
+}
+
+static double dot_scalar(const double* a, const double* b, size_t n) {
+    double dot = 0;
+    for (size_t i = 0; i < n; i++) {
+        dot += a[i] * b[i];
+    }
+    return dot;
+}
+
+static void axpy_scalar(double alpha, const double* x, const double* y, double* result, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        result[i] = alpha * x[i] + y[i];
+    }
+}
+
+/*
+    y = y + A x for a block of rows x columns stored by columns. The columns are read four
+    at a time, so every value of y is loaded and stored once for four columns
+*/
+static void gemv_scalar(const double* a, size_t lda, const double* x, double* y, size_t rows, size_t columns) {
+    size_t j = 0;
+    for (; j + 4 <= columns; j += 4) {
+        const double* a0 = a + j * lda;
+        const double *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+        for (size_t i = 0; i < rows; i++) {
+            y[i] += a0[i] * x[j] + a1[i] * x[j + 1] + a2[i] * x[j + 2] + a3[i] * x[j + 3];
+        }
+    }
+    for (; j < columns; j++) {
+        const double* a0 = a + j * lda;
+        for (size_t i = 0; i < rows; i++) {
+            y[i] += a0[i] * x[j];
+        }
+    }
+}
+
+/*
+    Transpose a block. The values are moved in squares of 8 x 8, so every line of the
+    cache which is read or written is used completely before moving on
+*/
+static void transpose_scalar(const double* source, size_t source_stride, double* destination,
+                             size_t destination_stride, int rows, int columns) {
+    for (int first_column = 0; first_column < columns; first_column += 8) {
+        int last_column = first_column + 8 < columns ? first_column + 8 : columns;
+        for (int first_row = 0; first_row < rows; first_row += 8) {
+            int last_row = first_row + 8 < rows ? first_row + 8 : rows;
+            for (int column = first_column; column < last_column; column++) {
+                for (int row = first_row; row < last_row; row++) {
+                    destination[(size_t) row * destination_stride + column] = source[(size_t) column * source_stride + row];
+                }
+            }
+        }
+    }
+}
+
+/*********************************************/
+/*
+    SSE2 kernels (two doubles per register)
+*/
+/**********************************************/
+
+__attribute__((target("sse2")))
+static void add_sse2(const double* a, const double* b, double* result, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(result + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        result[i] = a[i] + b[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static void substract_sse2(const double* a, const double* b, double* result, size_t n) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(result + i, _mm_sub_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        result[i] = a[i] - b[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static void multiply_sse2(const double* a, double factor, double* result, size_t n) {
+    __m128d vfactor = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(result + i, _mm_mul_pd(_mm_loadu_pd(a + i), vfactor));
+    }
+    for (; i < n; i++) {
+        result[i] = a[i] * factor;
+    }
+}
+
+__attribute__((target("sse2")))
+static void divide_sse2(const double* a, double factor, double* result, size_t n) {
+    __m128d vfactor = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(result + i, _mm_div_pd(_mm_loadu_pd(a + i), vfactor));
+    }
+    for (; i < n; i++) {
+        result[i] = a[i] / factor;
+    }
+}
+
+__attribute__((target("sse2")))
+static double sum_sse2(const double* a, size_t n) {
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(a + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(a + i + 2));
+    }
+    double partial[2];
+    _mm_storeu_pd(partial, _mm_add_pd(sum0, sum1));
+    double sum = partial[0] + partial[1];
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+__attribute__((target("sse2")))
+static double maximum_sse2(const double* a, size_t n) {
+    // _mm_max_pd returns its second operand when the first one is NaN, so NaN values are skipped
+    __m128d maximum = _mm_set1_pd(-INFINITY);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        maximum = _mm_max_pd(_mm_loadu_pd(a + i), maximum);
+    }
+    double partial[2];
+    _mm_storeu_pd(partial, maximum);
+    double result = partial[0] > partial[1] ? partial[0] : partial[1];
+    for (; i < n; i++) {
+        if (a[i] > result) {
+            result = a[i];
+        }
+    }
+    return result;
+}
+
+__attribute__((target("sse2")))
+static double dot_sse2(const double* a, const double* b, size_t n) {
+    __m128d dot0 = _mm_setzero_pd(), dot1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        dot0 = _mm_add_pd(dot0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        dot1 = _mm_add_pd(dot1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double partial[2];
+    _mm_storeu_pd(partial, _mm_add_pd(dot0, dot1));
+    double dot = partial[0] + partial[1];
+    for (; i < n; i++) {
+        dot += a[i] * b[i];
+    }
+    return dot;
+}
+
+__attribute__((target("sse2")))
+static void axpy_sse2(double alpha, const double* x, const double* y, double* result, size_t n) {
+    __m128d valpha = _mm_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(result + i, _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(x + i), valpha), _mm_loadu_pd(y + i)));
+    }
+    for (; i < n; i++) {
+        result[i] = alpha * x[i] + y[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static void gemv_sse2(const double* a, size_t lda, const double* x, double* y, size_t rows, size_t columns) {
+    size_t j = 0;
+    for (; j + 4 <= columns; j += 4) {
+        const double* a0 = a + j * lda;
+        const double *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+        __m128d x0 = _mm_set1_pd(x[j]), x1 = _mm_set1_pd(x[j + 1]);
+        __m128d x2 = _mm_set1_pd(x[j + 2]), x3 = _mm_set1_pd(x[j + 3]);
+        size_t i = 0;
+        for (; i + 2 <= rows; i += 2) {
+            __m128d sum01 = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(a0 + i), x0), _mm_mul_pd(_mm_loadu_pd(a1 + i), x1));
+            __m128d sum23 = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(a2 + i), x2), _mm_mul_pd(_mm_loadu_pd(a3 + i), x3));
+            _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_add_pd(sum01, sum23)));
+        }
+        for (; i < rows; i++) {
+            y[i] += a0[i] * x[j] + a1[i] * x[j + 1] + a2[i] * x[j + 2] + a3[i] * x[j + 3];
+        }
+    }
+    for (; j < columns; j++) {
+        axpy_sse2(x[j], a + j * lda, y, y, rows);
+    }
+}
+
+/*
+    Transpose a block in squares of 2 x 2 held in two registers
+*/
+__attribute__((target("sse2")))
+static void transpose_sse2(const double* source, size_t source_stride, double* destination,
+                           size_t destination_stride, int rows, int columns) {
+    int even_rows = rows & ~1;
+    int even_columns = columns & ~1;
+    for (int first_column = 0; first_column < even_columns; first_column += 8) {
+        int last_column = first_column + 8 < even_columns ? first_column + 8 : even_columns;
+        for (int first_row = 0; first_row < even_rows; first_row += 8) {
+            int last_row = first_row + 8 < even_rows ? first_row + 8 : even_rows;
+            for (int column = first_column; column < last_column; column += 2) {
+                const double* column0 = source + (size_t) column * source_stride;
+                const double* column1 = column0 + source_stride;
+                for (int row = first_row; row < last_row; row += 2) {
+                    __m128d a = _mm_loadu_pd(column0 + row);
+                    __m128d b = _mm_loadu_pd(column1 + row);
+                    double* row0 = destination + (size_t) row * destination_stride + column;
+                    _mm_storeu_pd(row0, _mm_unpacklo_pd(a, b));
+                    _mm_storeu_pd(row0 + destination_stride, _mm_unpackhi_pd(a, b));
+                }
+            }
+        }
+    }
+    // Last row and last column when their number is odd
+    if (even_rows < rows) {
+        transpose_scalar(source + even_rows, source_stride, destination + (size_t) even_rows * destination_stride,
+                         destination_stride, rows - even_rows, columns);
+    }
+    if (even_columns < columns) {
+        transpose_scalar(source + (size_t) even_columns * source_stride, source_stride, destination + even_columns,
+                         destination_stride, even_rows, columns - even_columns);
+    }
+}
+
+/*********************************************/
+/*
+    AVX2 kernels (four doubles per register, fused multiply-add for the products)
+*/
+/**********************************************/
+
+__attribute__((target("avx2")))
+static void add_avx2(const double* a, const double* b, double* result, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(result + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        result[i] = a[i] + b[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void substract_avx2(const double* a, const double* b, double* result, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(result + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < n; i++) {
+        result[i] = a[i] - b[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void multiply_avx2(const double* a, double factor, double* result, size_t n) {
+    __m256d vfactor = _mm256_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(result + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), vfactor));
+    }
+    for (; i < n; i++) {
+        result[i] = a[i] * factor;
+    }
+}
+
+__attribute__((target("avx2")))
+static void divide_avx2(const double* a, double factor, double* result, size_t n) {
+    __m256d vfactor = _mm256_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(result + i, _mm256_div_pd(_mm256_loadu_pd(a + i), vfactor));
+    }
+    for (; i < n; i++) {
+        result[i] = a[i] / factor;
+    }
+}
+
+__attribute__((target("avx2")))
+static double sum_avx2(const double* a, size_t n) {
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(a + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(a + i + 4));
+    }
+    double partial[4];
+    _mm256_storeu_pd(partial, _mm256_add_pd(sum0, sum1));
+    double sum = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static double maximum_avx2(const double* a, size_t n) {
+    __m256d maximum = _mm256_set1_pd(-INFINITY);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        maximum = _mm256_max_pd(_mm256_loadu_pd(a + i), maximum);
+    }
+    double partial[4];
+    _mm256_storeu_pd(partial, maximum);
+    double result = -INFINITY;
+    for (int lane = 0; lane < 4; lane++) {
+        if (partial[lane] > result) {
+            result = partial[lane];
+        }
+    }
+    for (; i < n; i++) {
+        if (a[i] > result) {
+            result = a[i];
+        }
+    }
+    return result;
+}
+
+__attribute__((target("avx2,fma")))
+static double dot_avx2(const double* a, const double* b, size_t n) {
+    __m256d dot0 = _mm256_setzero_pd(), dot1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        dot0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), dot0);
+        dot1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), dot1);
+    }
+    double partial[4];
+    _mm256_storeu_pd(partial, _mm256_add_pd(dot0, dot1));
+    double dot = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+    for (; i < n; i++) {
+        dot += a[i] * b[i];
+    }
+    return dot;
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(double alpha, const double* x, const double* y, double* result, size_t n) {
+    __m256d valpha = _mm256_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(result + i, _mm256_fmadd_pd(_mm256_loadu_pd(x + i), valpha, _mm256_loadu_pd(y + i)));
+    }
+    for (; i < n; i++) {
+        result[i] = alpha * x[i] + y[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void gemv_avx2(const double* a, size_t lda, const double* x, double* y, size_t rows, size_t columns) {
+    size_t j = 0;
+    for (; j + 4 <= columns; j += 4) {
+        const double* a0 = a + j * lda;
+        const double *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+        __m256d x0 = _mm256_set1_pd(x[j]), x1 = _mm256_set1_pd(x[j + 1]);
+        __m256d x2 = _mm256_set1_pd(x[j + 2]), x3 = _mm256_set1_pd(x[j + 3]);
+        size_t i = 0;
+        for (; i + 4 <= rows; i += 4) {
+            __m256d sum = _mm256_loadu_pd(y + i);
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(a0 + i), x0, sum);
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(a1 + i), x1, sum);
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(a2 + i), x2, sum);
+            sum = _mm256_fmadd_pd(_mm256_loadu_pd(a3 + i), x3, sum);
+            _mm256_storeu_pd(y + i, sum);
+        }
+        for (; i < rows; i++) {
+            y[i] += a0[i] * x[j] + a1[i] * x[j + 1] + a2[i] * x[j + 2] + a3[i] * x[j + 3];
+        }
+    }
+    for (; j < columns; j++) {
+        axpy_avx2(x[j], a + j * lda, y, y, rows);
+    }
+}
+
+/*
+    Transpose a square of 4 x 4: four columns of four values into four rows
+*/
+__attribute__((target("avx2")))
+static inline void transpose_4x4_avx2(const double* source, size_t source_stride, double* destination, size_t destination_stride) {
+    __m256d a0 = _mm256_loadu_pd(source);
+    __m256d a1 = _mm256_loadu_pd(source + source_stride);
+    __m256d a2 = _mm256_loadu_pd(source + 2 * source_stride);
+    __m256d a3 = _mm256_loadu_pd(source + 3 * source_stride);
+    __m256d t0 = _mm256_unpacklo_pd(a0, a1);
+    __m256d t1 = _mm256_unpackhi_pd(a0, a1);
+    __m256d t2 = _mm256_unpacklo_pd(a2, a3);
+    __m256d t3 = _mm256_unpackhi_pd(a2, a3);
+    _mm256_storeu_pd(destination, _mm256_permute2f128_pd(t0, t2, 0x20));
+    _mm256_storeu_pd(destination + destination_stride, _mm256_permute2f128_pd(t1, t3, 0x20));
+    _mm256_storeu_pd(destination + 2 * destination_stride, _mm256_permute2f128_pd(t0, t2, 0x31));
+    _mm256_storeu_pd(destination + 3 * destination_stride, _mm256_permute2f128_pd(t1, t3, 0x31));
+}
+
+/*
+    Transpose a block in squares of 8 x 8, each one made of four squares of 4 x 4
+*/
+__attribute__((target("avx2")))
+static void transpose_avx2(const double* source, size_t source_stride, double* destination,
+                           size_t destination_stride, int rows, int columns) {
+    int full_rows = rows & ~3;
+    int full_columns = columns & ~3;
+    for (int first_column = 0; first_column < full_columns; first_column += 8) {
+        int last_column = first_column + 8 < full_columns ? first_column + 8 : full_columns;
+        for (int first_row = 0; first_row < full_rows; first_row += 8) {
+            int last_row = first_row + 8 < full_rows ? first_row + 8 : full_rows;
+            for (int column = first_column; column < last_column; column += 4) {
+                for (int row = first_row; row < last_row; row += 4) {
+                    transpose_4x4_avx2(source + (size_t) column * source_stride + row, source_stride,
+                                       destination + (size_t) row * destination_stride + column, destination_stride);
+                }
+            }
+        }
+    }
+    // Rows and columns which do not fill a square of 4 x 4
+    if (full_rows < rows) {
+        transpose_scalar(source + full_rows, source_stride, destination + (size_t) full_rows * destination_stride,
+                         destination_stride, rows - full_rows, columns);
+    }
+    if (full_columns < columns) {
+        transpose_scalar(source + (size_t) full_columns * source_stride, source_stride, destination + full_columns,
+                         destination_stride, full_rows, columns - full_columns);
+    }
+}
+
+/*********************************************/
+/*
+    AVX-512 kernels (eight doubles per register, masked loads for the remainder)
+*/
+/**********************************************/
+
+__attribute__((target("avx512f")))
+static void add_avx512(const double* a, const double* b, double* result, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(result + i, _mm512_add_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)));
+    }
+    __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_pd(result + i, mask, _mm512_add_pd(_mm512_maskz_loadu_pd(mask, a + i),
+                                                          _mm512_maskz_loadu_pd(mask, b + i)));
+}
+
+__attribute__((target("avx512f")))
+static void substract_avx512(const double* a, const double* b, double* result, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(result + i, _mm512_sub_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i)));
+    }
+    __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_pd(result + i, mask, _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, a + i),
+                                                          _mm512_maskz_loadu_pd(mask, b + i)));
+}
+
+__attribute__((target("avx512f")))
+static void multiply_avx512(const double* a, double factor, double* result, size_t n) {
+    __m512d vfactor = _mm512_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(result + i, _mm512_mul_pd(_mm512_loadu_pd(a + i), vfactor));
+    }
+    __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_pd(result + i, mask, _mm512_mul_pd(_mm512_maskz_loadu_pd(mask, a + i), vfactor));
+}
+
+__attribute__((target("avx512f")))
+static void divide_avx512(const double* a, double factor, double* result, size_t n) {
+    __m512d vfactor = _mm512_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(result + i, _mm512_div_pd(_mm512_loadu_pd(a + i), vfactor));
+    }
+    __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_pd(result + i, mask, _mm512_div_pd(_mm512_maskz_loadu_pd(mask, a + i), vfactor));
+}
+
+__attribute__((target("avx512f")))
+static double sum_avx512(const double* a, size_t n) {
+    __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm512_add_pd(sum0, _mm512_loadu_pd(a + i));
+        sum1 = _mm512_add_pd(sum1, _mm512_loadu_pd(a + i + 8));
+    }
+    for (; i + 8 <= n; i += 8) {
+        sum0 = _mm512_add_pd(sum0, _mm512_loadu_pd(a + i));
+    }
+    __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+    sum1 = _mm512_add_pd(sum1, _mm512_maskz_loadu_pd(mask, a + i));
+    return _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+static double maximum_avx512(const double* a, size_t n) {
+    __m512d maximum = _mm512_set1_pd(-INFINITY);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        maximum = _mm512_max_pd(_mm512_loadu_pd(a + i), maximum);
+    }
+    // The lanes out of the mask keep -INFINITY, so they do not change the maximum
+    __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+    maximum = _mm512_max_pd(_mm512_mask_loadu_pd(_mm512_set1_pd(-INFINITY), mask, a + i), maximum);
+    return _mm512_reduce_max_pd(maximum);
+}
+
+__attribute__((target("avx512f")))
+static double dot_avx512(const double* a, const double* b, size_t n) {
+    __m512d dot0 = _mm512_setzero_pd(), dot1 = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        dot0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), dot0);
+        dot1 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8), dot1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        dot0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), dot0);
+    }
+    __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+    dot1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i), dot1);
+    return _mm512_reduce_add_pd(_mm512_add_pd(dot0, dot1));
+}
+
+__attribute__((target("avx512f")))
+static void axpy_avx512(double alpha, const double* x, const double* y, double* result, size_t n) {
+    __m512d valpha = _mm512_set1_pd(alpha);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(result + i, _mm512_fmadd_pd(_mm512_loadu_pd(x + i), valpha, _mm512_loadu_pd(y + i)));
+    }
+    __mmask8 mask = (__mmask8)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_pd(result + i, mask, _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, x + i), valpha,
+                                                            _mm512_maskz_loadu_pd(mask, y + i)));
+}
+
+__attribute__((target("avx512f")))
+static void gemv_avx512(const double* a, size_t lda, const double* x, double* y, size_t rows, size_t columns) {
+    size_t j = 0;
+    for (; j + 4 <= columns; j += 4) {
+        const double* a0 = a + j * lda;
+        const double *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+        __m512d x0 = _mm512_set1_pd(x[j]), x1 = _mm512_set1_pd(x[j + 1]);
+        __m512d x2 = _mm512_set1_pd(x[j + 2]), x3 = _mm512_set1_pd(x[j + 3]);
+        size_t i = 0;
+        for (; i + 8 <= rows; i += 8) {
+            __m512d sum = _mm512_loadu_pd(y + i);
+            sum = _mm512_fmadd_pd(_mm512_loadu_pd(a0 + i), x0, sum);
+            sum = _mm512_fmadd_pd(_mm512_loadu_pd(a1 + i), x1, sum);
+            sum = _mm512_fmadd_pd(_mm512_loadu_pd(a2 + i), x2, sum);
+            sum = _mm512_fmadd_pd(_mm512_loadu_pd(a3 + i), x3, sum);
+            _mm512_storeu_pd(y + i, sum);
+        }
+        __mmask8 mask = (__mmask8)((1u << (rows - i)) - 1);
+        __m512d sum = _mm512_maskz_loadu_pd(mask, y + i);
+        sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a0 + i), x0, sum);
+        sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a1 + i), x1, sum);
+        sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a2 + i), x2, sum);
+        sum = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a3 + i), x3, sum);
+        _mm512_mask_storeu_pd(y + i, mask, sum);
+    }
+    for (; j < columns; j++) {
+        axpy_avx512(x[j], a + j * lda, y, y, rows);
+    }
+}
+
+/*********************************************/
+/*
+    Dispatch
+*/
+/**********************************************/
+
+static const MatrixKernels scalar_kernels = {
+    SIMD_SCALAR, "scalar",
+    add_scalar, substract_scalar, multiply_scalar, divide_scalar,
+    sum_scalar, maximum_scalar, dot_scalar,
+    axpy_scalar, gemv_scalar,
+    transpose_scalar
+};
+
+static const MatrixKernels sse2_kernels = {
+    SIMD_SSE2, "sse2",
+    add_sse2, substract_sse2, multiply_sse2, divide_sse2,
+    sum_sse2, maximum_sse2, dot_sse2,
+    axpy_sse2, gemv_sse2,
+    transpose_sse2
+};
+
+static const MatrixKernels avx2_kernels = {
+    SIMD_AVX2, "avx2",
+    add_avx2, substract_avx2, multiply_avx2, divide_avx2,
+    sum_avx2, maximum_avx2, dot_avx2,
+    axpy_avx2, gemv_avx2,
+    transpose_avx2
+};
+
+static const MatrixKernels avx512_kernels = {
+    SIMD_AVX512, "avx512",
+    add_avx512, substract_avx512, multiply_avx512, divide_avx512,
+    sum_avx512, maximum_avx512, dot_avx512,
+    axpy_avx512, gemv_avx512,
+    transpose_avx2 // the squares of 4 x 4 already use whole lines of the cache
+};
+
+// Kernels in use. They are the scalar ones until select_kernels is called
+const MatrixKernels* kernels = &scalar_kernels;
+
+/*
+    Obtain the kernels of an instruction set. Returns NULL when the processor does not support it
+*/
+const MatrixKernels* get_kernels(int simd_level) {
+    __builtin_cpu_init();
+    switch (simd_level) {
+        case SIMD_SCALAR:
+            return &scalar_kernels;
+        case SIMD_SSE2:
+            return __builtin_cpu_supports("sse2") ? &sse2_kernels : NULL;
+        case SIMD_AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? &avx2_kernels : NULL;
+        case SIMD_AVX512:
+            return __builtin_cpu_supports("avx512f") ? &avx512_kernels : NULL;
+        default:
+            return NULL;
+    }
+}
+
+/*
+    Choose the best kernels supported by the processor. It is called when the library is installed
+*/
+void select_kernels(void) {
+    for (int level = SIMD_AVX512; level >= SIMD_SCALAR; level--) {
+        const MatrixKernels* candidate = get_kernels(level);
+        if (candidate) {
+            kernels = candidate;
+            return;
+        }
+    }
+}
+
+/*
+    Use the kernels of an instruction set. Returns SUCCESS, or FAILURE if it is not supported
+*/
+int set_kernels(int simd_level) {
+    const MatrixKernels* candidate = get_kernels(simd_level);
+    if (!candidate) {
+        return FAILURE;
+    }
+    kernels = candidate;
+    return SUCCESS;
+}
+
+/*********************************************/
+/*
+    Parallel execution of the kernels. The arrays are split in chunks of at least
+    PARALLEL_GRAIN elements which run on the thread pool, so small matrices stay
+    on the calling thread
+*/
+/**********************************************/
+
+typedef struct {
+    binary_kernel_t binary;
+    factor_kernel_t factor_kernel;
+    const double* a;
+    const double* b;
+    double* result;
+    double factor;
+    size_t n;
+    size_t number_chunks;
+    double* partials; // one partial result per chunk for the reductions
+} KernelJob;
+
+static void binary_kernel_task(void* context, size_t begin, size_t end) {
+    KernelJob* job = context;
+    job->binary(job->a + begin, job->b + begin, job->result + begin, end - begin);
+}
+
+static void factor_kernel_task(void* context, size_t begin, size_t end) {
+    KernelJob* job = context;
+    job->factor_kernel(job->a + begin, job->factor, job->result + begin, end - begin);
+}
+
+void parallel_binary_kernel(binary_kernel_t kernel, const double* a, const double* b, double* result, size_t n) {
+    KernelJob job = { .binary = kernel, .a = a, .b = b, .result = result, .n = n };
+    parallel_for(n, PARALLEL_GRAIN, binary_kernel_task, &job);
+}
+
+void parallel_factor_kernel(factor_kernel_t kernel, const double* a, double factor, double* result, size_t n) {
+    KernelJob job = { .factor_kernel = kernel, .a = a, .factor = factor, .result = result, .n = n };
+    parallel_for(n, PARALLEL_GRAIN, factor_kernel_task, &job);
+}
+
+/*
+    Range of the elements of a chunk of a reduction
+*/
+static void chunk_range(KernelJob* job, size_t chunk, size_t* begin, size_t* end) {
+    *begin = job->n * chunk / job->number_chunks;
+    *end = job->n * (chunk + 1) / job->number_chunks;
+}
+
+static void dot_task(void* context, size_t first, size_t last) {
+    KernelJob* job = context;
+    for (size_t chunk = first; chunk < last; chunk++) {
+        size_t begin, end;
+        chunk_range(job, chunk, &begin, &end);
+        job->partials[chunk] = kernels->dot(job->a + begin, job->b + begin, end - begin);
+    }
+}
+
+/*
+    Split a reduction in one chunk per thread (at most MAX_REDUCTION_CHUNKS) and
+    run it. Returns the number of partial results
+*/
+static size_t run_reduction(KernelJob* job, parallel_task_t task) {
+    size_t number_chunks = job->n / PARALLEL_GRAIN;
+    size_t threads = (size_t) get_thread_count();
+    if (number_chunks > threads) {
+        number_chunks = threads;
+    }
+    if (number_chunks > MAX_REDUCTION_CHUNKS) {
+        number_chunks = MAX_REDUCTION_CHUNKS;
+    }
+    job->number_chunks = number_chunks;
+    parallel_for(number_chunks, 1, task, job);
+    return number_chunks;
+}
+
+double parallel_dot(const double* a, const double* b, size_t n) {
+    double partials[MAX_REDUCTION_CHUNKS];
+    KernelJob job = { .a = a, .b = b, .n = n, .partials = partials };
+    if (n < 2 * PARALLEL_GRAIN) {
+        return kernels->dot(a, b, n);
+    }
+    size_t number_chunks = run_reduction(&job, dot_task);
+    double dot = 0;
+    for (size_t chunk = 0; chunk < number_chunks; chunk++) {
+        dot += partials[chunk];
+    }
+    return dot;
+}
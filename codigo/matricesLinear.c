@@ -0,0 +1,532 @@
+#include "definitions.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <SWI-Stream.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the dense linear systems: LU factorization with partial pivoting,
+  Cholesky factorization, solves with several right-hand sides, determinant and inverse.
+  Both factorizations are blocked and right-looking: a panel of FACTORIZATION_BLOCK columns
+  is factorized with simple loops and then the rest of the matrix is updated with the blocked
+  product of matricesGemm.c, which does almost all the operations. The triangular solves are
+  blocked in the same way. A factorization can be kept in a handle and used for many solves.
+*/
+
+/*
+    Free a factorization and its factors
+*/
+void free_factorization(Factorization* factorization) {
+    if (!factorization) {
+        return;
+    }
+    free_matrix(factorization->factors);
+    free(factorization->pivots);
+    free(factorization);
+}
+
+/*
+    Create a factorization with a copy of a square matrix, which can be stored in any layout
+    or be a view. Returns NULL on failure
+*/
+static Factorization* new_factorization(Matrix* matrix, int kind) {
+    if (!matrix) {
+        return NULL;
+    }
+    if (matrix->rows != matrix->columns) {
+        report_error("La matriz debe ser cuadrada\n");
+        return NULL;
+    }
+    Factorization* factorization = calloc(1, sizeof(Factorization));
+    if (!factorization) {
+        return NULL;
+    }
+    factorization->kind = kind;
+    factorization->sign = 1;
+    factorization->factors = new_matrix(matrix->rows, matrix->columns);
+    if (kind == FACTORIZATION_LU) {
+        factorization->pivots = malloc(sizeof(int) * (size_t) matrix->rows);
+    }
+    if (!factorization->factors || (kind == FACTORIZATION_LU && !factorization->pivots)) {
+        free_factorization(factorization);
+        return NULL;
+    }
+    copy_matrix_values(matrix, factorization->factors);
+    return factorization;
+}
+
+/*********************************************/
+/*
+    Triangular solves of L X = B and U X = B, where B has r columns and is overwritten with X
+*/
+/**********************************************/
+
+typedef struct {
+    int n;
+    const double* triangle;
+    int ldt;
+    int unit; // the diagonal of the triangle is made of ones, which are not stored
+    double* b;
+    int ldb;
+} TriangularJob;
+
+/*
+    Forward substitution for the columns [begin, end) of B
+*/
+static void solve_lower_task(void* context, size_t begin, size_t end) {
+    TriangularJob* job = context;
+    for (size_t column = begin; column < end; column++) {
+        double* x = job->b + column * job->ldb;
+        for (int j = 0; j < job->n; j++) {
+            const double* l = job->triangle + (size_t) j * job->ldt;
+            if (!job->unit) {
+                x[j] /= l[j];
+            }
+            double value = x[j];
+            if (value != 0.0) {
+                for (int i = j + 1; i < job->n; i++) {
+                    x[i] -= value * l[i];
+                }
+            }
+        }
+    }
+}
+
+/*
+    Backward substitution for the columns [begin, end) of B
+*/
+static void solve_upper_task(void* context, size_t begin, size_t end) {
+    TriangularJob* job = context;
+    for (size_t column = begin; column < end; column++) {
+        double* x = job->b + column * job->ldb;
+        for (int j = job->n - 1; j >= 0; j--) {
+            const double* u = job->triangle + (size_t) j * job->ldt;
+            x[j] /= u[j];
+            double value = x[j];
+            if (value != 0.0) {
+                for (int i = 0; i < j; i++) {
+                    x[i] -= value * u[i];
+                }
+            }
+        }
+    }
+}
+
+static void solve_triangle(parallel_task_t task, int n, int r, const double* triangle, int ldt, int unit, double* b, int ldb) {
+    TriangularJob job = { n, triangle, ldt, unit, b, ldb };
+    parallel_for((size_t) r, PARALLEL_GRAIN / ((size_t) n * n) + 1, task, &job);
+}
+
+/*
+    Solve L X = B, with L lower triangular of n x n. Returns SUCCESS or FAILURE
+*/
+static int solve_lower(int n, int r, const double* l, int ldl, int unit, double* b, int ldb) {
+    for (int k = 0; k < n; k += FACTORIZATION_BLOCK) {
+        int nb = n - k < FACTORIZATION_BLOCK ? n - k : FACTORIZATION_BLOCK;
+        solve_triangle(solve_lower_task, nb, r, l + k + (size_t) k * ldl, ldl, unit, b + k, ldb);
+        if (k + nb < n && gemm_parallel(n - k - nb, r, nb, -1.0, l + (k + nb) + (size_t) k * ldl, ldl,
+                                        b + k, ldb, 1.0, b + k + nb, ldb) == FAILURE) {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+    Solve U X = B, with U upper triangular of n x n. Returns SUCCESS or FAILURE
+*/
+static int solve_upper(int n, int r, const double* u, int ldu, double* b, int ldb) {
+    for (int k = (n - 1) / FACTORIZATION_BLOCK * FACTORIZATION_BLOCK; k >= 0; k -= FACTORIZATION_BLOCK) {
+        int nb = n - k < FACTORIZATION_BLOCK ? n - k : FACTORIZATION_BLOCK;
+        solve_triangle(solve_upper_task, nb, r, u + k + (size_t) k * ldu, ldu, 0, b + k, ldb);
+        if (k > 0 && gemm_parallel(k, r, nb, -1.0, u + (size_t) k * ldu, ldu, b + k, ldb, 1.0, b, ldb) == FAILURE) {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+    Apply the row swaps first..last - 1 of a LU factorization to the columns of a matrix
+*/
+static void swap_rows(double* data, int ld, int columns, const int* pivots, int first, int last) {
+    for (int column = 0; column < columns; column++) {
+        double* values = data + (size_t) column * ld;
+        for (int row = first; row < last; row++) {
+            if (pivots[row] != row) {
+                double value = values[row];
+                values[row] = values[pivots[row]];
+                values[pivots[row]] = value;
+            }
+        }
+    }
+}
+
+/*********************************************/
+/*
+    Factorizations
+*/
+/**********************************************/
+
+/*
+    LU factorization with partial pivoting of a square matrix (P A = L U).
+    Returns the factorization, or NULL on failure. A singular matrix is factorized too,
+    and it is marked as singular
+*/
+Factorization* lu_factorization(Matrix* matrix) {
+    Factorization* factorization = new_factorization(matrix, FACTORIZATION_LU);
+    if (!factorization) {
+        return NULL;
+    }
+    int n = matrix->rows;
+    double* a = factorization->factors->data;
+    int* pivots = factorization->pivots;
+
+    for (int k = 0; k < n; k += FACTORIZATION_BLOCK) {
+        int nb = n - k < FACTORIZATION_BLOCK ? n - k : FACTORIZATION_BLOCK;
+        double* panel = a + (size_t) k * n;
+
+        // Panel of the columns k..k + nb - 1, with the swaps applied only to the panel
+        for (int j = k; j < k + nb; j++) {
+            double* column = a + (size_t) j * n;
+            int pivot = j;
+            for (int i = j + 1; i < n; i++) {
+                if (fabs(column[i]) > fabs(column[pivot])) {
+                    pivot = i;
+                }
+            }
+            pivots[j] = pivot;
+            if (pivot != j) {
+                swap_rows(panel, n, nb, pivots, j, j + 1);
+                factorization->sign = -factorization->sign;
+            }
+            if (column[j] == 0.0) {
+                factorization->singular = 1;
+                continue;
+            }
+            double inverse = 1.0 / column[j];
+            for (int i = j + 1; i < n; i++) {
+                column[i] *= inverse;
+            }
+            for (int c = j + 1; c < k + nb; c++) {
+                double* target = a + (size_t) c * n;
+                double factor = target[j];
+                if (factor != 0.0) {
+                    for (int i = j + 1; i < n; i++) {
+                        target[i] -= column[i] * factor;
+                    }
+                }
+            }
+        }
+        // Swaps of the panel in the columns at its left and at its right
+        swap_rows(a, n, k, pivots, k, k + nb);
+        if (k + nb < n) {
+            double* right = a + (size_t)(k + nb) * n;
+            swap_rows(right, n, n - k - nb, pivots, k, k + nb);
+            // U12 = L11^-1 A12 and A22 = A22 - L21 U12
+            solve_triangle(solve_lower_task, nb, n - k - nb, panel + k, n, 1, right + k, n);
+            if (gemm_parallel(n - k - nb, n - k - nb, nb, -1.0, panel + k + nb, n, right + k, n,
+                              1.0, right + k + nb, n) == FAILURE) {
+                free_factorization(factorization);
+                return NULL;
+            }
+        }
+    }
+    return factorization;
+}
+
+/*
+    Cholesky factorization of a symmetric positive definite matrix (A = L L^T).
+    Returns the factorization, or NULL on failure
+*/
+Factorization* cholesky_factorization(Matrix* matrix) {
+    if (matrix && matrix->rows == matrix->columns && !is_matrix_symmetric(matrix)) {
+        report_error("La matriz no es simétrica definida positiva\n");
+        return NULL;
+    }
+    Factorization* factorization = new_factorization(matrix, FACTORIZATION_CHOLESKY);
+    if (!factorization) {
+        return NULL;
+    }
+    int n = matrix->rows;
+    double* a = factorization->factors->data;
+    size_t capacity = 0;
+    double* transposed = NULL; // L21^T for the update of the rest of the matrix
+
+    for (int k = 0; k < n; k += FACTORIZATION_BLOCK) {
+        int nb = n - k < FACTORIZATION_BLOCK ? n - k : FACTORIZATION_BLOCK;
+        int m = n - k - nb;
+
+        // Panel of the columns k..k + nb - 1, only the lower triangle is read and written
+        for (int j = k; j < k + nb; j++) {
+            double* column = a + (size_t) j * n;
+            if (!(column[j] > 0.0)) {
+                report_error("La matriz no es simétrica definida positiva\n");
+                pool_release(transposed, capacity);
+                free_factorization(factorization);
+                return NULL;
+            }
+            column[j] = sqrt(column[j]);
+            double inverse = 1.0 / column[j];
+            for (int i = j + 1; i < n; i++) {
+                column[i] *= inverse;
+            }
+            for (int c = j + 1; c < k + nb; c++) {
+                double* target = a + (size_t) c * n;
+                double factor = column[c];
+                for (int i = c; i < n; i++) {
+                    target[i] -= column[i] * factor;
+                }
+            }
+        }
+        if (m == 0) {
+            break;
+        }
+        // A22 = A22 - L21 L21^T, only the blocks of columns on and below the diagonal
+        if (!transposed && !(transposed = pool_allocate(sizeof(double) * FACTORIZATION_BLOCK * (size_t) m, &capacity))) {
+            free_factorization(factorization);
+            return NULL;
+        }
+        const double* l21 = a + (size_t) k * n + k + nb;
+        double* a22 = a + (size_t)(k + nb) * n + k + nb;
+        kernels->transpose(l21, n, transposed, nb, m, nb);
+        for (int first = 0; first < m; first += 4 * FACTORIZATION_BLOCK) {
+            int width = m - first < 4 * FACTORIZATION_BLOCK ? m - first : 4 * FACTORIZATION_BLOCK;
+            if (gemm_parallel(m - first, width, nb, -1.0, l21 + first, n, transposed + (size_t) first * nb, nb,
+                              1.0, a22 + first + (size_t) first * n, n) == FAILURE) {
+                pool_release(transposed, capacity);
+                free_factorization(factorization);
+                return NULL;
+            }
+        }
+    }
+    pool_release(transposed, capacity);
+    // L^T above the diagonal, so the second solve reads columns as the first one
+    for (int column = 0; column < n; column++) {
+        for (int row = column + 1; row < n; row++) {
+            a[(size_t) row * n + column] = a[(size_t) column * n + row];
+        }
+    }
+    return factorization;
+}
+
+/*
+    Solve A X = B with a factorization of A. The result is a matrix of the size of B stored by
+    columns, which can be B itself. B can be stored in any layout or be a view, as it is
+    copied into the result before the solves. Returns SUCCESS or FAILURE
+*/
+int solve_with_factorization(Factorization* factorization, Matrix* right_hand_sides, Matrix* result) {
+    if (!factorization || !right_hand_sides || !result) {
+        return FAILURE;
+    }
+    Matrix* factors = factorization->factors;
+    int n = factors->rows;
+    if (right_hand_sides->rows != n || result->rows != n || result->columns != right_hand_sides->columns) {
+        report_error("El número de filas de los términos independientes debe ser %d\n", n);
+        return FAILURE;
+    }
+    if (factorization->singular) {
+        report_error("La matriz es singular\n");
+        return FAILURE;
+    }
+    int r = right_hand_sides->columns;
+    if (result != right_hand_sides) {
+        copy_matrix_values(right_hand_sides, result);
+    }
+    if (factorization->kind == FACTORIZATION_LU) {
+        swap_rows(result->data, n, r, factorization->pivots, 0, n);
+    }
+    if (solve_lower(n, r, factors->data, n, factorization->kind == FACTORIZATION_LU, result->data, n) == FAILURE ||
+        solve_upper(n, r, factors->data, n, result->data, n) == FAILURE) {
+        return FAILURE;
+    }
+    invalidate_matrix_structure(result);
+    return SUCCESS;
+}
+
+/*
+    Determinant of the matrix of a factorization
+*/
+double factorization_determinant(Factorization* factorization) {
+    Matrix* factors = factorization->factors;
+    double determinant = factorization->kind == FACTORIZATION_LU ? factorization->sign : 1.0;
+    for (int i = 0; i < factors->rows; i++) {
+        determinant *= ACCESS(factors, i, i);
+    }
+    return factorization->kind == FACTORIZATION_CHOLESKY ? determinant * determinant : determinant;
+}
+
+/*********************************************/
+/*
+    Factorization handles and foreign predicates
+*/
+/**********************************************/
+
+static int release_factorization_handle(atom_t handle) {
+    Factorization** factorization = (Factorization**) PL_blob_data(handle, NULL, NULL);
+    if (factorization && *factorization) {
+        free_factorization(*factorization);
+        *factorization = NULL;
+    }
+    return TRUE;
+}
+
+/*
+   Print a handle as <factorizacion>(Address,Kind,SizexSize)
+*/
+static int write_factorization_handle(IOSTREAM* stream, atom_t handle, int flags) {
+    Factorization** factorization = (Factorization**) PL_blob_data(handle, NULL, NULL);
+    if (!factorization || !*factorization) {
+        Sfprintf(stream, "<factorizacion>(liberada)");
+        return TRUE;
+    }
+    Sfprintf(stream, "<factorizacion>(%p,%s,%dx%d)", (void*) *factorization,
+             (*factorization)->kind == FACTORIZATION_LU ? "lu" : "cholesky",
+             (*factorization)->factors->rows, (*factorization)->factors->columns);
+    return TRUE;
+}
+
+static PL_blob_t factorization_blob = {
+    PL_BLOB_MAGIC,
+    PL_BLOB_UNIQUE,
+    "factorizacion",
+    release_factorization_handle,
+    NULL,
+    write_factorization_handle,
+    NULL
+};
+
+/*
+    Unify a term with a new handle which owns the factorization. Returns SUCCESS or FAILURE
+*/
+static int unify_factorization_handle(term_t handle, Factorization* factorization) {
+    if (!factorization) {
+        return FAILURE;
+    }
+    return PL_unify_blob(handle, &factorization, sizeof(Factorization*), &factorization_blob);
+}
+
+/*
+    Obtain the factorization of a term: the one of a factorization handle, or a new LU
+    factorization of a matrix, which is also stored in owned so the caller frees it.
+    Returns NULL on failure
+*/
+static Factorization* get_factorization_from_term(term_t term, Factorization** owned) {
+    void* blob_data;
+    PL_blob_t* type;
+
+    *owned = NULL;
+    if (PL_get_blob(term, &blob_data, NULL, &type) && type == &factorization_blob) {
+        return *(Factorization**) blob_data;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    *owned = lu_factorization(get_strided_matrix_from_term(term, &arena));
+    arena_release(&arena);
+    return *owned;
+}
+
+/*
+  Foreign predicates to factorize a matrix and keep the factorization in a handle
+*/
+foreign_t pl_lu_factorization(term_t matrix, term_t factorization) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Factorization* f = lu_factorization(get_strided_matrix_from_term(matrix, &arena));
+    arena_release(&arena);
+    return unify_factorization_handle(factorization, f);
+}
+
+foreign_t pl_cholesky_factorization(term_t matrix, term_t factorization) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Factorization* f = cholesky_factorization(get_strided_matrix_from_term(matrix, &arena));
+    arena_release(&arena);
+    return unify_factorization_handle(factorization, f);
+}
+
+/*
+  Solve A X = B, where A is a matrix or a factorization handle and B has one column per system.
+  The result is unified as a list of lists or as a handle
+*/
+static foreign_t solve_system_common(term_t matrix, term_t right_hand_sides, term_t result, int as_handle) {
+    Factorization* owned;
+    Factorization* factorization = get_factorization_from_term(matrix, &owned);
+    if (!factorization) {
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* b = get_strided_matrix_from_term(right_hand_sides, &arena);
+    Matrix* x = b ? arena_new_matrix(&arena, b->rows, b->columns) : NULL;
+    int solved = x && solve_with_factorization(factorization, b, x);
+    free_factorization(owned);
+    if (!solved) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_matrix_result(result, x, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+foreign_t pl_solve_system(term_t matrix, term_t right_hand_sides, term_t result) {
+    return solve_system_common(matrix, right_hand_sides, result, 0);
+}
+
+foreign_t pl_solve_system_handle(term_t matrix, term_t right_hand_sides, term_t result) {
+    return solve_system_common(matrix, right_hand_sides, result, 1);
+}
+
+/*
+  Foreign predicate to obtain the determinant of a matrix or of a factorization handle
+*/
+foreign_t pl_determinant(term_t matrix, term_t determinant) {
+    Factorization* owned;
+    Factorization* factorization = get_factorization_from_term(matrix, &owned);
+    if (!factorization) {
+        PL_fail;
+    }
+    double value = factorization->singular ? 0.0 : factorization_determinant(factorization);
+    free_factorization(owned);
+    return PL_unify_float(determinant, value);
+}
+
+/*
+  Inverse of a matrix or of a factorization handle, solving A X = I.
+  The result is unified as a list of lists or as a handle
+*/
+static foreign_t inverse_common(term_t matrix, term_t result, int as_handle) {
+    Factorization* owned;
+    Factorization* factorization = get_factorization_from_term(matrix, &owned);
+    if (!factorization) {
+        PL_fail;
+    }
+    int n = factorization->factors->rows;
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* x = arena_new_matrix(&arena, n, n);
+    if (x) {
+        memset(x->data, 0, sizeof(double) * (size_t) n * n);
+        for (int i = 0; i < n; i++) {
+            ACCESS(x, i, i) = 1.0;
+        }
+    }
+    int solved = x && solve_with_factorization(factorization, x, x);
+    free_factorization(owned);
+    if (!solved) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_matrix_result(result, x, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+foreign_t pl_inverse(term_t matrix, term_t result) {
+    return inverse_common(matrix, result, 0);
+}
+
+foreign_t pl_inverse_handle(term_t matrix, term_t result) {
+    return inverse_common(matrix, result, 1);
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <SWI-Prolog.h>
 
 /*
@@ -11,42 +12,183 @@
     Returns a valid matrix pointer on success and NULL on failure
 */
 Matrix* new_matrix(int rows, int columns) {
+    return new_matrix_with_layout(rows, columns, MATRIX_LAYOUT_COLUMN_MAJOR);
+}
+
+/*
+    Create a new matrix whose values are stored by columns (MATRIX_LAYOUT_COLUMN_MAJOR) or by
+    rows (MATRIX_LAYOUT_ROW_MAJOR). Returns a valid matrix pointer on success and NULL on failure
+*/
+Matrix* new_matrix_with_layout(int rows, int columns, int layout) {
 
     if (rows <= 0 || columns <= 0) {
         return NULL;
     }
     // Allocate a matrix structure
-    Matrix* matrix = (Matrix *)malloc(sizeof(Matrix));
+    Matrix* matrix = pool_allocate_struct();
     if (matrix == NULL) {
-       fprintf(stderr, "Error, No es posible crea la matriz");
+        report_error("Error, no es posible crear la matriz\n");
         return NULL;
     }
-    matrix->rows = rows;
-    matrix->columns = columns;
-    // Allocate double array of size rows*columns
-    matrix->data = (double *)malloc(rows * columns * sizeof(double));
+    set_matrix_layout(matrix, rows, columns, layout);
+    // Allocate double array of size rows*columns, aligned to 64 bytes and reused from previous matrices when possible
+    matrix->data = (double *)pool_allocate((size_t)rows * columns * sizeof(double), &matrix->capacity);
 
     if (matrix->data == NULL) {
-        fprintf(stderr, "Error, no es posible crear la matriz");
-        free_matrix(matrix); // Free the allocated Matrix structure
+        report_error("Error, no es posible crear la matriz\n");
+        pool_release_struct(matrix); // Free the allocated Matrix structure
         return NULL;
     }
     return matrix;
 }
 
 /*
-    Free the memory of a matrix
+    Set the number of rows and columns of a matrix which owns its data, whose values are stored
+    by columns one after the other
+*/
+void set_matrix_shape(Matrix* matrix, int rows, int columns) {
+    matrix->rows = rows;
+    matrix->columns = columns;
+    matrix->row_stride = 1;
+    matrix->column_stride = (size_t) rows;
+}
+
+/*
+    Set the number of rows and columns of a matrix which owns its data, whose values are stored
+    by rows (MATRIX_LAYOUT_ROW_MAJOR) or by columns one after the other
+*/
+void set_matrix_layout(Matrix* matrix, int rows, int columns, int layout) {
+    set_matrix_shape(matrix, rows, columns);
+    if (layout == MATRIX_LAYOUT_ROW_MAJOR) {
+        matrix->row_stride = (size_t) columns;
+        matrix->column_stride = 1;
+    }
+}
+
+/*
+    Layout of the result of an element-wise operation (matrix2 is NULL for the operations with a
+    factor): the one of the operands when they share it, so the kernel reads and writes the three
+    matrices sequentially, otherwise by columns
+*/
+int elementwise_layout(Matrix* matrix1, Matrix* matrix2) {
+    int layout = matrix_layout(matrix1);
+    return layout == MATRIX_LAYOUT_ROW_MAJOR && (!matrix2 || matrix_layout(matrix2) == layout)
+           ? MATRIX_LAYOUT_ROW_MAJOR : MATRIX_LAYOUT_COLUMN_MAJOR;
+}
+
+/*
+    Layout of a product: by rows when both operands are stored by rows, because the result stored
+    by rows is the product of the transposes stored by columns (see matrices_multiplication), otherwise by columns
+*/
+int product_layout(Matrix* matrix1, Matrix* matrix2) {
+    return matrix_layout(matrix1) == MATRIX_LAYOUT_ROW_MAJOR && matrix_layout(matrix2) == MATRIX_LAYOUT_ROW_MAJOR
+           ? MATRIX_LAYOUT_ROW_MAJOR : MATRIX_LAYOUT_COLUMN_MAJOR;
+}
+
+/*
+    Layout of a transpose: the opposite of the one of the matrix, whose values are then already the
+    ones of the transpose in order
+*/
+int transpose_layout(Matrix* matrix) {
+    return matrix_layout(matrix) == MATRIX_LAYOUT_COLUMN_MAJOR ? MATRIX_LAYOUT_ROW_MAJOR : MATRIX_LAYOUT_COLUMN_MAJOR;
+}
+
+/*
+    Check whether the operands and the result of an element-wise operation have the same layout,
+    which is not strided, so the kernel can run over their data as flat arrays
+*/
+static int same_flat_layout(Matrix* matrix1, Matrix* matrix2, Matrix* result) {
+    int layout = matrix_layout(result);
+    return layout != MATRIX_LAYOUT_STRIDED && matrix_layout(matrix1) == layout &&
+           (!matrix2 || matrix_layout(matrix2) == layout);
+}
+
+/*
+    Free the memory of a matrix. While there are views of the matrix only the reference of
+    the caller is dropped, and the data is freed with the last one. Freeing a view drops its
+    reference to the parent
 */
 int free_matrix(Matrix* matrix) {
   if (!matrix) {
     return FAILURE;
   }
-  assert (matrix->data);
-  free(matrix->data);
-  free(matrix);
+  if (atomic_fetch_sub(&matrix->references, 1) > 0) {
+    return SUCCESS;
+  }
+  if (matrix->storage == MATRIX_STORAGE_VIEW) {
+    Matrix* parent = matrix->parent;
+    pool_release_struct(matrix);
+    return free_matrix(parent);
+  }
+  if (matrix->storage != MATRIX_STORAGE_POOL) {
+    unmap_matrix_file(matrix);
+  } else {
+    pool_release(matrix->data, matrix->capacity);
+  }
+  pool_release_struct(matrix);
   return SUCCESS;
 }
 
+typedef struct {
+    binary_kernel_t binary; // NULL for the operations with a factor
+    factor_kernel_t factor_kernel;
+    double factor;
+    Matrix* matrix1;
+    Matrix* matrix2;
+    Matrix* result;
+} StridedKernelJob;
+
+/*
+    Obtain count values of a column of a matrix, from first_row, as a contiguous array: the column
+    itself when its values are contiguous, or a copy in buffer for the views whose columns are strided
+*/
+static const double* column_values(Matrix* matrix, size_t column, size_t first_row, size_t count, double* buffer) {
+    const double* values = matrix->data + column * matrix->column_stride + first_row * matrix->row_stride;
+    if (matrix->row_stride == 1) {
+        return values;
+    }
+    for (size_t row = 0; row < count; row++) {
+        buffer[row] = values[row * matrix->row_stride];
+    }
+    return buffer;
+}
+
+/*
+    Run the kernel over the columns [begin, end) of the operands, in blocks of VIEW_BLOCK rows
+*/
+static void strided_kernel_task(void* context, size_t begin, size_t end) {
+    StridedKernelJob* job = context;
+    size_t rows = (size_t) job->result->rows;
+    double buffer1[VIEW_BLOCK], buffer2[VIEW_BLOCK];
+    for (size_t column = begin; column < end; column++) {
+        double* result = job->result->data + column * job->result->column_stride;
+        for (size_t first = 0; first < rows; first += VIEW_BLOCK) {
+            size_t count = rows - first < VIEW_BLOCK ? rows - first : VIEW_BLOCK;
+            const double* values1 = column_values(job->matrix1, column, first, count, buffer1);
+            if (job->binary) {
+                job->binary(values1, column_values(job->matrix2, column, first, count, buffer2), result + first, count);
+            } else {
+                job->factor_kernel(values1, job->factor, result + first, count);
+            }
+        }
+    }
+}
+
+/*
+    Run an element-wise kernel over operands which can be views, column by column. The result
+    is a matrix which owns its data. A result stored by rows is written as its transpose, whose
+    columns are the rows of the result
+*/
+static void strided_kernel(StridedKernelJob* job) {
+    Matrix transpose1, transpose2, transpose_result;
+    if (matrix_layout(job->result) == MATRIX_LAYOUT_ROW_MAJOR) {
+        job->matrix1 = describe_transpose(job->matrix1, &transpose1);
+        job->matrix2 = job->matrix2 ? describe_transpose(job->matrix2, &transpose2) : NULL;
+        job->result = describe_transpose(job->result, &transpose_result);
+    }
+    parallel_for((size_t) job->result->columns, PARALLEL_GRAIN / job->result->rows + 1, strided_kernel_task, job);
+}
+
 /*
     Add two matrices and returns Success if everything goes or 0 for failure.
 */
@@ -59,16 +201,17 @@ int matrices_addition(Matrix *matrix1, Matrix *matrix2, Matrix *result){
 
 // Check all the matrices has the same dimensions
      if (do_matrices_have_same_dimensions(matrix1, matrix2) == FAILURE) {
-        printf("Para realizar la suma, asegúrate que ambas matrices tienen el mismo número de filas que de columnas\n");
+        report_error("Para realizar la suma, asegúrate que ambas matrices tienen el mismo número de filas que de columnas\n");
         return FAILURE;
         }
 
-    for (int row = 0; row < result->rows; row++) {
-        for (int column = 0; column < result->columns; column++) {
-        
-            ACCESS(result, row, column) = ACCESS(matrix1, row, column) + ACCESS(matrix2, row, column);
-        }
+    if (same_flat_layout(matrix1, matrix2, result)) {
+        parallel_binary_kernel(kernels->add, matrix1->data, matrix2->data, result->data, (size_t)matrix1->rows * matrix1->columns);
+    } else {
+        StridedKernelJob job = { kernels->add, NULL, 0.0, matrix1, matrix2, result };
+        strided_kernel(&job);
     }
+    set_structure_of_sum(matrix1, matrix2, result);
     return SUCCESS;
 }   
 /*
@@ -81,21 +224,27 @@ int matrices_substraction(Matrix *matrix1, Matrix *matrix2, Matrix *result)
     }
     // Check all the matrices has the same dimensions
     if (do_matrices_have_same_dimensions(matrix1, matrix2) == FAILURE){
-        printf("Para realizar la resta, asegúrate que ambas matrices tienen el mismo número de filas que de columnas\n");
+        report_error("Para realizar la resta, asegúrate que ambas matrices tienen el mismo número de filas que de columnas\n");
         return FAILURE;
         }
 
-    for (int row = 0; row < result->rows; row++){
-        for (int column = 0; column < result->columns; column++){
-        
-            ACCESS(result, row, column) = ACCESS(matrix1, row, column)- ACCESS(matrix2, row, column);
-        }
+    if (same_flat_layout(matrix1, matrix2, result)) {
+        parallel_binary_kernel(kernels->substract, matrix1->data, matrix2->data, result->data, (size_t)matrix1->rows * matrix1->columns);
+    } else {
+        StridedKernelJob job = { kernels->substract, NULL, 0.0, matrix1, matrix2, result };
+        strided_kernel(&job);
     }
+    set_structure_of_sum(matrix1, matrix2, result);
     return SUCCESS; 
 }
 
 /*
-    Multiply two matrices with valid dimensions. Returns 
+    Multiply two matrices with valid dimensions. Returns SUCCESS or FAILURE.
+    Products of diagonal, banded, triangular or identity matrices use their structure (matricesStructure.c),
+    otherwise small products use the triple loop and large ones the blocked kernel of matricesGemm.c
+    or, if it has been selected, the Strassen-Winograd algorithm of matricesStrassen.c.
+    The views are multiplied by the blocked kernel, which packs them from the data of their parents,
+    and so are the operands of different layouts, whose strides tell the kernel which one is transposed
 */
 int matrices_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix* result) {
 
@@ -105,11 +254,43 @@ int matrices_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix* result) {
     }
     // Check the dimensions are compatible
     if (matrix1->columns != matrix2->rows) {
-        printf("Para realizar la multiplicación, asegúrate de que el número de columnas de "
+        report_error("Para realizar la multiplicación, asegúrate de que el número de columnas de "
        "la primera matriz: %d sea igual al número de filas de la segunda: %d\n", 
         matrix1->columns, matrix2->rows);
         return FAILURE;
     }
+    // A result stored by rows is the product of the transposes, B^T A^T, stored by columns. Swapping
+    // the strides of the three matrices lets two operands stored by rows use the paths below
+    if (matrix_layout(result) == MATRIX_LAYOUT_ROW_MAJOR) {
+        Matrix transpose1, transpose2, transpose_result;
+        if (matrices_multiplication(describe_transpose(matrix2, &transpose2), describe_transpose(matrix1, &transpose1),
+                                    describe_transpose(result, &transpose_result)) == FAILURE) {
+            return FAILURE;
+        }
+        set_structure_of_product(matrix1, matrix2, result);
+        return SUCCESS;
+    }
+    int contiguous = is_matrix_contiguous(matrix1) && is_matrix_contiguous(matrix2);
+    if (contiguous && structured_multiplication(matrix1, matrix2, result) == SUCCESS) {
+        set_structure_of_product(matrix1, matrix2, result);
+        return SUCCESS;
+    }
+    // Large products go to the Strassen-Winograd algorithm when it has been selected
+    if (contiguous && strassen_multiplication(matrix1, matrix2, result) == SUCCESS) {
+        set_structure_of_product(matrix1, matrix2, result);
+        return SUCCESS;
+    }
+    // or to the blocked kernel, which keeps the blocks in cache
+    if ((double)matrix1->rows * matrix2->columns * matrix1->columns >= GEMM_THRESHOLD) {
+        if (gemm_strided(matrix1->rows, matrix2->columns, matrix1->columns, 1.0,
+                         matrix1->data, matrix1->row_stride, matrix1->column_stride,
+                         matrix2->data, matrix2->row_stride, matrix2->column_stride,
+                         0.0, result->data, result->rows) == FAILURE) {
+            return FAILURE;
+        }
+        set_structure_of_product(matrix1, matrix2, result);
+        return SUCCESS;
+    }
     for (int row = 0; row < result->rows; row++){
         for (int column = 0; column < result->columns; column++){
             double value = 0;
@@ -119,6 +300,7 @@ int matrices_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix* result) {
             ACCESS(result, row, column) = value;
         }
     }
+    set_structure_of_product(matrix1, matrix2, result);
     return SUCCESS;
 }
 
@@ -134,11 +316,23 @@ int matrix_transpose(Matrix* matrix, Matrix* result) {
   if (matrix->rows != result->columns || matrix->columns != result->rows){
     return FAILURE;
   }
-    for (int row = 0; row < matrix->rows; row++) {
-        for (int column = 0; column < matrix->columns; column++) {
-            ACCESS(result, column, row) = ACCESS(matrix, row, column);
-        }
-    }
+  int layout = matrix_layout(matrix);
+  int result_layout = matrix_layout(result);
+  if (layout != MATRIX_LAYOUT_STRIDED && result_layout != MATRIX_LAYOUT_STRIDED && layout != result_layout) {
+    // The values of a matrix stored by rows are the ones of its transpose stored by columns, and the other way round
+    memcpy(result->data, matrix->data, (size_t) matrix->rows * matrix->columns * sizeof(double));
+  } else if (result_layout == MATRIX_LAYOUT_ROW_MAJOR) {
+    // and the values of the transpose stored by rows are the ones of the matrix stored by columns
+    copy_strided_values(matrix->data, matrix->row_stride, matrix->column_stride, matrix->rows, matrix->columns,
+                        result->data);
+  } else if (is_matrix_contiguous(matrix)) {
+    transpose_values(matrix->data, matrix->rows, matrix->columns, result->data);
+  } else {
+    // The transpose of a view is the copy of the view with the strides swapped
+    copy_strided_values(matrix->data, matrix->column_stride, matrix->row_stride, matrix->columns, matrix->rows,
+                        result->data);
+  }
+  set_structure_of_transpose(matrix, result);
   return SUCCESS;
 }
 
@@ -152,15 +346,25 @@ int calculate_dot_product(Matrix* vector1, Matrix* vector2, double* result) {
     if (!vector1 || !vector2 || !result) {
         return FAILURE;
     }
-    // Check that the dimension fo the vectors are valid
-    if (vector1->columns != vector2->columns || vector1->rows != 1 || vector2->rows != 1) {
-        printf("Debe de ser vectores que tengan el mismo número de elementos"); 
+    // Check that the dimension fo the vectors are valid. A vector can have one row or one column
+    size_t length = (size_t) vector1->rows * vector1->columns;
+    if ((vector1->rows != 1 && vector1->columns != 1) || (vector2->rows != 1 && vector2->columns != 1) ||
+        length != (size_t) vector2->rows * vector2->columns) {
+        report_error("Debe de ser vectores que tengan el mismo número de elementos"); 
         return FAILURE;
     }
-    *result = 0; 
-    for (int current_column = 0; current_column < vector1->columns; current_column++) {
-        *result += ACCESS(vector1, 0, current_column) * ACCESS(vector2, 0, current_column);
+    // The values of a vector which is a view (a row, a column or a diagonal) are a fixed stride apart
+    size_t stride1 = vector1->rows == 1 ? vector1->column_stride : vector1->row_stride;
+    size_t stride2 = vector2->rows == 1 ? vector2->column_stride : vector2->row_stride;
+    if (stride1 == 1 && stride2 == 1) {
+        *result = parallel_dot(vector1->data, vector2->data, length);
+        return SUCCESS;
+    }
+    double value = 0.0;
+    for (size_t i = 0; i < length; i++) {
+        value += vector1->data[i * stride1] * vector2->data[i * stride2];
     }
+    *result = value;
     return SUCCESS;
 }
 
@@ -173,29 +377,19 @@ int obtain_maximum_value_from_matrix(Matrix* matrix, double* maximum_value) {
     if (!matrix || !maximum_value) {
         return FAILURE;
     }
-    for (int row = 0; row < matrix->rows; row++) {
-        for (int column = 0; column < matrix->columns; column++) {
-            if (ACCESS(matrix, row, column) > *maximum_value) {
-                *maximum_value = ACCESS(matrix, row, column);
-            }
-        }
+    Reduction reduction;
+    if (reduce_matrix(matrix, REDUCTION_ALL, REDUCTION_MAXIMUM, &reduction) == FAILURE) {
+        return FAILURE;
     }
+    *maximum_value = reduction.maximum;
     return SUCCESS;
 }
 /*
    Check if a matrix is diagonal. This is is a matrix in which the entries outside the main diagonal are all zero  
-   If possible, it returns SUCCESS, otherwise FAILURE.
+   If possible, it returns SUCCESS, otherwise FAILURE. The answer comes from the structure flags of the matrix
 */
 int is_matrix_diagonal(Matrix* matrix) {
-    if (!matrix || matrix->rows != matrix->columns) {
-        return FAILURE;
-    }
-  for (int row = 0; row < matrix->rows; row++)
-    for (int column = 0; column < matrix->columns; column++)
-      if (row != column && ACCESS(matrix, row, column) != 0.0)
-            return FAILURE;
-
-  return SUCCESS;
+    return has_matrix_structure(matrix, MATRIX_DIAGONAL) ? SUCCESS : FAILURE;
 }
 
 /*
@@ -206,11 +400,13 @@ int multiply_matrix_by_factor(Matrix* matrix, double* factor, Matrix* result) {
     if (!matrix || !result) {
         return FAILURE;
     }
-    for (int row = 0; row < matrix->rows; row++) {
-        for (int column = 0; column < matrix->columns; column++) {
-            ACCESS(result, row, column) = ACCESS(matrix, row, column) * (*factor);
-        }
+    if (same_flat_layout(matrix, NULL, result)) {
+        parallel_factor_kernel(kernels->multiply, matrix->data, *factor, result->data, (size_t)matrix->rows * matrix->columns);
+    } else {
+        StridedKernelJob job = { NULL, kernels->multiply, *factor, matrix, NULL, result };
+        strided_kernel(&job);
     }
+    set_structure_of_scaling(matrix, *factor, result);
     return SUCCESS;
 }
 
@@ -221,15 +417,17 @@ int divide_matrix_by_factor(Matrix* matrix, double *factor, Matrix* result) {
     if (!matrix || !factor || !result) {
         return FAILURE;
     }
-    if (factor == 0) {
-        printf("No es posible dividir los valores entre 0\n"); 
+    if (*factor == 0) {
+        report_error("No es posible dividir los valores entre 0\n"); 
         return FAILURE;
     }
-    for (int row = 0; row < matrix->rows; row++) {
-        for (int column = 0; column < matrix->columns; column++) {
-            ACCESS(result, row, column) = ACCESS(matrix, row, column) / (*factor);
-        }
+    if (same_flat_layout(matrix, NULL, result)) {
+        parallel_factor_kernel(kernels->divide, matrix->data, *factor, result->data, (size_t)matrix->rows * matrix->columns);
+    } else {
+        StridedKernelJob job = { NULL, kernels->divide, *factor, matrix, NULL, result };
+        strided_kernel(&job);
     }
+    set_structure_of_scaling(matrix, *factor, result);
     return SUCCESS;
 }
 
@@ -237,12 +435,11 @@ int sum_elements_from_matrix(Matrix* matrix, double* result) {
     if (!matrix || !result) {
         return FAILURE;
     }
-    *result = 0;
-    for (int row = 0; row < matrix->rows; row++) {
-        for (int column = 0; column < matrix->columns; column++) {
-            *result += ACCESS(matrix, row, column);
-        }
+    Reduction reduction;
+    if (reduce_matrix(matrix, REDUCTION_ALL, REDUCTION_SUM, &reduction) == FAILURE) {
+        return FAILURE;
     }
+    *result = reduction_sum(&reduction, 0);
     return SUCCESS;
 }
 
@@ -250,21 +447,28 @@ int sum_elements_from_matrix(Matrix* matrix, double* result) {
    This matrix is an upper triangular matrix when all the elements below the main diagonal are zero.
 */
 int is_upper_triangular_matrix(Matrix* matrix) {
-    if (!matrix) {
-        return FAILURE;
-    }
-    if (matrix->rows != matrix->columns) {
-        return FAILURE;
-    }
-    
-    for (int row = 0; row < matrix->rows; row++) {
-        for (int column = 0; column < matrix->columns; column++) {
-            if ((row > column && ACCESS(matrix, row, column) != 0)) {
-                return FAILURE;
-            }
-        }
-    }
-    return SUCCESS;
+    return has_matrix_structure(matrix, MATRIX_UPPER_TRIANGULAR) ? SUCCESS : FAILURE;
+}
+
+/*
+   This matrix is a lower triangular matrix when all the elements above the main diagonal are zero.
+*/
+int is_lower_triangular_matrix(Matrix* matrix) {
+    return has_matrix_structure(matrix, MATRIX_LOWER_TRIANGULAR) ? SUCCESS : FAILURE;
+}
+
+/*
+   Check if a matrix is equal to its transpose
+*/
+int is_matrix_symmetric(Matrix* matrix) {
+    return has_matrix_structure(matrix, MATRIX_SYMMETRIC) ? SUCCESS : FAILURE;
+}
+
+/*
+   Check if a matrix is the identity matrix
+*/
+int is_identity_matrix(Matrix* matrix) {
+    return has_matrix_structure(matrix, MATRIX_IDENTITY) ? SUCCESS : FAILURE;
 }
 
 /*
@@ -290,103 +494,214 @@ int do_matrices_have_same_dimensions(Matrix* matrix1, Matrix* matrix2) {
 
 /**********************************************/
 /* 
-    Parse a list of lists representing a term in SWI-Prolog into a matrix struct.
+    Parse a list of lists representing a term in SWI-Prolog into a matrix struct, whose values are
+    stored by rows so they are written in the order they are read.
     Returns valid matrix pointer on success and NULL on failure
 */
 
 Matrix* parse_list_of_lists_into_matrix(term_t tList) {
-    int number_rows = 0; 
-    int number_columns = 0;
-   
-    if (get_correct_dimensions(tList, &number_rows, &number_columns) ==  FAILURE){
-        return NULL; 
-    }
-     Matrix* matrix = new_matrix(number_rows, number_columns); 
-    // Check that the matrix is not null 
-    if (!matrix) {
-        return NULL; 
+    size_t number_rows = 0;
+    size_t number_columns = 0;
+
+    // Only the spine of the outer list and of the first row are walked to know the dimensions
+    if (PL_skip_list(tList, 0, &number_rows) != PL_LIST || number_rows == 0) {
+        report_error("No se trata de una lista\n");
+        return NULL;
     }
+    if (number_rows > INT_MAX) {
+        report_error("La matriz tiene demasiadas filas\n");
+        return NULL;
+    }
+    fid_t frame = PL_open_foreign_frame(); // The term references below are discarded when the frame is closed
     term_t tTail = PL_copy_term_ref(tList);
-    term_t tHead = PL_new_term_ref();
-    int current_row = 0;
-
-    while (PL_get_list(tTail, tHead, tTail)) {
-
-        if (!PL_is_list(tHead)) { // Check if the current element is a list
-        printf("No se está pasando correctamente una lista de elementos\n");
+    term_t tRow = PL_new_term_ref();
+    term_t tRowTail = PL_new_term_ref();
+    term_t tValue = PL_new_term_ref();
+
+    PL_get_list(tList, tRow, tRowTail);
+    if (PL_skip_list(tRow, 0, &number_columns) != PL_LIST || number_columns == 0 || number_columns > INT_MAX) {
+        report_error("No se está pasando correctamente una lista de elementos\n");
+        PL_close_foreign_frame(frame);
         return NULL;
-            }
-
-        term_t inner_tail = PL_copy_term_ref(tHead);
-        term_t inner_head = PL_new_term_ref();
+    }
+    Matrix* matrix = new_matrix_with_layout((int) number_rows, (int) number_columns, MATRIX_LAYOUT_ROW_MAJOR);
+    // Check that the matrix is not null
+    if (!matrix) {
+        PL_close_foreign_frame(frame);
+        return NULL;
+    }
 
-        int integer_value; // The input could be an integer
-        double double_value; // The input could be a double
+    // Single pass over the values: the shape of every row is checked while it is read, and the
+    // row is hashed for the result cache while it is still in the cache of the processor
+    const char* error = NULL;
+    double* values = matrix->data;
+    int hashing = result_cache_enabled();
+    ValuesHash hash;
+    begin_values_hash(&hash);
+    while (!error && PL_get_list(tTail, tRow, tTail)) {
         int current_column = 0;
+        double value;
 
-        while (PL_get_list(inner_tail, inner_head, inner_tail)) {
-            if (PL_get_integer(inner_head, &integer_value)) {
-                ACCESS(matrix, current_row, current_column) = (double) integer_value;
-                current_column++;
-
-            } else if (PL_get_float(inner_head, &double_value)) {
-                ACCESS(matrix, current_row, current_column) = double_value;
-                current_column++;
-
-            } else {
-                printf("Asegúrate que todos los valores que se introduce a la matriz son valores numéricos\n");
-                return NULL;
+        if (!PL_is_list(tRow)) { // Check if the current element is a list
+            error = "No se está pasando correctamente una lista de elementos\n";
+            break;
+        }
+        PL_put_term(tRowTail, tRow);
+        while (PL_get_list(tRowTail, tValue, tRowTail)) {
+            if (current_column == matrix->columns) {
+                error = "La matriz no tiene el mismo número de columnas en todas las filas\n";
+                break;
+            }
+            // Integers, big integers and floats are all converted to double by a single call
+            if (!PL_get_float(tValue, &value)) {
+                error = "Asegúrate que todos los valores que se introduce a la matriz son valores numéricos\n";
+                break;
             }
+            *values++ = value;
+            current_column++;
         }
-        current_row++;
+        if (!error && (current_column != matrix->columns || !PL_get_nil(tRowTail))) {
+            error = "La matriz no tiene el mismo número de columnas en todas las filas\n";
         }
-
-        return matrix;
+        if (!error && hashing) {
+            hash_values(&hash, values - matrix->columns, (size_t) matrix->columns, 1, MATRIX_TYPE_F64);
+        }
+    }
+    PL_close_foreign_frame(frame);
+    if (error) {
+        report_error("%s", error);
+        free_matrix(matrix);
+        return NULL;
+    }
+    if (hashing) {
+        finish_values_hash(&hash, matrix);
     }
+    return matrix;
+}
 
 /*
     Parse a matrix struct into a list of lists. Returns SUCCESS if the operation is successful (if it is possible to unify the result with the list of lists), 
     otherwise returns FAILURE
 */
 int parse_matrix_into_list_of_lists(Matrix* matrix, term_t resutltListofLists) {
+    return unify_matrix_with_term(matrix, resutltListofLists, MATRIX_FORMAT_ROWS);
+}
+
+/*
+    Unify a term with the values of a matrix in one of the output formats:
+      - MATRIX_FORMAT_ROWS: a list of lists, one list per row
+      - MATRIX_FORMAT_FLAT: a single list with the values row by row
+      - MATRIX_FORMAT_COMPOUND: matrix(Rows, Columns, Values) with the values row by row
+    The term is written directly, cell by cell, so the number of term references does not
+    depend on the size of the matrix. The values of a matrix stored by rows are read in order.
+    Returns SUCCESS or FAILURE
+*/
+int unify_matrix_with_term(Matrix* matrix, term_t result, int format) {
     if (!matrix || !matrix->data || !matrix->rows || !matrix->columns) {
         return FAILURE; 
     }
-    term_t tLists = PL_new_term_refs(matrix->rows); // These are consecutive references for all the lists. Each list represnts a row of the matrix
-
-    for (int current_row = 0; current_row < matrix->rows; current_row++) {
-        if (assign_matrix_row_values_to_list(matrix, tLists + current_row, current_row) == FAILURE) {
-            return FAILURE;
+    fid_t frame = PL_open_foreign_frame();
+    term_t tList = PL_copy_term_ref(result);
+    term_t tHead = PL_new_term_ref();
+    term_t tRow = PL_new_term_ref();
+    int unified = TRUE;
+
+    if (format == MATRIX_FORMAT_COMPOUND) {
+        unified = PL_unify_functor(result, matrix_functor) &&
+                  PL_get_arg(1, result, tHead) && PL_unify_integer(tHead, matrix->rows) &&
+                  PL_get_arg(2, result, tHead) && PL_unify_integer(tHead, matrix->columns) &&
+                  PL_get_arg(3, result, tList);
+    }
+    for (int current_row = 0; unified && current_row < matrix->rows; current_row++) {
+        // In the rows format each row is a new list, otherwise the values go on the same list
+        term_t tValues = tList;
+        if (format == MATRIX_FORMAT_ROWS) {
+            unified = PL_unify_list(tList, tRow, tList);
+            tValues = tRow;
         }
-    }
-    term_t allLists = PL_new_term_ref(); // This concatenates all the lists of for the rows into a single list makin a lists of lists. It has to be in ord
-    PL_put_nil(allLists); // Make the the empty list
-    for (int i = matrix->rows - 1; i >= 0; i--){ 
-        if (!PL_cons_list(allLists, tLists + i, allLists)) {
-            return FAILURE;
+        for (int current_column = 0; unified && current_column < matrix->columns; current_column++) {
+            // The integers of the typed matrices are unified as integers
+            unified = PL_unify_list(tValues, tHead, tValues) &&
+                      (matrix->element_type == MATRIX_TYPE_F64 ?
+                       PL_unify_float(tHead, ACCESS(matrix, current_row, current_column)) :
+                       unify_typed_value(tHead, matrix, current_row, current_column));
+        }
+        if (format == MATRIX_FORMAT_ROWS) {
+            unified = unified && PL_unify_nil(tRow);
         }
     }
-    return PL_unify(resutltListofLists, allLists);
+    unified = unified && PL_unify_nil(tList);
+    PL_close_foreign_frame(frame);
+    return unified ? SUCCESS : FAILURE;
 }
+
 /*
-    Pass the values of the a row of a struct matrix into a list. Returns SUCCESS if the operation is successful, otherwise FAILURE
+    Unify a list with the values of a row of a struct matrix. Returns SUCCESS if the operation is successful, otherwise FAILURE
 */
 
 int assign_matrix_row_values_to_list(Matrix* matrix, term_t tList, int current_row) {
     if (!matrix) {
         return FAILURE;
     }
-    PL_put_nil(tList); // Concatenate the list of values for a row
-    term_t current_value = PL_new_term_ref(); // Current double value of a row of the matrix
-    for (int current_column = matrix -> columns - 1; current_column >= 0; current_column--) {
-        if (!PL_put_float(current_value, ACCESS(matrix, current_row, current_column))) {
+    term_t tTail = PL_copy_term_ref(tList);
+    term_t current_value = PL_new_term_ref(); // Cell of the list for the current value of the row
+    for (int current_column = 0; current_column < matrix->columns; current_column++) {
+        if (!PL_unify_list(tTail, current_value, tTail) ||
+            !(matrix->element_type == MATRIX_TYPE_F64 ?
+              PL_unify_float(current_value, ACCESS(matrix, current_row, current_column)) :
+              unify_typed_value(current_value, matrix, current_row, current_column))) {
             return FAILURE;
         }
-        if (!PL_cons_list(tList, current_value, tList)) {
-            return FAILURE;
+    }
+    return PL_unify_nil(tTail) ? SUCCESS : FAILURE;
+}
+
+/*
+    Parse a term matrix(Rows, Columns, Values), where Values is a list with the values
+    row by row, into a matrix struct stored by rows. Returns valid matrix pointer on success and NULL on failure
+*/
+Matrix* parse_matrix_compound(term_t tMatrix) {
+    int rows, columns;
+    fid_t frame = PL_open_foreign_frame();
+    term_t tArgument = PL_new_term_ref();
+    term_t tValue = PL_new_term_ref();
+
+    if (!PL_get_arg(1, tMatrix, tArgument) || !PL_get_integer(tArgument, &rows) ||
+        !PL_get_arg(2, tMatrix, tArgument) || !PL_get_integer(tArgument, &columns) ||
+        !PL_get_arg(3, tMatrix, tArgument)) {
+        report_error("El término debe ser de la forma matrix(Filas, Columnas, Valores)\n");
+        PL_close_foreign_frame(frame);
+        return NULL;
+    }
+    Matrix* matrix = new_matrix_with_layout(rows, columns, MATRIX_LAYOUT_ROW_MAJOR);
+    if (!matrix) {
+        PL_close_foreign_frame(frame);
+        return NULL;
+    }
+    size_t total = (size_t) rows * columns;
+    size_t index = 0;
+    double value;
+    int hashing = result_cache_enabled();
+    ValuesHash hash;
+    begin_values_hash(&hash);
+    while (index < total && PL_get_list(tArgument, tValue, tArgument) && PL_get_float(tValue, &value)) {
+        matrix->data[index++] = value;
+        // Each row is hashed for the result cache as soon as it is complete
+        if (hashing && index % columns == 0) {
+            hash_values(&hash, matrix->data + index - columns, (size_t) columns, 1, MATRIX_TYPE_F64);
         }
-    }    
-    return SUCCESS;    
+    }
+    int correct = index == total && PL_get_nil(tArgument);
+    PL_close_foreign_frame(frame);
+    if (!correct) {
+        report_error("La lista de valores debe tener %d x %d valores numéricos\n", rows, columns);
+        free_matrix(matrix);
+        return NULL;
+    }
+    if (hashing) {
+        finish_values_hash(&hash, matrix);
+    }
+    return matrix;
 }
 
 /*
@@ -404,14 +719,14 @@ int get_correct_dimensions(term_t tList, int* rows, int* columns) {
 
     // Check if the outer term is a list
     if (!PL_is_list(tList)) {
-        printf("No se trata de una lista\n"); 
+        report_error("No se trata de una lista\n"); 
         return FAILURE;
     }
     // Iterate over the list
     while (PL_get_list(tail, head, tail)) {
 
         if (!PL_is_list(head)) {
-            printf(" No se trata de una list \n");
+            report_error(" No se trata de una list \n");
             return FAILURE;
         }
 
@@ -429,7 +744,7 @@ int get_correct_dimensions(term_t tList, int* rows, int* columns) {
         }
         // If the current row has a different number of columns than previous rows, it's not a valid matrix
         if (current_columns != total_columns) {
-            printf("La matriz no tiene el mismo número de columnas en todas las filas\n");
+            report_error("La matriz no tiene el mismo número de columnas en todas las filas\n");
             return FAILURE;
             }
 
@@ -0,0 +1,309 @@
+#include "definitions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the memory of the matrices.
+    - Data buffers are aligned to 64 bytes and grouped in size classes (four classes
+      per power of two). When a matrix is freed its buffer is kept in the free list
+      of its class, so the next matrix of a similar size reuses it instead of calling
+      malloc. At most POOL_MAX_CACHED_BYTES are kept in the free lists.
+    - Matrix structs are also kept in a free list.
+    - A MatrixArena collects the matrices created during a foreign call and frees all
+      of them when the call finishes.
+*/
+
+typedef struct {
+    pthread_mutex_t lock;
+    void* free_buffers[POOL_CLASSES]; // free lists of data buffers, linked through their first bytes
+    Matrix* free_structs; // free list of Matrix structs, linked through their data pointer
+    size_t cached_bytes; // bytes kept in the free lists
+    MemoryStatistics statistics;
+} MemoryPool;
+
+static MemoryPool memory_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Last version given to the contents of a matrix
+static atomic_uint_fast64_t last_matrix_version = 0;
+
+/*
+    Obtain the size class of a buffer of the given number of bytes and the size of the
+    buffers of that class. Returns -1 when the buffer is too big to be kept in the pool
+*/
+static int size_class(size_t bytes, size_t* class_bytes) {
+    if (bytes <= POOL_MIN_BYTES) {
+        *class_bytes = POOL_MIN_BYTES;
+        return 0;
+    }
+    int exponent = 63 - __builtin_clzll((unsigned long long)(bytes - 1)); // 2^exponent < bytes <= 2^(exponent + 1)
+    size_t step = (size_t) 1 << (exponent - 2);
+    size_t rounded = (bytes + step - 1) & ~(step - 1);
+    int index = 1 + (exponent - 6) * 4 + (int)(rounded / step - 5);
+    *class_bytes = rounded;
+    if (rounded > POOL_MAX_BUFFER_BYTES || index >= POOL_CLASSES) {
+        return -1;
+    }
+    return index;
+}
+
+/*
+    Obtain a data buffer of at least the given number of bytes, aligned to 64 bytes.
+    Stores the real size of the buffer in capacity. Returns NULL on failure
+*/
+void* pool_allocate(size_t bytes, size_t* capacity) {
+    size_t class_bytes;
+    int index = size_class(bytes, &class_bytes);
+    void* buffer = NULL;
+
+    pthread_mutex_lock(&memory_pool.lock);
+    memory_pool.statistics.allocations++;
+    if (index >= 0 && memory_pool.free_buffers[index]) {
+        buffer = memory_pool.free_buffers[index];
+        memory_pool.free_buffers[index] = *(void**) buffer;
+        memory_pool.cached_bytes -= class_bytes;
+        memory_pool.statistics.reused++;
+    }
+    pthread_mutex_unlock(&memory_pool.lock);
+
+    if (!buffer) {
+        // aligned_alloc needs a size multiple of the alignment, the small classes are not
+        buffer = aligned_alloc(POOL_ALIGNMENT, (class_bytes + POOL_ALIGNMENT - 1) & ~(size_t)(POOL_ALIGNMENT - 1));
+        if (!buffer) {
+            statistics_record_failure(STATISTICS_FAILURE_MEMORY);
+            return NULL;
+        }
+        pthread_mutex_lock(&memory_pool.lock);
+        memory_pool.statistics.system_allocations++;
+        memory_pool.statistics.system_bytes += class_bytes;
+        pthread_mutex_unlock(&memory_pool.lock);
+    }
+
+    pthread_mutex_lock(&memory_pool.lock);
+    memory_pool.statistics.bytes_in_use += class_bytes;
+    memory_pool.statistics.allocated_bytes += class_bytes;
+    if (memory_pool.statistics.bytes_in_use > memory_pool.statistics.peak_bytes) {
+        memory_pool.statistics.peak_bytes = memory_pool.statistics.bytes_in_use;
+    }
+    pthread_mutex_unlock(&memory_pool.lock);
+    if (statistics_enabled) {
+        statistics_record_allocation(class_bytes);
+    }
+    *capacity = class_bytes;
+    return buffer;
+}
+
+/*
+    Give back a buffer obtained with pool_allocate. It is kept for reuse if the pool
+    has room for it, otherwise it is freed
+*/
+void pool_release(void* buffer, size_t capacity) {
+    if (!buffer) {
+        return;
+    }
+    size_t class_bytes;
+    int index = size_class(capacity, &class_bytes);
+
+    pthread_mutex_lock(&memory_pool.lock);
+    memory_pool.statistics.releases++;
+    memory_pool.statistics.bytes_in_use -= capacity;
+    if (index >= 0 && memory_pool.cached_bytes + capacity <= POOL_MAX_CACHED_BYTES) {
+        *(void**) buffer = memory_pool.free_buffers[index];
+        memory_pool.free_buffers[index] = buffer;
+        memory_pool.cached_bytes += capacity;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&memory_pool.lock);
+    free(buffer);
+}
+
+/*
+    Obtain a Matrix struct. Returns NULL on failure
+*/
+Matrix* pool_allocate_struct(void) {
+    Matrix* matrix = NULL;
+
+    pthread_mutex_lock(&memory_pool.lock);
+    if (memory_pool.free_structs) {
+        matrix = memory_pool.free_structs;
+        memory_pool.free_structs = (Matrix*) matrix->data;
+    }
+    pthread_mutex_unlock(&memory_pool.lock);
+
+    if (!matrix) {
+        matrix = (Matrix*) malloc(sizeof(Matrix));
+    }
+    if (matrix) {
+        memset(matrix, 0, sizeof(Matrix));
+        renew_matrix_version(matrix);
+    }
+    return matrix;
+}
+
+/*
+    Give a new version to the contents of a matrix, so the results cached for the old ones are
+    not used. The versions are never repeated, not even by the structs which are reused
+*/
+void renew_matrix_version(Matrix* matrix) {
+    matrix->version = atomic_fetch_add(&last_matrix_version, 1) + 1;
+}
+
+/*
+    Give back a Matrix struct obtained with pool_allocate_struct
+*/
+void pool_release_struct(Matrix* matrix) {
+    pthread_mutex_lock(&memory_pool.lock);
+    matrix->data = (double*) memory_pool.free_structs;
+    memory_pool.free_structs = matrix;
+    pthread_mutex_unlock(&memory_pool.lock);
+}
+
+/*
+    Free all the buffers and structs kept for reuse
+*/
+void pool_trim(void) {
+    pthread_mutex_lock(&memory_pool.lock);
+    for (int index = 0; index < POOL_CLASSES; index++) {
+        void* buffer = memory_pool.free_buffers[index];
+        while (buffer) {
+            void* next = *(void**) buffer;
+            free(buffer);
+            buffer = next;
+        }
+        memory_pool.free_buffers[index] = NULL;
+    }
+    memory_pool.cached_bytes = 0;
+    Matrix* matrix = memory_pool.free_structs;
+    while (matrix) {
+        Matrix* next = (Matrix*) matrix->data;
+        free(matrix);
+        matrix = next;
+    }
+    memory_pool.free_structs = NULL;
+    pthread_mutex_unlock(&memory_pool.lock);
+}
+
+/*
+    Copy the allocation statistics
+*/
+void get_memory_statistics(MemoryStatistics* statistics) {
+    pthread_mutex_lock(&memory_pool.lock);
+    *statistics = memory_pool.statistics;
+    statistics->cached_bytes = memory_pool.cached_bytes;
+    pthread_mutex_unlock(&memory_pool.lock);
+}
+
+/*********************************************/
+/*
+    Arenas for the matrices of a foreign call
+*/
+/**********************************************/
+
+void arena_init(MatrixArena* arena) {
+    arena->count = 0;
+}
+
+/*
+    Register a matrix in the arena, so it is freed by arena_release. If the arena is
+    full the matrix is freed and NULL is returned
+*/
+Matrix* arena_adopt(MatrixArena* arena, Matrix* matrix) {
+    if (!matrix) {
+        return NULL;
+    }
+    if (arena->count == ARENA_CAPACITY) {
+        free_matrix(matrix);
+        return NULL;
+    }
+    arena->matrices[arena->count++] = matrix;
+    return matrix;
+}
+
+/*
+    Create a matrix which belongs to the arena. Returns NULL on failure
+*/
+Matrix* arena_new_matrix(MatrixArena* arena, int rows, int columns) {
+    return arena_adopt(arena, new_matrix(rows, columns));
+}
+
+/*
+    Create a matrix which belongs to the arena, whose values are stored with a layout (MATRIX_LAYOUT_*).
+    Returns NULL on failure
+*/
+Matrix* arena_new_matrix_with_layout(MatrixArena* arena, int rows, int columns, int layout) {
+    return arena_adopt(arena, new_matrix_with_layout(rows, columns, layout));
+}
+
+/*
+    Remove a matrix from the arena, so it survives the call (for instance, because a handle owns it)
+*/
+Matrix* arena_detach(MatrixArena* arena, Matrix* matrix) {
+    for (int i = 0; i < arena->count; i++) {
+        if (arena->matrices[i] == matrix) {
+            arena->matrices[i] = arena->matrices[--arena->count];
+            break;
+        }
+    }
+    return matrix;
+}
+
+/*
+    Free all the matrices of the arena
+*/
+void arena_release(MatrixArena* arena) {
+    for (int i = 0; i < arena->count; i++) {
+        free_matrix(arena->matrices[i]);
+    }
+    arena->count = 0;
+}
+
+/*
+    Free all the matrices of the arena and fail. Used by the foreign predicates as PL_fail
+*/
+foreign_t arena_fail(MatrixArena* arena) {
+    arena_release(arena);
+    PL_fail;
+}
+
+/*
+  Foreign predicate to obtain the allocation statistics as a list of Key-Value pairs
+*/
+foreign_t pl_memory_statistics(term_t statistics) {
+    MemoryStatistics values;
+    get_memory_statistics(&values);
+
+    const char* keys[] = {
+        "asignaciones", "bytes_asignados", "reutilizaciones", "liberaciones", "llamadas_malloc",
+        "bytes_malloc", "bytes_en_uso", "pico_bytes", "bytes_en_cache"
+    };
+    size_t numbers[] = {
+        values.allocations, values.allocated_bytes, values.reused, values.releases, values.system_allocations,
+        values.system_bytes, values.bytes_in_use, values.peak_bytes, values.cached_bytes
+    };
+    functor_t pair = PL_new_functor(PL_new_atom("-"), 2);
+    term_t list = PL_copy_term_ref(statistics);
+    term_t head = PL_new_term_ref();
+    term_t key = PL_new_term_ref();
+    term_t value = PL_new_term_ref();
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (!PL_put_atom(key, PL_new_atom(keys[i])) ||
+            !PL_put_int64(value, (int64_t) numbers[i]) ||
+            !PL_unify_list(list, head, list) ||
+            !PL_unify_functor(head, pair) ||
+            !PL_unify_arg(1, head, key) ||
+            !PL_unify_arg(2, head, value)) {
+            PL_fail;
+        }
+    }
+    return PL_unify_nil(list);
+}
+
+/*
+  Foreign predicate to free the buffers kept for reuse
+*/
+foreign_t pl_trim_memory(void) {
+    pool_trim();
+    PL_succeed;
+}
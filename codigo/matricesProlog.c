@@ -12,95 +12,159 @@
 */
 
 /*
-   Foreign predicate for the addition of two matrices
+   Addition of two matrices. The result is unified as a list of lists or as a handle
 */
-foreign_t pl_matrices_addition(term_t matrix1, term_t matrix2, term_t result){
-   
-    Matrix* m1 = parse_list_of_lists_into_matrix(matrix1);
-    Matrix* m2 = parse_list_of_lists_into_matrix(matrix2);
+static foreign_t matrices_addition_common(term_t matrix1, term_t matrix2, term_t result, int as_handle){
+    if (is_sparse_handle(matrix1) || is_sparse_handle(matrix2)) {
+        return sparse_binary_common(matrix1, matrix2, result, SPARSE_ADDITION, as_handle);
+    }
+    if (is_typed_handle(matrix1) || is_typed_handle(matrix2)) {
+        return typed_binary_common(matrix1, matrix2, result, SPARSE_ADDITION, as_handle);
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m1 = get_strided_matrix_from_term(matrix1, &arena);
+    Matrix* m2 = get_strided_matrix_from_term(matrix2, &arena);
     if (!m1 || !m2) {
-        PL_fail;
+        return arena_fail(&arena);
+    }
+    ResultKey key;
+    Matrix* cached = cached_result(&key, RESULT_CACHE_ADDITION, matrix1, m1, matrix2, m2);
+    if (cached) {
+        arena_release(&arena);
+        return unify_cached_result(result, cached, as_handle);
     }
-    Matrix* matrix_result = new_matrix(m1->rows, m1->columns);
+    Matrix* matrix_result = arena_new_matrix_with_layout(&arena, m1->rows, m1->columns, elementwise_layout(m1, m2));
     if (!matrix_result) {
-        PL_fail;
+        return arena_fail(&arena);
     }
   
     if (matrices_addition(m1 ,m2 ,matrix_result) == FAILURE) { 
-        PL_fail;
-    }
-    term_t matrix_list = PL_new_term_ref();
-
-    if(parse_matrix_into_list_of_lists(matrix_result, matrix_list) == FAILURE) {
-        PL_fail;
+        return arena_fail(&arena);
     }
-    return PL_unify(result, matrix_list);
+    cache_result(&key, matrix_result);
+    int unified = unify_matrix_result(result, matrix_result, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
 }
 /*
- Foreign predicate for the substraction of two matrices
+ Substraction of two matrices. The result is unified as a list of lists or as a handle
 */
-foreign_t pl_matrices_substraction(term_t matrix1, term_t matrix2, term_t result){
-    Matrix* m1 = parse_list_of_lists_into_matrix(matrix1);
-    Matrix* m2 = parse_list_of_lists_into_matrix(matrix2);
+static foreign_t matrices_substraction_common(term_t matrix1, term_t matrix2, term_t result, int as_handle){
+    if (is_sparse_handle(matrix1) || is_sparse_handle(matrix2)) {
+        return sparse_binary_common(matrix1, matrix2, result, SPARSE_SUBSTRACTION, as_handle);
+    }
+    if (is_typed_handle(matrix1) || is_typed_handle(matrix2)) {
+        return typed_binary_common(matrix1, matrix2, result, SPARSE_SUBSTRACTION, as_handle);
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m1 = get_strided_matrix_from_term(matrix1, &arena);
+    Matrix* m2 = get_strided_matrix_from_term(matrix2, &arena);
     if (!m1 || !m2) {
-        PL_fail;
+        return arena_fail(&arena);
     }
-    Matrix* matrix_result = new_matrix(m1->rows, m1->columns);
+    ResultKey key;
+    Matrix* cached = cached_result(&key, RESULT_CACHE_SUBSTRACTION, matrix1, m1, matrix2, m2);
+    if (cached) {
+        arena_release(&arena);
+        return unify_cached_result(result, cached, as_handle);
+    }
+    Matrix* matrix_result = arena_new_matrix_with_layout(&arena, m1->rows, m1->columns, elementwise_layout(m1, m2));
     if (!matrix_result) {
-        PL_fail;
+        return arena_fail(&arena);
     }
 
     if (matrices_substraction(m1 ,m2 ,matrix_result) == FAILURE) { 
-        PL_fail;
-    }
-    term_t matrix_list = PL_new_term_ref();
-
-    if(parse_matrix_into_list_of_lists(matrix_result, matrix_list) == FAILURE) {
-        PL_fail;
+        return arena_fail(&arena);
     }
-    return PL_unify(result, matrix_list);
+    cache_result(&key, matrix_result);
+    int unified = unify_matrix_result(result, matrix_result, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
 }
 
 /*
-  Foreign predicate for the multiplication of two matrices
+  Multiplication of two matrices. The result is unified as a list of lists or as a handle
 */
 
-foreign_t pl_matrices_multiplication(term_t matrix1, term_t matrix2, term_t result) {
-    Matrix* m1 = parse_list_of_lists_into_matrix(matrix1);
-    Matrix* m2 = parse_list_of_lists_into_matrix(matrix2);
+static foreign_t matrices_multiplication_common(term_t matrix1, term_t matrix2, term_t result, int as_handle) {
+    if (is_sparse_handle(matrix1) || is_sparse_handle(matrix2)) {
+        return sparse_binary_common(matrix1, matrix2, result, SPARSE_MULTIPLICATION, as_handle);
+    }
+    if (is_typed_handle(matrix1) || is_typed_handle(matrix2)) {
+        return typed_binary_common(matrix1, matrix2, result, SPARSE_MULTIPLICATION, as_handle);
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m1 = get_strided_matrix_from_term(matrix1, &arena);
+    Matrix* m2 = get_strided_matrix_from_term(matrix2, &arena);
     if (!m1 || !m2) {
-      PL_fail;
+      return arena_fail(&arena);
+    }
+    ResultKey key;
+    Matrix* cached = cached_result(&key, RESULT_CACHE_MULTIPLICATION, matrix1, m1, matrix2, m2);
+    if (cached) {
+        arena_release(&arena);
+        return unify_cached_result(result, cached, as_handle);
+    }
+    Matrix* matrix_result = arena_new_matrix_with_layout(&arena, m1->rows, m2->columns, product_layout(m1, m2));
+    if (!matrix_result) {
+      return arena_fail(&arena);
     }
-    Matrix* matrix_result = new_matrix(m1->rows, m2->columns);
     if (matrices_multiplication(m1 ,m2 ,matrix_result) == FAILURE) { 
-        PL_fail;
+        return arena_fail(&arena);
     }
     
-    term_t matrix_list = PL_new_term_ref();
-    if(parse_matrix_into_list_of_lists(matrix_result, matrix_list) == FAILURE) {
-      PL_fail;
-    }
-  return PL_unify(result, matrix_list);
+    cache_result(&key, matrix_result);
+    int unified = unify_matrix_result(result, matrix_result, as_handle, &arena);
+    
+    arena_release(&arena);
+    
+    return unified;
 }
 
 /*
-  Foreign predicate to obtain the transpose of a matrix
+  Transpose of a matrix. The result is unified as a list of lists or as a handle
 */
 
-foreign_t pl_matrices_transpose(term_t matrix, term_t result) {
-    Matrix* m = parse_list_of_lists_into_matrix(matrix);
+static foreign_t matrices_transpose_common(term_t matrix, term_t result, int as_handle) {
+    if (is_sparse_handle(matrix)) {
+        return sparse_transpose_common(matrix, result, as_handle);
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
     if (!m) {
-        PL_fail;
+        return arena_fail(&arena);
+    }
+    ResultKey key;
+    Matrix* cached = cached_result(&key, RESULT_CACHE_TRANSPOSE, matrix, m, 0, NULL);
+    if (cached) {
+        arena_release(&arena);
+        return unify_cached_result(result, cached, as_handle);
+    }
+    if (!is_matrix_handle(matrix)) {
+        // The matrix has been read for this call, so it is transposed in place by swapping its strides
+        if (matrix_transpose_in_place(m) == FAILURE) {
+            return arena_fail(&arena);
+        }
+        cache_result(&key, m);
+        int unified = unify_matrix_result(result, m, as_handle, &arena);
+        arena_release(&arena);
+        return unified;
+    }
+    Matrix* matrix_result = arena_new_matrix_with_layout(&arena, m->columns, m->rows, transpose_layout(m));
+    if (!matrix_result) {
+      return arena_fail(&arena);
     }
-    Matrix* matrix_result = new_matrix(m->columns, m->rows); 
     if (matrix_transpose(m, matrix_result) == FAILURE) {
-        PL_fail;
-    }
-    term_t matrix_list = PL_new_term_ref();
-    if(parse_matrix_into_list_of_lists(matrix_result, matrix_list) == FAILURE) {
-      PL_fail;
+        return arena_fail(&arena);
     }
-  return PL_unify(result, matrix_list);
+    cache_result(&key, matrix_result);
+    int unified = unify_matrix_result(result, matrix_result, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
 }
 
 /*
@@ -108,16 +172,21 @@ foreign_t pl_matrices_transpose(term_t matrix, term_t result) {
 */
 
 foreign_t pl_vectors_dot_product(term_t vector1, term_t vector2, term_t result) {
-    Matrix* v1 = parse_list_of_lists_into_matrix(vector1);
-    Matrix* v2 = parse_list_of_lists_into_matrix(vector2);
+    MatrixArena arena;
+    arena_init(&arena);
+    // The vectors of a handle can be views (a row, a column or a diagonal), which are read through their strides
+    Matrix* v1 = is_matrix_handle(vector1) ? get_strided_matrix_from_term(vector1, &arena) : get_vector_from_term(vector1, &arena);
+    Matrix* v2 = is_matrix_handle(vector2) ? get_strided_matrix_from_term(vector2, &arena) : get_vector_from_term(vector2, &arena);
     if (!v1 || !v2) {
-      PL_fail;
+      return arena_fail(&arena);
     }
     double dot_product = 0;
     if (calculate_dot_product(v1, v2, &dot_product) == FAILURE) {
-      PL_fail;
+      return arena_fail(&arena);
     }
-    return PL_unify_float(result, dot_product);
+    int unified = PL_unify_float(result, dot_product);
+    arena_release(&arena);
+    return unified;
 }
 
 /*
@@ -125,15 +194,19 @@ foreign_t pl_vectors_dot_product(term_t vector1, term_t vector2, term_t result)
 */
 
 foreign_t pl_obtain_maximum_value_from_matrix(term_t matrix, term_t result) {
-    Matrix* m = parse_list_of_lists_into_matrix(matrix);
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
     if (!m) {
-      PL_fail;
+      return arena_fail(&arena);
     }
-    double maximum_value = -INFINITY;
+    double maximum_value;
     if (obtain_maximum_value_from_matrix(m, &maximum_value) == FAILURE) {
-      PL_fail;
+      return arena_fail(&arena);
     }
-    return PL_unify_float(result, maximum_value);
+    int unified = PL_unify_float(result, maximum_value);
+    arena_release(&arena);
+    return unified;
 }
 
 /*
@@ -141,73 +214,86 @@ foreign_t pl_obtain_maximum_value_from_matrix(term_t matrix, term_t result) {
 */
 
 foreign_t pl_is_diagonal(term_t matrix) {
-    Matrix* m = parse_list_of_lists_into_matrix(matrix);
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
     if (!m) {
-      PL_fail;
+      return arena_fail(&arena);
     }
     if (is_matrix_diagonal(m) == FAILURE) {
-      PL_fail;
+      return arena_fail(&arena);
     }
+    arena_release(&arena);
     PL_succeed;
 }
 /*
-  Foreign predicate to obtain a matrix in which all its elements have been 
-  multiplied by a factor
+  Obtain a matrix in which all its elements have been multiplied by a factor. 
+  The result is unified as a list of lists or as a handle
 */
 
-foreign_t pl_multiply_matrix_by_factor(term_t matrix, term_t factor, term_t result) {
-    Matrix* m = parse_list_of_lists_into_matrix(matrix);
+static foreign_t multiply_matrix_by_factor_common(term_t matrix, term_t factor, term_t result, int as_handle) {
+    if (is_sparse_handle(matrix)) {
+        return sparse_scale_common(matrix, factor, result, 0, as_handle);
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
     if (!m) {
-      PL_fail;
+      return arena_fail(&arena);
     }
     double double_factor;
     int integer_factor;
      if (PL_get_integer(factor, &integer_factor)) {
         double_factor = (double)integer_factor;
      } else if (PL_get_float(factor, &double_factor) == FAILURE) {
-        PL_fail;
+        return arena_fail(&arena);
      }
 
-    Matrix* matrix_factor = new_matrix(m->rows, m->columns);
+    Matrix* matrix_factor = arena_new_matrix_with_layout(&arena, m->rows, m->columns, elementwise_layout(m, NULL));
     if (multiply_matrix_by_factor(m, &double_factor, matrix_factor) == FAILURE) {
-      PL_fail;
+      return arena_fail(&arena);
     }
 
-    term_t matrix_list = PL_new_term_ref();
-    if(parse_matrix_into_list_of_lists(matrix_factor, matrix_list) == FAILURE) {
-      PL_fail;
-    }
-    return PL_unify(result, matrix_list);
+    int unified = unify_matrix_result(result, matrix_factor, as_handle, &arena);
+
+    arena_release(&arena);
+
+    return unified;
 }
 
 /*
-  Foreign predicate to obtain a matrix in which all its elements have been 
-  divided by a factor
+  Obtain a matrix in which all its elements have been divided by a factor. 
+  The result is unified as a list of lists or as a handle
 */
 
-foreign_t pl_divide_matrix_by_factor(term_t matrix, term_t factor, term_t result) {
-    Matrix* m = parse_list_of_lists_into_matrix(matrix);
+static foreign_t divide_matrix_by_factor_common(term_t matrix, term_t factor, term_t result, int as_handle) {
+    if (is_sparse_handle(matrix)) {
+        return sparse_scale_common(matrix, factor, result, 1, as_handle);
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
     if (!m) {
-      PL_fail;
+      return arena_fail(&arena);
     }
     double double_factor;
     int integer_factor;
      if (PL_get_integer(factor, &integer_factor)) {
         double_factor = (double)integer_factor;
      } else if (PL_get_float(factor, &double_factor) == FAILURE) {
-        PL_fail;
+        return arena_fail(&arena);
      }
 
-    Matrix* matrix_factor = new_matrix(m->rows, m->columns);
+    Matrix* matrix_factor = arena_new_matrix_with_layout(&arena, m->rows, m->columns, elementwise_layout(m, NULL));
     if (divide_matrix_by_factor(m, &double_factor, matrix_factor) == FAILURE) {
-      PL_fail;
+      return arena_fail(&arena);
     }
 
-    term_t matrix_list = PL_new_term_ref();
-    if(parse_matrix_into_list_of_lists(matrix_factor, matrix_list) == FAILURE) {
-      PL_fail;
-    }
-    return PL_unify(result, matrix_list);
+    int unified = unify_matrix_result(result, matrix_factor, as_handle, &arena);
+
+    arena_release(&arena);
+
+    return unified;
 }
 
 /* 
@@ -215,60 +301,448 @@ foreign_t pl_divide_matrix_by_factor(term_t matrix, term_t factor, term_t result
 */
 
 foreign_t pl_sum_elements_from_matrix(term_t matrix, term_t result) {
-    Matrix* m = parse_list_of_lists_into_matrix(matrix);
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
     if (!m) {
-      PL_fail;
+      return arena_fail(&arena);
     }
     double sum;
     if (sum_elements_from_matrix(m, &sum) == FAILURE) {
-      PL_fail;
+      return arena_fail(&arena);
     }
-    return PL_unify_float(result, sum);
+    int unified = PL_unify_float(result, sum);
+    arena_release(&arena);
+    return unified;
 }
 /*
   Foreign predicate to check whether a matrix is an upper triangular matrix 
 */
 foreign_t pl_is_upper_triangular_matrix(term_t matrix) {
-  Matrix* m = parse_list_of_lists_into_matrix(matrix);
-  if (!matrix) {
-        PL_fail;
+    MatrixArena arena;
+    arena_init(&arena);
+  Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+  if (!m) {
+        return arena_fail(&arena);
     }
     if (is_upper_triangular_matrix(m) == FAILURE) {
-      PL_fail;
+      return arena_fail(&arena);
     }
+    arena_release(&arena);
     PL_succeed;
 }
 
+/*
+  Check whether a matrix has a structure (lower triangular, symmetric or identity)
+*/
+static foreign_t check_structure_common(term_t matrix, int (*check)(Matrix*)) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m || check(m) == FAILURE) {
+      return arena_fail(&arena);
+    }
+    arena_release(&arena);
+    PL_succeed;
+}
+
+foreign_t pl_is_lower_triangular_matrix(term_t matrix) {
+    return check_structure_common(matrix, is_lower_triangular_matrix);
+}
+foreign_t pl_is_symmetric_matrix(term_t matrix) {
+    return check_structure_common(matrix, is_matrix_symmetric);
+}
+foreign_t pl_is_identity_matrix(term_t matrix) {
+    return check_structure_common(matrix, is_identity_matrix);
+}
+
+/*
+  Foreign predicate to obtain the number of diagonals below and above the main one
+  which have non zero values
+*/
+foreign_t pl_matrix_bandwidth(term_t matrix, term_t lower, term_t upper) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+      return arena_fail(&arena);
+    }
+    has_matrix_structure(m, MATRIX_STRUCTURE_EXACT);
+    int unified = PL_unify_integer(lower, m->lower_bandwidth) && PL_unify_integer(upper, m->upper_bandwidth);
+    arena_release(&arena);
+    return unified;
+}
+
 /*
   Check whether two matrices have the same number of columns and rows
 */
 
 foreign_t pl_matrices_with_same_dimensions(term_t matrix1, term_t matrix2) {
-    Matrix* m1 = parse_list_of_lists_into_matrix(matrix1); 
-    Matrix* m2 = parse_list_of_lists_into_matrix(matrix2);
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m1 = get_strided_matrix_from_term(matrix1, &arena); 
+    Matrix* m2 = get_strided_matrix_from_term(matrix2, &arena);
     if (!m1 || !m2) {
-      PL_fail;
+      return arena_fail(&arena);
     }
     if (do_matrices_have_same_dimensions(m1,m2) == FAILURE) {
-      PL_fail;
+      return arena_fail(&arena);
     }
+    arena_release(&arena);
     PL_succeed;
 }
 
+/*
+  Foreign predicates which return the resulting matrix as a list of lists
+*/
+foreign_t pl_matrices_addition(term_t matrix1, term_t matrix2, term_t result) {
+    return matrices_addition_common(matrix1, matrix2, result, 0);
+}
+foreign_t pl_matrices_substraction(term_t matrix1, term_t matrix2, term_t result) {
+    return matrices_substraction_common(matrix1, matrix2, result, 0);
+}
+foreign_t pl_matrices_multiplication(term_t matrix1, term_t matrix2, term_t result) {
+    return matrices_multiplication_common(matrix1, matrix2, result, 0);
+}
+foreign_t pl_matrices_transpose(term_t matrix, term_t result) {
+    return matrices_transpose_common(matrix, result, 0);
+}
+foreign_t pl_multiply_matrix_by_factor(term_t matrix, term_t factor, term_t result) {
+    return multiply_matrix_by_factor_common(matrix, factor, result, 0);
+}
+foreign_t pl_divide_matrix_by_factor(term_t matrix, term_t factor, term_t result) {
+    return divide_matrix_by_factor_common(matrix, factor, result, 0);
+}
+
+/*
+  Foreign predicates which return the resulting matrix as a handle, so that it
+  can be passed to the next operation without converting it into a list
+*/
+foreign_t pl_matrices_addition_handle(term_t matrix1, term_t matrix2, term_t result) {
+    return matrices_addition_common(matrix1, matrix2, result, 1);
+}
+foreign_t pl_matrices_substraction_handle(term_t matrix1, term_t matrix2, term_t result) {
+    return matrices_substraction_common(matrix1, matrix2, result, 1);
+}
+foreign_t pl_matrices_multiplication_handle(term_t matrix1, term_t matrix2, term_t result) {
+    return matrices_multiplication_common(matrix1, matrix2, result, 1);
+}
+foreign_t pl_matrices_transpose_handle(term_t matrix, term_t result) {
+    return matrices_transpose_common(matrix, result, 1);
+}
+foreign_t pl_multiply_matrix_by_factor_handle(term_t matrix, term_t factor, term_t result) {
+    return multiply_matrix_by_factor_common(matrix, factor, result, 1);
+}
+foreign_t pl_divide_matrix_by_factor_handle(term_t matrix, term_t factor, term_t result) {
+    return divide_matrix_by_factor_common(matrix, factor, result, 1);
+}
+
+/*
+  Foreign predicate to consult or change the instruction set of the kernels.
+  If the argument is unbound it is unified with the one in use (scalar, sse2, avx2 or avx512),
+  otherwise that instruction set is selected if the processor supports it
+*/
+foreign_t pl_simd_instruction_set(term_t name) {
+    static const char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+    char* requested;
+
+    if (PL_is_variable(name)) {
+        return PL_unify_atom_chars(name, kernels->name);
+    }
+    if (!PL_get_atom_chars(name, &requested)) {
+        PL_fail;
+    }
+    for (int level = SIMD_SCALAR; level <= SIMD_AVX512; level++) {
+        if (strcmp(requested, names[level]) == 0) {
+            return set_kernels(level);
+        }
+    }
+    PL_fail;
+}
+
+/*
+  Foreign predicate to consult or change the number of threads used by the operations.
+  If the argument is unbound it is unified with the current number, otherwise the
+  number of threads is changed (0 means one thread per processor)
+*/
+foreign_t pl_number_of_threads(term_t threads) {
+    int thread_count;
+
+    if (PL_is_variable(threads)) {
+        return PL_unify_integer(threads, get_thread_count());
+    }
+    if (!PL_get_integer(threads, &thread_count)) {
+        PL_fail;
+    }
+    return set_thread_count(thread_count);
+}
+
+/*
+  Instrumented versions of the foreign predicates. They forget the error of the previous call
+  (matriz_ultimo_error/1) and, while the statistics are disabled, they only call the predicate,
+  otherwise the call is counted by statistics_begin and statistics_end.
+  REGISTER_INSTRUMENTED registers the predicate in the statistics and in SWI-Prolog
+*/
+#define INSTRUMENTED_1(function) \
+    static int function##_statistics; \
+    static foreign_t function##_instrumented(term_t a1) { \
+        begin_call_errors(); \
+        if (!statistics_enabled) return function(a1); \
+        CallStatistics call; \
+        statistics_begin(&call, function##_statistics); \
+        return statistics_end(&call, function(a1)); \
+    }
+#define INSTRUMENTED_2(function) \
+    static int function##_statistics; \
+    static foreign_t function##_instrumented(term_t a1, term_t a2) { \
+        begin_call_errors(); \
+        if (!statistics_enabled) return function(a1, a2); \
+        CallStatistics call; \
+        statistics_begin(&call, function##_statistics); \
+        return statistics_end(&call, function(a1, a2)); \
+    }
+#define INSTRUMENTED_3(function) \
+    static int function##_statistics; \
+    static foreign_t function##_instrumented(term_t a1, term_t a2, term_t a3) { \
+        begin_call_errors(); \
+        if (!statistics_enabled) return function(a1, a2, a3); \
+        CallStatistics call; \
+        statistics_begin(&call, function##_statistics); \
+        return statistics_end(&call, function(a1, a2, a3)); \
+    }
+#define INSTRUMENTED_4(function) \
+    static int function##_statistics; \
+    static foreign_t function##_instrumented(term_t a1, term_t a2, term_t a3, term_t a4) { \
+        begin_call_errors(); \
+        if (!statistics_enabled) return function(a1, a2, a3, a4); \
+        CallStatistics call; \
+        statistics_begin(&call, function##_statistics); \
+        return statistics_end(&call, function(a1, a2, a3, a4)); \
+    }
+#define INSTRUMENTED_6(function) \
+    static int function##_statistics; \
+    static foreign_t function##_instrumented(term_t a1, term_t a2, term_t a3, term_t a4, term_t a5, term_t a6) { \
+        begin_call_errors(); \
+        if (!statistics_enabled) return function(a1, a2, a3, a4, a5, a6); \
+        CallStatistics call; \
+        statistics_begin(&call, function##_statistics); \
+        return statistics_end(&call, function(a1, a2, a3, a4, a5, a6)); \
+    }
+#define REGISTER_INSTRUMENTED(name, arity, function) \
+    do { \
+        function##_statistics = register_predicate_statistics(name, arity); \
+        PL_register_foreign(name, arity, function##_instrumented, 0); \
+    } while (0)
+
+INSTRUMENTED_3(pl_matrices_addition)
+INSTRUMENTED_3(pl_matrices_substraction)
+INSTRUMENTED_3(pl_matrices_multiplication)
+INSTRUMENTED_2(pl_matrices_transpose)
+INSTRUMENTED_3(pl_vectors_dot_product)
+INSTRUMENTED_2(pl_obtain_maximum_value_from_matrix)
+INSTRUMENTED_1(pl_is_diagonal)
+INSTRUMENTED_3(pl_multiply_matrix_by_factor)
+INSTRUMENTED_3(pl_divide_matrix_by_factor)
+INSTRUMENTED_2(pl_sum_elements_from_matrix)
+INSTRUMENTED_1(pl_is_upper_triangular_matrix)
+INSTRUMENTED_2(pl_matrices_with_same_dimensions)
+INSTRUMENTED_1(pl_is_lower_triangular_matrix)
+INSTRUMENTED_1(pl_is_symmetric_matrix)
+INSTRUMENTED_1(pl_is_identity_matrix)
+INSTRUMENTED_3(pl_matrix_bandwidth)
+INSTRUMENTED_2(pl_list_to_matrix_handle)
+INSTRUMENTED_2(pl_matrix_handle_to_list)
+INSTRUMENTED_3(pl_matrix_handle_to_term)
+INSTRUMENTED_3(pl_matrices_addition_handle)
+INSTRUMENTED_3(pl_matrices_substraction_handle)
+INSTRUMENTED_3(pl_matrices_multiplication_handle)
+INSTRUMENTED_2(pl_matrices_transpose_handle)
+INSTRUMENTED_1(pl_matrix_transpose_in_place)
+INSTRUMENTED_2(pl_matrix_layout)
+INSTRUMENTED_2(pl_change_matrix_layout)
+INSTRUMENTED_3(pl_multiply_matrix_by_factor_handle)
+INSTRUMENTED_3(pl_divide_matrix_by_factor_handle)
+INSTRUMENTED_2(pl_save_matrix)
+INSTRUMENTED_2(pl_load_matrix)
+INSTRUMENTED_3(pl_load_matrix_with_mode)
+INSTRUMENTED_2(pl_load_csv)
+INSTRUMENTED_2(pl_load_csv_handle)
+INSTRUMENTED_2(pl_matrix_to_sparse)
+INSTRUMENTED_3(pl_matrix_to_sparse_with_format)
+INSTRUMENTED_2(pl_sparse_to_matrix)
+INSTRUMENTED_2(pl_sparse_to_matrix_handle)
+INSTRUMENTED_2(pl_matrix_eval)
+INSTRUMENTED_2(pl_matrix_eval_handle)
+INSTRUMENTED_2(pl_lu_factorization)
+INSTRUMENTED_2(pl_cholesky_factorization)
+INSTRUMENTED_3(pl_solve_system)
+INSTRUMENTED_3(pl_solve_system_handle)
+INSTRUMENTED_2(pl_determinant)
+INSTRUMENTED_2(pl_inverse)
+INSTRUMENTED_2(pl_inverse_handle)
+INSTRUMENTED_4(pl_reduce_matrix)
+INSTRUMENTED_6(pl_gemv)
+INSTRUMENTED_6(pl_gemv_handle)
+INSTRUMENTED_3(pl_matrix_vector_product)
+INSTRUMENTED_3(pl_matrix_vector_product_handle)
+INSTRUMENTED_4(pl_axpy)
+INSTRUMENTED_4(pl_axpy_handle)
+INSTRUMENTED_3(pl_batched_dot_products)
+INSTRUMENTED_6(pl_submatrix)
+INSTRUMENTED_3(pl_matrix_row)
+INSTRUMENTED_3(pl_matrix_column)
+INSTRUMENTED_2(pl_matrix_diagonal)
+INSTRUMENTED_2(pl_transposed_view)
+INSTRUMENTED_3(pl_list_to_typed_matrix)
+INSTRUMENTED_2(pl_matrix_type)
+INSTRUMENTED_3(pl_convert_matrix)
+INSTRUMENTED_3(pl_matrices_addition_async)
+INSTRUMENTED_3(pl_matrices_substraction_async)
+INSTRUMENTED_3(pl_matrices_multiplication_async)
+INSTRUMENTED_2(pl_matrices_transpose_async)
+INSTRUMENTED_2(pl_matrix_wait)
+INSTRUMENTED_1(pl_matrix_ready)
+INSTRUMENTED_1(pl_matrix_cancel)
+INSTRUMENTED_2(pl_matrix_chain_multiplication)
+INSTRUMENTED_2(pl_matrix_chain_multiplication_handle)
+INSTRUMENTED_3(pl_matrix_power)
+INSTRUMENTED_3(pl_matrix_power_handle)
+INSTRUMENTED_1(pl_multiplication_algorithm)
+INSTRUMENTED_1(pl_strassen_cutoff)
+INSTRUMENTED_1(pl_summation_algorithm)
+
 install_t
 install() {
-    PL_register_foreign("sumar_matrices", 3 , pl_matrices_addition, 0);
-    PL_register_foreign("restar_matrices", 3 , pl_matrices_substraction, 0);
-    PL_register_foreign("multiplicar_matrices", 3, pl_matrices_multiplication, 0);
-    PL_register_foreign("transponer_matriz", 2, pl_matrices_transpose, 0);
-    PL_register_foreign("producto_escalar", 3, pl_vectors_dot_product, 0);
-    PL_register_foreign("obtener_valor_maximo", 2, pl_obtain_maximum_value_from_matrix, 0);
-    PL_register_foreign("es_diagonal", 1, pl_is_diagonal, 0);
-    PL_register_foreign("multiplicar_matriz_por_factor", 3, pl_multiply_matrix_by_factor, 0);
-    PL_register_foreign("dividir_matriz_por_factor", 3, pl_divide_matrix_by_factor, 0);
-    PL_register_foreign("sumar_elementos_de_matriz", 2, pl_sum_elements_from_matrix, 0);
-    PL_register_foreign("es_matriz_diagonal_superior", 1, pl_is_upper_triangular_matrix, 0);
-    PL_register_foreign("matrices_mismas_dimensions", 2, pl_matrices_with_same_dimensions, 0);
+    select_kernels();
+    init_matrix_terms();
+
+    REGISTER_INSTRUMENTED("sumar_matrices", 3, pl_matrices_addition);
+    REGISTER_INSTRUMENTED("restar_matrices", 3, pl_matrices_substraction);
+    REGISTER_INSTRUMENTED("multiplicar_matrices", 3, pl_matrices_multiplication);
+    REGISTER_INSTRUMENTED("transponer_matriz", 2, pl_matrices_transpose);
+    REGISTER_INSTRUMENTED("producto_escalar", 3, pl_vectors_dot_product);
+    REGISTER_INSTRUMENTED("obtener_valor_maximo", 2, pl_obtain_maximum_value_from_matrix);
+    REGISTER_INSTRUMENTED("es_diagonal", 1, pl_is_diagonal);
+    REGISTER_INSTRUMENTED("multiplicar_matriz_por_factor", 3, pl_multiply_matrix_by_factor);
+    REGISTER_INSTRUMENTED("dividir_matriz_por_factor", 3, pl_divide_matrix_by_factor);
+    REGISTER_INSTRUMENTED("sumar_elementos_de_matriz", 2, pl_sum_elements_from_matrix);
+    REGISTER_INSTRUMENTED("es_matriz_diagonal_superior", 1, pl_is_upper_triangular_matrix);
+    REGISTER_INSTRUMENTED("matrices_mismas_dimensions", 2, pl_matrices_with_same_dimensions);
+    REGISTER_INSTRUMENTED("es_matriz_diagonal_inferior", 1, pl_is_lower_triangular_matrix);
+    REGISTER_INSTRUMENTED("es_matriz_simetrica", 1, pl_is_symmetric_matrix);
+    REGISTER_INSTRUMENTED("es_matriz_identidad", 1, pl_is_identity_matrix);
+    REGISTER_INSTRUMENTED("ancho_de_banda", 3, pl_matrix_bandwidth);
+
+    // Handles: the matrices stay in C memory and are converted into lists only on demand
+    REGISTER_INSTRUMENTED("lista_a_matriz", 2, pl_list_to_matrix_handle);
+    REGISTER_INSTRUMENTED("matriz_a_lista", 2, pl_matrix_handle_to_list);
+    REGISTER_INSTRUMENTED("matriz_a_lista", 3, pl_matrix_handle_to_term);
+    PL_register_foreign("dimensiones_matriz", 3, pl_matrix_handle_dimensions, 0);
+    REGISTER_INSTRUMENTED("sumar_matrices_h", 3, pl_matrices_addition_handle);
+    REGISTER_INSTRUMENTED("restar_matrices_h", 3, pl_matrices_substraction_handle);
+    REGISTER_INSTRUMENTED("multiplicar_matrices_h", 3, pl_matrices_multiplication_handle);
+    REGISTER_INSTRUMENTED("transponer_matriz_h", 2, pl_matrices_transpose_handle);
+    REGISTER_INSTRUMENTED("transponer_matriz_en_sitio", 1, pl_matrix_transpose_in_place);
+    REGISTER_INSTRUMENTED("disposicion_matriz", 2, pl_matrix_layout);
+    REGISTER_INSTRUMENTED("cambiar_disposicion", 2, pl_change_matrix_layout);
+    REGISTER_INSTRUMENTED("multiplicar_matriz_por_factor_h", 3, pl_multiply_matrix_by_factor_handle);
+    REGISTER_INSTRUMENTED("dividir_matriz_por_factor_h", 3, pl_divide_matrix_by_factor_handle);
+
+    // Binary matrix files, loaded by mapping them into memory
+    REGISTER_INSTRUMENTED("guardar_matriz", 2, pl_save_matrix);
+    REGISTER_INSTRUMENTED("cargar_matriz", 2, pl_load_matrix);
+    REGISTER_INSTRUMENTED("cargar_matriz", 3, pl_load_matrix_with_mode);
+    REGISTER_INSTRUMENTED("cargar_csv", 2, pl_load_csv);
+    REGISTER_INSTRUMENTED("cargar_csv_h", 2, pl_load_csv_handle);
+
+    // Sparse matrices, used automatically by the operations above when a handle is sparse
+    REGISTER_INSTRUMENTED("matriz_a_dispersa", 2, pl_matrix_to_sparse);
+    REGISTER_INSTRUMENTED("matriz_a_dispersa", 3, pl_matrix_to_sparse_with_format);
+    REGISTER_INSTRUMENTED("dispersa_a_matriz", 2, pl_sparse_to_matrix);
+    REGISTER_INSTRUMENTED("dispersa_a_matriz_h", 2, pl_sparse_to_matrix_handle);
+    PL_register_foreign("elementos_no_nulos", 2, pl_sparse_nonzeros, 0);
+
+    REGISTER_INSTRUMENTED("matriz_eval", 2, pl_matrix_eval);
+    REGISTER_INSTRUMENTED("matriz_eval_h", 2, pl_matrix_eval_handle);
+
+    // Linear systems, the first argument of the last ones can be a factorization handle
+    REGISTER_INSTRUMENTED("factorizar_lu", 2, pl_lu_factorization);
+    REGISTER_INSTRUMENTED("factorizar_cholesky", 2, pl_cholesky_factorization);
+    REGISTER_INSTRUMENTED("resolver_sistema", 3, pl_solve_system);
+    REGISTER_INSTRUMENTED("resolver_sistema_h", 3, pl_solve_system_handle);
+    REGISTER_INSTRUMENTED("determinante", 2, pl_determinant);
+    REGISTER_INSTRUMENTED("inversa", 2, pl_inverse);
+    REGISTER_INSTRUMENTED("inversa_h", 2, pl_inverse_handle);
+
+    REGISTER_INSTRUMENTED("reducir_matriz", 4, pl_reduce_matrix);
+
+    // Vectors, which can be flat lists or matrices of one row or one column
+    REGISTER_INSTRUMENTED("gemv", 6, pl_gemv);
+    REGISTER_INSTRUMENTED("gemv_h", 6, pl_gemv_handle);
+    REGISTER_INSTRUMENTED("multiplicar_matriz_vector", 3, pl_matrix_vector_product);
+    REGISTER_INSTRUMENTED("multiplicar_matriz_vector_h", 3, pl_matrix_vector_product_handle);
+    REGISTER_INSTRUMENTED("axpy", 4, pl_axpy);
+    REGISTER_INSTRUMENTED("axpy_h", 4, pl_axpy_handle);
+    REGISTER_INSTRUMENTED("productos_escalares", 3, pl_batched_dot_products);
+
+    // Views which share the values of a matrix, returned as handles
+    REGISTER_INSTRUMENTED("submatriz", 6, pl_submatrix);
+    REGISTER_INSTRUMENTED("fila_de_matriz", 3, pl_matrix_row);
+    REGISTER_INSTRUMENTED("columna_de_matriz", 3, pl_matrix_column);
+    REGISTER_INSTRUMENTED("diagonal_de_matriz", 2, pl_matrix_diagonal);
+    REGISTER_INSTRUMENTED("transponer_vista", 2, pl_transposed_view);
+
+    // Matrices of f32, i32 or i64 values, returned as handles
+    REGISTER_INSTRUMENTED("lista_a_matriz", 3, pl_list_to_typed_matrix);
+    REGISTER_INSTRUMENTED("tipo_matriz", 2, pl_matrix_type);
+    REGISTER_INSTRUMENTED("convertir_matriz", 3, pl_convert_matrix);
+
+    // Operations in the background, which return a future of their result
+    REGISTER_INSTRUMENTED("sumar_matrices_async", 3, pl_matrices_addition_async);
+    REGISTER_INSTRUMENTED("restar_matrices_async", 3, pl_matrices_substraction_async);
+    REGISTER_INSTRUMENTED("multiplicar_matrices_async", 3, pl_matrices_multiplication_async);
+    REGISTER_INSTRUMENTED("transponer_matriz_async", 2, pl_matrices_transpose_async);
+    REGISTER_INSTRUMENTED("matriz_wait", 2, pl_matrix_wait);
+    REGISTER_INSTRUMENTED("matriz_ready", 1, pl_matrix_ready);
+    REGISTER_INSTRUMENTED("matriz_cancel", 1, pl_matrix_cancel);
+    PL_register_foreign("matriz_error", 2, pl_matrix_error, 0);
+    PL_register_foreign("matriz_ultimo_error", 1, pl_matrix_last_error, 0);
+
+    // Products of a chain of matrices in the cheapest order, and powers of a square matrix
+    REGISTER_INSTRUMENTED("multiplicar_cadena", 2, pl_matrix_chain_multiplication);
+    REGISTER_INSTRUMENTED("multiplicar_cadena_h", 2, pl_matrix_chain_multiplication_handle);
+    REGISTER_INSTRUMENTED("potencia_matriz", 3, pl_matrix_power);
+    REGISTER_INSTRUMENTED("potencia_matriz_h", 3, pl_matrix_power_handle);
+
+    PL_register_foreign("instrucciones_simd", 1, pl_simd_instruction_set, 0);
+    PL_register_foreign("numero_hilos", 1, pl_number_of_threads, 0);
+    REGISTER_INSTRUMENTED("algoritmo_multiplicacion", 1, pl_multiplication_algorithm);
+    REGISTER_INSTRUMENTED("umbral_strassen", 1, pl_strassen_cutoff);
+    REGISTER_INSTRUMENTED("algoritmo_suma", 1, pl_summation_algorithm);
+    PL_register_foreign("estadisticas_memoria", 1, pl_memory_statistics, 0);
+    PL_register_foreign("liberar_memoria_reservada", 0, pl_trim_memory, 0);
+
+    // Result cache of the sums, differences, products and transposes, disabled until it has a budget
+    PL_register_foreign("cache_resultados", 1, pl_result_cache, 0);
+    PL_register_foreign("estadisticas_cache", 1, pl_result_cache_statistics, 0);
+    PL_register_foreign("vaciar_cache", 0, pl_clear_result_cache, 0);
+
+    // Statistics of the predicates registered with REGISTER_INSTRUMENTED
+    PL_register_foreign("matrices_stats", 1, pl_matrices_stats, 0);
+    PL_register_foreign("matrices_stats_activar", 1, pl_matrices_stats_enable, 0);
+    PL_register_foreign("matrices_stats_reiniciar", 0, pl_matrices_stats_reset, 0);
+    PL_register_foreign("matrices_stats_traza", 1, pl_matrices_stats_trace, 0);
+    PL_register_foreign("matrices_stats_cerrar_traza", 0, pl_matrices_stats_close_trace, 0);
+}
+
+/*
+  Called when the library is unloaded. It stops the background thread and the worker threads
+*/
+install_t
+uninstall() {
+    shutdown_futures();
+    shutdown_thread_pool();
+    pool_trim();
 }
 
 
@@ -0,0 +1,597 @@
+#include "definitions.h"
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the reductions of the dense matrices: sum, mean, minimum, maximum, position
+  of the minimum and of the maximum and the norms 1 and 2, for the whole matrix, for each row or
+  for each column. All the requested operations are computed in the same pass over the values.
+    - The values are read in blocks of REDUCTION_BLOCK, which stay in the first level cache while
+      each operation runs over them, and the sums of a block are computed by the SIMD kernels.
+    - With pairwise summation the blocks are the leaves of a binary tree of additions, so the
+      error grows with the logarithm of the number of values instead of with the number of values.
+      With Kahan summation the blocks are added in order keeping the rounding error of every
+      addition, and the error hardly depends on the number of values.
+    - The whole matrix is split in one chunk per thread, the columns are handed out to the threads
+      and the rows are reduced in bands of REDUCTION_BAND rows.
+  The summation algorithm is a setting of the Prolog thread which selects it.
+*/
+
+static __thread int summation_algorithm = SUMMATION_PAIRWISE;
+
+static const char* summation_names[] = { "por_pares", "kahan" };
+
+static const struct {
+    const char* name;
+    int operation;
+} operation_names[] = {
+    { "suma", REDUCTION_SUM },
+    { "media", REDUCTION_MEAN },
+    { "minimo", REDUCTION_MINIMUM },
+    { "maximo", REDUCTION_MAXIMUM },
+    { "argmin", REDUCTION_ARGMIN },
+    { "argmax", REDUCTION_ARGMAX },
+    { "norma1", REDUCTION_NORM1 },
+    { "norma2", REDUCTION_NORM2 }
+};
+
+# define NEEDS_SUM(operations) ((operations) & (REDUCTION_SUM | REDUCTION_MEAN))
+# define NEEDS_EXTREMES(operations) \
+    ((operations) & (REDUCTION_MINIMUM | REDUCTION_MAXIMUM | REDUCTION_ARGMIN | REDUCTION_ARGMAX))
+
+static void reduction_init(Reduction* reduction) {
+    memset(reduction, 0, sizeof(Reduction));
+    reduction->minimum = INFINITY;
+    reduction->maximum = -INFINITY;
+}
+
+/*
+    Add value to a sum keeping the rounding error in error (Neumaier's variant of Kahan summation,
+    which is also exact when the value is bigger than the sum)
+*/
+static inline void compensated_add(double* sum, double* error, double value) {
+    double total = *sum + value;
+    if (fabs(*sum) >= fabs(value)) {
+        *error += (*sum - total) + value;
+    } else {
+        *error += (value - total) + *sum;
+    }
+    *sum = total;
+}
+
+/*
+    Merge the reduction of the values which come after the ones of into. On ties the first
+    position is kept
+*/
+static void merge_reductions(Reduction* into, const Reduction* from, int compensated) {
+    for (int i = 0; i < 3; i++) {
+        if (compensated) {
+            compensated_add(&into->sums[i], &into->errors[i], from->sums[i]);
+            into->errors[i] += from->errors[i];
+        } else {
+            into->sums[i] += from->sums[i];
+        }
+    }
+    if (from->minimum < into->minimum) {
+        into->minimum = from->minimum;
+        into->argmin = from->argmin;
+    }
+    if (from->maximum > into->maximum) {
+        into->maximum = from->maximum;
+        into->argmax = from->argmax;
+    }
+}
+
+/*
+    Value of one of the sums of a reduction (0 the sum, 1 the absolute values, 2 the squares)
+*/
+double reduction_sum(const Reduction* reduction, int which) {
+    return reduction->sums[which] + reduction->errors[which];
+}
+
+/*********************************************/
+/*
+    Reductions of contiguous values: the whole matrix and the columns
+*/
+/**********************************************/
+
+/*
+    Reduce a block of at most REDUCTION_BLOCK values, stride values apart, whose first one is at
+    position offset. The strided values of a view are gathered first, so the kernels read them contiguous
+*/
+static void reduce_block(const double* a, size_t stride, size_t n, size_t offset, int operations, Reduction* reduction) {
+    double gathered[REDUCTION_BLOCK];
+    if (stride != 1) {
+        for (size_t i = 0; i < n; i++) {
+            gathered[i] = a[i * stride];
+        }
+        a = gathered;
+    }
+    reduction_init(reduction);
+    if (NEEDS_SUM(operations)) {
+        reduction->sums[0] = kernels->sum(a, n);
+    }
+    if (operations & REDUCTION_NORM1) {
+        double partial[4] = { 0, 0, 0, 0 };
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            partial[0] += fabs(a[i]);
+            partial[1] += fabs(a[i + 1]);
+            partial[2] += fabs(a[i + 2]);
+            partial[3] += fabs(a[i + 3]);
+        }
+        for (; i < n; i++) {
+            partial[0] += fabs(a[i]);
+        }
+        reduction->sums[1] = (partial[0] + partial[1]) + (partial[2] + partial[3]);
+    }
+    if (operations & REDUCTION_NORM2) {
+        reduction->sums[2] = kernels->dot(a, a, n);
+    }
+    if (operations & (REDUCTION_MINIMUM | REDUCTION_ARGMIN | REDUCTION_ARGMAX)) {
+        for (size_t i = 0; i < n; i++) {
+            if (a[i] < reduction->minimum) {
+                reduction->minimum = a[i];
+                reduction->argmin = offset + i;
+            }
+            if (a[i] > reduction->maximum) {
+                reduction->maximum = a[i];
+                reduction->argmax = offset + i;
+            }
+        }
+    } else if (operations & REDUCTION_MAXIMUM) {
+        reduction->maximum = kernels->maximum(a, n);
+    }
+}
+
+/*
+    Reduce n values, stride values apart (1 unless they are a row or a diagonal of a view), whose
+    first one is at position offset
+*/
+static void reduce_segment(const double* a, size_t stride, size_t n, size_t offset, int operations, int algorithm,
+                           Reduction* reduction) {
+    if (algorithm == SUMMATION_PAIRWISE) {
+        if (n <= REDUCTION_BLOCK) {
+            reduce_block(a, stride, n, offset, operations, reduction);
+            return;
+        }
+        // The left half has a whole number of blocks
+        size_t half = (n / 2 + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK * REDUCTION_BLOCK;
+        Reduction right;
+        reduce_segment(a, stride, half, offset, operations, algorithm, reduction);
+        reduce_segment(a + half * stride, stride, n - half, offset + half, operations, algorithm, &right);
+        merge_reductions(reduction, &right, 0);
+        return;
+    }
+    reduction_init(reduction);
+    for (size_t begin = 0; begin < n; begin += REDUCTION_BLOCK) {
+        Reduction block;
+        reduce_block(a + begin * stride, stride, n - begin < REDUCTION_BLOCK ? n - begin : REDUCTION_BLOCK,
+                     offset + begin, operations, &block);
+        merge_reductions(reduction, &block, 1);
+    }
+}
+
+typedef struct {
+    const double* data;
+    size_t rows;
+    size_t columns;
+    size_t row_stride;
+    size_t column_stride;
+    int operations;
+    int algorithm;
+    size_t number_chunks;
+    Reduction* results;
+} ReductionJob;
+
+/*
+    Reduce the values [begin, end) of the matrix, counted by columns. When the columns are not
+    one after the other (a view), every piece of a column is reduced on its own and the pieces
+    are merged in order
+*/
+static void reduce_range(const ReductionJob* job, size_t begin, size_t end, Reduction* reduction) {
+    if (job->row_stride == 1 && job->column_stride == job->rows) {
+        reduce_segment(job->data + begin, 1, end - begin, begin, job->operations, job->algorithm, reduction);
+        return;
+    }
+    for (size_t first = begin; first < end;) {
+        size_t column = first / job->rows;
+        size_t row = first % job->rows;
+        size_t last = (column + 1) * job->rows < end ? (column + 1) * job->rows : end;
+        Reduction piece;
+        reduce_segment(job->data + column * job->column_stride + row * job->row_stride, job->row_stride,
+                       last - first, first, job->operations, job->algorithm, first == begin ? reduction : &piece);
+        if (first != begin) {
+            merge_reductions(reduction, &piece, job->algorithm == SUMMATION_KAHAN);
+        }
+        first = last;
+    }
+}
+
+static void reduce_chunks_task(void* context, size_t first, size_t last) {
+    ReductionJob* job = context;
+    size_t n = job->rows * job->columns;
+    for (size_t chunk = first; chunk < last; chunk++) {
+        size_t begin = n * chunk / job->number_chunks;
+        size_t end = n * (chunk + 1) / job->number_chunks;
+        reduce_range(job, begin, end, &job->results[chunk]);
+    }
+}
+
+static void reduce_columns_task(void* context, size_t first, size_t last) {
+    ReductionJob* job = context;
+    for (size_t column = first; column < last; column++) {
+        reduce_segment(job->data + column * job->column_stride, job->row_stride, job->rows, 0, job->operations,
+                       job->algorithm, &job->results[column]);
+    }
+}
+
+/*
+    Reduce all the values in one chunk per thread (at most MAX_REDUCTION_CHUNKS), and merge the
+    chunks in order
+*/
+static void reduce_all(ReductionJob* job) {
+    Reduction partials[MAX_REDUCTION_CHUNKS];
+    size_t n = job->rows * job->columns;
+    size_t number_chunks = n / PARALLEL_GRAIN;
+    size_t threads = (size_t) get_thread_count();
+    if (number_chunks > threads) {
+        number_chunks = threads;
+    }
+    if (number_chunks > MAX_REDUCTION_CHUNKS) {
+        number_chunks = MAX_REDUCTION_CHUNKS;
+    }
+    if (number_chunks < 2) {
+        reduce_range(job, 0, n, job->results);
+        return;
+    }
+    Reduction* result = job->results;
+    job->number_chunks = number_chunks;
+    job->results = partials;
+    parallel_for(number_chunks, 1, reduce_chunks_task, job);
+    *result = partials[0];
+    for (size_t chunk = 1; chunk < number_chunks; chunk++) {
+        merge_reductions(result, &partials[chunk], job->algorithm == SUMMATION_KAHAN);
+    }
+    job->results = result;
+}
+
+/*********************************************/
+/*
+    Reductions of the rows
+*/
+/**********************************************/
+
+/*
+    Reduce the columns [first, first + width) of a band of height rows, with width at most
+    REDUCTION_BLOCK. The partial results of every row are kept in arrays, so the loops over
+    the rows of a column are vectorized
+*/
+static void reduce_rows_block(const ReductionJob* job, size_t first_row, int height, size_t first, size_t width,
+                              Reduction* reductions) {
+    double sum[REDUCTION_BAND], absolute[REDUCTION_BAND], squares[REDUCTION_BAND];
+    double minimum[REDUCTION_BAND], maximum[REDUCTION_BAND];
+    size_t argmin[REDUCTION_BAND], argmax[REDUCTION_BAND];
+    double gathered[REDUCTION_BAND];
+    int operations = job->operations;
+
+    for (int row = 0; row < height; row++) {
+        sum[row] = absolute[row] = squares[row] = 0.0;
+        minimum[row] = INFINITY;
+        maximum[row] = -INFINITY;
+        argmin[row] = argmax[row] = 0;
+    }
+    for (size_t column = first; column < first + width; column++) {
+        const double* values = job->data + column * job->column_stride + first_row * job->row_stride;
+        if (job->row_stride != 1) {
+            for (int row = 0; row < height; row++) {
+                gathered[row] = values[row * job->row_stride];
+            }
+            values = gathered;
+        }
+        if (NEEDS_SUM(operations)) {
+            for (int row = 0; row < height; row++) {
+                sum[row] += values[row];
+            }
+        }
+        if (operations & REDUCTION_NORM1) {
+            for (int row = 0; row < height; row++) {
+                absolute[row] += fabs(values[row]);
+            }
+        }
+        if (operations & REDUCTION_NORM2) {
+            for (int row = 0; row < height; row++) {
+                squares[row] += values[row] * values[row];
+            }
+        }
+        if (NEEDS_EXTREMES(operations)) {
+            for (int row = 0; row < height; row++) {
+                if (values[row] < minimum[row]) {
+                    minimum[row] = values[row];
+                    argmin[row] = column;
+                }
+                if (values[row] > maximum[row]) {
+                    maximum[row] = values[row];
+                    argmax[row] = column;
+                }
+            }
+        }
+    }
+    for (int row = 0; row < height; row++) {
+        Reduction* reduction = &reductions[row];
+        reduction_init(reduction);
+        reduction->sums[0] = sum[row];
+        reduction->sums[1] = absolute[row];
+        reduction->sums[2] = squares[row];
+        reduction->minimum = minimum[row];
+        reduction->maximum = maximum[row];
+        reduction->argmin = argmin[row];
+        reduction->argmax = argmax[row];
+    }
+}
+
+/*
+    Reduce the columns [first, first + width) of a band of height rows, adding the blocks of
+    columns pairwise or in order with compensated summation
+*/
+static void reduce_rows_range(const ReductionJob* job, size_t first_row, int height, size_t first, size_t width,
+                              Reduction* reductions) {
+    Reduction others[REDUCTION_BAND];
+    if (job->algorithm == SUMMATION_PAIRWISE) {
+        if (width <= REDUCTION_BLOCK) {
+            reduce_rows_block(job, first_row, height, first, width, reductions);
+            return;
+        }
+        size_t half = (width / 2 + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK * REDUCTION_BLOCK;
+        reduce_rows_range(job, first_row, height, first, half, reductions);
+        reduce_rows_range(job, first_row, height, first + half, width - half, others);
+        for (int row = 0; row < height; row++) {
+            merge_reductions(&reductions[row], &others[row], 0);
+        }
+        return;
+    }
+    for (int row = 0; row < height; row++) {
+        reduction_init(&reductions[row]);
+    }
+    for (size_t begin = first; begin < first + width; begin += REDUCTION_BLOCK) {
+        size_t block = first + width - begin < REDUCTION_BLOCK ? first + width - begin : REDUCTION_BLOCK;
+        reduce_rows_block(job, first_row, height, begin, block, others);
+        for (int row = 0; row < height; row++) {
+            merge_reductions(&reductions[row], &others[row], 1);
+        }
+    }
+}
+
+static void reduce_rows_task(void* context, size_t first, size_t last) {
+    ReductionJob* job = context;
+    for (size_t band = first; band < last; band++) {
+        size_t first_row = band * REDUCTION_BAND;
+        int height = job->rows - first_row < REDUCTION_BAND ? (int)(job->rows - first_row) : REDUCTION_BAND;
+        reduce_rows_range(job, first_row, height, 0, job->columns, job->results + first_row);
+    }
+}
+
+/*
+    Compute the requested operations (REDUCTION_* flags) of the whole matrix (one result), of each
+    row (one result per row) or of each column (one result per column), with the summation
+    algorithm selected by algoritmo_suma/1. The values of a view are read from its parent: a view whose
+    rows are contiguous (a transposed view) and a matrix of one row are reduced as their transpose, so
+    the values are read by columns. Returns SUCCESS or FAILURE
+*/
+int reduce_matrix(Matrix* matrix, int axis, int operations, Reduction* results) {
+    if (!matrix || !results) {
+        return FAILURE;
+    }
+    ReductionJob job = { matrix->data, (size_t) matrix->rows, (size_t) matrix->columns, matrix->row_stride,
+                         matrix->column_stride, operations, summation_algorithm, 0, results };
+    int transposed = matrix->rows == 1 || (matrix->row_stride != 1 && matrix->column_stride == 1);
+    if (transposed) {
+        job.rows = (size_t) matrix->columns;
+        job.columns = (size_t) matrix->rows;
+        job.row_stride = matrix->column_stride;
+        job.column_stride = matrix->row_stride;
+        axis = axis == REDUCTION_ROWS ? REDUCTION_COLUMNS : axis == REDUCTION_COLUMNS ? REDUCTION_ROWS : axis;
+    }
+    if (axis == REDUCTION_ALL) {
+        reduce_all(&job);
+        if (transposed) {
+            // Positions of the transpose, counted by its columns, into positions of the matrix
+            results->argmin = results->argmin % job.rows * job.columns + results->argmin / job.rows;
+            results->argmax = results->argmax % job.rows * job.columns + results->argmax / job.rows;
+        }
+    } else if (axis == REDUCTION_COLUMNS) {
+        parallel_for(job.columns, PARALLEL_GRAIN / job.rows + 1, reduce_columns_task, &job);
+    } else {
+        size_t bands = (job.rows + REDUCTION_BAND - 1) / REDUCTION_BAND;
+        parallel_for(bands, PARALLEL_GRAIN / (REDUCTION_BAND * job.columns) + 1, reduce_rows_task, &job);
+    }
+    return SUCCESS;
+}
+
+/*********************************************/
+/*
+    Foreign predicates
+*/
+/**********************************************/
+
+/*
+    Unify the value of an operation of a reduction of count values. The positions are counted
+    from 1, and the ones of the whole matrix are Fila-Columna
+*/
+static int unify_reduction_value(term_t value, const Reduction* reduction, int operation, int axis, size_t count,
+                                 int rows) {
+    term_t argument;
+    size_t position;
+    switch (operation) {
+    case REDUCTION_SUM:
+        return PL_unify_float(value, reduction_sum(reduction, 0));
+    case REDUCTION_MEAN:
+        return PL_unify_float(value, reduction_sum(reduction, 0) / (double) count);
+    case REDUCTION_MINIMUM:
+        return PL_unify_float(value, reduction->minimum);
+    case REDUCTION_MAXIMUM:
+        return PL_unify_float(value, reduction->maximum);
+    case REDUCTION_NORM1:
+        return PL_unify_float(value, reduction_sum(reduction, 1));
+    case REDUCTION_NORM2:
+        return PL_unify_float(value, sqrt(reduction_sum(reduction, 2)));
+    }
+    position = operation == REDUCTION_ARGMIN ? reduction->argmin : reduction->argmax;
+    if (axis != REDUCTION_ALL) {
+        return PL_unify_int64(value, (int64_t) position + 1);
+    }
+    argument = PL_new_term_ref();
+    return PL_unify_functor(value, PL_new_functor(PL_new_atom("-"), 2)) &&
+           PL_get_arg(1, value, argument) && PL_unify_int64(argument, (int64_t)(position % rows) + 1) &&
+           PL_get_arg(2, value, argument) && PL_unify_int64(argument, (int64_t)(position / rows) + 1);
+}
+
+/*
+    Unify the value of an operation: a number for the whole matrix, a list with one number per
+    row or column otherwise
+*/
+static int unify_reduction(term_t value, const Reduction* results, int number_results, int operation, int axis,
+                           Matrix* matrix) {
+    size_t count = axis == REDUCTION_ALL ? (size_t) matrix->rows * matrix->columns :
+                   axis == REDUCTION_ROWS ? (size_t) matrix->columns : (size_t) matrix->rows;
+    if (axis == REDUCTION_ALL) {
+        return unify_reduction_value(value, results, operation, axis, count, matrix->rows);
+    }
+    term_t list = PL_copy_term_ref(value);
+    term_t head = PL_new_term_ref();
+    for (int i = 0; i < number_results; i++) {
+        if (!PL_unify_list(list, head, list) ||
+            !unify_reduction_value(head, &results[i], operation, axis, count, matrix->rows)) {
+            return FALSE;
+        }
+    }
+    return PL_unify_nil(list);
+}
+
+/*
+    Read an operation name. Returns its REDUCTION_* flag or 0
+*/
+static int get_operation(term_t term) {
+    char* name;
+    if (PL_get_atom_chars(term, &name)) {
+        for (int i = 0; i < (int)(sizeof(operation_names) / sizeof(operation_names[0])); i++) {
+            if (strcmp(name, operation_names[i].name) == 0) {
+                return operation_names[i].operation;
+            }
+        }
+    }
+    report_error("Las operaciones de reducción son suma, media, minimo, maximo, argmin, argmax, norma1 y norma2\n");
+    return 0;
+}
+
+/*
+  Foreign predicate reducir_matriz(Matriz, Eje, Operaciones, Resultado). Eje is todo, filas or
+  columnas, and Operaciones is an operation or a list of them, whose results are unified in the
+  same order. All the operations are computed in one pass over the matrix
+*/
+foreign_t pl_reduce_matrix(term_t matrix, term_t axis, term_t operations, term_t result) {
+    int requested[REDUCTION_MAX_OPERATIONS];
+    int number_operations = 0;
+    int all_operations = 0;
+    int single = PL_is_atom(operations);
+    char* axis_name;
+    int axis_value;
+
+    if (!PL_get_atom_chars(axis, &axis_name) ||
+        (strcmp(axis_name, "todo") != 0 && strcmp(axis_name, "filas") != 0 && strcmp(axis_name, "columnas") != 0)) {
+        report_error("El eje de la reducción debe ser todo, filas o columnas\n");
+        PL_fail;
+    }
+    axis_value = strcmp(axis_name, "todo") == 0 ? REDUCTION_ALL :
+                 strcmp(axis_name, "filas") == 0 ? REDUCTION_ROWS : REDUCTION_COLUMNS;
+    if (single) {
+        if (!(requested[0] = get_operation(operations))) {
+            PL_fail;
+        }
+        number_operations = 1;
+    } else {
+        term_t list = PL_copy_term_ref(operations);
+        term_t head = PL_new_term_ref();
+        while (PL_get_list(list, head, list)) {
+            if (number_operations == REDUCTION_MAX_OPERATIONS) {
+                report_error("Como mucho se pueden pedir %d operaciones\n", REDUCTION_MAX_OPERATIONS);
+                PL_fail;
+            }
+            if (!(requested[number_operations++] = get_operation(head))) {
+                PL_fail;
+            }
+        }
+        if (!PL_get_nil(list)) {
+            report_error("Las operaciones deben ser una operación o una lista de operaciones\n");
+            PL_fail;
+        }
+    }
+    for (int i = 0; i < number_operations; i++) {
+        all_operations |= requested[i];
+    }
+
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    int number_results = axis_value == REDUCTION_ALL ? 1 : axis_value == REDUCTION_ROWS ? m->rows : m->columns;
+    size_t capacity;
+    Reduction* results = pool_allocate(sizeof(Reduction) * (size_t) number_results, &capacity);
+    if (!results || reduce_matrix(m, axis_value, all_operations, results) == FAILURE) {
+        pool_release(results, capacity);
+        return arena_fail(&arena);
+    }
+
+    int unified = TRUE;
+    if (single) {
+        unified = unify_reduction(result, results, number_results, requested[0], axis_value, m);
+    } else {
+        term_t list = PL_copy_term_ref(result);
+        term_t head = PL_new_term_ref();
+        for (int i = 0; unified && i < number_operations; i++) {
+            unified = PL_unify_list(list, head, list) &&
+                      unify_reduction(head, results, number_results, requested[i], axis_value, m);
+        }
+        unified = unified && PL_unify_nil(list);
+    }
+    pool_release(results, capacity);
+    arena_release(&arena);
+    return unified;
+}
+
+/*
+    Summation algorithm of the calling thread, which the background operations copy when they
+    are started and use when they are run
+*/
+int get_summation_algorithm(void) {
+    return summation_algorithm;
+}
+
+void set_summation_algorithm(int algorithm) {
+    summation_algorithm = algorithm;
+}
+
+/*
+  Foreign predicate to query (unbound argument) or change (por_pares or kahan) the summation
+  algorithm of the reductions of the calling thread
+*/
+foreign_t pl_summation_algorithm(term_t algorithm) {
+    char* name;
+    if (PL_is_variable(algorithm)) {
+        return PL_unify_atom_chars(algorithm, summation_names[summation_algorithm]);
+    }
+    if (PL_get_atom_chars(algorithm, &name)) {
+        for (int i = 0; i < (int)(sizeof(summation_names) / sizeof(summation_names[0])); i++) {
+            if (strcmp(name, summation_names[i]) == 0) {
+                summation_algorithm = i;
+                PL_succeed;
+            }
+        }
+    }
+    report_error("El algoritmo de suma debe ser por_pares o kahan\n");
+    PL_fail;
+}
@@ -0,0 +1,720 @@
+#include "definitions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SWI-Stream.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the sparse matrices. A sparse matrix keeps only its non zero values
+  in compressed rows (CSR) or compressed columns (CSC):
+    - pointers[i] .. pointers[i + 1] - 1 are the positions of the values of row (or column) i
+    - indices[p] is the column (or row) of values[p], in increasing order inside each row (or column)
+  The CSR form of a matrix is also the CSC form of its transpose.
+  Sparse matrices are used through handles of the blob matriz_dispersa, and the operations
+  on them are chosen automatically by sumar_matrices/3, restar_matrices/3,
+  multiplicar_matrices/3, transponer_matriz/2 and the products by a factor.
+*/
+
+/*
+    Create a sparse matrix with room for nonzeros values. Returns NULL on failure
+*/
+SparseMatrix* new_sparse_matrix(int rows, int columns, int format, size_t nonzeros) {
+    if (rows <= 0 || columns <= 0) {
+        return NULL;
+    }
+    SparseMatrix* sparse = malloc(sizeof(SparseMatrix));
+    if (!sparse) {
+        report_error("Error, no es posible crear la matriz dispersa\n");
+        return NULL;
+    }
+    int major = format == SPARSE_CSR ? rows : columns;
+    sparse->rows = rows;
+    sparse->columns = columns;
+    sparse->format = format;
+    sparse->pointers = calloc((size_t) major + 1, sizeof(size_t));
+    sparse->indices = malloc((nonzeros ? nonzeros : 1) * sizeof(int));
+    sparse->values = malloc((nonzeros ? nonzeros : 1) * sizeof(double));
+    if (!sparse->pointers || !sparse->indices || !sparse->values) {
+        free_sparse_matrix(sparse);
+        report_error("Error, no es posible crear la matriz dispersa\n");
+        return NULL;
+    }
+    return sparse;
+}
+
+/*
+    Free the memory of a sparse matrix
+*/
+void free_sparse_matrix(SparseMatrix* sparse) {
+    if (sparse) {
+        free(sparse->pointers);
+        free(sparse->indices);
+        free(sparse->values);
+        free(sparse);
+    }
+}
+
+/*
+    Number of rows (CSR) or columns (CSC) which are compressed
+*/
+static int major_dimension(const SparseMatrix* sparse) {
+    return sparse->format == SPARSE_CSR ? sparse->rows : sparse->columns;
+}
+
+/*
+    Number of values stored in a sparse matrix
+*/
+size_t sparse_nonzeros(const SparseMatrix* sparse) {
+    return sparse->pointers[major_dimension(sparse)];
+}
+
+/*
+    Build the sparse form of a dense matrix or view. The dense matrix is traversed by columns,
+    also when the result has compressed rows. A matrix stored by rows is traversed as its
+    transpose, which is stored by columns, so the values are always read in the order they are
+    stored. Returns NULL on failure
+*/
+SparseMatrix* dense_to_sparse(Matrix* matrix, int format) {
+    if (!matrix) {
+        return NULL;
+    }
+    if (matrix->rows > 1 && matrix->columns > 1 && matrix->column_stride == 1) {
+        Matrix transpose;
+        SparseMatrix* sparse = dense_to_sparse(describe_transpose(matrix, &transpose),
+                                               format == SPARSE_CSR ? SPARSE_CSC : SPARSE_CSR);
+        if (sparse) {
+            // The compressed columns of the transpose are the compressed rows of the matrix
+            sparse->rows = matrix->rows;
+            sparse->columns = matrix->columns;
+            sparse->format = format;
+        }
+        return sparse;
+    }
+    size_t nonzeros = 0;
+    for (int column = 0; column < matrix->columns; column++) {
+        for (int row = 0; row < matrix->rows; row++) {
+            nonzeros += ACCESS(matrix, row, column) != 0.0;
+        }
+    }
+    SparseMatrix* sparse = new_sparse_matrix(matrix->rows, matrix->columns, format, nonzeros);
+    if (!sparse) {
+        return NULL;
+    }
+    size_t* pointers = sparse->pointers;
+    if (format == SPARSE_CSC) {
+        for (int column = 0; column < matrix->columns; column++) {
+            size_t position = pointers[column];
+            for (int row = 0; row < matrix->rows; row++) {
+                double value = ACCESS(matrix, row, column);
+                if (value != 0.0) {
+                    sparse->indices[position] = row;
+                    sparse->values[position++] = value;
+                }
+            }
+            pointers[column + 1] = position;
+        }
+        return sparse;
+    }
+    // Count the values of each row, turn the counts into the first position of each row and fill the rows
+    for (int column = 0; column < matrix->columns; column++) {
+        for (int row = 0; row < matrix->rows; row++) {
+            pointers[row + 1] += ACCESS(matrix, row, column) != 0.0;
+        }
+    }
+    for (int row = 0; row < matrix->rows; row++) {
+        pointers[row + 1] += pointers[row];
+    }
+    for (int column = 0; column < matrix->columns; column++) {
+        for (int row = 0; row < matrix->rows; row++) {
+            double value = ACCESS(matrix, row, column);
+            if (value != 0.0) {
+                size_t position = pointers[row]++;
+                sparse->indices[position] = column;
+                sparse->values[position] = value;
+            }
+        }
+    }
+    // pointers[row] now holds the first position of the next row
+    memmove(pointers + 1, pointers, (size_t) matrix->rows * sizeof(size_t));
+    pointers[0] = 0;
+    return sparse;
+}
+
+/*
+    Build the dense form of a sparse matrix. Returns NULL on failure
+*/
+Matrix* sparse_to_dense(SparseMatrix* sparse) {
+    if (!sparse) {
+        return NULL;
+    }
+    Matrix* matrix = new_matrix(sparse->rows, sparse->columns);
+    if (!matrix) {
+        return NULL;
+    }
+    memset(matrix->data, 0, (size_t) sparse->rows * sparse->columns * sizeof(double));
+    for (int major = 0; major < major_dimension(sparse); major++) {
+        for (size_t p = sparse->pointers[major]; p < sparse->pointers[major + 1]; p++) {
+            if (sparse->format == SPARSE_CSR) {
+                ACCESS(matrix, major, sparse->indices[p]) = sparse->values[p];
+            } else {
+                ACCESS(matrix, sparse->indices[p], major) = sparse->values[p];
+            }
+        }
+    }
+    return matrix;
+}
+
+/*
+    Copy a sparse matrix in the given format. Changing the format is a counting sort of the
+    values by their index, which keeps the indices of each row (or column) in order.
+    Returns NULL on failure
+*/
+SparseMatrix* sparse_convert(SparseMatrix* sparse, int format) {
+    if (!sparse) {
+        return NULL;
+    }
+    size_t nonzeros = sparse_nonzeros(sparse);
+    SparseMatrix* result = new_sparse_matrix(sparse->rows, sparse->columns, format, nonzeros);
+    if (!result) {
+        return NULL;
+    }
+    if (format == sparse->format) {
+        memcpy(result->pointers, sparse->pointers, ((size_t) major_dimension(sparse) + 1) * sizeof(size_t));
+        memcpy(result->indices, sparse->indices, nonzeros * sizeof(int));
+        memcpy(result->values, sparse->values, nonzeros * sizeof(double));
+        return result;
+    }
+    int minor = major_dimension(result);
+    size_t* pointers = result->pointers;
+    for (size_t p = 0; p < nonzeros; p++) {
+        pointers[sparse->indices[p] + 1]++;
+    }
+    for (int i = 0; i < minor; i++) {
+        pointers[i + 1] += pointers[i];
+    }
+    for (int major = 0; major < major_dimension(sparse); major++) {
+        for (size_t p = sparse->pointers[major]; p < sparse->pointers[major + 1]; p++) {
+            size_t position = pointers[sparse->indices[p]]++;
+            result->indices[position] = major;
+            result->values[position] = sparse->values[p];
+        }
+    }
+    memmove(pointers + 1, pointers, (size_t) minor * sizeof(size_t));
+    pointers[0] = 0;
+    return result;
+}
+
+/*
+    Transpose of a sparse matrix: the same arrays with the dimensions and the format swapped.
+    Returns NULL on failure
+*/
+SparseMatrix* sparse_transpose(SparseMatrix* sparse) {
+    SparseMatrix* result = sparse_convert(sparse, sparse ? sparse->format : SPARSE_CSR);
+    if (result) {
+        result->rows = sparse->columns;
+        result->columns = sparse->rows;
+        result->format = sparse->format == SPARSE_CSR ? SPARSE_CSC : SPARSE_CSR;
+    }
+    return result;
+}
+
+/*
+    Obtain the CSR form of a sparse matrix. If it is already in CSR the same matrix is returned,
+    otherwise a new one which has to be freed by the caller
+*/
+static SparseMatrix* as_csr(SparseMatrix* sparse) {
+    return sparse->format == SPARSE_CSR ? sparse : sparse_convert(sparse, SPARSE_CSR);
+}
+
+/*
+    Addition (sign = 1) or substraction (sign = -1) of two sparse matrices, merging the rows
+    of both matrices. The values which become zero are not stored. Returns NULL on failure
+*/
+SparseMatrix* sparse_addition(SparseMatrix* sparse1, SparseMatrix* sparse2, double sign) {
+    if (!sparse1 || !sparse2) {
+        return NULL;
+    }
+    if (sparse1->rows != sparse2->rows || sparse1->columns != sparse2->columns) {
+        report_error("Para realizar la suma o la resta, asegúrate que ambas matrices tienen el mismo número de filas que de columnas\n");
+        return NULL;
+    }
+    SparseMatrix* a = as_csr(sparse1);
+    SparseMatrix* b = as_csr(sparse2);
+    SparseMatrix* result = NULL;
+    if (a && b) {
+        result = new_sparse_matrix(a->rows, a->columns, SPARSE_CSR, sparse_nonzeros(a) + sparse_nonzeros(b));
+    }
+    if (result) {
+        size_t position = 0;
+        for (int row = 0; row < a->rows; row++) {
+            size_t p = a->pointers[row], q = b->pointers[row];
+            size_t p_end = a->pointers[row + 1], q_end = b->pointers[row + 1];
+            while (p < p_end || q < q_end) {
+                int column;
+                double value;
+                if (q == q_end || (p < p_end && a->indices[p] < b->indices[q])) {
+                    column = a->indices[p];
+                    value = a->values[p++];
+                } else if (p == p_end || b->indices[q] < a->indices[p]) {
+                    column = b->indices[q];
+                    value = sign * b->values[q++];
+                } else {
+                    column = a->indices[p];
+                    value = a->values[p++] + sign * b->values[q++];
+                }
+                if (value != 0.0) {
+                    result->indices[position] = column;
+                    result->values[position++] = value;
+                }
+            }
+            result->pointers[row + 1] = position;
+        }
+    }
+    if (a != sparse1) free_sparse_matrix(a);
+    if (b != sparse2) free_sparse_matrix(b);
+    return result;
+}
+
+/*
+    Addition of a sparse and a dense matrix: result = sign1 * sparse + sign2 * matrix, where the
+    dense matrix can be stored in any layout or be a view. Returns SUCCESS or FAILURE
+*/
+int sparse_dense_addition(SparseMatrix* sparse, double sign1, Matrix* matrix, double sign2, Matrix* result) {
+    if (!sparse || !matrix || !result) {
+        return FAILURE;
+    }
+    if (sparse->rows != matrix->rows || sparse->columns != matrix->columns) {
+        report_error("Para realizar la suma o la resta, asegúrate que ambas matrices tienen el mismo número de filas que de columnas\n");
+        return FAILURE;
+    }
+    size_t total = (size_t) matrix->rows * matrix->columns;
+    copy_matrix_values(matrix, result);
+    if (sign2 < 0) {
+        for (size_t i = 0; i < total; i++) {
+            result->data[i] = 0.0 - result->data[i]; // 0 - 0 is 0, while -1 * 0 would be -0
+        }
+    }
+    for (int major = 0; major < major_dimension(sparse); major++) {
+        for (size_t p = sparse->pointers[major]; p < sparse->pointers[major + 1]; p++) {
+            if (sparse->format == SPARSE_CSR) {
+                ACCESS(result, major, sparse->indices[p]) += sign1 * sparse->values[p];
+            } else {
+                ACCESS(result, sparse->indices[p], major) += sign1 * sparse->values[p];
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+    Multiply (or divide) all the values of a sparse matrix by a factor. Returns NULL on failure
+*/
+SparseMatrix* sparse_scale(SparseMatrix* sparse, double factor, int divide) {
+    if (divide && factor == 0) {
+        report_error("No es posible dividir los valores entre 0\n");
+        return NULL;
+    }
+    SparseMatrix* result = sparse_convert(sparse, sparse ? sparse->format : SPARSE_CSR);
+    if (!result) {
+        return NULL;
+    }
+    size_t nonzeros = sparse_nonzeros(result);
+    if (divide) {
+        for (size_t p = 0; p < nonzeros; p++) result->values[p] /= factor;
+    } else {
+        for (size_t p = 0; p < nonzeros; p++) result->values[p] *= factor;
+    }
+    return result;
+}
+
+typedef struct {
+    SparseMatrix* sparse;
+    Matrix* matrix;
+    Matrix* result;
+} SparseProductJob;
+
+/*
+    Rows [begin, end) of the product of a CSR matrix and a dense matrix
+*/
+static void sparse_dense_rows_task(void* context, size_t begin, size_t end) {
+    SparseProductJob* job = context;
+    SparseMatrix* a = job->sparse;
+    Matrix* b = job->matrix;
+    Matrix* c = job->result;
+    for (int row = (int) begin; row < (int) end; row++) {
+        for (int column = 0; column < b->columns; column++) {
+            const double* b_column = b->data + (size_t) column * b->column_stride;
+            double value = 0;
+            for (size_t p = a->pointers[row]; p < a->pointers[row + 1]; p++) {
+                value += a->values[p] * b_column[(size_t) a->indices[p] * b->row_stride];
+            }
+            ACCESS(c, row, column) = value;
+        }
+    }
+}
+
+/*
+    Columns [begin, end) of the product of a dense matrix and a CSC matrix. Each column of the
+    result is a combination of the columns of the dense matrix
+*/
+static void dense_sparse_columns_task(void* context, size_t begin, size_t end) {
+    SparseProductJob* job = context;
+    SparseMatrix* b = job->sparse;
+    Matrix* a = job->matrix;
+    Matrix* c = job->result;
+    for (int column = (int) begin; column < (int) end; column++) {
+        double* c_column = c->data + (size_t) column * c->rows;
+        memset(c_column, 0, (size_t) c->rows * sizeof(double));
+        for (size_t p = b->pointers[column]; p < b->pointers[column + 1]; p++) {
+            const double* a_column = a->data + (size_t) b->indices[p] * a->column_stride;
+            double factor = b->values[p];
+            for (int row = 0; row < a->rows; row++) {
+                c_column[row] += factor * a_column[(size_t) row * a->row_stride];
+            }
+        }
+    }
+}
+
+/*
+    Product of a sparse and a dense matrix (a matrix-vector product when the dense matrix has
+    one column), which is read through its strides. Returns SUCCESS or FAILURE
+*/
+int sparse_dense_multiplication(SparseMatrix* sparse, Matrix* matrix, Matrix* result) {
+    if (!sparse || !matrix || !result) {
+        return FAILURE;
+    }
+    if (sparse->columns != matrix->rows) {
+        report_error("Para realizar la multiplicación, asegúrate de que el número de columnas de "
+               "la primera matriz: %d sea igual al número de filas de la segunda: %d\n",
+               sparse->columns, matrix->rows);
+        return FAILURE;
+    }
+    SparseMatrix* a = as_csr(sparse);
+    if (!a) {
+        return FAILURE;
+    }
+    SparseProductJob job = { a, matrix, result };
+    size_t work_per_row = sparse_nonzeros(a) / a->rows * matrix->columns + 1;
+    parallel_for(a->rows, PARALLEL_GRAIN / work_per_row + 1, sparse_dense_rows_task, &job);
+    if (a != sparse) free_sparse_matrix(a);
+    return SUCCESS;
+}
+
+/*
+    Product of a dense and a sparse matrix, which is read through its strides. Returns SUCCESS or FAILURE
+*/
+int dense_sparse_multiplication(Matrix* matrix, SparseMatrix* sparse, Matrix* result) {
+    if (!sparse || !matrix || !result) {
+        return FAILURE;
+    }
+    if (matrix->columns != sparse->rows) {
+        report_error("Para realizar la multiplicación, asegúrate de que el número de columnas de "
+               "la primera matriz: %d sea igual al número de filas de la segunda: %d\n",
+               matrix->columns, sparse->rows);
+        return FAILURE;
+    }
+    SparseMatrix* b = sparse->format == SPARSE_CSC ? sparse : sparse_convert(sparse, SPARSE_CSC);
+    if (!b) {
+        return FAILURE;
+    }
+    SparseProductJob job = { b, matrix, result };
+    size_t work_per_column = sparse_nonzeros(b) / b->columns * matrix->rows + 1;
+    parallel_for(b->columns, PARALLEL_GRAIN / work_per_column + 1, dense_sparse_columns_task, &job);
+    if (b != sparse) free_sparse_matrix(b);
+    return SUCCESS;
+}
+
+/*
+    Product of two sparse matrices, row by row (Gustavson's algorithm): the row i of the result
+    combines the rows of the second matrix selected by the row i of the first one. A first pass
+    counts the values of each row of the result and a second one computes them.
+    Returns NULL on failure
+*/
+SparseMatrix* sparse_sparse_multiplication(SparseMatrix* sparse1, SparseMatrix* sparse2) {
+    if (!sparse1 || !sparse2) {
+        return NULL;
+    }
+    if (sparse1->columns != sparse2->rows) {
+        report_error("Para realizar la multiplicación, asegúrate de que el número de columnas de "
+               "la primera matriz: %d sea igual al número de filas de la segunda: %d\n",
+               sparse1->columns, sparse2->rows);
+        return NULL;
+    }
+    SparseMatrix* a = as_csr(sparse1);
+    SparseMatrix* b = as_csr(sparse2);
+    int* marker = malloc((size_t) sparse2->columns * sizeof(int)); // last row which used each column
+    double* accumulator = malloc((size_t) sparse2->columns * sizeof(double));
+    int* row_columns = malloc((size_t) sparse2->columns * sizeof(int)); // columns used in the current row
+    SparseMatrix* result = NULL;
+
+    if (a && b && marker && accumulator && row_columns) {
+        size_t nonzeros = 0;
+        for (int column = 0; column < b->columns; column++) marker[column] = -1;
+        for (int row = 0; row < a->rows; row++) {
+            for (size_t p = a->pointers[row]; p < a->pointers[row + 1]; p++) {
+                int k = a->indices[p];
+                for (size_t q = b->pointers[k]; q < b->pointers[k + 1]; q++) {
+                    if (marker[b->indices[q]] != row) {
+                        marker[b->indices[q]] = row;
+                        nonzeros++;
+                    }
+                }
+            }
+        }
+        result = new_sparse_matrix(a->rows, b->columns, SPARSE_CSR, nonzeros);
+    }
+    if (result) {
+        size_t position = 0;
+        for (int column = 0; column < b->columns; column++) marker[column] = -1;
+        for (int row = 0; row < a->rows; row++) {
+            int count = 0;
+            for (size_t p = a->pointers[row]; p < a->pointers[row + 1]; p++) {
+                int k = a->indices[p];
+                double factor = a->values[p];
+                for (size_t q = b->pointers[k]; q < b->pointers[k + 1]; q++) {
+                    int column = b->indices[q];
+                    if (marker[column] != row) {
+                        marker[column] = row;
+                        accumulator[column] = 0;
+                        row_columns[count++] = column;
+                    }
+                    accumulator[column] += factor * b->values[q];
+                }
+            }
+            // Keep the columns of the row in order
+            for (int i = 1; i < count; i++) {
+                int column = row_columns[i], j = i;
+                for (; j > 0 && row_columns[j - 1] > column; j--) row_columns[j] = row_columns[j - 1];
+                row_columns[j] = column;
+            }
+            for (int i = 0; i < count; i++) {
+                result->indices[position] = row_columns[i];
+                result->values[position++] = accumulator[row_columns[i]];
+            }
+            result->pointers[row + 1] = position;
+        }
+    }
+    free(marker);
+    free(accumulator);
+    free(row_columns);
+    if (a && a != sparse1) free_sparse_matrix(a);
+    if (b && b != sparse2) free_sparse_matrix(b);
+    return result;
+}
+
+/*********************************************/
+/*
+    Handles of sparse matrices
+*/
+/**********************************************/
+
+static int release_sparse_handle(atom_t handle) {
+    SparseMatrix** sparse = (SparseMatrix**) PL_blob_data(handle, NULL, NULL);
+    if (sparse && *sparse) {
+        free_sparse_matrix(*sparse);
+        *sparse = NULL;
+    }
+    return TRUE;
+}
+
+/*
+   Print a handle as <matriz_dispersa>(Address,RowsxColumns,Nonzeros)
+*/
+static int write_sparse_handle(IOSTREAM* stream, atom_t handle, int flags) {
+    SparseMatrix** sparse = (SparseMatrix**) PL_blob_data(handle, NULL, NULL);
+    if (!sparse || !*sparse) {
+        Sfprintf(stream, "<matriz_dispersa>(liberada)");
+        return TRUE;
+    }
+    Sfprintf(stream, "<matriz_dispersa>(%p,%dx%d,%zu)", (void*) *sparse, (*sparse)->rows,
+             (*sparse)->columns, sparse_nonzeros(*sparse));
+    return TRUE;
+}
+
+static PL_blob_t sparse_blob = {
+    PL_BLOB_MAGIC,
+    PL_BLOB_UNIQUE,
+    "matriz_dispersa",
+    release_sparse_handle,
+    NULL,
+    write_sparse_handle,
+    NULL
+};
+
+/*
+    Unify a term with a new handle which owns the sparse matrix. Returns SUCCESS or FAILURE
+*/
+int unify_sparse_handle(term_t handle, SparseMatrix* sparse) {
+    if (!sparse) {
+        return FAILURE;
+    }
+    return PL_unify_blob(handle, &sparse, sizeof(SparseMatrix*), &sparse_blob);
+}
+
+/*
+    Obtain the sparse matrix of a handle. Returns NULL if the term is not a sparse matrix handle
+*/
+SparseMatrix* get_sparse_from_handle(term_t handle) {
+    void* blob_data;
+    PL_blob_t* type;
+
+    if (!PL_get_blob(handle, &blob_data, NULL, &type) || type != &sparse_blob) {
+        return NULL;
+    }
+    return *(SparseMatrix**) blob_data;
+}
+
+int is_sparse_handle(term_t term) {
+    PL_blob_t* type;
+    return PL_is_blob(term, &type) && type == &sparse_blob;
+}
+
+/*
+    Unify the sparse result of an operation either with a new handle or with a term in the
+    output format. The sparse matrix is owned by the handle blob or freed
+*/
+static int unify_sparse_result(term_t result, SparseMatrix* sparse, int as_handle) {
+    if (!sparse) {
+        return FAILURE;
+    }
+    if (as_handle) {
+        return unify_sparse_handle(result, sparse);
+    }
+    Matrix* matrix = sparse_to_dense(sparse);
+    free_sparse_matrix(sparse);
+    if (!matrix) {
+        return FAILURE;
+    }
+    int unified = unify_matrix_result(result, matrix, 0, NULL);
+    free_matrix(matrix);
+    return unified;
+}
+
+/*
+    Addition, substraction or multiplication when at least one of the operands is a sparse
+    handle. Two sparse operands give a sparse result, otherwise the result is dense
+*/
+foreign_t sparse_binary_common(term_t matrix1, term_t matrix2, term_t result, int operation, int as_handle) {
+    MatrixArena arena;
+    arena_init(&arena);
+    SparseMatrix* s1 = get_sparse_from_handle(matrix1);
+    SparseMatrix* s2 = get_sparse_from_handle(matrix2);
+    double sign = operation == SPARSE_SUBSTRACTION ? -1.0 : 1.0;
+
+    if (s1 && s2) {
+        SparseMatrix* sparse = operation == SPARSE_MULTIPLICATION ? sparse_sparse_multiplication(s1, s2)
+                                                                  : sparse_addition(s1, s2, sign);
+        return unify_sparse_result(result, sparse, as_handle);
+    }
+    Matrix* m = get_strided_matrix_from_term(s1 ? matrix2 : matrix1, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    SparseMatrix* s = s1 ? s1 : s2;
+    Matrix* matrix_result;
+    int done;
+    if (operation == SPARSE_MULTIPLICATION) {
+        matrix_result = s1 ? arena_new_matrix(&arena, s1->rows, m->columns) : arena_new_matrix(&arena, m->rows, s2->columns);
+        done = matrix_result && (s1 ? sparse_dense_multiplication(s1, m, matrix_result)
+                                    : dense_sparse_multiplication(m, s2, matrix_result));
+    } else {
+        matrix_result = arena_new_matrix(&arena, m->rows, m->columns);
+        done = matrix_result && (s1 ? sparse_dense_addition(s, 1.0, m, sign, matrix_result)
+                                    : sparse_dense_addition(s, sign, m, 1.0, matrix_result));
+    }
+    if (!done) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_matrix_result(result, matrix_result, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+/*
+    Transpose of a sparse handle
+*/
+foreign_t sparse_transpose_common(term_t matrix, term_t result, int as_handle) {
+    return unify_sparse_result(result, sparse_transpose(get_sparse_from_handle(matrix)), as_handle);
+}
+
+/*
+    Product (or division) of a sparse handle by a factor
+*/
+foreign_t sparse_scale_common(term_t matrix, term_t factor, term_t result, int divide, int as_handle) {
+    double double_factor;
+    if (!PL_get_float(factor, &double_factor)) {
+        PL_fail;
+    }
+    return unify_sparse_result(result, sparse_scale(get_sparse_from_handle(matrix), double_factor, divide), as_handle);
+}
+
+/*
+  Foreign predicate to create a sparse handle (in CSR) from a list of lists or a handle
+*/
+foreign_t pl_matrix_to_sparse(term_t matrix, term_t sparse) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    SparseMatrix* s = dense_to_sparse(m, SPARSE_CSR);
+    arena_release(&arena);
+    return unify_sparse_result(sparse, s, 1);
+}
+
+/*
+  Foreign predicate to create a sparse handle in a given format (csr or csc)
+*/
+foreign_t pl_matrix_to_sparse_with_format(term_t matrix, term_t format, term_t sparse) {
+    char* name;
+    int sparse_format;
+
+    if (!PL_get_atom_chars(format, &name)) {
+        PL_fail;
+    }
+    if (strcmp(name, "csr") == 0) {
+        sparse_format = SPARSE_CSR;
+    } else if (strcmp(name, "csc") == 0) {
+        sparse_format = SPARSE_CSC;
+    } else {
+        report_error("El formato de una matriz dispersa debe ser csr o csc\n");
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    SparseMatrix* s = dense_to_sparse(m, sparse_format);
+    arena_release(&arena);
+    return unify_sparse_result(sparse, s, 1);
+}
+
+/*
+  Foreign predicates to convert a sparse handle into a list of lists or into a dense handle
+*/
+foreign_t pl_sparse_to_matrix(term_t sparse, term_t result) {
+    Matrix* m = sparse_to_dense(get_sparse_from_handle(sparse));
+    if (!m) {
+        PL_fail;
+    }
+    int unified = unify_matrix_result(result, m, 0, NULL);
+    free_matrix(m);
+    return unified;
+}
+
+foreign_t pl_sparse_to_matrix_handle(term_t sparse, term_t handle) {
+    Matrix* m = sparse_to_dense(get_sparse_from_handle(sparse));
+    if (!m) {
+        PL_fail;
+    }
+    return unify_matrix_result(handle, m, 1, NULL);
+}
+
+/*
+  Foreign predicate to obtain the number of values stored in a sparse handle
+*/
+foreign_t pl_sparse_nonzeros(term_t sparse, term_t nonzeros) {
+    SparseMatrix* s = get_sparse_from_handle(sparse);
+    if (!s) {
+        PL_fail;
+    }
+    return PL_unify_int64(nonzeros, (int64_t) sparse_nonzeros(s));
+}
@@ -0,0 +1,359 @@
+#include "definitions.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the statistics of the foreign predicates. When they are enabled each
+  instrumented predicate counts its calls and its failures (with their reason), the time spent
+  obtaining the matrices of the arguments, computing and unifying the result, the elements of
+  the operands and of the result and the bytes taken from the memory pool.
+  While they are disabled the predicates only check statistics_enabled.
+  The calls can also be written into a trace file in the Chrome trace event format, which
+  can be opened with chrome://tracing or Perfetto to see where the time of each call goes.
+*/
+
+typedef struct {
+    const char* name;
+    int arity;
+    uint64_t calls;
+    uint64_t failures;
+    uint64_t total_ns;
+    uint64_t parse_ns;
+    uint64_t unify_ns;
+    uint64_t input_elements;
+    uint64_t output_elements;
+    uint64_t bytes;
+    uint64_t failure_reasons[STATISTICS_FAILURE_REASONS];
+} PredicateStatistics;
+
+int statistics_enabled = 0;
+
+static pthread_mutex_t statistics_lock = PTHREAD_MUTEX_INITIALIZER;
+static PredicateStatistics predicates[STATISTICS_MAX_PREDICATES];
+static int predicate_count = 0;
+static __thread CallStatistics* current_call = NULL;
+
+static const char* failure_names[STATISTICS_FAILURE_REASONS] = { "argumentos", "memoria", "operacion", "unificacion" };
+
+static FILE* trace_file = NULL;
+static int trace_empty = 1; // no event has been written yet, so the next one needs no comma before it
+
+static uint64_t clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/*
+    Register a predicate whose calls are counted. Returns the index used by statistics_begin,
+    or -1 when there is no room for more predicates (their calls are not counted then)
+*/
+int register_predicate_statistics(const char* name, int arity) {
+    pthread_mutex_lock(&statistics_lock);
+    int index = -1;
+    for (int i = 0; i < predicate_count; i++) {
+        if (predicates[i].arity == arity && strcmp(predicates[i].name, name) == 0) {
+            index = i;
+        }
+    }
+    if (index < 0 && predicate_count < STATISTICS_MAX_PREDICATES) {
+        index = predicate_count++;
+        predicates[index].name = name;
+        predicates[index].arity = arity;
+    }
+    pthread_mutex_unlock(&statistics_lock);
+    return index;
+}
+
+/*
+    Start counting a call of a predicate. The call becomes the current one of the thread,
+    so the functions which read the arguments and unify the results add their counters to it
+*/
+void statistics_begin(CallStatistics* call, int predicate) {
+    memset(call, 0, sizeof(CallStatistics));
+    call->predicate = predicate;
+    call->failure_reason = -1;
+    call->previous = current_call;
+    call->start_ns = clock_ns();
+    current_call = call;
+}
+
+/*
+    Write an event of the trace. The times are microseconds of the monotonic clock
+*/
+static void trace_event(const char* name, int arity, uint64_t start, uint64_t end, const CallStatistics* call) {
+    pthread_mutex_lock(&statistics_lock);
+    if (trace_file) {
+        fprintf(trace_file, "%s{\"name\":\"%s", trace_empty ? "" : ",\n", name);
+        trace_empty = 0;
+        if (arity >= 0) {
+            fprintf(trace_file, "/%d", arity);
+        }
+        fprintf(trace_file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                PL_thread_self(), start / 1000.0, (end - start) / 1000.0);
+        if (call) {
+            fprintf(trace_file, ",\"args\":{\"elementos_entrada\":%llu,\"elementos_salida\":%llu,\"bytes_asignados\":%llu,\"exito\":%s}",
+                    (unsigned long long) call->input_elements, (unsigned long long) call->output_elements,
+                    (unsigned long long) call->bytes, call->failure_reason < 0 ? "true" : "false");
+        }
+        fprintf(trace_file, "}");
+    }
+    pthread_mutex_unlock(&statistics_lock);
+}
+
+/*
+    Finish a call started with statistics_begin and add its counters to the ones of the predicate.
+    Returns the result of the call, so it can be used as the return value of the predicate
+*/
+foreign_t statistics_end(CallStatistics* call, foreign_t result) {
+    uint64_t end = clock_ns();
+    current_call = call->previous;
+    if (call->predicate < 0) {
+        return result;
+    }
+    if (!result && call->failure_reason < 0) {
+        // Nothing failed while reading the arguments, allocating or unifying, so the operation did
+        call->failure_reason = STATISTICS_FAILURE_OPERATION;
+    }
+    PredicateStatistics* predicate = &predicates[call->predicate];
+
+    pthread_mutex_lock(&statistics_lock);
+    predicate->calls++;
+    predicate->total_ns += end - call->start_ns;
+    predicate->parse_ns += call->parse_ns;
+    predicate->unify_ns += call->unify_ns;
+    predicate->input_elements += call->input_elements;
+    predicate->output_elements += call->output_elements;
+    predicate->bytes += call->bytes;
+    if (!result) {
+        predicate->failures++;
+        predicate->failure_reasons[call->failure_reason]++;
+    }
+    pthread_mutex_unlock(&statistics_lock);
+
+    if (trace_file) {
+        trace_event(predicate->name, predicate->arity, call->start_ns, end, call);
+    }
+    return result;
+}
+
+/*
+    Time used to measure a phase of the current call, or 0 if no call is being counted
+*/
+uint64_t statistics_clock(void) {
+    return current_call ? clock_ns() : 0;
+}
+
+/*
+    Count an operand of the current call. If start is not 0 the time since start is
+    added to the time spent reading the arguments. A NULL matrix is a wrong argument
+*/
+void statistics_record_operand(uint64_t start, Matrix* matrix) {
+    CallStatistics* call = current_call;
+    if (!call) {
+        return;
+    }
+    if (start) {
+        uint64_t end = clock_ns();
+        call->parse_ns += end - start;
+        if (trace_file) {
+            trace_event("lectura", -1, start, end, NULL);
+        }
+    }
+    if (matrix) {
+        call->input_elements += (uint64_t) matrix->rows * matrix->columns;
+    } else {
+        statistics_record_failure(STATISTICS_FAILURE_ARGUMENTS);
+    }
+}
+
+/*
+    Count the result of the current call, unified since start
+*/
+void statistics_record_result(uint64_t start, Matrix* matrix, int unified) {
+    CallStatistics* call = current_call;
+    if (!call) {
+        return;
+    }
+    if (start) {
+        uint64_t end = clock_ns();
+        call->unify_ns += end - start;
+        if (trace_file) {
+            trace_event("unificacion", -1, start, end, NULL);
+        }
+    }
+    if (matrix) {
+        call->output_elements += (uint64_t) matrix->rows * matrix->columns;
+    }
+    if (!unified) {
+        statistics_record_failure(STATISTICS_FAILURE_UNIFICATION);
+    }
+}
+
+/*
+    Count the bytes taken from the memory pool by the current call
+*/
+void statistics_record_allocation(size_t bytes) {
+    if (current_call) {
+        current_call->bytes += bytes;
+    }
+}
+
+/*
+    Record why the current call fails. Only the first reason is kept, the rest are consequences of it
+*/
+void statistics_record_failure(int reason) {
+    if (current_call && current_call->failure_reason < 0) {
+        current_call->failure_reason = reason;
+    }
+}
+
+/*
+    Unify the tail of a list with a new Key-Value pair. Returns TRUE or FALSE
+*/
+static int unify_pair(term_t list, const char* key, uint64_t value) {
+    term_t head = PL_new_term_ref();
+    term_t argument = PL_new_term_ref();
+    return PL_unify_list(list, head, list) &&
+           PL_unify_functor(head, PL_new_functor(PL_new_atom("-"), 2)) &&
+           PL_get_arg(1, head, argument) && PL_unify_atom_chars(argument, key) &&
+           PL_get_arg(2, head, argument) && PL_unify_int64(argument, (int64_t) value);
+}
+
+/*
+  Foreign predicate to obtain the statistics of the predicates which have been called, as a list of
+  Nombre/Aridad-[llamadas-N, fallos-N, ns_total-N, ns_lectura-N, ns_calculo-N, ns_unificacion-N,
+  elementos_entrada-N, elementos_salida-N, bytes_asignados-N, errores-[argumentos-N, memoria-N, operacion-N, unificacion-N]]
+*/
+foreign_t pl_matrices_stats(term_t statistics) {
+    PredicateStatistics copy[STATISTICS_MAX_PREDICATES];
+    pthread_mutex_lock(&statistics_lock);
+    int count = predicate_count;
+    memcpy(copy, predicates, sizeof(PredicateStatistics) * count);
+    pthread_mutex_unlock(&statistics_lock);
+
+    functor_t pair = PL_new_functor(PL_new_atom("-"), 2);
+    functor_t indicator = PL_new_functor(PL_new_atom("/"), 2);
+    term_t list = PL_copy_term_ref(statistics);
+    term_t head = PL_new_term_ref();
+    term_t argument = PL_new_term_ref();
+    term_t name = PL_new_term_ref();
+    term_t values = PL_new_term_ref();
+    term_t errors = PL_new_term_ref();
+
+    for (int i = 0; i < count; i++) {
+        PredicateStatistics* predicate = &copy[i];
+        if (!predicate->calls) {
+            continue;
+        }
+        uint64_t phases = predicate->parse_ns + predicate->unify_ns;
+        uint64_t compute_ns = predicate->total_ns > phases ? predicate->total_ns - phases : 0;
+
+        if (!PL_unify_list(list, head, list) || !PL_unify_functor(head, pair) ||
+            !PL_get_arg(1, head, argument) || !PL_unify_functor(argument, indicator) ||
+            !PL_get_arg(1, argument, name) || !PL_unify_atom_chars(name, predicate->name) ||
+            !PL_get_arg(2, argument, name) || !PL_unify_integer(name, predicate->arity) ||
+            !PL_get_arg(2, head, values)) {
+            PL_fail;
+        }
+        if (!unify_pair(values, "llamadas", predicate->calls) ||
+            !unify_pair(values, "fallos", predicate->failures) ||
+            !unify_pair(values, "ns_total", predicate->total_ns) ||
+            !unify_pair(values, "ns_lectura", predicate->parse_ns) ||
+            !unify_pair(values, "ns_calculo", compute_ns) ||
+            !unify_pair(values, "ns_unificacion", predicate->unify_ns) ||
+            !unify_pair(values, "elementos_entrada", predicate->input_elements) ||
+            !unify_pair(values, "elementos_salida", predicate->output_elements) ||
+            !unify_pair(values, "bytes_asignados", predicate->bytes) ||
+            !PL_unify_list(values, head, values) || !PL_unify_functor(head, pair) ||
+            !PL_get_arg(1, head, argument) || !PL_unify_atom_chars(argument, "errores") ||
+            !PL_get_arg(2, head, errors)) {
+            PL_fail;
+        }
+        for (int reason = 0; reason < STATISTICS_FAILURE_REASONS; reason++) {
+            if (!unify_pair(errors, failure_names[reason], predicate->failure_reasons[reason])) {
+                PL_fail;
+            }
+        }
+        if (!PL_unify_nil(errors) || !PL_unify_nil(values)) {
+            PL_fail;
+        }
+    }
+    return PL_unify_nil(list);
+}
+
+/*
+  Foreign predicate to query (unbound argument) or change (true or false) whether the
+  calls of the predicates are counted
+*/
+foreign_t pl_matrices_stats_enable(term_t enabled) {
+    int value;
+    if (PL_is_variable(enabled)) {
+        return PL_unify_bool(enabled, statistics_enabled);
+    }
+    if (!PL_get_bool(enabled, &value)) {
+        report_error("El argumento debe ser true o false\n");
+        PL_fail;
+    }
+    statistics_enabled = value;
+    PL_succeed;
+}
+
+/*
+  Foreign predicate to set all the counters to zero
+*/
+foreign_t pl_matrices_stats_reset(void) {
+    pthread_mutex_lock(&statistics_lock);
+    for (int i = 0; i < predicate_count; i++) {
+        const char* name = predicates[i].name;
+        int arity = predicates[i].arity;
+        memset(&predicates[i], 0, sizeof(PredicateStatistics));
+        predicates[i].name = name;
+        predicates[i].arity = arity;
+    }
+    pthread_mutex_unlock(&statistics_lock);
+    PL_succeed;
+}
+
+/*
+  Foreign predicate to write the calls into a trace file (Chrome trace event format). The
+  statistics are enabled, and each call and its reading and unification phases are an event
+*/
+foreign_t pl_matrices_stats_trace(term_t file) {
+    char* path;
+    if (!PL_get_file_name(file, &path, 0)) {
+        report_error("El nombre del fichero no es correcto\n");
+        PL_fail;
+    }
+    FILE* opened = fopen(path, "w");
+    if (!opened) {
+        report_error("No es posible crear el fichero %s: %s\n", path, strerror(errno));
+        PL_fail;
+    }
+    fprintf(opened, "[\n");
+    pl_matrices_stats_close_trace();
+    pthread_mutex_lock(&statistics_lock);
+    trace_file = opened;
+    trace_empty = 1;
+    pthread_mutex_unlock(&statistics_lock);
+    statistics_enabled = 1;
+    PL_succeed;
+}
+
+/*
+  Foreign predicate to close the trace file. The statistics stay enabled
+*/
+foreign_t pl_matrices_stats_close_trace(void) {
+    pthread_mutex_lock(&statistics_lock);
+    if (trace_file) {
+        fprintf(trace_file, "\n]\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&statistics_lock);
+    PL_succeed;
+}
@@ -0,0 +1,212 @@
+#include "definitions.h"
+#include <string.h>
+#include <stdio.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the Strassen-Winograd product of large matrices. It is only used when
+  it is selected with algoritmo_multiplicacion(strassen), because it is less accurate than the
+  blocked product of matricesGemm.c. The algorithm and the cutoff are settings of the Prolog
+  thread which selects them, so a thread which asks for Strassen does not change the products
+  of the others.
+    - Every level splits A, B and C in four quadrants and computes the product with 7 products
+      of quadrants and 15 additions instead of 8 products (Winograd's variant of Strassen's
+      algorithm), so each level saves 1/8 of the operations.
+    - The recursion stops when any dimension is below the cutoff (umbral_strassen/1), and the
+      quadrants are multiplied by the blocked kernel.
+    - When a dimension is odd, the last row, column or inner index is left out of the recursion
+      and added by the blocked kernel afterwards, so no padded copies are needed.
+    - The quadrants of C hold the intermediate products, and the rest of the temporaries of all
+      the levels come from a single buffer of the memory pool allocated before the recursion.
+      Its size is about a third of A plus a third of B.
+  Error bound (Higham, Accuracy and Stability of Numerical Algorithms, 2nd ed., section 23.2.2):
+  with u the unit roundoff (2^-53), n the size of square matrices, n0 the size of the products
+  done by the blocked kernel and |X| the largest absolute value of the elements of X,
+      |C - computed C| <= ((n / n0)^log2(18) * (n0^2 + 6 n0) - 6 n) * u * |A| * |B|
+  while the classical product satisfies |c_ij - computed c_ij| <= n u (|A| |B|)_ij element by
+  element. Each level multiplies the bound by about 18/4 = 4.5 instead of 2, and the bound is
+  relative to the largest elements of A and B, so the small elements of C can lose most of their
+  digits when A or B have elements of very different magnitudes.
+*/
+
+static __thread int multiplication_algorithm = MULTIPLICATION_CLASSIC;
+static __thread int strassen_cutoff = STRASSEN_CUTOFF;
+
+static const char* algorithm_names[] = { "clasico", "strassen" };
+
+typedef struct {
+    const double* a;
+    int lda;
+    const double* b;
+    int ldb;
+    double* c;
+    int ldc;
+    int rows;
+    double sign; // c = a + sign * b
+} AdditionJob;
+
+/*
+    Add the columns [begin, end) of two blocks with the SIMD kernels
+*/
+static void add_blocks_task(void* context, size_t begin, size_t end) {
+    AdditionJob* job = context;
+    binary_kernel_t kernel = job->sign > 0 ? kernels->add : kernels->substract;
+    for (size_t column = begin; column < end; column++) {
+        kernel(job->a + column * job->lda, job->b + column * job->ldb, job->c + column * job->ldc, (size_t) job->rows);
+    }
+}
+
+/*
+    C = A + sign * B for blocks of rows x columns with their own leading dimensions.
+    C can be the same block as A or B
+*/
+static void add_blocks(int rows, int columns, const double* a, int lda, double sign, const double* b, int ldb,
+                       double* c, int ldc) {
+    AdditionJob job = { a, lda, b, ldb, c, ldc, rows, sign };
+    parallel_for((size_t) columns, PARALLEL_GRAIN / rows + 1, add_blocks_task, &job);
+}
+
+/*
+    Doubles of workspace needed by strassen_recursive for a product of m x k by k x n
+*/
+static size_t strassen_workspace(int m, int n, int k, int cutoff) {
+    size_t total = 0;
+    while (m >= cutoff && n >= cutoff && k >= cutoff) {
+        m /= 2;
+        n /= 2;
+        k /= 2;
+        total += (size_t) m * (k > n ? k : n) + (size_t) k * n;
+    }
+    return total;
+}
+
+/*
+    C = A * B, where A is m x k, B is k x n and C is m x n, all column-major with their leading
+    dimensions. The workspace has the size given by strassen_workspace.
+    Returns SUCCESS, or FAILURE if the blocked kernel can not allocate its buffers
+*/
+static int strassen_recursive(int m, int n, int k, const double* a, int lda, const double* b, int ldb,
+                              double* c, int ldc, double* workspace, int cutoff) {
+    if (m < cutoff || n < cutoff || k < cutoff) {
+        return gemm_parallel(m, n, k, 1.0, a, lda, b, ldb, 0.0, c, ldc);
+    }
+    int hm = m / 2, hn = n / 2, hk = k / 2;
+    const double *a11 = a, *a21 = a + hm, *a12 = a + (size_t) hk * lda, *a22 = a12 + hm;
+    const double *b11 = b, *b21 = b + hk, *b12 = b + (size_t) hn * ldb, *b22 = b12 + hk;
+    double *c11 = c, *c21 = c + hm, *c12 = c + (size_t) hn * ldc, *c22 = c12 + hm;
+    // X holds the sums of quadrants of A and then P1, Y the sums of quadrants of B
+    double* x = workspace;
+    double* y = x + (size_t) hm * (hk > hn ? hk : hn);
+    double* next = y + (size_t) hk * hn;
+    int ok = SUCCESS;
+
+    // Schedule of Boyer, Dumas, Pernet and Zhou (2009), with two temporaries per level
+    add_blocks(hm, hk, a11, lda, -1.0, a21, lda, x, hm);                              // X = S3 = A11 - A21
+    add_blocks(hk, hn, b22, ldb, -1.0, b12, ldb, y, hk);                              // Y = T3 = B22 - B12
+    ok = ok && strassen_recursive(hm, hn, hk, x, hm, y, hk, c21, ldc, next, cutoff);   // C21 = P7 = S3 T3
+    add_blocks(hm, hk, a21, lda, 1.0, a22, lda, x, hm);                               // X = S1 = A21 + A22
+    add_blocks(hk, hn, b12, ldb, -1.0, b11, ldb, y, hk);                              // Y = T1 = B12 - B11
+    ok = ok && strassen_recursive(hm, hn, hk, x, hm, y, hk, c22, ldc, next, cutoff);   // C22 = P5 = S1 T1
+    add_blocks(hm, hk, x, hm, -1.0, a11, lda, x, hm);                                 // X = S2 = S1 - A11
+    add_blocks(hk, hn, b22, ldb, -1.0, y, hk, y, hk);                                 // Y = T2 = B22 - T1
+    ok = ok && strassen_recursive(hm, hn, hk, x, hm, y, hk, c12, ldc, next, cutoff);   // C12 = P6 = S2 T2
+    add_blocks(hm, hk, a12, lda, -1.0, x, hm, x, hm);                                 // X = S4 = A12 - S2
+    ok = ok && strassen_recursive(hm, hn, hk, x, hm, b22, ldb, c11, ldc, next, cutoff); // C11 = P3 = S4 B22
+    ok = ok && strassen_recursive(hm, hn, hk, a11, lda, b11, ldb, x, hm, next, cutoff); // X = P1 = A11 B11
+    add_blocks(hm, hn, x, hm, 1.0, c12, ldc, c12, ldc);                               // C12 = U2 = P1 + P6
+    add_blocks(hm, hn, c12, ldc, 1.0, c21, ldc, c21, ldc);                            // C21 = U3 = U2 + P7
+    add_blocks(hm, hn, c12, ldc, 1.0, c22, ldc, c12, ldc);                            // C12 = U4 = U2 + P5
+    add_blocks(hm, hn, c21, ldc, 1.0, c22, ldc, c22, ldc);                            // C22 = U7 = U3 + P5
+    add_blocks(hm, hn, c12, ldc, 1.0, c11, ldc, c12, ldc);                            // C12 = U5 = U4 + P3
+    add_blocks(hk, hn, y, hk, -1.0, b21, ldb, y, hk);                                 // Y = T4 = T2 - B21
+    ok = ok && strassen_recursive(hm, hn, hk, a22, lda, y, hk, c11, ldc, next, cutoff); // C11 = P4 = A22 T4
+    add_blocks(hm, hn, c21, ldc, -1.0, c11, ldc, c21, ldc);                           // C21 = U6 = U3 - P4
+    ok = ok && strassen_recursive(hm, hn, hk, a12, lda, b21, ldb, c11, ldc, next, cutoff); // C11 = P2 = A12 B21
+    add_blocks(hm, hn, x, hm, 1.0, c11, ldc, c11, ldc);                               // C11 = U1 = P1 + P2
+
+    // Odd dimensions: the last inner index, row and column are added by the blocked kernel
+    int em = 2 * hm, en = 2 * hn, ek = 2 * hk;
+    if (ok && ek < k) {
+        ok = gemm_blocked(em, en, 1, 1.0, a + (size_t) ek * lda, lda, b + ek, ldb, 1.0, c, ldc);
+    }
+    if (ok && em < m) {
+        ok = gemm_blocked(1, n, k, 1.0, a + em, lda, b, ldb, 0.0, c + em, ldc);
+    }
+    if (ok && en < n) {
+        ok = gemm_blocked(em, 1, k, 1.0, a, lda, b + (size_t) en * ldb, ldb, 0.0, c + (size_t) en * ldc, ldc);
+    }
+    return ok;
+}
+
+/*
+    Multiply two matrices with the Strassen-Winograd algorithm if it has been selected and the
+    matrices are big enough. Returns SUCCESS if the product has been computed, otherwise FAILURE
+    (and the caller uses the classical product)
+*/
+int strassen_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix* result) {
+    int m = matrix1->rows, n = matrix2->columns, k = matrix1->columns;
+    int cutoff = strassen_cutoff;
+    if (multiplication_algorithm != MULTIPLICATION_STRASSEN || m < cutoff || n < cutoff || k < cutoff) {
+        return FAILURE;
+    }
+    size_t capacity;
+    double* workspace = pool_allocate(strassen_workspace(m, n, k, cutoff) * sizeof(double), &capacity);
+    if (!workspace) {
+        return FAILURE;
+    }
+    int computed = strassen_recursive(m, n, k, matrix1->data, m, matrix2->data, k, result->data, m, workspace, cutoff);
+    pool_release(workspace, capacity);
+    return computed;
+}
+
+/*
+    Algorithm and cutoff of the products of the calling thread, which the background operations
+    copy when they are started and use when they are run
+*/
+void get_multiplication_settings(int* algorithm, int* cutoff) {
+    *algorithm = multiplication_algorithm;
+    *cutoff = strassen_cutoff;
+}
+
+void set_multiplication_settings(int algorithm, int cutoff) {
+    multiplication_algorithm = algorithm;
+    strassen_cutoff = cutoff;
+}
+
+/*
+  Foreign predicate to query (unbound argument) or change (clasico or strassen) the algorithm
+  of the products of large dense matrices of the calling thread
+*/
+foreign_t pl_multiplication_algorithm(term_t algorithm) {
+    char* name;
+    if (PL_is_variable(algorithm)) {
+        return PL_unify_atom_chars(algorithm, algorithm_names[multiplication_algorithm]);
+    }
+    if (PL_get_atom_chars(algorithm, &name)) {
+        for (int i = 0; i < (int)(sizeof(algorithm_names) / sizeof(algorithm_names[0])); i++) {
+            if (strcmp(name, algorithm_names[i]) == 0) {
+                multiplication_algorithm = i;
+                PL_succeed;
+            }
+        }
+    }
+    report_error("El algoritmo de multiplicación debe ser clasico o strassen\n");
+    PL_fail;
+}
+
+/*
+  Foreign predicate to query (unbound argument) or change the smallest dimension of the
+  products which are split by the Strassen-Winograd algorithm on the calling thread
+*/
+foreign_t pl_strassen_cutoff(term_t cutoff) {
+    int value;
+    if (PL_is_variable(cutoff)) {
+        return PL_unify_integer(cutoff, strassen_cutoff);
+    }
+    if (!PL_get_integer(cutoff, &value) || value < 2 * GEMM_MR) {
+        report_error("El umbral de Strassen debe ser un entero mayor o igual que %d\n", 2 * GEMM_MR);
+        PL_fail;
+    }
+    strassen_cutoff = value;
+    PL_succeed;
+}
@@ -0,0 +1,336 @@
+#include "definitions.h"
+#include <string.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the structure of the matrices (diagonal, triangular, banded, symmetric,
+  identity). The structure of a matrix is computed the first time it is needed and kept in
+  the Matrix struct. The operations whose result has a known structure set it directly from
+  the structure of their operands, and the products use it to skip the zero parts.
+  The structure which comes from the operands is a bound (for instance, the sum of two
+  upper triangular matrices is upper triangular, but it can also be diagonal), so the
+  predicates which answer questions about the structure only trust the flags which are set,
+  unless the structure has been computed from the values (MATRIX_STRUCTURE_EXACT).
+*/
+
+/*
+    Structure flags of a matrix. Several Prolog threads can compute the structure of the same
+    matrix, so the flags are stored with release order after the bandwidths and loaded with
+    acquire order: whoever sees MATRIX_STRUCTURE_KNOWN also sees the bandwidths
+*/
+static int load_structure(Matrix* matrix) {
+    return atomic_load_explicit(&matrix->structure, memory_order_acquire);
+}
+
+/*
+    Set the flags which follow from the bandwidths of a matrix
+*/
+static void set_flags_from_bandwidths(Matrix* matrix, int flags) {
+    if (matrix->rows == matrix->columns) {
+        if (matrix->lower_bandwidth == 0) flags |= MATRIX_UPPER_TRIANGULAR;
+        if (matrix->upper_bandwidth == 0) flags |= MATRIX_LOWER_TRIANGULAR;
+        if (matrix->lower_bandwidth == 0 && matrix->upper_bandwidth == 0) flags |= MATRIX_DIAGONAL;
+    } else {
+        flags &= ~(MATRIX_SYMMETRIC | MATRIX_IDENTITY);
+    }
+    if (matrix->lower_bandwidth < matrix->rows - 1 || matrix->upper_bandwidth < matrix->columns - 1) {
+        flags |= MATRIX_BANDED;
+    }
+    atomic_store_explicit(&matrix->structure, flags | MATRIX_STRUCTURE_KNOWN, memory_order_release);
+}
+
+/*
+    Compute the structure of a matrix from its values. Every column is scanned from the top
+    and from the bottom until a non zero value is found, so for dense matrices it only reads
+    a few values per column. The symmetry check stops at the first pair which differs
+*/
+static void compute_matrix_structure(Matrix* matrix) {
+    int lower = 0, upper = 0;
+    for (int column = 0; column < matrix->columns; column++) {
+        const double* values = matrix->data + (size_t) column * matrix->column_stride;
+        size_t stride = matrix->row_stride;
+        int first = 0, last = matrix->rows - 1;
+        while (first <= last && values[first * stride] == 0.0) first++;
+        if (first > last) {
+            continue;
+        }
+        while (values[last * stride] == 0.0) last--;
+        if (column - first > upper) upper = column - first;
+        if (last - column > lower) lower = last - column;
+    }
+    matrix->lower_bandwidth = lower;
+    matrix->upper_bandwidth = upper;
+
+    int flags = MATRIX_STRUCTURE_EXACT;
+    if (matrix->rows == matrix->columns && lower == upper) {
+        int symmetric = 1;
+        for (int column = 0; column < matrix->columns && symmetric; column++) {
+            int last = column + lower < matrix->rows - 1 ? column + lower : matrix->rows - 1;
+            for (int row = column + 1; row <= last && symmetric; row++) {
+                symmetric = ACCESS(matrix, row, column) == ACCESS(matrix, column, row);
+            }
+        }
+        if (symmetric) flags |= MATRIX_SYMMETRIC;
+        if (lower == 0) {
+            int identity = 1;
+            for (int i = 0; i < matrix->rows && identity; i++) {
+                identity = ACCESS(matrix, i, i) == 1.0;
+            }
+            if (identity) flags |= MATRIX_IDENTITY;
+        }
+    }
+    set_flags_from_bandwidths(matrix, flags);
+}
+
+/*
+    Obtain the structure flags of a matrix, computing them if they are not known
+*/
+int get_matrix_structure(Matrix* matrix) {
+    int structure = load_structure(matrix);
+    if (!(structure & MATRIX_STRUCTURE_KNOWN)) {
+        compute_matrix_structure(matrix);
+        structure = load_structure(matrix);
+    }
+    return structure;
+}
+
+/*
+    Check whether a matrix has all the given structure flags. If the known structure is only a
+    bound and it does not have them, the structure is computed from the values
+*/
+int has_matrix_structure(Matrix* matrix, int flags) {
+    if (!matrix) {
+        return 0;
+    }
+    if ((get_matrix_structure(matrix) & flags) == flags) {
+        return 1;
+    }
+    if (!(load_structure(matrix) & MATRIX_STRUCTURE_EXACT)) {
+        compute_matrix_structure(matrix);
+    }
+    return (load_structure(matrix) & flags) == flags;
+}
+
+/*
+    Forget the structure of a matrix whose values have been changed
+*/
+void invalidate_matrix_structure(Matrix* matrix) {
+    atomic_store_explicit(&matrix->structure, 0, memory_order_release);
+}
+
+/*
+    Structure of the sum or substraction of two matrices whose structure is known
+*/
+void set_structure_of_sum(Matrix* matrix1, Matrix* matrix2, Matrix* result) {
+    int structure1 = load_structure(matrix1), structure2 = load_structure(matrix2);
+    if (!(structure1 & MATRIX_STRUCTURE_KNOWN) || !(structure2 & MATRIX_STRUCTURE_KNOWN)) {
+        return;
+    }
+    result->lower_bandwidth = matrix1->lower_bandwidth > matrix2->lower_bandwidth ? matrix1->lower_bandwidth : matrix2->lower_bandwidth;
+    result->upper_bandwidth = matrix1->upper_bandwidth > matrix2->upper_bandwidth ? matrix1->upper_bandwidth : matrix2->upper_bandwidth;
+    set_flags_from_bandwidths(result, structure1 & structure2 & MATRIX_SYMMETRIC);
+}
+
+/*
+    Structure of the product (or division) of a matrix by a factor
+*/
+void set_structure_of_scaling(Matrix* matrix, double factor, Matrix* result) {
+    int structure = load_structure(matrix);
+    if (!(structure & MATRIX_STRUCTURE_KNOWN)) {
+        return;
+    }
+    result->lower_bandwidth = matrix->lower_bandwidth;
+    result->upper_bandwidth = matrix->upper_bandwidth;
+    set_flags_from_bandwidths(result, structure & (factor == 1.0 ? MATRIX_SYMMETRIC | MATRIX_IDENTITY : MATRIX_SYMMETRIC));
+}
+
+/*
+    Structure of the transpose of a matrix, which is as exact as the one of the matrix
+*/
+void set_structure_of_transpose(Matrix* matrix, Matrix* result) {
+    int structure = load_structure(matrix);
+    if (!(structure & MATRIX_STRUCTURE_KNOWN)) {
+        return;
+    }
+    // The matrix and the result can be the same one when it is transposed in place
+    int lower = matrix->upper_bandwidth;
+    int upper = matrix->lower_bandwidth;
+    result->lower_bandwidth = lower;
+    result->upper_bandwidth = upper;
+    set_flags_from_bandwidths(result, structure & (MATRIX_SYMMETRIC | MATRIX_IDENTITY | MATRIX_STRUCTURE_EXACT));
+}
+
+/*
+    Structure of the product of two matrices: the bandwidths are added
+*/
+void set_structure_of_product(Matrix* matrix1, Matrix* matrix2, Matrix* result) {
+    int structure1 = load_structure(matrix1), structure2 = load_structure(matrix2);
+    if (!(structure1 & MATRIX_STRUCTURE_KNOWN) || !(structure2 & MATRIX_STRUCTURE_KNOWN)) {
+        return;
+    }
+    int lower = matrix1->lower_bandwidth + matrix2->lower_bandwidth;
+    int upper = matrix1->upper_bandwidth + matrix2->upper_bandwidth;
+    result->lower_bandwidth = lower < result->rows - 1 ? lower : result->rows - 1;
+    result->upper_bandwidth = upper < result->columns - 1 ? upper : result->columns - 1;
+    set_flags_from_bandwidths(result, structure1 & structure2 & MATRIX_IDENTITY);
+}
+
+/*********************************************/
+/*
+    Products which use the structure of the operands
+*/
+/**********************************************/
+
+typedef struct {
+    Matrix* matrix1;
+    Matrix* matrix2;
+    Matrix* result;
+} BandedProductJob;
+
+/*
+    Columns [begin, end) of the product of two banded matrices. The column j of the result
+    only combines the columns of the first matrix selected by the band of the column j of the
+    second one, and only the rows inside the band of each of those columns
+*/
+static void banded_product_task(void* context, size_t begin, size_t end) {
+    BandedProductJob* job = context;
+    Matrix* a = job->matrix1;
+    Matrix* b = job->matrix2;
+    Matrix* c = job->result;
+    for (int column = (int) begin; column < (int) end; column++) {
+        double* c_column = c->data + (size_t) column * c->rows;
+        memset(c_column, 0, (size_t) c->rows * sizeof(double));
+        int k_first = column - b->upper_bandwidth > 0 ? column - b->upper_bandwidth : 0;
+        int k_last = column + b->lower_bandwidth < b->rows - 1 ? column + b->lower_bandwidth : b->rows - 1;
+        for (int k = k_first; k <= k_last; k++) {
+            double factor = ACCESS(b, k, column);
+            if (factor == 0.0) {
+                continue;
+            }
+            const double* a_column = a->data + (size_t) k * a->rows;
+            int row_first = k - a->upper_bandwidth > 0 ? k - a->upper_bandwidth : 0;
+            int row_last = k + a->lower_bandwidth < a->rows - 1 ? k + a->lower_bandwidth : a->rows - 1;
+            for (int row = row_first; row <= row_last; row++) {
+                c_column[row] += factor * a_column[row];
+            }
+        }
+    }
+}
+
+/*
+    C = T * B, where T is an upper or lower triangular matrix of m x m. The triangle is split
+    in two smaller triangles and a rectangular block, which is multiplied with the blocked
+    product, until the triangles are small enough for the simple loop
+*/
+static int triangular_left_product(int upper, int m, int n, const double* t, int ldt,
+                                   const double* b, int ldb, double* c, int ldc) {
+    if (m <= TRIANGULAR_BLOCK) {
+        for (int j = 0; j < n; j++) {
+            double* c_column = c + (size_t) j * ldc;
+            memset(c_column, 0, (size_t) m * sizeof(double));
+            for (int k = 0; k < m; k++) {
+                double factor = b[(size_t) j * ldb + k];
+                const double* t_column = t + (size_t) k * ldt;
+                int first = upper ? 0 : k, last = upper ? k : m - 1;
+                for (int i = first; i <= last; i++) {
+                    c_column[i] += factor * t_column[i];
+                }
+            }
+        }
+        return SUCCESS;
+    }
+    int h = m / 2;
+    const double* t11 = t;
+    const double* t22 = t + (size_t) h * ldt + h;
+    if (upper) {
+        // C1 = T11 * B1 + T12 * B2, C2 = T22 * B2
+        return triangular_left_product(upper, h, n, t11, ldt, b, ldb, c, ldc) &&
+               gemm_parallel(h, n, m - h, 1.0, t + (size_t) h * ldt, ldt, b + h, ldb, 1.0, c, ldc) &&
+               triangular_left_product(upper, m - h, n, t22, ldt, b + h, ldb, c + h, ldc);
+    }
+    // C1 = T11 * B1, C2 = T21 * B1 + T22 * B2
+    return triangular_left_product(upper, h, n, t11, ldt, b, ldb, c, ldc) &&
+           triangular_left_product(upper, m - h, n, t22, ldt, b + h, ldb, c + h, ldc) &&
+           gemm_parallel(m - h, n, h, 1.0, t + h, ldt, b, ldb, 1.0, c + h, ldc);
+}
+
+/*
+    C = A * T, where T is an upper or lower triangular matrix of n x n, split as in triangular_left_product
+*/
+static int triangular_right_product(int upper, int m, int n, const double* a, int lda,
+                                    const double* t, int ldt, double* c, int ldc) {
+    if (n <= TRIANGULAR_BLOCK) {
+        for (int j = 0; j < n; j++) {
+            double* c_column = c + (size_t) j * ldc;
+            memset(c_column, 0, (size_t) m * sizeof(double));
+            int first = upper ? 0 : j, last = upper ? j : n - 1;
+            for (int k = first; k <= last; k++) {
+                double factor = t[(size_t) j * ldt + k];
+                const double* a_column = a + (size_t) k * lda;
+                for (int i = 0; i < m; i++) {
+                    c_column[i] += factor * a_column[i];
+                }
+            }
+        }
+        return SUCCESS;
+    }
+    int h = n / 2;
+    const double* t11 = t;
+    const double* t22 = t + (size_t) h * ldt + h;
+    const double* a2 = a + (size_t) h * lda;
+    double* c2 = c + (size_t) h * ldc;
+    if (upper) {
+        // C1 = A1 * T11, C2 = A1 * T12 + A2 * T22
+        return triangular_right_product(upper, m, h, a, lda, t11, ldt, c, ldc) &&
+               triangular_right_product(upper, m, n - h, a2, lda, t22, ldt, c2, ldc) &&
+               gemm_parallel(m, n - h, h, 1.0, a, lda, t + (size_t) h * ldt, ldt, 1.0, c2, ldc);
+    }
+    // C1 = A1 * T11 + A2 * T21, C2 = A2 * T22
+    return triangular_right_product(upper, m, h, a, lda, t11, ldt, c, ldc) &&
+           gemm_parallel(m, h, n - h, 1.0, a2, lda, t + h, ldt, 1.0, c, ldc) &&
+           triangular_right_product(upper, m, n - h, a2, lda, t22, ldt, c2, ldc);
+}
+
+/*
+    Multiply two matrices using their structure: a copy when one of them is the identity,
+    the banded product when the bands make it much cheaper than the full product (diagonal,
+    tridiagonal, ...) and the triangular products for large triangular matrices.
+    Returns SUCCESS if the product has been computed, or FAILURE if the general product has to be used
+*/
+int structured_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix* result) {
+    int structure1 = get_matrix_structure(matrix1);
+    int structure2 = get_matrix_structure(matrix2);
+    size_t total = (size_t) result->rows * result->columns;
+
+    if (structure1 & MATRIX_IDENTITY) {
+        memcpy(result->data, matrix2->data, total * sizeof(double));
+        return SUCCESS;
+    }
+    if (structure2 & MATRIX_IDENTITY) {
+        memcpy(result->data, matrix1->data, total * sizeof(double));
+        return SUCCESS;
+    }
+    double full_work = (double) matrix1->rows * matrix1->columns * matrix2->columns;
+    double banded_work = (double) matrix2->columns * (matrix2->lower_bandwidth + matrix2->upper_bandwidth + 1) *
+                         (matrix1->lower_bandwidth + matrix1->upper_bandwidth + 1);
+    if (banded_work * BANDED_PRODUCT_RATIO <= full_work) {
+        BandedProductJob job = { matrix1, matrix2, result };
+        size_t work_per_column = (size_t)(banded_work / matrix2->columns) + 1;
+        parallel_for(result->columns, PARALLEL_GRAIN / work_per_column + 1, banded_product_task, &job);
+        return SUCCESS;
+    }
+    if (full_work < GEMM_THRESHOLD) {
+        return FAILURE;
+    }
+    if (structure1 & (MATRIX_UPPER_TRIANGULAR | MATRIX_LOWER_TRIANGULAR)) {
+        return triangular_left_product(structure1 & MATRIX_UPPER_TRIANGULAR, matrix1->rows, matrix2->columns,
+                                       matrix1->data, matrix1->rows, matrix2->data, matrix2->rows,
+                                       result->data, result->rows);
+    }
+    if (structure2 & (MATRIX_UPPER_TRIANGULAR | MATRIX_LOWER_TRIANGULAR)) {
+        return triangular_right_product(structure2 & MATRIX_UPPER_TRIANGULAR, matrix1->rows, matrix2->columns,
+                                        matrix1->data, matrix1->rows, matrix2->data, matrix2->rows,
+                                        result->data, result->rows);
+    }
+    return FAILURE;
+}
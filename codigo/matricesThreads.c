@@ -0,0 +1,229 @@
+#include "definitions.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/*
+  Class in charge of the pool of worker threads. The workers are created the first
+  time an operation is split and they wait for jobs until the library is unloaded.
+  A job is a range of indexes [0, n) which is split in chunks; the workers and the
+  calling thread take chunks until there are no more left.
+  Only one job runs at a time. If another Prolog thread (or a task of the job itself)
+  asks for the pool while it is busy, its job runs entirely on the calling thread.
+*/
+
+typedef struct {
+    pthread_t* workers; // worker threads (the calling thread also works, so there are thread_count - 1)
+    int number_workers; // number of workers which have been created
+    atomic_int thread_count; // number of threads to use, including the calling one. 0 means one per processor.
+                             // Atomic because the operations read it without holding any lock
+    int shutting_down; // set to ask the workers to finish
+
+    pthread_mutex_t job_lock; // held by the thread which is running a job on the pool
+    pthread_mutex_t lock; // protects the fields below and the condition variables
+    pthread_cond_t work_ready; // signaled when there is a new job
+    pthread_cond_t work_done; // signaled when the last worker finishes a job
+    unsigned long generation; // incremented for every new job
+    int active_workers; // workers which have not finished the current job
+
+    // Current job
+    parallel_task_t task;
+    void* context;
+    size_t total;
+    size_t chunk;
+    atomic_size_t next;
+} ThreadPool;
+
+// Index of the thread in the pool: 0 for the threads which run a job, 1.. for the workers
+static __thread int worker_index = 0;
+
+static ThreadPool pool = {
+    .job_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_ready = PTHREAD_COND_INITIALIZER,
+    .work_done = PTHREAD_COND_INITIALIZER
+};
+
+/*
+    Take chunks of the current job and run them until there are no more left
+*/
+static void run_chunks(void) {
+    size_t begin;
+    while ((begin = atomic_fetch_add(&pool.next, pool.chunk)) < pool.total) {
+        size_t end = begin + pool.chunk < pool.total ? begin + pool.chunk : pool.total;
+        pool.task(pool.context, begin, end);
+    }
+}
+
+/*
+    Loop of a worker: wait for a job, work on it and report that it is finished
+*/
+static void* worker_loop(void* argument) {
+    unsigned long seen_generation = 0;
+    worker_index = (int)(intptr_t) argument;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.shutting_down && pool.generation == seen_generation) {
+            pthread_cond_wait(&pool.work_ready, &pool.lock);
+        }
+        if (pool.shutting_down) {
+            pthread_mutex_unlock(&pool.lock);
+            return NULL;
+        }
+        seen_generation = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_chunks();
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.active_workers == 0) {
+            pthread_cond_signal(&pool.work_done);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/*
+    Number of threads which the pool should have
+*/
+static int wanted_threads(void) {
+    int thread_count = atomic_load(&pool.thread_count);
+    if (thread_count > 0) {
+        return thread_count;
+    }
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return processors > 0 ? (int) processors : 1;
+}
+
+/*
+    Create the workers if they do not exist. It is called with job_lock held
+*/
+static void start_workers(void) {
+    int number_workers = wanted_threads() - 1;
+    if (pool.workers || number_workers <= 0) {
+        return;
+    }
+    pool.workers = malloc(sizeof(pthread_t) * number_workers);
+    if (!pool.workers) {
+        return;
+    }
+    pool.shutting_down = 0;
+    pool.generation = 0;
+    pool.number_workers = 0;
+    for (int i = 0; i < number_workers; i++) {
+        if (pthread_create(&pool.workers[i], NULL, worker_loop, (void*)(intptr_t)(i + 1)) != 0) {
+            break;
+        }
+        pool.number_workers++;
+    }
+}
+
+/*
+    Stop and join the workers. It is called with job_lock held
+*/
+static void stop_workers(void) {
+    if (!pool.workers) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.shutting_down = 1;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < pool.number_workers; i++) {
+        pthread_join(pool.workers[i], NULL);
+    }
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.number_workers = 0;
+}
+
+/*
+    Run task over the range [0, n) split in chunks of at least grain indexes.
+    The range is only split when it has more than one grain and there are workers,
+    otherwise the task runs on the calling thread
+*/
+void parallel_for(size_t n, size_t grain, parallel_task_t task, void* context) {
+    if (n == 0) {
+        return;
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+    if (n <= grain || wanted_threads() <= 1 || pthread_mutex_trylock(&pool.job_lock) != 0) {
+        task(context, 0, n);
+        return;
+    }
+    start_workers();
+    if (pool.number_workers == 0) {
+        pthread_mutex_unlock(&pool.job_lock);
+        task(context, 0, n);
+        return;
+    }
+
+    // A few chunks per thread balance the work when some threads are slower
+    size_t threads = (size_t) pool.number_workers + 1;
+    size_t chunk = (n + threads * 4 - 1) / (threads * 4);
+    pool.chunk = chunk < grain ? grain : chunk;
+    pool.task = task;
+    pool.context = context;
+    pool.total = n;
+    atomic_store(&pool.next, 0);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.active_workers = pool.number_workers;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_chunks();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active_workers > 0) {
+        pthread_cond_wait(&pool.work_done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.job_lock);
+}
+
+/*
+    Number of threads used by the operations, including the calling one
+*/
+int get_thread_count(void) {
+    return wanted_threads();
+}
+
+/*
+    Index of the calling thread among the threads which run the tasks of a job: 0 for the
+    thread which called parallel_for, and 1 to get_thread_count() - 1 for the workers. A task
+    can use it to keep per thread buffers, since a thread runs its tasks one after another
+*/
+int current_worker(void) {
+    return worker_index;
+}
+
+/*
+    Change the number of threads. 0 means one per processor. The workers are
+    created again the next time they are needed. Returns SUCCESS or FAILURE
+*/
+int set_thread_count(int thread_count) {
+    if (thread_count < 0) {
+        return FAILURE;
+    }
+    pthread_mutex_lock(&pool.job_lock);
+    stop_workers();
+    atomic_store(&pool.thread_count, thread_count);
+    pthread_mutex_unlock(&pool.job_lock);
+    return SUCCESS;
+}
+
+/*
+    Stop the workers. It is called when the library is unloaded
+*/
+void shutdown_thread_pool(void) {
+    pthread_mutex_lock(&pool.job_lock);
+    stop_workers();
+    pthread_mutex_unlock(&pool.job_lock);
+}
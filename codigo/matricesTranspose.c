@@ -0,0 +1,337 @@
+#include "definitions.h"
+#include <string.h>
+#include <stdio.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the transposes of the dense matrices.
+    - Out of place: the matrix is split recursively by its biggest dimension until the
+      pieces are tiles of at most TRANSPOSE_BLOCK x TRANSPOSE_BLOCK, which are transposed by
+      the SIMD kernel in squares of 8 x 8 values, so every line of the cache is read and
+      written completely at once whatever the size of the matrix is.
+      The columns are split between the threads.
+    - In place: the values do not move, the strides are swapped, so a matrix stored by columns
+      becomes its transpose stored by rows and the other way round.
+    - Change of the layout in place, which moves the values to keep the matrix: for square
+      matrices every tile above the diagonal is swapped with the transposed tile below it
+      through a buffer of one tile, and the tiles of the diagonal are transposed through the
+      same buffer. For rectangular matrices each value is moved along the cycle of positions
+      of the permutation, with a bit per value to remember the ones already moved. It only
+      needs 1/64 of the memory of the matrix, but it reads the values in a random order,
+      so it is used only when memory matters more than time.
+*/
+
+static const char* layout_names[] = { "columnas", "filas", "vista" };
+
+/*
+    Cache-oblivious transpose: split the biggest dimension in two halves until the piece is a tile
+*/
+static void transpose_recursive(const double* source, size_t source_stride, double* destination, size_t destination_stride,
+                                int rows, int columns) {
+    while (rows > TRANSPOSE_BLOCK || columns > TRANSPOSE_BLOCK) {
+        if (rows >= columns) {
+            int half = rows / 2;
+            transpose_recursive(source, source_stride, destination, destination_stride, half, columns);
+            source += half;
+            destination += (size_t) half * destination_stride;
+            rows -= half;
+        } else {
+            int half = columns / 2;
+            transpose_recursive(source, source_stride, destination, destination_stride, rows, half);
+            source += (size_t) half * source_stride;
+            destination += half;
+            columns -= half;
+        }
+    }
+    kernels->transpose(source, source_stride, destination, destination_stride, rows, columns);
+}
+
+typedef struct {
+    const double* source;
+    double* destination;
+    int rows;
+    int columns;
+    size_t source_stride; // distance between the columns of the source
+} TransposeJob;
+
+/*
+    Transpose the columns [begin, end) of a matrix into the rows of the result
+*/
+static void transpose_columns_task(void* context, size_t begin, size_t end) {
+    TransposeJob* job = context;
+    transpose_recursive(job->source + begin * job->source_stride, job->source_stride,
+                        job->destination + begin, (size_t) job->columns,
+                        job->rows, (int)(end - begin));
+}
+
+/*
+    Transpose a matrix of rows x columns stored by columns, which are source_stride values apart
+*/
+static void transpose_with_stride(const double* source, size_t source_stride, int rows, int columns, double* destination) {
+    TransposeJob job = { source, destination, rows, columns, source_stride };
+    size_t grain = PARALLEL_GRAIN / rows + 1;
+    parallel_for((size_t) columns, grain, transpose_columns_task, &job);
+}
+
+/*
+    Write the transpose of the values of a matrix of rows x columns (stored by columns),
+    which is a matrix of columns x rows, into destination
+*/
+void transpose_values(const double* source, int rows, int columns, double* destination) {
+    transpose_with_stride(source, (size_t) rows, rows, columns, destination);
+}
+
+typedef struct {
+    const double* source;
+    size_t row_stride;
+    size_t column_stride;
+    int rows;
+    double* destination;
+} StridedCopyJob;
+
+/*
+    Copy the columns [begin, end) of a strided matrix
+*/
+static void copy_strided_columns_task(void* context, size_t begin, size_t end) {
+    StridedCopyJob* job = context;
+    size_t rows = (size_t) job->rows;
+    for (size_t column = begin; column < end; column++) {
+        const double* values = job->source + column * job->column_stride;
+        double* destination = job->destination + column * rows;
+        if (job->row_stride == 1) {
+            memcpy(destination, values, rows * sizeof(double));
+        } else {
+            for (size_t row = 0; row < rows; row++) {
+                destination[row] = values[row * job->row_stride];
+            }
+        }
+    }
+}
+
+/*
+    Copy the values of a matrix of rows x columns whose element (row, column) is
+    source[row * row_stride + column * column_stride] into destination, stored by columns.
+    When the rows of the source are contiguous (the transpose of a matrix stored by columns)
+    the copy is the tiled transpose, otherwise the columns are copied one by one.
+    The transpose of a strided matrix is the copy with the strides swapped
+*/
+void copy_strided_values(const double* source, size_t row_stride, size_t column_stride, int rows, int columns,
+                         double* destination) {
+    if (column_stride == 1 && row_stride != 1 && rows > 1) {
+        transpose_with_stride(source, row_stride, columns, rows, destination);
+        return;
+    }
+    StridedCopyJob job = { source, row_stride, column_stride, rows, destination };
+    parallel_for((size_t) columns, PARALLEL_GRAIN / rows + 1, copy_strided_columns_task, &job);
+}
+
+typedef struct {
+    double* data;
+    int size;
+} SquareTransposeJob;
+
+/*
+    Copy a tile of rows x columns from a buffer with columns of TRANSPOSE_BLOCK values into a matrix
+*/
+static void copy_tile(const double* buffer, double* destination, size_t destination_stride, int rows, int columns) {
+    for (int column = 0; column < columns; column++) {
+        memcpy(destination + (size_t) column * destination_stride, buffer + (size_t) column * TRANSPOSE_BLOCK,
+               (size_t) rows * sizeof(double));
+    }
+}
+
+/*
+    Swap the tiles of the block rows [begin, end) above the diagonal with the ones below it,
+    transposing them, and transpose the tiles of the diagonal
+*/
+static void transpose_square_task(void* context, size_t begin, size_t end) {
+    SquareTransposeJob* job = context;
+    size_t n = (size_t) job->size;
+    double* data = job->data;
+
+    double buffer[TRANSPOSE_BLOCK * TRANSPOSE_BLOCK];
+
+    for (size_t block_row = begin; block_row < end; block_row++) {
+        size_t first_row = block_row * TRANSPOSE_BLOCK;
+        int height = first_row + TRANSPOSE_BLOCK < n ? TRANSPOSE_BLOCK : (int)(n - first_row);
+        double* diagonal = data + first_row * n + first_row;
+        kernels->transpose(diagonal, n, buffer, TRANSPOSE_BLOCK, height, height);
+        copy_tile(buffer, diagonal, n, height, height);
+
+        for (size_t first_column = first_row + height; first_column < n; first_column += TRANSPOSE_BLOCK) {
+            int width = first_column + TRANSPOSE_BLOCK < n ? TRANSPOSE_BLOCK : (int)(n - first_column);
+            double* upper = data + first_column * n + first_row; // height x width, above the diagonal
+            double* lower = data + first_row * n + first_column; // width x height, below the diagonal
+            kernels->transpose(upper, n, buffer, TRANSPOSE_BLOCK, height, width);
+            kernels->transpose(lower, n, upper, n, width, height);
+            copy_tile(buffer, lower, n, width, height);
+        }
+    }
+}
+
+/*
+    Transpose the values of a square matrix in place
+*/
+static void transpose_square_in_place(double* data, int size) {
+    SquareTransposeJob job = { data, size };
+    size_t blocks = ((size_t) size + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    // The first block rows have more tiles than the last ones, so the blocks are handed out one by one
+    size_t grain = PARALLEL_GRAIN / ((size_t) size * TRANSPOSE_BLOCK) + 1;
+    parallel_for(blocks, grain, transpose_square_task, &job);
+}
+
+/*
+    Transpose the values of a rectangular matrix of rows x columns in place following the cycles
+    of the permutation: the value at index k goes to k * columns mod (rows * columns - 1), and
+    the first and the last values do not move. Returns SUCCESS, or FAILURE if there is no memory
+    for the bits of the values already moved
+*/
+static int transpose_cycles_in_place(double* data, int rows, int columns) {
+    size_t last = (size_t) rows * columns - 1;
+    size_t capacity;
+    size_t words = last / 64 + 1;
+    uint64_t* moved = pool_allocate(words * sizeof(uint64_t), &capacity);
+    if (!moved) {
+        return FAILURE;
+    }
+    memset(moved, 0, words * sizeof(uint64_t));
+
+    for (size_t start = 1; start < last; start++) {
+        if (moved[start / 64] & ((uint64_t) 1 << (start % 64))) {
+            continue;
+        }
+        double value = data[start];
+        size_t index = start;
+        do {
+            // The product only fits in 64 bits for matrices of less than 2^32 values
+            size_t next = last <= UINT32_MAX ? index * (size_t) columns % last
+                                             : (size_t)((unsigned __int128) index * (size_t) columns % last);
+            double displaced = data[next];
+            data[next] = value;
+            value = displaced;
+            moved[next / 64] |= (uint64_t) 1 << (next % 64);
+            index = next;
+        } while (index != start);
+    }
+    pool_release(moved, capacity);
+    return SUCCESS;
+}
+
+/*
+    Transpose a matrix in place, swapping its number of rows and columns and its strides, so no value
+    is moved and even the matrices mapped read-only from a file and the views can be transposed.
+    The typed matrices, whose kernels need them stored by columns, can not, and neither can the
+    matrices which are shared with a view, the result cache or an operation in the background.
+    Returns SUCCESS or FAILURE
+*/
+int matrix_transpose_in_place(Matrix* matrix) {
+    if (!matrix) {
+        return FAILURE;
+    }
+    if (matrix->element_type != MATRIX_TYPE_F64) {
+        report_error("Solo se pueden transponer en el sitio las matrices de valores f64\n");
+        return FAILURE;
+    }
+    if (atomic_load(&matrix->references) > 0) {
+        report_error("La matriz comparte sus valores con una vista, la caché de resultados o una operación en segundo plano y no se puede transponer en el sitio\n");
+        return FAILURE;
+    }
+    int rows = matrix->rows;
+    size_t row_stride = matrix->row_stride;
+    matrix->rows = matrix->columns;
+    matrix->columns = rows;
+    matrix->row_stride = matrix->column_stride;
+    matrix->column_stride = row_stride;
+    set_structure_of_transpose(matrix, matrix);
+    renew_matrix_version(matrix);
+    return SUCCESS;
+}
+
+/*
+    Store the values of a matrix which owns them in another layout (MATRIX_LAYOUT_COLUMN_MAJOR or
+    MATRIX_LAYOUT_ROW_MAJOR), moving them in place so the matrix keeps its values. The matrices
+    mapped read-only from a file can not be changed, and neither can the views, the typed matrices
+    nor the matrices which are shared with a view, the result cache or an operation in the background.
+    Returns SUCCESS or FAILURE
+*/
+int change_matrix_layout(Matrix* matrix, int layout) {
+    if (!matrix) {
+        return FAILURE;
+    }
+    int current = matrix_layout(matrix);
+    if (current == layout || (current != MATRIX_LAYOUT_STRIDED && (matrix->rows == 1 || matrix->columns == 1))) {
+        // A vector has the same values in the same order in both layouts
+        return SUCCESS;
+    }
+    if (matrix->storage == MATRIX_STORAGE_MAPPED) {
+        report_error("La matriz se ha cargado en modo lectura y no se puede modificar\n");
+        return FAILURE;
+    }
+    if (matrix->element_type != MATRIX_TYPE_F64) {
+        report_error("Solo se puede cambiar la disposición de las matrices de valores f64\n");
+        return FAILURE;
+    }
+    if (current == MATRIX_LAYOUT_STRIDED || atomic_load(&matrix->references) > 0) {
+        report_error("La matriz es una vista o comparte sus valores con una vista, la caché de resultados o una operación en segundo plano y no se puede cambiar su disposición\n");
+        return FAILURE;
+    }
+    // The buffer holds the matrix stored by columns, or its transpose stored by columns
+    int rows = current == MATRIX_LAYOUT_COLUMN_MAJOR ? matrix->rows : matrix->columns;
+    int columns = current == MATRIX_LAYOUT_COLUMN_MAJOR ? matrix->columns : matrix->rows;
+    if (rows == columns) {
+        transpose_square_in_place(matrix->data, rows);
+    } else if (transpose_cycles_in_place(matrix->data, rows, columns) == FAILURE) {
+        return FAILURE;
+    }
+    set_matrix_layout(matrix, matrix->rows, matrix->columns, layout);
+    return SUCCESS;
+}
+
+/*
+  Foreign predicate to transpose the matrix of a handle in place. The handle keeps the
+  transposed matrix, so the other terms which refer to it also see the change
+*/
+foreign_t pl_matrix_transpose_in_place(term_t handle) {
+    Matrix* m = get_matrix_from_handle(handle);
+    if (!m) {
+        report_error("Solo se pueden transponer en el sitio las matrices de un manejador\n");
+        PL_fail;
+    }
+    return matrix_transpose_in_place(m);
+}
+
+/*
+  Foreign predicate disposicion_matriz(Matriz, Disposicion): layout of the values of a matrix,
+  columnas, filas or vista (a view whose values are not contiguous). The lists are read by rows
+*/
+foreign_t pl_matrix_layout(term_t matrix, term_t layout) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = is_matrix_handle(matrix) ? get_matrix_from_handle(matrix) : get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    int unified = PL_unify_atom_chars(layout, layout_names[matrix_layout(m)]);
+    arena_release(&arena);
+    return unified;
+}
+
+/*
+  Foreign predicate cambiar_disposicion(Manejador, Disposicion): store the values of the matrix of
+  a handle by columns or by rows (columnas or filas). The handle keeps the same values
+*/
+foreign_t pl_change_matrix_layout(term_t handle, term_t layout) {
+    Matrix* m = get_matrix_from_handle(handle);
+    char* name;
+    if (!m) {
+        report_error("Solo se puede cambiar la disposición de las matrices de un manejador\n");
+        PL_fail;
+    }
+    if (!PL_get_atom_chars(layout, &name) ||
+        (strcmp(name, layout_names[MATRIX_LAYOUT_COLUMN_MAJOR]) != 0 && strcmp(name, layout_names[MATRIX_LAYOUT_ROW_MAJOR]) != 0)) {
+        report_error("La disposición debe ser columnas o filas\n");
+        PL_fail;
+    }
+    return change_matrix_layout(m, strcmp(name, layout_names[MATRIX_LAYOUT_ROW_MAJOR]) == 0 ?
+                                   MATRIX_LAYOUT_ROW_MAJOR : MATRIX_LAYOUT_COLUMN_MAJOR);
+}
@@ -0,0 +1,950 @@
+#include "definitions.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <limits.h>
+#include <immintrin.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the element types of the dense matrices: f64 (double), f32 (float) and
+  i32 and i64 (integers of 32 and 64 bits). The type is a property of the matrix, the values
+  of data are stored with it, and the sum, the difference and the product have a kernel for
+  every type:
+    - The floats of 32 bits use half of the memory and a SIMD register holds twice as many of them.
+    - The integers are exact: the lists are read with PL_get_int64, the results are checked
+      for overflow and they are unified as integers.
+  Promotion rules of the operations of two matrices:
+    - Two matrices of the same type give a matrix of that type, but an i32 result which does not
+      fit in 32 bits is stored as i64. An i64 result which does not fit in 64 bits is an error.
+    - i32 with i64 gives i64, while f32 with an integer type and any type with f64 give f64.
+  The operations which do not have a typed path receive a copy of the matrix in f64
+  (get_strided_matrix_from_term).
+*/
+
+static const char* type_names[MATRIX_TYPES] = { "f64", "f32", "i32", "i64" };
+
+/*
+    Bytes of a value of a type
+*/
+size_t matrix_element_size(int type) {
+    return type == MATRIX_TYPE_F32 || type == MATRIX_TYPE_I32 ? sizeof(float) : sizeof(double);
+}
+
+/*
+    Name of a type, as it is written in Prolog
+*/
+const char* matrix_type_name(int type) {
+    return type >= 0 && type < MATRIX_TYPES ? type_names[type] : "?";
+}
+
+static int is_integer_type(int type) {
+    return type == MATRIX_TYPE_I32 || type == MATRIX_TYPE_I64;
+}
+
+/*
+    Create a new matrix whose values have a type. Returns NULL on failure
+*/
+Matrix* new_typed_matrix(int rows, int columns, int type) {
+    if (type == MATRIX_TYPE_F64) {
+        return new_matrix(rows, columns);
+    }
+    if (rows <= 0 || columns <= 0) {
+        return NULL;
+    }
+    Matrix* matrix = pool_allocate_struct();
+    if (!matrix) {
+        return NULL;
+    }
+    set_matrix_shape(matrix, rows, columns);
+    matrix->element_type = type;
+    matrix->data = pool_allocate((size_t) rows * columns * matrix_element_size(type), &matrix->capacity);
+    if (!matrix->data) {
+        pool_release_struct(matrix);
+        return NULL;
+    }
+    return matrix;
+}
+
+/*
+    Type of the result of an operation of two matrices
+*/
+int promote_types(int type1, int type2) {
+    if (type1 == type2) {
+        return type1;
+    }
+    return is_integer_type(type1) && is_integer_type(type2) ? MATRIX_TYPE_I64 : MATRIX_TYPE_F64;
+}
+
+static double value_as_double(const Matrix* matrix, size_t index) {
+    switch (matrix->element_type) {
+        case MATRIX_TYPE_F32: return ((const float*) matrix->data)[index];
+        case MATRIX_TYPE_I32: return ((const int32_t*) matrix->data)[index];
+        case MATRIX_TYPE_I64: return (double)((const int64_t*) matrix->data)[index];
+        default: return matrix->data[index];
+    }
+}
+
+/*
+    Obtain a value as an integer of a type. Returns FAILURE when the value is not an integer
+    or it does not fit in the type
+*/
+static int value_as_integer(const Matrix* matrix, size_t index, int type, int64_t* integer) {
+    if (matrix->element_type == MATRIX_TYPE_I32) {
+        *integer = ((const int32_t*) matrix->data)[index];
+    } else if (matrix->element_type == MATRIX_TYPE_I64) {
+        *integer = ((const int64_t*) matrix->data)[index];
+    } else {
+        double value = value_as_double(matrix, index);
+        // 2^63 is the first double which does not fit in 64 bits
+        if (value != floor(value) || value < -9223372036854775808.0 || value >= 9223372036854775808.0) {
+            return FAILURE;
+        }
+        *integer = (int64_t) value;
+    }
+    return type == MATRIX_TYPE_I64 || (*integer >= INT32_MIN && *integer <= INT32_MAX) ? SUCCESS : FAILURE;
+}
+
+/*
+    Copy a matrix which owns its data into a new matrix of another type. The conversions into
+    an integer type fail if some value is not an integer of the type. Returns NULL on failure
+*/
+Matrix* convert_matrix(Matrix* matrix, int type) {
+    Matrix* result = new_typed_matrix(matrix->rows, matrix->columns, type);
+    if (!result) {
+        return NULL;
+    }
+    size_t n = (size_t) matrix->rows * matrix->columns;
+    if (matrix->element_type == type) {
+        memcpy(result->data, matrix->data, n * matrix_element_size(type));
+    } else if (type == MATRIX_TYPE_F64) {
+        for (size_t i = 0; i < n; i++) {
+            result->data[i] = value_as_double(matrix, i);
+        }
+    } else if (type == MATRIX_TYPE_F32) {
+        float* values = (float*) result->data;
+        for (size_t i = 0; i < n; i++) {
+            values[i] = (float) value_as_double(matrix, i);
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            int64_t integer;
+            if (value_as_integer(matrix, i, type, &integer) == FAILURE) {
+                report_error("El valor %.17g no es un entero de tipo %s\n", value_as_double(matrix, i), type_names[type]);
+                free_matrix(result);
+                return NULL;
+            }
+            if (type == MATRIX_TYPE_I32) {
+                ((int32_t*) result->data)[i] = (int32_t) integer;
+            } else {
+                ((int64_t*) result->data)[i] = integer;
+            }
+        }
+    }
+    result->structure = matrix->structure;
+    result->lower_bandwidth = matrix->lower_bandwidth;
+    result->upper_bandwidth = matrix->upper_bandwidth;
+    return result;
+}
+
+/*
+    Unify a term with the value (row, column) of a matrix of any type. Returns TRUE or FALSE
+*/
+int unify_typed_value(term_t value, Matrix* matrix, int row, int column) {
+    size_t index = (size_t) column * matrix->column_stride + (size_t) row * matrix->row_stride;
+    switch (matrix->element_type) {
+        case MATRIX_TYPE_I32: return PL_unify_int64(value, ((const int32_t*) matrix->data)[index]);
+        case MATRIX_TYPE_I64: return PL_unify_int64(value, ((const int64_t*) matrix->data)[index]);
+        default: return PL_unify_float(value, value_as_double(matrix, index));
+    }
+}
+
+/*********************************************/
+/*
+    Element-wise kernels. The ones of the integers return a value different from zero when
+    some result has overflowed: the sign bit of (a ^ r) & (b ^ r) is set when the operands of a sum
+    have the same sign and the result has the other one, and the one of (a ^ b) & (a ^ r) for
+    a difference
+*/
+/**********************************************/
+
+typedef int (*typed_kernel_t)(const void* a, const void* b, void* result, size_t n);
+
+static int add_f32_scalar(const void* a, const void* b, void* result, size_t n) {
+    const float* x = a;
+    const float* y = b;
+    float* r = result;
+    for (size_t i = 0; i < n; i++) {
+        r[i] = x[i] + y[i];
+    }
+    return 0;
+}
+
+static int substract_f32_scalar(const void* a, const void* b, void* result, size_t n) {
+    const float* x = a;
+    const float* y = b;
+    float* r = result;
+    for (size_t i = 0; i < n; i++) {
+        r[i] = x[i] - y[i];
+    }
+    return 0;
+}
+
+static int add_i32_scalar(const void* a, const void* b, void* result, size_t n) {
+    const uint32_t* x = a;
+    const uint32_t* y = b;
+    uint32_t* r = result;
+    uint32_t overflow = 0;
+    for (size_t i = 0; i < n; i++) {
+        r[i] = x[i] + y[i];
+        overflow |= (x[i] ^ r[i]) & (y[i] ^ r[i]);
+    }
+    return overflow >> 31;
+}
+
+static int substract_i32_scalar(const void* a, const void* b, void* result, size_t n) {
+    const uint32_t* x = a;
+    const uint32_t* y = b;
+    uint32_t* r = result;
+    uint32_t overflow = 0;
+    for (size_t i = 0; i < n; i++) {
+        r[i] = x[i] - y[i];
+        overflow |= (x[i] ^ y[i]) & (x[i] ^ r[i]);
+    }
+    return overflow >> 31;
+}
+
+static int add_i64_scalar(const void* a, const void* b, void* result, size_t n) {
+    const uint64_t* x = a;
+    const uint64_t* y = b;
+    uint64_t* r = result;
+    uint64_t overflow = 0;
+    for (size_t i = 0; i < n; i++) {
+        r[i] = x[i] + y[i];
+        overflow |= (x[i] ^ r[i]) & (y[i] ^ r[i]);
+    }
+    return (int)(overflow >> 63);
+}
+
+static int substract_i64_scalar(const void* a, const void* b, void* result, size_t n) {
+    const uint64_t* x = a;
+    const uint64_t* y = b;
+    uint64_t* r = result;
+    uint64_t overflow = 0;
+    for (size_t i = 0; i < n; i++) {
+        r[i] = x[i] - y[i];
+        overflow |= (x[i] ^ y[i]) & (x[i] ^ r[i]);
+    }
+    return (int)(overflow >> 63);
+}
+
+__attribute__((target("avx2")))
+static int add_f32_avx2(const void* a, const void* b, void* result, size_t n) {
+    const float* x = a;
+    const float* y = b;
+    float* r = result;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(r + i, _mm256_add_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    return add_f32_scalar(x + i, y + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int substract_f32_avx2(const void* a, const void* b, void* result, size_t n) {
+    const float* x = a;
+    const float* y = b;
+    float* r = result;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(r + i, _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    return substract_f32_scalar(x + i, y + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int add_i32_avx2(const void* a, const void* b, void* result, size_t n) {
+    const int32_t* x = a;
+    const int32_t* y = b;
+    int32_t* r = result;
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i vx = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i vy = _mm256_loadu_si256((const __m256i*)(y + i));
+        __m256i vr = _mm256_add_epi32(vx, vy);
+        _mm256_storeu_si256((__m256i*)(r + i), vr);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(vx, vr), _mm256_xor_si256(vy, vr)));
+    }
+    return _mm256_movemask_ps(_mm256_castsi256_ps(overflow)) | add_i32_scalar(x + i, y + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int substract_i32_avx2(const void* a, const void* b, void* result, size_t n) {
+    const int32_t* x = a;
+    const int32_t* y = b;
+    int32_t* r = result;
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i vx = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i vy = _mm256_loadu_si256((const __m256i*)(y + i));
+        __m256i vr = _mm256_sub_epi32(vx, vy);
+        _mm256_storeu_si256((__m256i*)(r + i), vr);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(vx, vy), _mm256_xor_si256(vx, vr)));
+    }
+    return _mm256_movemask_ps(_mm256_castsi256_ps(overflow)) | substract_i32_scalar(x + i, y + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int add_i64_avx2(const void* a, const void* b, void* result, size_t n) {
+    const int64_t* x = a;
+    const int64_t* y = b;
+    int64_t* r = result;
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i vx = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i vy = _mm256_loadu_si256((const __m256i*)(y + i));
+        __m256i vr = _mm256_add_epi64(vx, vy);
+        _mm256_storeu_si256((__m256i*)(r + i), vr);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(vx, vr), _mm256_xor_si256(vy, vr)));
+    }
+    return _mm256_movemask_pd(_mm256_castsi256_pd(overflow)) | add_i64_scalar(x + i, y + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int substract_i64_avx2(const void* a, const void* b, void* result, size_t n) {
+    const int64_t* x = a;
+    const int64_t* y = b;
+    int64_t* r = result;
+    __m256i overflow = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i vx = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i vy = _mm256_loadu_si256((const __m256i*)(y + i));
+        __m256i vr = _mm256_sub_epi64(vx, vy);
+        _mm256_storeu_si256((__m256i*)(r + i), vr);
+        overflow = _mm256_or_si256(overflow, _mm256_and_si256(_mm256_xor_si256(vx, vy), _mm256_xor_si256(vx, vr)));
+    }
+    return _mm256_movemask_pd(_mm256_castsi256_pd(overflow)) | substract_i64_scalar(x + i, y + i, r + i, n - i);
+}
+
+/*
+    Element-wise kernel of a type (f32, i32 or i64) for the instruction set in use
+*/
+static typed_kernel_t select_typed_kernel(int type, int substract) {
+    int avx2 = kernels->level >= SIMD_AVX2;
+    switch (type) {
+        case MATRIX_TYPE_F32:
+            return substract ? (avx2 ? substract_f32_avx2 : substract_f32_scalar) : (avx2 ? add_f32_avx2 : add_f32_scalar);
+        case MATRIX_TYPE_I32:
+            return substract ? (avx2 ? substract_i32_avx2 : substract_i32_scalar) : (avx2 ? add_i32_avx2 : add_i32_scalar);
+        default:
+            return substract ? (avx2 ? substract_i64_avx2 : substract_i64_scalar) : (avx2 ? add_i64_avx2 : add_i64_scalar);
+    }
+}
+
+typedef struct {
+    typed_kernel_t kernel;
+    const char* a;
+    const char* b;
+    char* result;
+    size_t size; // bytes of a value
+    atomic_int overflow;
+} TypedKernelJob;
+
+static void typed_kernel_task(void* context, size_t begin, size_t end) {
+    TypedKernelJob* job = context;
+    size_t offset = begin * job->size;
+    if (job->kernel(job->a + offset, job->b + offset, job->result + offset, end - begin)) {
+        atomic_store(&job->overflow, 1);
+    }
+}
+
+/*
+    Run the element-wise kernel of the type of the matrices, which is the same for the three.
+    Returns 1 if some result has overflowed
+*/
+static int run_typed_kernel(Matrix* matrix1, Matrix* matrix2, int substract, Matrix* result) {
+    TypedKernelJob job = { select_typed_kernel(result->element_type, substract), (const char*) matrix1->data,
+                           (const char*) matrix2->data, (char*) result->data, matrix_element_size(result->element_type), 0 };
+    parallel_for((size_t) result->rows * result->columns, PARALLEL_GRAIN, typed_kernel_task, &job);
+    return atomic_load(&job.overflow);
+}
+
+/*
+    Convert the operands of an operation into the type of the result. The operands which
+    already have the type are not copied, so only the other ones have to be freed
+*/
+static int convert_operands(Matrix* matrix1, Matrix* matrix2, int type, Matrix** operand1, Matrix** operand2) {
+    *operand1 = matrix1->element_type == type ? matrix1 : convert_matrix(matrix1, type);
+    *operand2 = matrix2->element_type == type ? matrix2 : convert_matrix(matrix2, type);
+    return *operand1 && *operand2 ? SUCCESS : FAILURE;
+}
+
+static void free_operands(Matrix* matrix1, Matrix* matrix2, Matrix* operand1, Matrix* operand2) {
+    if (operand1 != matrix1) {
+        free_matrix(operand1);
+    }
+    if (operand2 != matrix2) {
+        free_matrix(operand2);
+    }
+}
+
+/*
+    Sum (or difference, with substract) of two matrices of any type, following the promotion rules.
+    The result is a new matrix which belongs to the caller. Returns SUCCESS or FAILURE
+*/
+int typed_addition(Matrix* matrix1, Matrix* matrix2, int substract, Matrix** result) {
+    if (do_matrices_have_same_dimensions(matrix1, matrix2) == FAILURE) {
+        report_error("Para realizar la %s, asegúrate que ambas matrices tienen el mismo número de filas que de columnas\n",
+               substract ? "resta" : "suma");
+        return FAILURE;
+    }
+    int type = promote_types(matrix1->element_type, matrix2->element_type);
+    Matrix* operand1;
+    Matrix* operand2;
+    if (convert_operands(matrix1, matrix2, type, &operand1, &operand2) == FAILURE ||
+        !(*result = new_typed_matrix(matrix1->rows, matrix1->columns, type))) {
+        free_operands(matrix1, matrix2, operand1, operand2);
+        return FAILURE;
+    }
+    int correct = SUCCESS;
+    if (type == MATRIX_TYPE_F64) {
+        correct = substract ? matrices_substraction(operand1, operand2, *result) : matrices_addition(operand1, operand2, *result);
+    } else if (run_typed_kernel(operand1, operand2, substract, *result)) {
+        free_matrix(*result);
+        *result = NULL;
+        if (type == MATRIX_TYPE_I32) {
+            // The result does not fit in 32 bits, so it is computed with 64 bits
+            Matrix* wide = convert_matrix(operand1, MATRIX_TYPE_I64);
+            correct = wide ? typed_addition(wide, operand2, substract, result) : FAILURE;
+            free_matrix(wide);
+        } else {
+            report_error("El resultado no cabe en un entero de 64 bits\n");
+            correct = FAILURE;
+        }
+    }
+    free_operands(matrix1, matrix2, operand1, operand2);
+    if (correct == FAILURE && *result) {
+        free_matrix(*result);
+        *result = NULL;
+    }
+    return correct;
+}
+
+/*********************************************/
+/*
+    Products. The columns of C are split between the threads, and every thread goes over
+    blocks of TYPED_GEMM_MC x TYPED_GEMM_KC values of A, which stay in the second level cache
+    while they are used by all the columns of the thread:
+      - In f32 the block is packed in panels of TYPED_GEMM_MR rows, and every tile of
+        TYPED_GEMM_MR x TYPED_GEMM_NR values of C is computed in registers.
+      - In i64 the block adds to the rows of every column of C its columns multiplied by the
+        values of the column of B.
+*/
+/**********************************************/
+
+/*
+    Pack a block of rows x depth values of A into panels of TYPED_GEMM_MR rows, whose values of
+    each column are consecutive. The last panel is filled with zeros
+*/
+static void pack_block_f32(const float* a, size_t lda, size_t rows, size_t depth, float* packed) {
+    for (size_t panel = 0; panel < rows; panel += TYPED_GEMM_MR) {
+        size_t height = rows - panel < TYPED_GEMM_MR ? rows - panel : TYPED_GEMM_MR;
+        for (size_t p = 0; p < depth; p++) {
+            const float* column = a + p * lda + panel;
+            size_t i = 0;
+            for (; i < height; i++) {
+                *packed++ = column[i];
+            }
+            for (; i < TYPED_GEMM_MR; i++) {
+                *packed++ = 0.0f;
+            }
+        }
+    }
+}
+
+/*
+    Add to the tile of rows x columns of C (at most TYPED_GEMM_MR x TYPED_GEMM_NR) the product
+    of a packed panel of A by depth values of the columns of B
+*/
+static void tile_f32_scalar(const float* panel, const float* b, size_t ldb, float* c, size_t ldc, size_t rows,
+                            size_t columns, size_t depth) {
+    float tile[TYPED_GEMM_NR][TYPED_GEMM_MR] = {{ 0.0f }};
+    for (size_t p = 0; p < depth; p++) {
+        for (size_t j = 0; j < columns; j++) {
+            float factor = b[j * ldb + p];
+            for (size_t i = 0; i < TYPED_GEMM_MR; i++) {
+                tile[j][i] += panel[p * TYPED_GEMM_MR + i] * factor;
+            }
+        }
+    }
+    for (size_t j = 0; j < columns; j++) {
+        for (size_t i = 0; i < rows; i++) {
+            c[j * ldc + i] += tile[j][i];
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void tile_f32_avx2(const float* panel, const float* b, size_t ldb, float* c, size_t ldc, size_t rows,
+                          size_t columns, size_t depth) {
+    // The missing columns of an edge tile read the first one again, and they are not stored
+    const float* b0 = b;
+    const float* b1 = columns > 1 ? b + ldb : b;
+    const float* b2 = columns > 2 ? b + 2 * ldb : b;
+    const float* b3 = columns > 3 ? b + 3 * ldb : b;
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps(), c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    for (size_t p = 0; p < depth; p++) {
+        __m256 a0 = _mm256_loadu_ps(panel + p * TYPED_GEMM_MR);
+        __m256 a1 = _mm256_loadu_ps(panel + p * TYPED_GEMM_MR + 8);
+        __m256 factor = _mm256_broadcast_ss(b0 + p);
+        c00 = _mm256_fmadd_ps(a0, factor, c00);
+        c01 = _mm256_fmadd_ps(a1, factor, c01);
+        factor = _mm256_broadcast_ss(b1 + p);
+        c10 = _mm256_fmadd_ps(a0, factor, c10);
+        c11 = _mm256_fmadd_ps(a1, factor, c11);
+        factor = _mm256_broadcast_ss(b2 + p);
+        c20 = _mm256_fmadd_ps(a0, factor, c20);
+        c21 = _mm256_fmadd_ps(a1, factor, c21);
+        factor = _mm256_broadcast_ss(b3 + p);
+        c30 = _mm256_fmadd_ps(a0, factor, c30);
+        c31 = _mm256_fmadd_ps(a1, factor, c31);
+    }
+    float tile[TYPED_GEMM_NR][TYPED_GEMM_MR] __attribute__((aligned(32)));
+    _mm256_store_ps(tile[0], c00);
+    _mm256_store_ps(tile[0] + 8, c01);
+    _mm256_store_ps(tile[1], c10);
+    _mm256_store_ps(tile[1] + 8, c11);
+    _mm256_store_ps(tile[2], c20);
+    _mm256_store_ps(tile[2] + 8, c21);
+    _mm256_store_ps(tile[3], c30);
+    _mm256_store_ps(tile[3] + 8, c31);
+    for (size_t j = 0; j < columns; j++) {
+        for (size_t i = 0; i < rows; i++) {
+            c[j * ldc + i] += tile[j][i];
+        }
+    }
+}
+
+/*
+    Same as the block of f32 for integers of 64 bits whose products and sums are known not to
+    overflow, without packing
+*/
+static void column_block_i64(const int64_t* a, size_t lda, const int64_t* b, int64_t* c, size_t rows, size_t depth) {
+    for (size_t p = 0; p < depth; p++) {
+        int64_t factor = b[p];
+        const int64_t* column = a + p * lda;
+        for (size_t i = 0; i < rows; i++) {
+            c[i] += column[i] * factor;
+        }
+    }
+}
+
+typedef struct {
+    int type;         // MATRIX_TYPE_F32 or MATRIX_TYPE_I64
+    const void* a;
+    const void* b;
+    void* c;          // Starts with zeros
+    size_t m;
+    size_t n;
+    size_t k;
+    int checked;      // The integer products and sums have to be checked for overflow
+    atomic_int overflow;
+    atomic_int failed; // Some thread could not allocate its packed block
+} TypedGemmJob;
+
+/*
+    Integer product of the columns [begin, end) of C, checking every operation for overflow
+*/
+static void checked_gemm_i64(TypedGemmJob* job, size_t begin, size_t end) {
+    const int64_t* a = job->a;
+    const int64_t* b = job->b;
+    int64_t* c = job->c;
+    for (size_t j = begin; j < end && !atomic_load(&job->overflow); j++) {
+        for (size_t p = 0; p < job->k; p++) {
+            int64_t factor = b[j * job->k + p];
+            for (size_t i = 0; i < job->m; i++) {
+                int64_t product;
+                if (__builtin_mul_overflow(a[p * job->m + i], factor, &product) ||
+                    __builtin_add_overflow(c[j * job->m + i], product, &c[j * job->m + i])) {
+                    atomic_store(&job->overflow, 1);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void gemm_f32_columns(TypedGemmJob* job, size_t begin, size_t end) {
+    float* packed = aligned_alloc(64, sizeof(float) * TYPED_GEMM_MC * TYPED_GEMM_KC);
+    if (!packed) {
+        atomic_store(&job->failed, 1);
+        return;
+    }
+    void (*tile)(const float*, const float*, size_t, float*, size_t, size_t, size_t, size_t) =
+        kernels->level >= SIMD_AVX2 ? tile_f32_avx2 : tile_f32_scalar;
+    const float* a = job->a;
+    const float* b = job->b;
+    float* c = job->c;
+    for (size_t kb = 0; kb < job->k; kb += TYPED_GEMM_KC) {
+        size_t depth = job->k - kb < TYPED_GEMM_KC ? job->k - kb : TYPED_GEMM_KC;
+        for (size_t ib = 0; ib < job->m; ib += TYPED_GEMM_MC) {
+            size_t rows = job->m - ib < TYPED_GEMM_MC ? job->m - ib : TYPED_GEMM_MC;
+            pack_block_f32(a + kb * job->m + ib, job->m, rows, depth, packed);
+            for (size_t j = begin; j < end; j += TYPED_GEMM_NR) {
+                size_t columns = end - j < TYPED_GEMM_NR ? end - j : TYPED_GEMM_NR;
+                for (size_t panel = 0; panel < rows; panel += TYPED_GEMM_MR) {
+                    tile(packed + panel * depth, b + j * job->k + kb, job->k, c + j * job->m + ib + panel, job->m,
+                         rows - panel < TYPED_GEMM_MR ? rows - panel : TYPED_GEMM_MR, columns, depth);
+                }
+            }
+        }
+    }
+    free(packed);
+}
+
+static void typed_gemm_task(void* context, size_t begin, size_t end) {
+    TypedGemmJob* job = context;
+    if (job->type == MATRIX_TYPE_F32) {
+        gemm_f32_columns(job, begin, end);
+    } else if (job->checked) {
+        checked_gemm_i64(job, begin, end);
+    } else {
+        for (size_t kb = 0; kb < job->k; kb += TYPED_GEMM_KC) {
+            size_t depth = job->k - kb < TYPED_GEMM_KC ? job->k - kb : TYPED_GEMM_KC;
+            for (size_t ib = 0; ib < job->m; ib += TYPED_GEMM_MC) {
+                size_t rows = job->m - ib < TYPED_GEMM_MC ? job->m - ib : TYPED_GEMM_MC;
+                for (size_t j = begin; j < end; j++) {
+                    column_block_i64((const int64_t*) job->a + kb * job->m + ib, job->m,
+                                     (const int64_t*) job->b + j * job->k + kb, (int64_t*) job->c + j * job->m + ib,
+                                     rows, depth);
+                }
+            }
+        }
+    }
+}
+
+/*
+    Largest absolute value of an integer matrix of 64 bits
+*/
+static uint64_t largest_magnitude(const Matrix* matrix) {
+    const int64_t* values = (const int64_t*) matrix->data;
+    uint64_t largest = 0;
+    for (size_t i = 0; i < (size_t) matrix->rows * matrix->columns; i++) {
+        uint64_t magnitude = values[i] < 0 ? 0 - (uint64_t) values[i] : (uint64_t) values[i];
+        largest = magnitude > largest ? magnitude : largest;
+    }
+    return largest;
+}
+
+/*
+    Product of two matrices of any type, following the promotion rules. The integer products are
+    computed with 64 bits: when the largest values of A and B can not overflow a sum of k products
+    the fast kernel is used, otherwise every operation is checked. The result is a new matrix which
+    belongs to the caller. Returns SUCCESS or FAILURE
+*/
+int typed_multiplication(Matrix* matrix1, Matrix* matrix2, Matrix** result) {
+    if (matrix1->columns != matrix2->rows) {
+        report_error("Para realizar la multiplicación, asegúrate que el número de columnas de la primera matriz es el mismo que el número de filas de la segunda\n");
+        return FAILURE;
+    }
+    int type = promote_types(matrix1->element_type, matrix2->element_type);
+    int computed_type = is_integer_type(type) ? MATRIX_TYPE_I64 : type;
+    Matrix* operand1;
+    Matrix* operand2;
+    *result = NULL;
+    if (convert_operands(matrix1, matrix2, computed_type, &operand1, &operand2) == FAILURE ||
+        !(*result = new_typed_matrix(matrix1->rows, matrix2->columns, computed_type))) {
+        free_operands(matrix1, matrix2, operand1, operand2);
+        return FAILURE;
+    }
+    int correct = SUCCESS;
+    if (computed_type == MATRIX_TYPE_F64) {
+        correct = matrices_multiplication(operand1, operand2, *result);
+    } else {
+        size_t m = (size_t) matrix1->rows, n = (size_t) matrix2->columns, k = (size_t) matrix1->columns;
+        memset((*result)->data, 0, m * n * matrix_element_size(computed_type));
+        // The bound is computed with saturating products, so that it can not wrap around itself
+        uint64_t bound = 0;
+        int checked = computed_type == MATRIX_TYPE_I64 &&
+                      (__builtin_mul_overflow(largest_magnitude(operand1), largest_magnitude(operand2), &bound) ||
+                       __builtin_mul_overflow(bound, (uint64_t) k, &bound) || bound > INT64_MAX);
+        TypedGemmJob job = { computed_type, operand1->data, operand2->data, (*result)->data, m, n, k, checked, 0, 0 };
+        parallel_for(n, PARALLEL_GRAIN / (m * k) + 1, typed_gemm_task, &job);
+        if (atomic_load(&job.overflow)) {
+            report_error("El resultado no cabe en un entero de 64 bits\n");
+            correct = FAILURE;
+        }
+        correct = atomic_load(&job.failed) ? FAILURE : correct;
+    }
+    free_operands(matrix1, matrix2, operand1, operand2);
+    if (correct == SUCCESS && type == MATRIX_TYPE_I32) {
+        // The result keeps 32 bits when all its values fit in them
+        const int64_t* values = (const int64_t*) (*result)->data;
+        size_t i = 0;
+        for (; i < (size_t) (*result)->rows * (*result)->columns && values[i] >= INT32_MIN && values[i] <= INT32_MAX; i++);
+        if (i == (size_t) (*result)->rows * (*result)->columns) {
+            Matrix* narrow = convert_matrix(*result, MATRIX_TYPE_I32);
+            free_matrix(*result);
+            *result = narrow;
+            correct = narrow ? SUCCESS : FAILURE;
+        }
+    }
+    if (correct == FAILURE && *result) {
+        free_matrix(*result);
+        *result = NULL;
+    }
+    return correct;
+}
+
+/*********************************************/
+/*
+    Conversion from and to Prolog terms
+*/
+/**********************************************/
+
+/*
+    Obtain the type named by an atom (f64, f32, i32 or i64). Returns -1 if the atom is not a type
+*/
+static int get_type_from_term(term_t term) {
+    char* name;
+    if (PL_get_atom_chars(term, &name)) {
+        for (int type = 0; type < MATRIX_TYPES; type++) {
+            if (strcmp(name, type_names[type]) == 0) {
+                return type;
+            }
+        }
+    }
+    report_error("El tipo de los elementos debe ser f64, f32, i32 o i64\n");
+    return -1;
+}
+
+/*
+    Store a Prolog number as the value index of a typed matrix. The integers are read exactly, and
+    a float is only accepted by the integer types when it is an integer. Returns SUCCESS or FAILURE
+*/
+static int store_typed_value(term_t value, Matrix* matrix, size_t index) {
+    int type = matrix->element_type;
+    double number;
+    if (!is_integer_type(type)) {
+        if (!PL_get_float(value, &number)) {
+            return FAILURE;
+        }
+        if (type == MATRIX_TYPE_F32) {
+            ((float*) matrix->data)[index] = (float) number;
+        } else {
+            matrix->data[index] = number;
+        }
+        return SUCCESS;
+    }
+    int64_t integer;
+    if (PL_is_integer(value)) {
+        if (!PL_get_int64(value, &integer)) {
+            return FAILURE;
+        }
+    } else if (PL_get_float(value, &number) && number == floor(number) && number >= -9223372036854775808.0 &&
+               number < 9223372036854775808.0) {
+        integer = (int64_t) number;
+    } else {
+        return FAILURE;
+    }
+    if (type == MATRIX_TYPE_I64) {
+        ((int64_t*) matrix->data)[index] = integer;
+    } else if (integer >= INT32_MIN && integer <= INT32_MAX) {
+        ((int32_t*) matrix->data)[index] = (int32_t) integer;
+    } else {
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/*
+    Read a list of lists of numbers into a new matrix of a type. Returns NULL on failure
+*/
+static Matrix* parse_list_of_lists_into_typed_matrix(term_t list, int type) {
+    if (type == MATRIX_TYPE_F64) {
+        return parse_list_of_lists_into_matrix(list);
+    }
+    size_t number_rows = 0;
+    size_t number_columns = 0;
+    term_t row = PL_new_term_ref();
+    term_t row_tail = PL_new_term_ref();
+    if (PL_skip_list(list, 0, &number_rows) != PL_LIST || number_rows == 0 || number_rows > INT_MAX ||
+        !PL_get_list(list, row, row_tail) || PL_skip_list(row, 0, &number_columns) != PL_LIST ||
+        number_columns == 0 || number_columns > INT_MAX) {
+        report_error("No se está pasando correctamente una lista de elementos\n");
+        return NULL;
+    }
+    Matrix* matrix = new_typed_matrix((int) number_rows, (int) number_columns, type);
+    if (!matrix) {
+        return NULL;
+    }
+    term_t tail = PL_copy_term_ref(list);
+    term_t value = PL_new_term_ref();
+    const char* error = NULL;
+    // The rows are hashed for the result cache as they are read, as parse_list_of_lists_into_matrix does
+    int hashing = result_cache_enabled();
+    ValuesHash hash;
+    begin_values_hash(&hash);
+    for (size_t r = 0; !error && PL_get_list(tail, row, tail); r++) {
+        size_t c = 0;
+        PL_put_term(row_tail, row);
+        while (!error && PL_get_list(row_tail, value, row_tail)) {
+            if (c == number_columns) {
+                error = "La matriz no tiene el mismo número de columnas en todas las filas\n";
+            } else if (store_typed_value(value, matrix, c * number_rows + r) == FAILURE) {
+                error = "Asegúrate que todos los valores que se introduce a la matriz son números del tipo de la matriz\n";
+            }
+            c++;
+        }
+        if (!error && (c != number_columns || !PL_get_nil(row_tail))) {
+            error = "La matriz no tiene el mismo número de columnas en todas las filas\n";
+        }
+        if (!error && hashing) {
+            hash_values(&hash, (const unsigned char*) matrix->data + r * matrix_element_size(type),
+                        number_columns, number_rows, type);
+        }
+    }
+    if (error) {
+        report_error("%s", error);
+        free_matrix(matrix);
+        return NULL;
+    }
+    if (hashing) {
+        finish_values_hash(&hash, matrix);
+    }
+    return matrix;
+}
+
+/*
+    Check whether a term is a handle of a matrix whose values are not doubles
+*/
+int is_typed_handle(term_t term) {
+    Matrix* matrix = is_matrix_handle(term) ? get_matrix_from_handle(term) : NULL;
+    return matrix && matrix->element_type != MATRIX_TYPE_F64;
+}
+
+/*
+    Obtain a matrix keeping the type of its values: the handles of typed matrices are returned
+    as they are, and the lists of lists are read with the given type. The other terms are read
+    as get_matrix_from_term does. Returns NULL on failure
+*/
+Matrix* get_typed_matrix_from_term(term_t term, int type, MatrixArena* arena) {
+    if (is_typed_handle(term)) {
+        Matrix* matrix = get_matrix_from_handle(term);
+        if (statistics_enabled) {
+            statistics_record_operand(0, matrix);
+        }
+        return matrix;
+    }
+    if (type == MATRIX_TYPE_F64 || is_matrix_handle(term) || is_sparse_handle(term) || is_matrix_compound(term)) {
+        return get_matrix_from_term(term, arena);
+    }
+    uint64_t start = statistics_enabled ? statistics_clock() : 0;
+    Matrix* matrix = parse_list_of_lists_into_typed_matrix(term, type);
+    if (statistics_enabled) {
+        statistics_record_operand(start, matrix);
+    }
+    return arena ? arena_adopt(arena, matrix) : matrix;
+}
+
+static int term_element_type(term_t term) {
+    return is_typed_handle(term) ? get_matrix_from_handle(term)->element_type : MATRIX_TYPE_F64;
+}
+
+/*
+    Sum, difference or product (SPARSE_ADDITION, SPARSE_SUBSTRACTION or SPARSE_MULTIPLICATION) when
+    one of the operands is a handle of a typed matrix. A list of lists is read with the type of
+    the other operand, so [[1,2]] added to a matrix of i64 stays exact
+*/
+foreign_t typed_binary_common(term_t matrix1, term_t matrix2, term_t result, int operation, int as_handle) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m1 = get_typed_matrix_from_term(matrix1, term_element_type(matrix2), &arena);
+    Matrix* m2 = get_typed_matrix_from_term(matrix2, term_element_type(matrix1), &arena);
+    if (!m1 || !m2) {
+        return arena_fail(&arena);
+    }
+    ResultKey key;
+    Matrix* cached = cached_result(&key, operation == SPARSE_MULTIPLICATION ? RESULT_CACHE_MULTIPLICATION :
+                                         operation == SPARSE_SUBSTRACTION ? RESULT_CACHE_SUBSTRACTION :
+                                         RESULT_CACHE_ADDITION, matrix1, m1, matrix2, m2);
+    if (cached) {
+        arena_release(&arena);
+        return unify_cached_result(result, cached, as_handle);
+    }
+    Matrix* r = NULL;
+    int correct = operation == SPARSE_MULTIPLICATION ? typed_multiplication(m1, m2, &r) :
+                  typed_addition(m1, m2, operation == SPARSE_SUBSTRACTION, &r);
+    if (correct == FAILURE || !arena_adopt(&arena, r)) {
+        return arena_fail(&arena);
+    }
+    cache_result(&key, r);
+    int unified = unify_matrix_result(result, r, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+/*********************************************/
+/*
+    Foreign predicates
+*/
+/**********************************************/
+
+/*
+  Foreign predicate lista_a_matriz(Lista, Tipo, Manejador): read a list of lists into a handle
+  of a matrix whose values have the type Tipo (f64, f32, i32 or i64)
+*/
+foreign_t pl_list_to_typed_matrix(term_t list, term_t type, term_t handle) {
+    int type_value = get_type_from_term(type);
+    if (type_value < 0) {
+        PL_fail;
+    }
+    uint64_t start = statistics_enabled ? statistics_clock() : 0;
+    Matrix* m = parse_list_of_lists_into_typed_matrix(list, type_value);
+    if (statistics_enabled) {
+        statistics_record_operand(start, m);
+    }
+    if (!m) {
+        PL_fail;
+    }
+    return unify_matrix_result(handle, m, 1, NULL);
+}
+
+/*
+  Foreign predicate tipo_matriz(Matriz, Tipo): type of the values of a matrix. The matrices which
+  are not handles of typed matrices have doubles
+*/
+foreign_t pl_matrix_type(term_t matrix, term_t type) {
+    return PL_unify_atom_chars(type, type_names[term_element_type(matrix)]);
+}
+
+/*
+  Foreign predicate convertir_matriz(Matriz, Tipo, Manejador): copy of a matrix with the values
+  converted into the type Tipo. The conversion into an integer type fails if some value is not
+  an integer which fits in the type
+*/
+foreign_t pl_convert_matrix(term_t matrix, term_t type, term_t handle) {
+    int type_value = get_type_from_term(type);
+    if (type_value < 0) {
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_typed_matrix_from_term(matrix, type_value, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    Matrix* converted = convert_matrix(m, type_value);
+    if (!arena_adopt(&arena, converted)) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_matrix_result(handle, converted, 1, &arena);
+    arena_release(&arena);
+    return unified;
+}
@@ -0,0 +1,333 @@
+#include "definitions.h"
+#include <string.h>
+#include <limits.h>
+#include <stdio.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the operations with vectors: matrix-vector product (GEMV),
+  y = alpha * x + y (AXPY) and the dot products of a vector with many vectors.
+  A vector can be a flat list of numbers or a matrix (list of lists, compound term or handle)
+  with one row or one column, whose values are already contiguous.
+    - The matrix-vector product reads A once, through its strides, in the order it is stored.
+      The rows are split in blocks of GEMV_BLOCK: when A is stored by columns, the part of y of
+      a block stays in the first level cache while the kernel adds the columns of the block four
+      at a time; when it is stored by rows (the lists of lists), every value of y is the dot
+      product of a row with x. The blocks are handed out to the threads, so each thread writes
+      its own part of y. Only the views which are stored neither way are copied.
+    - The dot products of a vector with the rows of a matrix are a matrix-vector product, whose
+      rows are read one after the other.
+*/
+
+/*
+    Read a flat list of numbers into a matrix of one row. Returns NULL on failure
+*/
+static Matrix* parse_list_into_vector(term_t list) {
+    size_t length = 0;
+    if (PL_skip_list(list, 0, &length) != PL_LIST || length == 0 || length > INT_MAX) {
+        report_error("No se trata de un vector\n");
+        return NULL;
+    }
+    Matrix* vector = new_matrix(1, (int) length);
+    if (!vector) {
+        return NULL;
+    }
+    term_t tail = PL_copy_term_ref(list);
+    term_t head = PL_new_term_ref();
+    for (size_t i = 0; PL_get_list(tail, head, tail); i++) {
+        if (!PL_get_float(head, &vector->data[i])) {
+            report_error("Asegúrate que todos los valores que se introduce al vector son valores numéricos\n");
+            free_matrix(vector);
+            return NULL;
+        }
+    }
+    return vector;
+}
+
+/*
+    Obtain a vector from a flat list of numbers or from a matrix of one row or one column.
+    The vector is added to the arena when it has been created for this call. Returns NULL on failure
+*/
+Matrix* get_vector_from_term(term_t term, MatrixArena* arena) {
+    term_t head = PL_new_term_ref();
+    term_t tail = PL_new_term_ref();
+    if (PL_get_list(term, head, tail) && PL_is_number(head)) {
+        uint64_t start = statistics_enabled ? statistics_clock() : 0;
+        Matrix* vector = parse_list_into_vector(term);
+        if (statistics_enabled) {
+            statistics_record_operand(start, vector);
+        }
+        return arena ? arena_adopt(arena, vector) : vector;
+    }
+    Matrix* vector = get_matrix_from_term(term, arena);
+    if (vector && vector->rows != 1 && vector->columns != 1) {
+        report_error("Un vector debe ser una lista de números o una matriz de una fila o una columna\n");
+        return NULL;
+    }
+    return vector;
+}
+
+/*
+    Unify the result of an operation with vectors either with a new handle or with a flat list
+*/
+int unify_vector_result(term_t result, Matrix* vector, int as_handle, MatrixArena* arena) {
+    if (as_handle) {
+        return unify_matrix_result(result, vector, 1, arena);
+    }
+    uint64_t start = statistics_enabled ? statistics_clock() : 0;
+    size_t length = (size_t) vector->rows * vector->columns;
+    term_t list = PL_copy_term_ref(result);
+    term_t head = PL_new_term_ref();
+    int unified = TRUE;
+    for (size_t i = 0; unified && i < length; i++) {
+        unified = PL_unify_list(list, head, list) && PL_unify_float(head, vector->data[i]);
+    }
+    unified = unified && PL_unify_nil(list);
+    if (statistics_enabled) {
+        statistics_record_result(start, vector, unified);
+    }
+    return unified;
+}
+
+static size_t vector_length(Matrix* vector) {
+    return (size_t) vector->rows * vector->columns;
+}
+
+typedef struct {
+    const double* a;
+    size_t lda; // distance between two columns of A, or between two rows when by_rows is set
+    int by_rows;
+    size_t rows;
+    size_t columns;
+    const double* x;
+    double beta;
+    const double* y; // NULL when beta is 0
+    double* result;
+} GemvJob;
+
+/*
+    result = alpha * A x + beta * y for the blocks of rows [begin, end). x already has the factor alpha
+*/
+static void gemv_task(void* context, size_t begin, size_t end) {
+    GemvJob* job = context;
+    for (size_t block = begin; block < end; block++) {
+        size_t first = block * GEMV_BLOCK;
+        size_t rows = job->rows - first < GEMV_BLOCK ? job->rows - first : GEMV_BLOCK;
+        double* result = job->result + first;
+        if (job->by_rows) {
+            const double* a = job->a + first * job->lda;
+            for (size_t i = 0; i < rows; i++) {
+                double previous = job->y ? job->beta * job->y[first + i] : 0.0;
+                result[i] = previous + kernels->dot(a + i * job->lda, job->x, job->columns);
+            }
+            continue;
+        }
+        if (job->y) {
+            kernels->multiply(job->y + first, job->beta, result, rows);
+        } else {
+            memset(result, 0, rows * sizeof(double));
+        }
+        kernels->gemv(job->a + first, job->lda, job->x, result, rows, job->columns);
+    }
+}
+
+/*
+    result = alpha * A x + beta * y, where y is not read when beta is 0 (and can be NULL).
+    A can be any matrix or view, while the vectors are contiguous. result can be y.
+    Returns SUCCESS or FAILURE
+*/
+int matrix_vector_product(double alpha, Matrix* matrix, Matrix* x, double beta, Matrix* y, Matrix* result) {
+    if (!matrix || !x || !result || (beta != 0.0 && !y)) {
+        return FAILURE;
+    }
+    if (vector_length(x) != (size_t) matrix->columns || vector_length(result) != (size_t) matrix->rows ||
+        (beta != 0.0 && vector_length(y) != (size_t) matrix->rows)) {
+        report_error("La matriz tiene %d filas y %d columnas, así que los vectores deben tener %d y %d elementos\n",
+               matrix->rows, matrix->columns, matrix->columns, matrix->rows);
+        return FAILURE;
+    }
+    Matrix* copy = NULL;
+    if (matrix->rows > 1 && matrix->row_stride != 1 && matrix->columns > 1 && matrix->column_stride != 1) {
+        copy = copy_matrix_view(matrix);
+        if (!copy) {
+            return FAILURE;
+        }
+        matrix = copy;
+    }
+    int by_rows = matrix->rows > 1 && matrix->row_stride != 1;
+    size_t capacity = 0;
+    double* scaled = NULL;
+    const double* values = x->data;
+    if (alpha != 1.0) {
+        scaled = pool_allocate(sizeof(double) * (size_t) matrix->columns, &capacity);
+        if (!scaled) {
+            free_matrix(copy);
+            return FAILURE;
+        }
+        kernels->multiply(x->data, alpha, scaled, (size_t) matrix->columns);
+        values = scaled;
+    }
+    GemvJob job = { matrix->data, by_rows ? matrix->row_stride : matrix->column_stride, by_rows,
+                    (size_t) matrix->rows, (size_t) matrix->columns, values, beta,
+                    beta != 0.0 ? y->data : NULL, result->data };
+    size_t blocks = (job.rows + GEMV_BLOCK - 1) / GEMV_BLOCK;
+    parallel_for(blocks, PARALLEL_GRAIN / (GEMV_BLOCK * job.columns) + 1, gemv_task, &job);
+    pool_release(scaled, capacity);
+    free_matrix(copy);
+    invalidate_matrix_structure(result);
+    return SUCCESS;
+}
+
+typedef struct {
+    double alpha;
+    const double* x;
+    const double* y;
+    double* result;
+} AxpyJob;
+
+static void axpy_task(void* context, size_t begin, size_t end) {
+    AxpyJob* job = context;
+    kernels->axpy(job->alpha, job->x + begin, job->y + begin, job->result + begin, end - begin);
+}
+
+/*
+    result = alpha * x + y, where result can be x or y. Returns SUCCESS or FAILURE
+*/
+int vectors_axpy(double alpha, Matrix* x, Matrix* y, Matrix* result) {
+    if (!x || !y || !result) {
+        return FAILURE;
+    }
+    if (vector_length(x) != vector_length(y) || vector_length(result) != vector_length(x)) {
+        report_error("Debe de ser vectores que tengan el mismo número de elementos\n");
+        return FAILURE;
+    }
+    AxpyJob job = { alpha, x->data, y->data, result->data };
+    parallel_for(vector_length(x), PARALLEL_GRAIN, axpy_task, &job);
+    invalidate_matrix_structure(result);
+    return SUCCESS;
+}
+
+/*********************************************/
+/*
+    Foreign predicates
+*/
+/**********************************************/
+
+/*
+  result = alpha * A x + beta * y. The result is unified as a flat list or as a handle
+  of one column
+*/
+static foreign_t gemv_common(term_t alpha, term_t matrix, term_t x, term_t beta, term_t y, term_t result,
+                             int as_handle) {
+    double alpha_value, beta_value;
+    if (!PL_get_float(alpha, &alpha_value) || !PL_get_float(beta, &beta_value)) {
+        report_error("Los factores deben ser valores numéricos\n");
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* a = get_strided_matrix_from_term(matrix, &arena);
+    Matrix* vx = get_vector_from_term(x, &arena);
+    // y is not read when beta is 0, so it can be []
+    Matrix* vy = beta_value != 0.0 ? get_vector_from_term(y, &arena) : NULL;
+    if (!a || !vx || (beta_value != 0.0 && !vy)) {
+        return arena_fail(&arena);
+    }
+    Matrix* product = arena_new_matrix(&arena, a->rows, 1);
+    if (!product || matrix_vector_product(alpha_value, a, vx, beta_value, vy, product) == FAILURE) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_vector_result(result, product, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+foreign_t pl_gemv(term_t alpha, term_t matrix, term_t x, term_t beta, term_t y, term_t result) {
+    return gemv_common(alpha, matrix, x, beta, y, result, 0);
+}
+
+foreign_t pl_gemv_handle(term_t alpha, term_t matrix, term_t x, term_t beta, term_t y, term_t result) {
+    return gemv_common(alpha, matrix, x, beta, y, result, 1);
+}
+
+/*
+  Product of a matrix by a vector, y = A x
+*/
+static foreign_t matrix_vector_common(term_t matrix, term_t x, term_t result, int as_handle) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* a = get_strided_matrix_from_term(matrix, &arena);
+    Matrix* vx = get_vector_from_term(x, &arena);
+    if (!a || !vx) {
+        return arena_fail(&arena);
+    }
+    Matrix* product = arena_new_matrix(&arena, a->rows, 1);
+    if (!product || matrix_vector_product(1.0, a, vx, 0.0, NULL, product) == FAILURE) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_vector_result(result, product, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+foreign_t pl_matrix_vector_product(term_t matrix, term_t x, term_t result) {
+    return matrix_vector_common(matrix, x, result, 0);
+}
+
+foreign_t pl_matrix_vector_product_handle(term_t matrix, term_t x, term_t result) {
+    return matrix_vector_common(matrix, x, result, 1);
+}
+
+/*
+  result = alpha * x + y. The result is unified as a flat list or as a handle with the
+  shape of x
+*/
+static foreign_t axpy_common(term_t alpha, term_t x, term_t y, term_t result, int as_handle) {
+    double alpha_value;
+    if (!PL_get_float(alpha, &alpha_value)) {
+        report_error("El factor debe ser un valor numérico\n");
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* vx = get_vector_from_term(x, &arena);
+    Matrix* vy = get_vector_from_term(y, &arena);
+    if (!vx || !vy) {
+        return arena_fail(&arena);
+    }
+    Matrix* sum = arena_new_matrix(&arena, vx->rows, vx->columns);
+    if (!sum || vectors_axpy(alpha_value, vx, vy, sum) == FAILURE) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_vector_result(result, sum, as_handle, &arena);
+    arena_release(&arena);
+    return unified;
+}
+
+foreign_t pl_axpy(term_t alpha, term_t x, term_t y, term_t result) {
+    return axpy_common(alpha, x, y, result, 0);
+}
+
+foreign_t pl_axpy_handle(term_t alpha, term_t x, term_t y, term_t result) {
+    return axpy_common(alpha, x, y, result, 1);
+}
+
+/*
+  Foreign predicate to obtain the dot products of a vector with each row of a matrix, as a list
+*/
+foreign_t pl_batched_dot_products(term_t vector, term_t vectors, term_t result) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* v = get_vector_from_term(vector, &arena);
+    Matrix* rows = get_strided_matrix_from_term(vectors, &arena);
+    if (!v || !rows) {
+        return arena_fail(&arena);
+    }
+    Matrix* products = arena_new_matrix(&arena, rows->rows, 1);
+    if (!products || matrix_vector_product(1.0, rows, v, 0.0, NULL, products) == FAILURE) {
+        return arena_fail(&arena);
+    }
+    int unified = unify_vector_result(result, products, 0, &arena);
+    arena_release(&arena);
+    return unified;
+}
@@ -0,0 +1,256 @@
+#include "definitions.h"
+#include <string.h>
+#include <stdio.h>
+#include <SWI-Prolog.h>
+
+/*
+  Class in charge of the views of the dense matrices. A view is a Matrix which shares the data
+  buffer of its parent: it only has its own start, number of rows and columns and row and
+  column strides, so a block, a row, a column, the diagonal or the transpose of a matrix are
+  obtained without copying any value.
+    - The parent counts the views which share its data, and it is freed with the last of them,
+      whatever the order in which the handles are collected. The views of a view refer to the
+      matrix which owns the data.
+    - The operations of matricesLogic.c, the reductions, the matrix-vector products, the linear
+      systems and the sparse conversions read the views through their strides. The fused
+      evaluation only copies the matrices which are not stored in the layout of its program.
+      The typed kernels and the vectors, which need their values stored by columns one after
+      the other, receive a copy of the views which are not contiguous, and of the matrices
+      stored by rows, from get_matrix_from_term.
+    - A matrix stored by rows is, for the kernels, the transpose of a matrix stored by columns:
+      describe_transpose swaps the strides of a matrix for the duration of an operation, without
+      creating a view.
+*/
+
+/*
+    Check whether the values of a matrix are stored by columns one after the other, as the ones
+    of the matrices which own their data, so they can be read as a flat array
+*/
+int is_matrix_contiguous(const Matrix* matrix) {
+    return (matrix->rows == 1 || matrix->row_stride == 1) &&
+           (matrix->columns == 1 || matrix->column_stride == (size_t) matrix->rows);
+}
+
+/*
+    Layout of the values of a matrix (MATRIX_LAYOUT_*), given by its strides. A matrix of one row
+    or one column is stored both ways, and it is said to be stored by columns
+*/
+int matrix_layout(const Matrix* matrix) {
+    if (is_matrix_contiguous(matrix)) {
+        return MATRIX_LAYOUT_COLUMN_MAJOR;
+    }
+    return matrix->column_stride == 1 && matrix->row_stride == (size_t) matrix->columns
+           ? MATRIX_LAYOUT_ROW_MAJOR : MATRIX_LAYOUT_STRIDED;
+}
+
+/*
+    Fill description with the transpose of a matrix, which shares its values and whose strides are
+    swapped. Unlike transposed_view it is not counted as a view, so it is only valid while the
+    matrix is. Returns description, or NULL if the matrix is NULL
+*/
+Matrix* describe_transpose(Matrix* matrix, Matrix* description) {
+    if (!matrix) {
+        return NULL;
+    }
+    memset(description, 0, sizeof(Matrix));
+    description->rows = matrix->columns;
+    description->columns = matrix->rows;
+    description->data = matrix->data;
+    description->element_type = matrix->element_type;
+    description->row_stride = matrix->column_stride;
+    description->column_stride = matrix->row_stride;
+    set_structure_of_transpose(matrix, description);
+    return description;
+}
+
+/*
+    Copy the values of a matrix into a matrix of the same dimensions which owns its data, in the
+    layout of the destination
+*/
+void copy_matrix_values(Matrix* source, Matrix* destination) {
+    if (matrix_layout(destination) == MATRIX_LAYOUT_ROW_MAJOR) {
+        // The values of a matrix stored by rows are the ones of its transpose stored by columns
+        copy_strided_values(source->data, source->column_stride, source->row_stride, source->columns, source->rows,
+                            destination->data);
+    } else {
+        copy_strided_values(source->data, source->row_stride, source->column_stride, source->rows, source->columns,
+                            destination->data);
+    }
+}
+
+/*
+    Create a view of rows x columns of a matrix, whose element (0, 0) is the element
+    (first_row, first_column) of the matrix and whose strides are in values of the data buffer.
+    The caller checks that the view is inside the matrix. Returns NULL on failure
+*/
+Matrix* new_matrix_view(Matrix* matrix, int first_row, int first_column, int rows, int columns,
+                        size_t row_stride, size_t column_stride) {
+    if (!matrix || rows <= 0 || columns <= 0) {
+        return NULL;
+    }
+    Matrix* view = pool_allocate_struct();
+    if (!view) {
+        return NULL;
+    }
+    Matrix* parent = matrix->storage == MATRIX_STORAGE_VIEW ? matrix->parent : matrix;
+    atomic_fetch_add(&parent->references, 1);
+    view->rows = rows;
+    view->columns = columns;
+    view->data = &ACCESS(matrix, first_row, first_column);
+    view->row_stride = row_stride;
+    view->column_stride = column_stride;
+    view->storage = MATRIX_STORAGE_VIEW;
+    view->parent = parent;
+    return view;
+}
+
+/*
+    Create a view with the transpose of a matrix: the same values with the strides swapped.
+    Returns NULL on failure
+*/
+Matrix* transposed_view(Matrix* matrix) {
+    Matrix* view = new_matrix_view(matrix, 0, 0, matrix->columns, matrix->rows, matrix->column_stride,
+                                   matrix->row_stride);
+    if (view) {
+        set_structure_of_transpose(matrix, view);
+    }
+    return view;
+}
+
+/*
+    Copy the values of a view, or of a matrix stored by rows, into a new matrix which owns them,
+    stored by columns. Returns NULL on failure
+*/
+Matrix* copy_matrix_view(Matrix* view) {
+    Matrix* copy = new_matrix(view->rows, view->columns);
+    if (!copy) {
+        return NULL;
+    }
+    copy_matrix_values(view, copy);
+    copy->structure = view->structure;
+    copy->lower_bandwidth = view->lower_bandwidth;
+    copy->upper_bandwidth = view->upper_bandwidth;
+    return copy;
+}
+
+/*********************************************/
+/*
+    Foreign predicates
+*/
+/**********************************************/
+
+/*
+    Unify a new handle with a view, or fail if it could not be created. The matrix of the
+    arena which the view comes from is kept alive by the view
+*/
+static foreign_t unify_view(term_t result, Matrix* view, MatrixArena* arena) {
+    if (!arena_adopt(arena, view)) {
+        return arena_fail(arena);
+    }
+    int unified = unify_matrix_result(result, view, 1, arena);
+    arena_release(arena);
+    return unified;
+}
+
+/*
+  Foreign predicate submatriz(Matriz, Fila, Columna, Filas, Columnas, Vista): view of the block
+  of Filas x Columnas whose first element is (Fila, Columna), counted from 1
+*/
+foreign_t pl_submatrix(term_t matrix, term_t first_row, term_t first_column, term_t rows, term_t columns, term_t view) {
+    int row_value, column_value, rows_value, columns_value;
+    if (!PL_get_integer(first_row, &row_value) || !PL_get_integer(first_column, &column_value) ||
+        !PL_get_integer(rows, &rows_value) || !PL_get_integer(columns, &columns_value)) {
+        report_error("La posición y las dimensiones de la submatriz deben ser números enteros\n");
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    if (row_value < 1 || column_value < 1 || rows_value < 1 || columns_value < 1 ||
+        rows_value > m->rows - row_value + 1 || columns_value > m->columns - column_value + 1) {
+        report_error("La submatriz de %d x %d desde (%d, %d) no está dentro de la matriz de %d x %d\n",
+               rows_value, columns_value, row_value, column_value, m->rows, m->columns);
+        return arena_fail(&arena);
+    }
+    return unify_view(view, new_matrix_view(m, row_value - 1, column_value - 1, rows_value, columns_value,
+                                            m->row_stride, m->column_stride), &arena);
+}
+
+/*
+  Foreign predicate fila_de_matriz(Matriz, Fila, Vista): view of a row as a matrix of one row
+*/
+foreign_t pl_matrix_row(term_t matrix, term_t row, term_t view) {
+    int row_value;
+    if (!PL_get_integer(row, &row_value)) {
+        report_error("La fila debe ser un número entero\n");
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    if (row_value < 1 || row_value > m->rows) {
+        report_error("La matriz no tiene la fila %d, tiene %d filas\n", row_value, m->rows);
+        return arena_fail(&arena);
+    }
+    return unify_view(view, new_matrix_view(m, row_value - 1, 0, 1, m->columns, m->row_stride, m->column_stride),
+                      &arena);
+}
+
+/*
+  Foreign predicate columna_de_matriz(Matriz, Columna, Vista): view of a column as a matrix of one column
+*/
+foreign_t pl_matrix_column(term_t matrix, term_t column, term_t view) {
+    int column_value;
+    if (!PL_get_integer(column, &column_value)) {
+        report_error("La columna debe ser un número entero\n");
+        PL_fail;
+    }
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    if (column_value < 1 || column_value > m->columns) {
+        report_error("La matriz no tiene la columna %d, tiene %d columnas\n", column_value, m->columns);
+        return arena_fail(&arena);
+    }
+    return unify_view(view, new_matrix_view(m, 0, column_value - 1, m->rows, 1, m->row_stride, m->column_stride),
+                      &arena);
+}
+
+/*
+  Foreign predicate diagonal_de_matriz(Matriz, Vista): view of the main diagonal as a matrix of one
+  column. Moving to the next value of the diagonal is moving one row and one column
+*/
+foreign_t pl_matrix_diagonal(term_t matrix, term_t view) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    int length = m->rows < m->columns ? m->rows : m->columns;
+    return unify_view(view, new_matrix_view(m, 0, 0, length, 1, m->row_stride + m->column_stride, m->column_stride),
+                      &arena);
+}
+
+/*
+  Foreign predicate transponer_vista(Matriz, Vista): view of the transpose, which swaps the
+  strides instead of moving the values
+*/
+foreign_t pl_transposed_view(term_t matrix, term_t view) {
+    MatrixArena arena;
+    arena_init(&arena);
+    Matrix* m = get_strided_matrix_from_term(matrix, &arena);
+    if (!m) {
+        return arena_fail(&arena);
+    }
+    return unify_view(view, transposed_view(m), &arena);
+}
@@ -0,0 +1,6 @@
+#!/bin/bash
+# Build the tests of the C functions and run them. The exit status is 1 if any check fails.
+# Usage: ./run_tests.sh
+cd "$(dirname "$0")"
+swipl-ld -o tests -O2 tests.c ../matricesLogic.c ../matricesGemm.c ../matricesKernels.c ../matricesThreads.c ../matricesMemory.c ../matricesHandles.c ../matricesFiles.c ../matricesSparse.c ../matricesStructure.c ../matricesStrassen.c ../matricesLinear.c ../matricesReductions.c ../matricesVectors.c ../matricesTranspose.c ../matricesViews.c ../matricesTypes.c ../matricesCache.c ../matricesAsync.c ../matricesChain.c ../matricesStats.c ../matricesEval.c -I/include -lpthread || exit 1
+./tests
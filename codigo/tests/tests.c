@@ -0,0 +1,786 @@
+#include "../definitions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+#include <SWI-Prolog.h>
+
+/*
+  Tests of the C functions of the library. Like the benchmark, it calls them directly, without
+  the foreign interface:
+    - The SIMD kernels of every instruction set supported by the processor are compared with
+      the scalar ones, with odd sizes and tails, with arrays which are not aligned and with the
+      operands in both orders.
+    - The products (blocked, split among the threads and Strassen-Winograd), the element-wise
+      operations and the transposes are compared with simple loops for every combination of
+      layouts and views.
+      Like a program would, the algorithm of the products is selected with its predicate.
+    - LU and Cholesky are checked by the residual of their solves, the typed kernels with the
+      same products in doubles and the chain of products and the powers with the products
+      done one after the other.
+    - The hits of the result cache and the waits of a future return the result which was kept,
+      and share its handle without adding references to it.
+  Usage: tests
+  Every check which fails is written in the standard error, and the exit status is 1 if any fails.
+*/
+
+static int checks = 0;
+static int failures = 0;
+
+static void check(int correct, const char* test, const char* detail, size_t size) {
+    checks++;
+    if (!correct) {
+        failures++;
+        fprintf(stderr, "FALLO %s: %s (n = %zu)\n", test, detail, size);
+    }
+}
+
+/*
+    Whether value is expected up to a relative error of tolerance. NaN is only close to NaN, and
+    an infinity to itself
+*/
+static int close_to(double value, double expected, double tolerance) {
+    if (isnan(expected) || isinf(expected)) {
+        return isnan(expected) ? isnan(value) : value == expected;
+    }
+    return fabs(value - expected) <= tolerance * (1.0 + fabs(expected));
+}
+
+/*
+    Tolerance of a sum of n values whose magnitudes add up to magnitude, in any order
+*/
+static double sum_tolerance(size_t n, double magnitude) {
+    return (n + 1) * DBL_EPSILON * (magnitude + 1.0);
+}
+
+static double random_value(void) {
+    return rand() / (double) RAND_MAX - 0.5;
+}
+
+static void fill_random(double* values, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        values[i] = random_value();
+    }
+}
+
+static Matrix* random_matrix_with_layout(int rows, int columns, int layout) {
+    Matrix* matrix = new_matrix_with_layout(rows, columns, layout);
+    if (matrix) {
+        fill_random(matrix->data, (size_t) rows * columns);
+    }
+    return matrix;
+}
+
+/*********************************************/
+/*
+    SIMD kernels against the scalar ones
+*/
+/**********************************************/
+
+# define KERNEL_MAX_SIZE 1100
+# define KERNEL_OFFSETS 3
+
+static const size_t kernel_sizes[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 23, 24, 25,
+    31, 32, 33, 47, 48, 49, 63, 64, 65, 127, 128, 129, 255, 256, 257, 1000, 1023, 1024, 1025
+};
+
+// Offsets of the arrays from an aligned buffer, so the vector loads are also not aligned
+static const size_t kernel_offsets[KERNEL_OFFSETS] = { 0, 1, 3 };
+
+typedef struct {
+    double* a;
+    double* b;
+    double* expected;
+    double* result;
+} KernelBuffers;
+
+static void test_binary_kernel(const char* name, binary_kernel_t tested, binary_kernel_t scalar,
+                               const KernelBuffers* buffers, size_t n) {
+    for (int o = 0; o < KERNEL_OFFSETS; o++) {
+        const double* a = buffers->a + kernel_offsets[o];
+        const double* b = buffers->b + kernel_offsets[(o + 1) % KERNEL_OFFSETS];
+        double* result = buffers->result + kernel_offsets[(o + 2) % KERNEL_OFFSETS];
+        // Both orders of the operands, as the difference is not commutative
+        for (int order = 0; order < 2; order++) {
+            const double* first = order ? b : a;
+            const double* second = order ? a : b;
+            scalar(first, second, buffers->expected, n);
+            tested(first, second, result, n);
+            check(memcmp(result, buffers->expected, n * sizeof(double)) == 0, name, "valores distintos", n);
+        }
+    }
+}
+
+static void test_factor_kernel(const char* name, factor_kernel_t tested, factor_kernel_t scalar,
+                               const KernelBuffers* buffers, size_t n) {
+    static const double factors[] = { 1.5, -0.25, 3.0 };
+    for (int o = 0; o < KERNEL_OFFSETS; o++) {
+        const double* a = buffers->a + kernel_offsets[o];
+        double* result = buffers->result + kernel_offsets[(o + 1) % KERNEL_OFFSETS];
+        scalar(a, factors[o], buffers->expected, n);
+        tested(a, factors[o], result, n);
+        int correct = 1;
+        for (size_t i = 0; i < n; i++) {
+            // The division can be a product by the inverse of the factor
+            correct &= close_to(result[i], buffers->expected[i], 2 * DBL_EPSILON);
+        }
+        check(correct, name, "valores distintos", n);
+    }
+}
+
+static void test_reduction_kernels(const MatrixKernels* tested, const MatrixKernels* scalar,
+                                   const KernelBuffers* buffers, size_t n) {
+    for (int o = 0; o < KERNEL_OFFSETS; o++) {
+        const double* a = buffers->a + kernel_offsets[o];
+        const double* b = buffers->b + kernel_offsets[(o + 1) % KERNEL_OFFSETS];
+        double magnitude = 0;
+        for (size_t i = 0; i < n; i++) {
+            magnitude += fabs(a[i]);
+        }
+        check(close_to(tested->sum(a, n), scalar->sum(a, n), sum_tolerance(n, magnitude)), "sum", "suma distinta", n);
+        check(tested->maximum(a, n) == scalar->maximum(a, n), "maximum", "máximo distinto", n);
+        check(close_to(tested->dot(a, b, n), scalar->dot(a, b, n), sum_tolerance(n, magnitude)) &&
+              tested->dot(a, b, n) == tested->dot(b, a, n), "dot", "producto escalar distinto", n);
+    }
+    if (n > 0) {
+        // The NaN values are skipped by the maximum, wherever they are
+        double* values = buffers->result + 1;
+        memcpy(values, buffers->a, n * sizeof(double));
+        values[n / 2] = NAN;
+        values[n - 1] = NAN;
+        check(tested->maximum(values, n) == scalar->maximum(values, n), "maximum", "máximo con NaN distinto", n);
+    }
+}
+
+static void test_axpy_kernel(const MatrixKernels* tested, const MatrixKernels* scalar,
+                             const KernelBuffers* buffers, size_t n) {
+    for (int o = 0; o < KERNEL_OFFSETS; o++) {
+        const double* x = buffers->a + kernel_offsets[o];
+        double* y = buffers->b + kernel_offsets[(o + 1) % KERNEL_OFFSETS];
+        scalar->axpy(-0.75, x, y, buffers->expected, n);
+        tested->axpy(-0.75, x, y, buffers->result, n);
+        int correct = 1;
+        for (size_t i = 0; i < n; i++) {
+            correct &= close_to(buffers->result[i], buffers->expected[i], 4 * DBL_EPSILON);
+        }
+        check(correct, "axpy", "valores distintos", n);
+        // The result can be y
+        memcpy(buffers->result, y, n * sizeof(double));
+        tested->axpy(-0.75, x, buffers->result, buffers->result, n);
+        correct = 1;
+        for (size_t i = 0; i < n; i++) {
+            correct &= close_to(buffers->result[i], buffers->expected[i], 4 * DBL_EPSILON);
+        }
+        check(correct, "axpy", "valores distintos con el resultado en y", n);
+    }
+}
+
+static void test_gemv_kernel(const MatrixKernels* tested, const MatrixKernels* scalar, size_t rows, size_t columns) {
+    size_t lda = rows + 3; // the columns of a block are not consecutive
+    double* a = malloc(sizeof(double) * (lda * columns + 1));
+    double* x = malloc(sizeof(double) * (columns + 1));
+    double* expected = malloc(sizeof(double) * (rows + 1));
+    double* y = malloc(sizeof(double) * (rows + 1));
+    if (!a || !x || !expected || !y) {
+        check(0, "gemv", "no hay memoria", rows);
+    } else {
+        fill_random(a, lda * columns + 1);
+        fill_random(x, columns + 1);
+        fill_random(expected, rows + 1);
+        memcpy(y, expected, sizeof(double) * (rows + 1));
+        // Not aligned: one value after the start of every buffer
+        scalar->gemv(a + 1, lda, x + 1, expected + 1, rows, columns);
+        tested->gemv(a + 1, lda, x + 1, y + 1, rows, columns);
+        int correct = 1;
+        for (size_t i = 1; i <= rows; i++) {
+            correct &= close_to(y[i], expected[i], sum_tolerance(columns, (double) columns));
+        }
+        check(correct, "gemv", "valores distintos", rows * columns);
+    }
+    free(a);
+    free(x);
+    free(expected);
+    free(y);
+}
+
+static void test_transpose_kernel(const MatrixKernels* tested, const MatrixKernels* scalar, int rows, int columns) {
+    size_t source_stride = (size_t) rows + 1, destination_stride = (size_t) columns + 2;
+    size_t source_size = source_stride * columns + 1, destination_size = destination_stride * rows + 1;
+    double* source = malloc(sizeof(double) * source_size);
+    double* expected = calloc(destination_size, sizeof(double));
+    double* result = calloc(destination_size, sizeof(double));
+    if (!source || !expected || !result) {
+        check(0, "transpose", "no hay memoria", (size_t) rows * columns);
+    } else {
+        fill_random(source, source_size);
+        scalar->transpose(source + 1, source_stride, expected + 1, destination_stride, rows, columns);
+        tested->transpose(source + 1, source_stride, result + 1, destination_stride, rows, columns);
+        check(memcmp(result, expected, sizeof(double) * destination_size) == 0, "transpose", "valores distintos",
+              (size_t) rows * columns);
+    }
+    free(source);
+    free(expected);
+    free(result);
+}
+
+static void test_kernels(void) {
+    const MatrixKernels* scalar = get_kernels(SIMD_SCALAR);
+    size_t length = KERNEL_MAX_SIZE + KERNEL_OFFSETS + 1;
+    KernelBuffers buffers = {
+        malloc(sizeof(double) * length), malloc(sizeof(double) * length),
+        malloc(sizeof(double) * length), malloc(sizeof(double) * length)
+    };
+    if (!buffers.a || !buffers.b || !buffers.expected || !buffers.result) {
+        check(0, "kernels", "no hay memoria", length);
+        return;
+    }
+    for (int level = SIMD_SSE2; level <= SIMD_AVX512; level++) {
+        const MatrixKernels* tested = get_kernels(level);
+        if (!tested) {
+            printf("kernels %d: no soportados por el procesador\n", level);
+            continue;
+        }
+        int previous_failures = failures;
+        for (size_t s = 0; s < sizeof(kernel_sizes) / sizeof(kernel_sizes[0]); s++) {
+            size_t n = kernel_sizes[s];
+            fill_random(buffers.a, length);
+            fill_random(buffers.b, length);
+            test_binary_kernel("add", tested->add, scalar->add, &buffers, n);
+            test_binary_kernel("substract", tested->substract, scalar->substract, &buffers, n);
+            test_factor_kernel("multiply", tested->multiply, scalar->multiply, &buffers, n);
+            test_factor_kernel("divide", tested->divide, scalar->divide, &buffers, n);
+            test_reduction_kernels(tested, scalar, &buffers, n);
+            test_axpy_kernel(tested, scalar, &buffers, n);
+        }
+        for (int rows = 1; rows <= 19; rows += 3) {
+            for (int columns = 1; columns <= 23; columns += 2) {
+                test_gemv_kernel(tested, scalar, (size_t) rows, (size_t) columns);
+                test_transpose_kernel(tested, scalar, rows, columns);
+            }
+        }
+        test_gemv_kernel(tested, scalar, 517, 9);
+        test_transpose_kernel(tested, scalar, 67, 45);
+        printf("kernels %s: %s\n", tested->name, failures == previous_failures ? "ok" : "con fallos");
+    }
+    free(buffers.a);
+    free(buffers.b);
+    free(buffers.expected);
+    free(buffers.result);
+}
+
+/*********************************************/
+/*
+    Operations over matrices in every layout
+*/
+/**********************************************/
+
+# define LAYOUT_KINDS 4
+
+static const char* layout_kinds[LAYOUT_KINDS] = { "columnas", "vista", "vista traspuesta", "filas" };
+
+/*
+    Matrix of rows x columns of one of the layout_kinds. The views are blocks of a larger matrix,
+    so their strides are not their dimensions, and their parent is kept in parent
+*/
+static Matrix* matrix_of_kind(int kind, int rows, int columns, Matrix** parent) {
+    *parent = NULL;
+    if (kind == 0 || kind == 3) {
+        return random_matrix_with_layout(rows, columns, kind == 0 ? MATRIX_LAYOUT_COLUMN_MAJOR : MATRIX_LAYOUT_ROW_MAJOR);
+    }
+    int transposed = kind == 2;
+    *parent = random_matrix_with_layout((transposed ? columns : rows) + 3, (transposed ? rows : columns) + 2,
+                                        MATRIX_LAYOUT_COLUMN_MAJOR);
+    if (!*parent) {
+        return NULL;
+    }
+    Matrix* view = transposed ? new_matrix_view(*parent, 1, 2, rows, columns, (*parent)->column_stride, 1)
+                              : new_matrix_view(*parent, 2, 1, rows, columns, 1, (*parent)->column_stride);
+    return view;
+}
+
+static void free_matrix_of_kind(Matrix* matrix, Matrix* parent) {
+    free_matrix(matrix);
+    free_matrix(parent);
+}
+
+static void test_product(int kind1, int kind2, int m, int n, int k, const char* test) {
+    Matrix *parent1, *parent2;
+    Matrix* a = matrix_of_kind(kind1, m, k, &parent1);
+    Matrix* b = matrix_of_kind(kind2, k, n, &parent2);
+    Matrix* result = a && b ? new_matrix_with_layout(m, n, product_layout(a, b)) : NULL;
+    if (!result) {
+        check(0, test, "no hay memoria", (size_t) m * n);
+    } else if (matrices_multiplication(a, b, result) == FAILURE) {
+        check(0, test, "el producto ha fallado", (size_t) m * n);
+    } else {
+        int correct = 1;
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                double expected = 0;
+                for (int l = 0; l < k; l++) {
+                    expected += ACCESS(a, i, l) * ACCESS(b, l, j);
+                }
+                correct &= close_to(ACCESS(result, i, j), expected, sum_tolerance((size_t) k, (double) k));
+            }
+        }
+        char detail[96];
+        snprintf(detail, sizeof(detail), "%s x %s, %d x %d x %d", layout_kinds[kind1], layout_kinds[kind2], m, n, k);
+        check(correct, test, detail, (size_t) m * n);
+    }
+    free_matrix_of_kind(a, parent1);
+    free_matrix_of_kind(b, parent2);
+    free_matrix(result);
+}
+
+static void test_products(void) {
+    // Triple loop, blocked kernel (more than GEMM_THRESHOLD operations) and its edges
+    static const int sizes[][3] = { { 1, 1, 1 }, { 3, 5, 7 }, { 17, 9, 33 }, { 65, 67, 63 }, { 97, 130, 71 } };
+    int previous_failures = failures;
+    for (int kind1 = 0; kind1 < LAYOUT_KINDS; kind1++) {
+        for (int kind2 = 0; kind2 < LAYOUT_KINDS; kind2++) {
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                test_product(kind1, kind2, sizes[s][0], sizes[s][1], sizes[s][2], "producto");
+            }
+        }
+    }
+    printf("productos: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+static void test_parallel_products(void) {
+    // Four threads even with one processor, so the large products are split by columns and,
+    // when C has few columns, by rows sharing every packed block of B (more than GEMM_KC deep)
+    if (set_thread_count(4) == FAILURE) {
+        check(0, "producto en paralelo", "no es posible cambiar el número de hilos", 4);
+        return;
+    }
+    static const int sizes[][3] = { { 130, 200, 150 }, { 400, 24, 300 }, { 333, 9, 700 } };
+    int previous_failures = failures;
+    for (int kind1 = 0; kind1 < LAYOUT_KINDS; kind1++) {
+        for (int kind2 = 0; kind2 < LAYOUT_KINDS; kind2++) {
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                test_product(kind1, kind2, sizes[s][0], sizes[s][1], sizes[s][2], "producto en paralelo");
+            }
+        }
+    }
+    set_thread_count(0);
+    printf("productos en paralelo: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+/*
+    Select the algorithm of the products and the cutoff of Strassen-Winograd with the predicates
+    algoritmo_multiplicacion/1 and umbral_strassen/1
+*/
+static int select_multiplication(const char* algorithm, int cutoff) {
+    term_t arguments = PL_new_term_refs(2);
+    return PL_put_atom_chars(arguments, algorithm) && PL_put_integer(arguments + 1, cutoff) &&
+           pl_multiplication_algorithm(arguments) && pl_strassen_cutoff(arguments + 1);
+}
+
+static void test_strassen(void) {
+    // A small cutoff, so the odd sizes are split several times
+    if (!select_multiplication("strassen", 16)) {
+        check(0, "strassen", "no es posible seleccionar el algoritmo", 16);
+        return;
+    }
+    int previous_failures = failures;
+    static const int sizes[] = { 16, 33, 64, 100, 129 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        test_product(0, 0, n, n, n, "strassen");
+        test_product(1, 0, n, n, n, "strassen");
+        test_product(3, 3, n, n, n, "strassen");
+        test_product(0, 3, n, n, n, "strassen");
+    }
+    select_multiplication("clasico", STRASSEN_CUTOFF);
+    printf("strassen: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+static void test_elementwise(void) {
+    int previous_failures = failures;
+    static const int sizes[][2] = { { 1, 1 }, { 1, 9 }, { 7, 1 }, { 5, 3 }, { 33, 65 }, { 200, 190 } };
+    for (int kind1 = 0; kind1 < LAYOUT_KINDS; kind1++) {
+        for (int kind2 = 0; kind2 < LAYOUT_KINDS; kind2++) {
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                int rows = sizes[s][0], columns = sizes[s][1];
+                Matrix *parent1, *parent2;
+                Matrix* a = matrix_of_kind(kind1, rows, columns, &parent1);
+                Matrix* b = matrix_of_kind(kind2, rows, columns, &parent2);
+                Matrix* sum = a && b ? new_matrix_with_layout(rows, columns, elementwise_layout(a, b)) : NULL;
+                Matrix* difference = sum ? new_matrix_with_layout(rows, columns, elementwise_layout(b, a)) : NULL;
+                Matrix* transpose = difference ? new_matrix_with_layout(columns, rows, transpose_layout(a)) : NULL;
+                int correct = transpose && matrices_addition(a, b, sum) == SUCCESS &&
+                              matrices_substraction(b, a, difference) == SUCCESS &&
+                              matrix_transpose(a, transpose) == SUCCESS;
+                for (int i = 0; correct && i < rows; i++) {
+                    for (int j = 0; j < columns; j++) {
+                        correct &= ACCESS(sum, i, j) == ACCESS(a, i, j) + ACCESS(b, i, j) &&
+                                   ACCESS(difference, i, j) == ACCESS(b, i, j) - ACCESS(a, i, j) &&
+                                   ACCESS(transpose, j, i) == ACCESS(a, i, j);
+                    }
+                }
+                char detail[96];
+                snprintf(detail, sizeof(detail), "%s y %s, %d x %d", layout_kinds[kind1], layout_kinds[kind2], rows, columns);
+                check(correct, "elemento a elemento", detail, (size_t) rows * columns);
+                free_matrix_of_kind(a, parent1);
+                free_matrix_of_kind(b, parent2);
+                free_matrix(sum);
+                free_matrix(difference);
+                free_matrix(transpose);
+            }
+        }
+    }
+    printf("operaciones elemento a elemento: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+/*********************************************/
+/*
+    Linear systems
+*/
+/**********************************************/
+
+/*
+    Check that the solves of a factorization of A give X with A X = B
+*/
+static void check_solution(Factorization* factorization, Matrix* a, const char* test, int kind) {
+    int n = a->rows;
+    Matrix* b = random_matrix_with_layout(n, 3, MATRIX_LAYOUT_ROW_MAJOR);
+    Matrix* x = b ? new_matrix(n, 3) : NULL;
+    int correct = factorization && x && solve_with_factorization(factorization, b, x) == SUCCESS;
+    for (int i = 0; correct && i < n; i++) {
+        for (int j = 0; j < 3; j++) {
+            double value = 0;
+            for (int l = 0; l < n; l++) {
+                value += ACCESS(a, i, l) * ACCESS(x, l, j);
+            }
+            correct &= close_to(value, ACCESS(b, i, j), 1e-9);
+        }
+    }
+    check(correct, test, layout_kinds[kind], (size_t) n);
+    free_matrix(b);
+    free_matrix(x);
+}
+
+static void test_linear_systems(void) {
+    // Inside one panel, on the edge of FACTORIZATION_BLOCK and with several panels
+    static const int sizes[] = { 1, 2, 5, 63, 64, 65, 150 };
+    int previous_failures = failures;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        for (int kind = 0; kind < LAYOUT_KINDS; kind++) {
+            Matrix* parent;
+            Matrix* a = matrix_of_kind(kind, n, n, &parent);
+            if (!a) {
+                check(0, "lu", "no hay memoria", (size_t) n);
+                continue;
+            }
+            // A dominant diagonal, so the matrix is not singular
+            for (int i = 0; i < n; i++) {
+                ACCESS(a, i, i) += n;
+            }
+            Factorization* lu = lu_factorization(a);
+            check_solution(lu, a, "lu", kind);
+            free_factorization(lu);
+
+            // M + M^T plus a dominant diagonal is symmetric positive definite
+            Matrix* spd = new_matrix(n, n);
+            if (spd) {
+                for (int i = 0; i < n; i++) {
+                    for (int j = 0; j < n; j++) {
+                        ACCESS(spd, i, j) = ACCESS(a, i, j) + ACCESS(a, j, i);
+                    }
+                }
+                Factorization* cholesky = cholesky_factorization(spd);
+                check_solution(cholesky, spd, "cholesky", kind);
+                Factorization* spd_lu = lu_factorization(spd);
+                check(cholesky && spd_lu && close_to(factorization_determinant(cholesky),
+                                                     factorization_determinant(spd_lu), 1e-9),
+                      "determinante", "lu y cholesky dan determinantes distintos", (size_t) n);
+                free_factorization(cholesky);
+                free_factorization(spd_lu);
+            }
+            free_matrix(spd);
+            free_matrix_of_kind(a, parent);
+        }
+    }
+    printf("sistemas lineales: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+/*********************************************/
+/*
+    Typed matrices
+*/
+/**********************************************/
+
+static double typed_value(const Matrix* matrix, size_t i) {
+    switch (matrix->element_type) {
+        case MATRIX_TYPE_F32: return ((const float*) matrix->data)[i];
+        case MATRIX_TYPE_I32: return ((const int32_t*) matrix->data)[i];
+        case MATRIX_TYPE_I64: return (double) ((const int64_t*) matrix->data)[i];
+        default: return matrix->data[i];
+    }
+}
+
+static void set_typed_value(Matrix* matrix, size_t i, int64_t value) {
+    switch (matrix->element_type) {
+        case MATRIX_TYPE_F32: ((float*) matrix->data)[i] = (float) value; break;
+        case MATRIX_TYPE_I32: ((int32_t*) matrix->data)[i] = (int32_t) value; break;
+        case MATRIX_TYPE_I64: ((int64_t*) matrix->data)[i] = value; break;
+        default: matrix->data[i] = (double) value;
+    }
+}
+
+static Matrix* random_typed_matrix(int rows, int columns, int type) {
+    Matrix* matrix = new_typed_matrix(rows, columns, type);
+    for (size_t i = 0; matrix && i < (size_t) rows * columns; i++) {
+        set_typed_value(matrix, i, rand() % 201 - 100);
+    }
+    return matrix;
+}
+
+static void test_typed_kernels(void) {
+    static const int types[] = { MATRIX_TYPE_F32, MATRIX_TYPE_I32, MATRIX_TYPE_I64 };
+    static const int sizes[][3] = { { 1, 1, 1 }, { 3, 5, 7 }, { 33, 17, 65 }, { 70, 90, 80 } };
+    int previous_failures = failures;
+    for (size_t t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            int m = sizes[s][0], n = sizes[s][1], k = sizes[s][2];
+            Matrix* a = random_typed_matrix(m, k, types[t]);
+            Matrix* b = random_typed_matrix(k, n, types[t]);
+            Matrix* c = random_typed_matrix(m, k, types[t]);
+            Matrix *product = NULL, *sum = NULL, *difference = NULL;
+            // The values are small integers, so all the results are exact
+            int correct = a && b && c && typed_multiplication(a, b, &product) == SUCCESS &&
+                          typed_addition(a, c, 0, &sum) == SUCCESS && typed_addition(c, a, 1, &difference) == SUCCESS &&
+                          product->element_type == types[t] && sum->element_type == types[t];
+            for (int i = 0; correct && i < m; i++) {
+                for (int j = 0; j < n; j++) {
+                    double expected = 0;
+                    for (int l = 0; l < k; l++) {
+                        expected += typed_value(a, i + (size_t) l * m) * typed_value(b, l + (size_t) j * k);
+                    }
+                    correct &= typed_value(product, i + (size_t) j * m) == expected;
+                }
+                for (int l = 0; l < k; l++) {
+                    size_t index = i + (size_t) l * m;
+                    correct &= typed_value(sum, index) == typed_value(a, index) + typed_value(c, index) &&
+                               typed_value(difference, index) == typed_value(c, index) - typed_value(a, index);
+                }
+            }
+            check(correct, "tipos", matrix_type_name(types[t]), (size_t) m * n);
+            free_matrix(a);
+            free_matrix(b);
+            free_matrix(c);
+            free_matrix(product);
+            free_matrix(sum);
+            free_matrix(difference);
+        }
+    }
+    // A product of i64 which does not fit in 64 bits fails instead of wrapping around, and its
+    // error is written as the predicates write it
+    Matrix* a = new_typed_matrix(2, 2, MATRIX_TYPE_I64);
+    Matrix* product = NULL;
+    if (a) {
+        for (size_t i = 0; i < 4; i++) {
+            set_typed_value(a, i, INT64_C(1) << 40);
+        }
+        check(typed_multiplication(a, a, &product) == FAILURE && !product, "tipos", "desbordamiento de i64 no detectado", 4);
+    }
+    free_matrix(a);
+    free_matrix(product);
+    printf("tipos: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+/*********************************************/
+/*
+    Chains of products and powers
+*/
+/**********************************************/
+
+/*
+    Product of the factors one after the other, from the left
+*/
+static Matrix* product_from_the_left(Matrix** factors, int count) {
+    Matrix* accumulated = copy_matrix_view(factors[0]);
+    for (int i = 1; accumulated && i < count; i++) {
+        Matrix* next = new_matrix(accumulated->rows, factors[i]->columns);
+        if (!next || matrices_multiplication(accumulated, factors[i], next) == FAILURE) {
+            free_matrix(next);
+            next = NULL;
+        }
+        free_matrix(accumulated);
+        accumulated = next;
+    }
+    return accumulated;
+}
+
+static void check_same_values(Matrix* value, Matrix* expected, const char* test, const char* detail, double tolerance) {
+    int correct = value && expected && value->rows == expected->rows && value->columns == expected->columns;
+    for (int i = 0; correct && i < value->rows; i++) {
+        for (int j = 0; j < value->columns; j++) {
+            correct &= close_to(ACCESS(value, i, j), ACCESS(expected, i, j), tolerance);
+        }
+    }
+    check(correct, test, detail, expected ? (size_t) expected->rows * expected->columns : 0);
+}
+
+static void test_chains(void) {
+    // The cheapest order is neither from the left nor from the right
+    static const int dimensions[] = { 13, 7, 29, 5, 31, 3, 40 };
+    int count = (int) (sizeof(dimensions) / sizeof(dimensions[0])) - 1;
+    Matrix* factors[sizeof(dimensions) / sizeof(dimensions[0])];
+    Matrix* parents[sizeof(dimensions) / sizeof(dimensions[0])];
+    int previous_failures = failures;
+    for (int i = 0; i < count; i++) {
+        factors[i] = matrix_of_kind(i % LAYOUT_KINDS, dimensions[i], dimensions[i + 1], &parents[i]);
+    }
+    for (int length = 1; length <= count; length++) {
+        Matrix* result = new_matrix(dimensions[0], dimensions[length]);
+        Matrix* expected = product_from_the_left(factors, length);
+        char detail[48];
+        snprintf(detail, sizeof(detail), "%d factores", length);
+        if (!result || matrix_chain_multiplication(factors, length, result) == FAILURE) {
+            check(0, "cadena", detail, (size_t) length);
+        } else {
+            check_same_values(result, expected, "cadena", detail, 1e-12);
+        }
+        free_matrix(result);
+        free_matrix(expected);
+    }
+    for (int i = 0; i < count; i++) {
+        free_matrix_of_kind(factors[i], parents[i]);
+    }
+
+    Matrix* base = random_matrix_with_layout(20, 20, MATRIX_LAYOUT_ROW_MAJOR);
+    for (int exponent = 0; base && exponent <= 9; exponent++) {
+        Matrix* power = new_matrix(20, 20);
+        Matrix* expected = new_matrix(20, 20);
+        if (!power || !expected || matrix_power(base, exponent, power) == FAILURE) {
+            check(0, "potencia", "la potencia ha fallado", (size_t) exponent);
+        } else {
+            for (int i = 0; i < 20; i++) {
+                for (int j = 0; j < 20; j++) {
+                    ACCESS(expected, i, j) = i == j;
+                }
+            }
+            for (int e = 0; e < exponent; e++) {
+                Matrix* next = new_matrix(20, 20);
+                matrices_multiplication(expected, base, next);
+                free_matrix(expected);
+                expected = next;
+            }
+            char detail[48];
+            snprintf(detail, sizeof(detail), "exponente %d", exponent);
+            check_same_values(power, expected, "potencia", detail, 1e-10);
+        }
+        free_matrix(power);
+        free_matrix(expected);
+    }
+    free_matrix(base);
+    printf("cadenas y potencias: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+/*********************************************/
+/*
+    Result cache
+*/
+/**********************************************/
+
+/*
+    Transpose a matrix as transponer_matriz_h/2 does, through the result cache, and unify the
+    result with a new handle in handle
+*/
+static int cached_transpose(term_t operand, Matrix* matrix, term_t handle) {
+    ResultKey key;
+    Matrix* cached = cached_result(&key, RESULT_CACHE_TRANSPOSE, operand, matrix, 0, NULL);
+    if (cached) {
+        return unify_cached_result(handle, cached, 1);
+    }
+    Matrix* result = new_matrix_with_layout(matrix->columns, matrix->rows, transpose_layout(matrix));
+    if (!result || matrix_transpose(matrix, result) == FAILURE) {
+        free_matrix(result);
+        return FAILURE;
+    }
+    cache_result(&key, result);
+    return unify_matrix_result(handle, result, 1, NULL);
+}
+
+static void test_result_cache(void) {
+    int previous_failures = failures;
+    term_t terms = PL_new_term_refs(5); // budget, operand and three handles
+    Matrix* matrix = random_matrix_with_layout(6, 4, MATRIX_LAYOUT_ROW_MAJOR);
+    if (!matrix || !PL_put_integer(terms, 1 << 20) || !pl_result_cache(terms)) {
+        check(0, "caché", "no es posible activar la caché", 0);
+        free_matrix(matrix);
+        return;
+    }
+    // The handles of the hits are the handle of the first result, as it is unique for its
+    // matrix, so they do not add references to it
+    int correct = cached_transpose(terms + 1, matrix, terms + 2) && cached_transpose(terms + 1, matrix, terms + 3) &&
+                  cached_transpose(terms + 1, matrix, terms + 4);
+    Matrix* result = correct ? get_matrix_from_handle(terms + 2) : NULL;
+    check(result && get_matrix_from_handle(terms + 3) == result && get_matrix_from_handle(terms + 4) == result,
+          "caché", "los aciertos no devuelven el resultado guardado", 3);
+    check(result && atomic_load(&result->references) == 1, "caché", "los aciertos como manejador no liberan su referencia", 3);
+    pl_clear_result_cache();
+    check(result && atomic_load(&result->references) == 0, "caché", "el resultado sigue compartido al vaciar la caché", 3);
+    PL_put_integer(terms, 0);
+    pl_result_cache(terms);
+    free_matrix(matrix);
+    printf("caché de resultados: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+/*********************************************/
+/*
+    Background operations
+*/
+/**********************************************/
+
+static void test_futures(void) {
+    int previous_failures = failures;
+    term_t terms = PL_new_term_refs(5); // operand, future and three results
+    Matrix* matrix = random_matrix_with_layout(5, 3, MATRIX_LAYOUT_COLUMN_MAJOR);
+    int correct = matrix && unify_matrix_handle(terms, matrix) && pl_matrices_transpose_async(terms, terms + 1) &&
+                  pl_matrix_wait(terms + 1, terms + 2) && pl_matrix_wait(terms + 1, terms + 3) &&
+                  pl_matrix_wait(terms + 1, terms + 4);
+    Matrix* result = correct ? get_matrix_from_handle(terms + 2) : NULL;
+    correct = result && get_matrix_from_handle(terms + 3) == result && get_matrix_from_handle(terms + 4) == result;
+    for (int i = 0; correct && i < 5; i++) {
+        for (int j = 0; j < 3; j++) {
+            correct &= ACCESS(result, j, i) == ACCESS(matrix, i, j);
+        }
+    }
+    check(correct, "futuros", "las esperas no devuelven el resultado", 3);
+    // The future keeps the result, and all the waits share one handle, which is its only other holder
+    check(result && atomic_load(&result->references) == 1, "futuros", "las esperas no liberan su referencia", 3);
+    printf("operaciones en segundo plano: %s\n", failures == previous_failures ? "ok" : "con fallos");
+}
+
+int main(int argc, char** argv) {
+    // The embedded engine is only used to call the predicates which change the settings and to
+    // create the handles
+    char* engine_arguments[] = { argc > 0 ? argv[0] : "tests", "-q", "--no-signals", NULL };
+    if (!PL_initialise(3, engine_arguments)) {
+        fprintf(stderr, "No es posible iniciar SWI-Prolog\n");
+        return 1;
+    }
+    select_kernels();
+    srand(1);
+    printf("kernels en uso: %s\n", kernels->name);
+    test_kernels();
+    test_products();
+    test_parallel_products();
+    test_strassen();
+    test_elementwise();
+    test_linear_systems();
+    test_typed_kernels();
+    test_chains();
+    test_result_cache();
+    test_futures();
+    printf("%d comprobaciones, %d fallos\n", checks, failures);
+    shutdown_thread_pool();
+    PL_halt(failures ? 1 : 0);
+    return failures ? 1 : 0;
+}